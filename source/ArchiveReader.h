@@ -0,0 +1,415 @@
+/*
+// ArchiveReader.h
+//
+// Description:
+//
+// This file reads images stored as members of zip and tar archives (.zip, .tar, .tar.gz, .tgz)
+// without extracting them to disk. A member is addressed with archive.zip!/case001.nii.gz; its
+// bytes are streamed straight into the NIfTI decoder. ArchiveIterator enumerates all members of
+// an archive in the order they are stored, which is used by the batch evaluation; ArchiveWalker
+// reads the truth images of a batch evaluation from an archive in a single pass.
+//
+*/
+
+#ifndef _ARCHIVEREADER
+#define _ARCHIVEREADER
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <stdexcept>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include "ByteSource.h"
+#include "ZipArchive.h"
+#include "NiftiStreamReader.h"
+
+static const char* ARCHIVE_EXTENSIONS[] = {".zip", ".tar", ".tar.gz", ".tgz"};
+static const int ARCHIVE_EXTENSION_COUNT = 4;
+
+bool isArchive(const std::string &path){
+	for(int i = 0; i < ARCHIVE_EXTENSION_COUNT; i++){
+		std::string ext = ARCHIVE_EXTENSIONS[i];
+		if(path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+// Splits archive!/member into the archive path and the member name. Returns false if the path
+// does not address an archive member.
+*/
+bool splitArchivePath(const std::string &path, std::string &archive, std::string &member){
+	size_t sep = path.find("!/");
+	while(sep != std::string::npos){
+		if(isArchive(path.substr(0, sep))){
+			archive = path.substr(0, sep);
+			member = path.substr(sep + 2);
+			return true;
+		}
+		sep = path.find("!/", sep + 2);
+	}
+	return false;
+}
+
+bool isArchiveMember(const char* path){
+	std::string archive, member;
+	return splitArchivePath(path, archive, member);
+}
+
+/*
+// Reads the members of a tar stream one after the other. After Next() the reader returns the data
+// of the current member. Supports ustar, GNU long names and pax path records.
+*/
+class TarReader : public ByteSource
+{
+private:
+	ByteSource *source;
+	long long remaining;
+	long long padding;
+
+	static long long parseOctal(const unsigned char *p, int len){
+		// GNU base-256 encoding for large sizes
+		if(p[0] & 0x80){
+			long long value = p[0] & 0x7f;
+			for(int i = 1; i < len; i++){
+				value = (value << 8) | p[i];
+			}
+			return value;
+		}
+		long long value = 0;
+		for(int i = 0; i < len && p[i] != 0 && p[i] != ' '; i++){
+			if(p[i] >= '0' && p[i] <= '7'){
+				value = value * 8 + (p[i] - '0');
+			}
+		}
+		return value;
+	}
+
+	bool readData(std::string &data, long long size){
+		data.resize(size);
+		if(size > 0 && !source->ReadFully(&data[0], size)){
+			return false;
+		}
+		return source->Skip((512 - size % 512) % 512);
+	}
+
+public:
+	TarReader(ByteSource *source){
+		this->source = source;
+		this->remaining = 0;
+		this->padding = 0;
+	}
+
+	// advances to the next regular file, returns false at the end of the archive
+	bool Next(std::string &name, long long &size){
+		if(!source->Skip(remaining + padding)){
+			throw std::runtime_error("Truncated tar archive");
+		}
+		remaining = 0;
+		padding = 0;
+		std::string longName;
+		while(true){
+			unsigned char h[512];
+			if(!source->ReadFully((char*)h, 512) || h[0] == 0){
+				return false;
+			}
+			char type = h[156];
+			long long length = parseOctal(h + 124, 12);
+			if(type == 'L' || type == 'x'){
+				std::string data;
+				if(!readData(data, length)){
+					throw std::runtime_error("Truncated tar archive");
+				}
+				if(type == 'L'){
+					longName = data.c_str();
+				}
+				else{
+					// pax records "length key=value\n"
+					size_t pos = 0;
+					while(pos < data.size()){
+						size_t space = data.find(' ', pos);
+						long long recordLength = atoll(data.c_str() + pos);
+						if(space == std::string::npos || recordLength <= 0 || recordLength > (long long)(data.size() - pos)
+							|| (long long)(space - pos) + 2 > recordLength){
+							throw std::runtime_error("Malformed pax header in tar archive");
+						}
+						std::string record = data.substr(space + 1, pos + recordLength - space - 2);
+						if(record.compare(0, 5, "path=") == 0){
+							longName = record.substr(5);
+						}
+						pos += recordLength;
+					}
+				}
+				continue;
+			}
+			if(type != '0' && type != 0){
+				// directories, links, global pax headers
+				if(!source->Skip(length + (512 - length % 512) % 512)){
+					throw std::runtime_error("Truncated tar archive");
+				}
+				longName = "";
+				continue;
+			}
+			if(longName != ""){
+				name = longName;
+			}
+			else{
+				name = std::string((const char*)h, strnlen((const char*)h, 100));
+				std::string prefix((const char*)h + 345, strnlen((const char*)h + 345, 155));
+				if(memcmp(h + 257, "ustar", 5) == 0 && prefix != ""){
+					name = prefix + "/" + name;
+				}
+			}
+			size = length;
+			remaining = length;
+			padding = (512 - length % 512) % 512;
+			return true;
+		}
+	}
+
+	long long Read(char *buf, long long len){
+		if(len > remaining){
+			len = remaining;
+		}
+		if(len == 0){
+			return 0;
+		}
+		long long n = source->Read(buf, len);
+		if(n > 0){
+			remaining -= n;
+		}
+		return n;
+	}
+};
+
+/*
+// Enumerates the members (regular files) of an archive in the order they are stored
+*/
+class ArchiveIterator
+{
+private:
+	bool zip;
+	ZipArchive *zipArchive;
+	size_t zipIndex;
+	ByteSource *entrySource;
+	FileByteSource *file;
+	InflateByteSource *inflater;
+	TarReader *tar;
+	long long size;
+
+public:
+	ArchiveIterator(const std::string &archive){
+		size = 0;
+		zipArchive = NULL;
+		zipIndex = 0;
+		entrySource = NULL;
+		file = NULL;
+		inflater = NULL;
+		tar = NULL;
+		zip = archive.size() >= 4 && archive.compare(archive.size() - 4, 4, ".zip") == 0;
+		if(zip){
+			zipArchive = new ZipArchive(archive);
+		}
+		else{
+			file = new FileByteSource(archive);
+			ByteSource *source = file;
+			if(archive.compare(archive.size() - 4, 4, ".tar") != 0){
+				inflater = new InflateByteSource(file, InflateByteSource::INFLATE_AUTO);
+				source = inflater;
+			}
+			tar = new TarReader(source);
+		}
+	}
+
+	~ArchiveIterator(){
+		delete entrySource;
+		delete zipArchive;
+		delete tar;
+		delete inflater;
+		delete file;
+	}
+
+	bool Next(std::string &name){
+		if(zip){
+			delete entrySource;
+			entrySource = NULL;
+			if(zipIndex >= zipArchive->entries.size()){
+				return false;
+			}
+			size = zipArchive->entries[zipIndex].uncompressedSize;
+			name = zipArchive->entries[zipIndex++].name;
+			return true;
+		}
+		return tar->Next(name, size);
+	}
+
+	// size of the data of the current member, known before it is read
+	long long GetSize(){
+		return size;
+	}
+
+	// data of the current member, valid until the next call of Next()
+	ByteSource* GetSource(){
+		if(zip){
+			if(entrySource == NULL){
+				entrySource = zipArchive->OpenEntry(zipArchive->entries[zipIndex - 1]);
+			}
+			return entrySource;
+		}
+		return tar;
+	}
+};
+
+/*
+// Opens a member of an archive for sequential reading
+*/
+class ArchiveMemberSource : public ByteSource
+{
+private:
+	ArchiveIterator iterator;
+	ByteSource *source;
+
+public:
+	ArchiveMemberSource(const std::string &archive, const std::string &member) : iterator(archive){
+		source = NULL;
+		std::string name;
+		while(source == NULL && iterator.Next(name)){
+			if(name == member){
+				source = iterator.GetSource();
+			}
+		}
+		if(source == NULL){
+			throw std::runtime_error("Member not found in archive: " + member);
+		}
+	}
+
+	long long Read(char *buf, long long len){
+		return source->Read(buf, len);
+	}
+};
+
+// reads the rest of a member into data
+void readArchiveMember(ByteSource *source, std::vector<char> &data){
+	std::vector<char> buf(BYTESOURCE_BUFFER_SIZE);
+	long long n;
+	while((n = source->Read(&buf[0], buf.size())) > 0){
+		data.insert(data.end(), buf.begin(), buf.begin() + n);
+	}
+}
+
+// bytes of the members passed over that ArchiveWalker keeps for later requests
+static const long long ARCHIVE_WALK_KEPT_BYTES = 256LL * 1024 * 1024;
+
+/*
+// Reads members of an archive by name, many of them, e.g. the truth images of a batch evaluation,
+// which are requested in the order of the submission archive. Opening each member on its own
+// would scan a tar archive from its beginning for every member.
+// A zip archive is indexed once by its central directory and its members are read directly.
+// A tar archive is walked once: the members passed over on the way to a requested one are kept
+// (up to ARCHIVE_WALK_KEPT_BYTES, as stored), so that a member requested later is not searched
+// again. Members that no longer fit are passed over without reading them; only a member passed over
+// and not kept makes the walk start again. Thread-safe.
+*/
+class ArchiveWalker
+{
+private:
+	std::string archive;
+	std::unique_ptr<ZipArchive> zipArchive;
+	std::map<std::string, size_t> zipIndex;
+	std::unique_ptr<ArchiveIterator> iterator;
+	long long membersPassed;
+	std::map<std::string, std::vector<char> > kept;
+	long long keptBytes;
+	std::set<std::string> returned;
+	std::mutex mutex;
+
+	// keeps a member passed over if it fits into what is left of ARCHIVE_WALK_KEPT_BYTES, a larger
+	// one is passed over without reading it
+	void keep(const std::string &name, ByteSource *source, long long size){
+		if(kept.count(name) > 0 || returned.count(name) > 0 || size > ARCHIVE_WALK_KEPT_BYTES - keptBytes){
+			return;
+		}
+		std::vector<char> &data = kept[name];
+		data.reserve(size);
+		readArchiveMember(source, data);
+		keptBytes += data.size();
+	}
+
+public:
+	// number of times the walk over a tar archive was started
+	long long passes;
+
+	ArchiveWalker(const std::string &archive){
+		this->archive = archive;
+		membersPassed = 0;
+		keptBytes = 0;
+		passes = 0;
+		if(archive.size() >= 4 && archive.compare(archive.size() - 4, 4, ".zip") == 0){
+			zipArchive.reset(new ZipArchive(archive));
+			for(size_t i = 0; i < zipArchive->entries.size(); i++){
+				zipIndex[zipArchive->entries[i].name] = i;
+			}
+		}
+	}
+
+	// the bytes of a member as stored in the archive (e.g. those of a .nii.gz file)
+	void Read(const std::string &member, std::vector<char> &data){
+		if(zipArchive){
+			std::map<std::string, size_t>::iterator entry = zipIndex.find(member);
+			if(entry == zipIndex.end()){
+				throw std::runtime_error("Member not found in archive: " + member);
+			}
+			std::unique_ptr<ByteSource> source(zipArchive->OpenEntry(zipArchive->entries[entry->second]));
+			readArchiveMember(source.get(), data);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<std::string, std::vector<char> >::iterator found = kept.find(member);
+		if(found != kept.end()){
+			data.swap(found->second);
+			keptBytes -= data.size();
+			kept.erase(found);
+			returned.insert(member);
+			return;
+		}
+		// from where the walk stopped to the end, then once more from the beginning
+		bool fromStart = !iterator || membersPassed == 0;
+		for(int walk = 0; walk < 2; walk++){
+			if(!iterator){
+				iterator.reset(new ArchiveIterator(archive));
+				membersPassed = 0;
+				passes++;
+			}
+			std::string name;
+			while(iterator->Next(name)){
+				membersPassed++;
+				if(name == member){
+					readArchiveMember(iterator->GetSource(), data);
+					returned.insert(member);
+					return;
+				}
+				keep(name, iterator->GetSource(), iterator->GetSize());
+			}
+			iterator.reset();
+			if(fromStart){
+				break;
+			}
+		}
+		throw std::runtime_error("Member not found in archive: " + member);
+	}
+};
+
+ImageType::Pointer loadArchiveMemberImage(const char* path){
+	std::string archive, member;
+	splitArchivePath(path, archive, member);
+	ArchiveMemberSource source(archive, member);
+	return readNiftiStream(&source);
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+// Arena.h
+//
+// Description:
+//
+// This file contains the allocator of the transient buffers of an evaluation, such as the voxel
+// lists and the search grid of the distance metrics. Memory is taken from large blocks by moving
+// an offset forward, so the loops of the metrics do not call the system allocator and the buffers
+// are not freed one by one: Release() returns everything allocated after a marker (e.g. at the
+// end of a metric) and Reset() everything at the start of the next evaluation. The blocks are kept
+// for reuse, so a process evaluating many image pairs does not grow. Only types without
+// constructors and destructors (plain structs, numbers) are allocated here.
+//
+// Each worker of the TaskGraph has its own arena, so that metrics running concurrently allocate and
+// release independently. The arenas belong to the process, not to the worker threads, which are
+// started for every evaluation: worker t of every evaluation takes the blocks of arena t.
+//
+*/
+
+#ifndef _ARENA
+#define _ARENA
+
+#include <vector>
+#include <deque>
+#include <cstdlib>
+#include <new>
+
+class Arena
+{
+private:
+	typedef struct Block{
+		char* data;
+		size_t size;
+	} Block;
+
+	std::vector<Block> blocks;
+	// block the allocations are taken from and the bytes used in it
+	size_t current;
+	size_t offset;
+
+	static const size_t MINIMUM_BLOCK_SIZE = 1024 * 1024;
+
+	void AddBlock(size_t bytes){
+		size_t size = blocks.empty() ? MINIMUM_BLOCK_SIZE : blocks.back().size * 2;
+		if(size < bytes){
+			size = bytes;
+		}
+		Block block;
+		block.data = (char*) malloc(size);
+		if(block.data == NULL){
+			throw std::bad_alloc();
+		}
+		block.size = size;
+		blocks.push_back(block);
+	}
+
+	void FreeBlocks(){
+		for(size_t i = 0; i < blocks.size(); i++){
+			free(blocks[i].data);
+		}
+		blocks.clear();
+	}
+
+public:
+	typedef struct Marker{
+		size_t block;
+		size_t offset;
+	} Marker;
+
+	Arena(){
+		current = 0;
+		offset = 0;
+	}
+
+	~Arena(){
+		FreeBlocks();
+	}
+
+	void* AllocateBytes(size_t bytes, size_t alignment){
+		while(current < blocks.size()){
+			size_t start = (offset + alignment - 1) / alignment * alignment;
+			if(start + bytes <= blocks[current].size){
+				offset = start + bytes;
+				return blocks[current].data + start;
+			}
+			// the rest of the block stays unused until the arena is reset
+			current++;
+			offset = 0;
+		}
+		AddBlock(bytes);
+		current = blocks.size() - 1;
+		offset = bytes;
+		return blocks[current].data;
+	}
+
+	// uninitialized array of count elements
+	template<class T>
+	T* Allocate(long long count){
+		if(count <= 0){
+			count = 1;
+		}
+		if((unsigned long long)count > (size_t)-1 / sizeof(T)){
+			throw std::bad_alloc();
+		}
+		return (T*) AllocateBytes((size_t)count * sizeof(T), alignof(T) > sizeof(double) ? alignof(T) : sizeof(double));
+	}
+
+	Marker Mark() const{
+		Marker marker;
+		marker.block = current;
+		marker.offset = offset;
+		return marker;
+	}
+
+	// frees everything allocated after the marker was taken
+	void Release(const Marker &marker){
+		current = marker.block;
+		offset = marker.offset;
+	}
+
+	// frees all allocations. Several blocks are merged into one, so that the next evaluation of
+	// the same size is served from a single block
+	void Reset(){
+		if(blocks.size() > 1){
+			size_t total = GetCapacity();
+			FreeBlocks();
+			AddBlock(total);
+		}
+		current = 0;
+		offset = 0;
+	}
+
+	size_t GetCapacity() const{
+		size_t total = 0;
+		for(size_t i = 0; i < blocks.size(); i++){
+			total += blocks[i].size;
+		}
+		return total;
+	}
+};
+
+// arenas of the transient buffers of the current evaluation, reset by validateImage; a deque, so
+// that adding arenas for more workers does not move those in use
+static std::deque<Arena> evaluationArenas(1);
+// arena of the calling thread, set for the workers of a TaskGraph; other threads use arena 0
+static thread_local size_t evaluationArenaIndex = 0;
+
+Arena& evaluationArena(){
+	return evaluationArenas[evaluationArenaIndex];
+}
+
+// makes the calling thread use arena index (created by reserveEvaluationArenas)
+void useEvaluationArena(size_t index){
+	evaluationArenaIndex = index;
+}
+
+void reserveEvaluationArenas(size_t count){
+	while(evaluationArenas.size() < count){
+		evaluationArenas.emplace_back();
+	}
+}
+
+void resetEvaluationArenas(){
+	for(size_t i = 0; i < evaluationArenas.size(); i++){
+		evaluationArenas[i].Reset();
+	}
+}
+
+#endif
@@ -28,11 +28,15 @@
 */
 
 
+#include <memory>
+#include <sstream>
 #include "itkImage.h"
 #include <itkVector.h>
 #include "itkLineIterator.h"
 #include "itkImageFileWriter.h"
 #include "itkConnectedComponentImageFilter.h"
+#include "Arena.h"
+#include "FastProfile.h"
 
 
 class AverageDistanceMetric
@@ -66,7 +70,9 @@ class AverageDistanceMetric
 		double x2;
 		double y2;
 		double z2;
-		std::vector<VoxelInfo> voxels;
+		// surface voxels in the cell
+		VoxelInfo* voxels;
+		long long size;
 		bool emp;
 	} Cell;
 
@@ -85,6 +91,22 @@ private:
 	double maxValue;
 
 public:
+	// voxels per axis of the cells of which one voxel is searched, 1 = all (see FastProfile.h)
+	int sampleCell;
+	// how the nearest surface voxels are searched, and the region containing the foreground of both
+	// images scanned by the distance transform (see DistanceBackends.h)
+	DistanceBackend backend;
+	ImageType::RegionType distanceRegion;
+	// distance transforms of the fixed and the moving image shared with the other distance
+	// metrics, NULL or not matching = made by this metric
+	const DistanceField* field_f;
+	const DistanceField* field_m;
+	// threads of the distance transforms made by this metric, fewer than the cores when other
+	// metrics run at the same time
+	int threads;
+	// details of the result, written by the caller after the concurrent metrics have finished
+	std::ostringstream details;
+
 	~AverageDistanceMetric(){
 
 	}
@@ -93,6 +115,12 @@ public:
 		this->fixedImage = fixedImage;
 		this->movingImage = movingImage;
 		this->fuzzy = fuzzy;
+		this->sampleCell = 1;
+		this->backend = DISTANCE_SPATIAL_INDEX;
+		this->distanceRegion = fixedImage->GetRequestedRegion();
+		this->field_f = NULL;
+		this->field_m = NULL;
+		this->threads = getNumberOfThreads();
 		grid_len =7;
         this->thd = 0;
 		if(!fuzzy && threshold!=-1){
@@ -128,32 +156,87 @@ public:
 	}
 
 	double CalcAverageDistace(bool prune){
-		double dist1 = calc(fixedImage, movingImage, false);
-		double dist2 = calc(movingImage, fixedImage, false);
+		double dist1 = calc(fixedImage, movingImage, backend == DISTANCE_BRUTE_FORCE);
+		double dist2 = calc(movingImage, fixedImage, backend == DISTANCE_BRUTE_FORCE);
 		return (dist1 + dist2)/2;
 	}
 	
 	double CalcAverageDistaceDirected(){
-		double dist1 = calc(fixedImage, movingImage, false);
+		double dist1 = calc(fixedImage, movingImage, backend == DISTANCE_BRUTE_FORCE);
 		return dist1;
 	}
+
+	/*
+	// Sum of the exact distances of the voxels of image1 missing in image2 to the foreground of
+	// image2, which are those to its surface, from a distance transform. Returns the sum if balanced,
+	// otherwise the average distance as calc() does.
+	*/
+	double calcEdt(ImageType *image1, ImageType *image2, bool balanced){
+		Arena::Marker marker = evaluationArena().Mark();
+		const DistanceField *shared = image2 == fixedImage ? field_f : field_m;
+		std::unique_ptr<DistanceField> own;
+		if(shared == NULL || !shared->Matches(distanceRegion, thd, spx, spy, spz)){
+			own.reset(new DistanceField(image2, distanceRegion, thd, spx, spy, spz, threads));
+			shared = own.get();
+		}
+		const DistanceField &field = *shared;
+		IteratorType it1(image1, distanceRegion);
+		IteratorType it2(image2, distanceRegion);
+		double AVD_SUM = 0;
+		long long numberfalseNegatives = 0;
+		long long numberTruePositives = 0;
+		emp_f=true;
+		emp_m=true;
+		for(it1.GoToBegin(), it2.GoToBegin(); !it1.IsAtEnd(); ++it1, ++it2){
+			bool foreground1 = it1.Get()>thd;
+			bool foreground2 = it2.Get()>thd;
+			if(foreground1){
+				emp_f=false;
+				if(foreground2){
+					numberTruePositives++;
+				}
+				else{
+					AVD_SUM += field.Distance(it1.GetIndex());
+					numberfalseNegatives++;
+				}
+			}
+			if(foreground2){
+				emp_m=false;
+			}
+		}
+		evaluationArena().Release(marker);
+		if(numberfalseNegatives==0){
+			return 0;
+		}
+		if(balanced){
+			return AVD_SUM;
+		}
+		double value2 = numberfalseNegatives+numberTruePositives;
+		details << "------------ Average distance details: -----------------" << std::endl;
+		details << "AVGDST: " << AVD_SUM <<" / " << value2 << " = " << AVD_SUM/value2 << std::endl;
+		details << "------------ Average distance details end. -----------------" << std::endl;
+		return AVD_SUM/value2;
+	}
 	
-	std::vector<Cell> build(){
-		std::vector<Cell> cs;
+	// empty cells of the search grid, allocated from the arena
+	Cell* build(){
 		grid_num_x = max_x/grid_len+1;
 		grid_num_y = max_y/grid_len+1;
 		grid_num_z = max_z/grid_len+1;
+		Cell* cs = evaluationArena().Allocate<Cell>((long long)grid_num_x * grid_num_y * grid_num_z);
+		long long i = 0;
 		for(double x=0; x < grid_num_x; x++){
 			for(double y=0; y < grid_num_y; y++){
 				for(double z=0; z < grid_num_z; z++){
-					Cell gc;
+					Cell &gc = cs[i++];
 					gc.x1=x*grid_len;
 					gc.x2=x*grid_len+grid_len;
 					gc.y1=y*grid_len;
 					gc.y2=y*grid_len+grid_len;
 					gc.z1=z*grid_len;
 					gc.z2=z*grid_len+grid_len;
-					cs.push_back(gc);
+					gc.voxels=NULL;
+					gc.size=0;
 					gc.emp=true;
 				}
 			}
@@ -161,17 +244,45 @@ public:
 		return cs;
 	}
 
+	long long cellIndex(const VoxelInfo &vi){
+		long long x_ind = vi.x/grid_len;
+		long long y_ind = vi.y/grid_len;
+		long long z_ind = vi.z/grid_len;
+		return z_ind + y_ind * grid_num_z + x_ind * grid_num_y * grid_num_z;
+	}
+
+	// distributes the surface voxels to their cells, keeping their order within a cell
+	void fillCells(Cell* cells, const VoxelInfo* surface, long long numberSurface){
+		VoxelInfo* cellVoxels = evaluationArena().Allocate<VoxelInfo>(numberSurface);
+		long long numberCells = (long long)grid_num_x * grid_num_y * grid_num_z;
+		long long start = 0;
+		for(long long c=0; c < numberCells; c++){
+			cells[c].voxels = cellVoxels + start;
+			cells[c].emp = cells[c].size == 0;
+			start += cells[c].size;
+			cells[c].size = 0;
+		}
+		for(long long i=0; i < numberSurface; i++){
+			Cell *gc = &cells[cellIndex(surface[i])];
+			gc->voxels[gc->size++] = surface[i];
+		}
+	}
+
 
 	double calc(ImageType *image1, ImageType *image2, bool exhaust_search){
-		std::vector<VoxelInfo> empSeg;
-		int numberfalseNegatives=0;
-		int numberTruePositives=0;
-		int numberFalsePositives=0;
+		if(backend == DISTANCE_EDT){
+			return calcEdt(image1, image2, false);
+		}
+		long long numberfalseNegatives=0;
+		long long numberMoving=0;
+		long long numberTruePositives=0;
+		long long numberFalsePositives=0;
 		max_x =0;
 		max_y =0;
 		max_z =0;
-		IteratorType fixedIt(image1, image1->GetRequestedRegion());
-		IteratorType movingIt(image2, image2->GetRequestedRegion());
+		// the region contains the foreground of both images (see DistanceBackends.h)
+		IteratorType fixedIt(image1, distanceRegion);
+		IteratorType movingIt(image2, distanceRegion);
 		emp_f=true;
 		emp_m=true;
 		fixedIt.GoToBegin();
@@ -184,6 +295,7 @@ public:
 			}
 			if(movingIt.Get()>thd){
 				emp_m=false;
+				numberMoving++;
 				if(fixedIt.Get()>thd){
 					emp_f=false;
 					numberTruePositives++;
@@ -220,21 +332,25 @@ public:
 		if(numberfalseNegatives==0){
 			return 0;
 		}
-		std::vector<Cell> index = build();
-		VoxelInfo* falseNegatives = new VoxelInfo[numberfalseNegatives];
-		int fp_ind=0;
-		int tp_ind=0;
+		// the voxel lists and the grid are freed from the arena when the distance is computed
+		Arena::Marker marker = evaluationArena().Mark();
+		Cell* index = build();
+		VoxelInfo* falseNegatives = evaluationArena().Allocate<VoxelInfo>(numberfalseNegatives);
+		// the surface of the moving image, at most all of its foreground voxels
+		VoxelInfo* empSeg = evaluationArena().Allocate<VoxelInfo>(numberMoving);
+		long long fp_ind=0;
+		long long tp_ind=0;
 #ifdef _DEBUG
 		VoxelInfo* truePositives;
 		VoxelInfo* falsePositives;
-		falsePositives = new VoxelInfo[numberFalsePositives];
-		truePositives = new VoxelInfo[numberTruePositives];
+		falsePositives = evaluationArena().Allocate<VoxelInfo>(numberFalsePositives);
+		truePositives = evaluationArena().Allocate<VoxelInfo>(numberTruePositives);
 #endif
 
 		fixedIt.GoToBegin();
 		movingIt.GoToBegin();
-		int FP_index=0;
-		int FN_index=0;
+		long long FP_index=0;
+		long long FN_index=0;
 
 		while (!fixedIt.IsAtEnd() && !movingIt.IsAtEnd()){
 			if(fixedIt.Get()>thd && movingIt.Get()<=thd){
@@ -253,13 +369,8 @@ public:
 				vi.z = movingIt.GetIndex()[2];
 				bool surface = isBoundary(movingIt.GetIndex(), image2);
 				if(surface){
-					empSeg.push_back(vi);
-					int x_ind = vi.x/grid_len;
-					int y_ind = vi.y/grid_len;
-					int z_ind = vi.z/grid_len;
-					Cell *gc = &index[z_ind + y_ind * grid_num_z + x_ind * grid_num_y*grid_num_z];
-					gc->voxels.push_back(vi);
-					gc->emp=false;
+					empSeg[FP_index] = vi;
+					index[cellIndex(vi)].size++;
 					FP_index++;
 				}
 			}
@@ -285,6 +396,14 @@ public:
 			++fixedIt;
 		}
 
+		fillCells(index, empSeg, FP_index);
+
+		// the fast profile searches one voxel per cell, weighted by the false negatives of the cell
+		std::vector<long long> weights;
+		if(sampleCell > 1){
+			numberfalseNegatives = sampleVoxels(falseNegatives, numberfalseNegatives, sampleCell, weights);
+		}
+
 		double AVD_SUM = 0;
 		double AVD_NUM = 0;
 		maxValue = 10000000000;
@@ -292,7 +411,7 @@ public:
 
 		int rcount=0;
 
-		for(int ind=0 ; ind< numberfalseNegatives ; ind++){
+		for(long long ind=0 ; ind< numberfalseNegatives ; ind++){
 			VoxelInfo p1 = falseNegatives[ind];   
 			double x = p1.x;
 			double y = p1.y;
@@ -338,9 +457,9 @@ public:
 							if(gc->emp){
 								continue;
 							}
-							int size=gc->voxels.size();
+							long long size=gc->size;
 							//std::cout << " size: "<< size<< std::endl;
-							for(int i=0; i< size;i++){
+							for(long long i=0; i< size;i++){
 								VoxelInfo p2 = gc->voxels[i];
 								
 								double dist =std::sqrt((double)(
@@ -364,8 +483,8 @@ public:
 			}
 			else{
 				rcount++;
-				int size=empSeg.size();
-				for(int i=0; i< size;i++){
+				long long size=FP_index;
+				for(long long i=0; i< size;i++){
 					VoxelInfo p2 = empSeg[i];
 					
 					double dist =std::sqrt((double)(
@@ -395,8 +514,9 @@ public:
 					               ));
 								   
 			//min = std::sqrt( (closest.x-x)*(closest.x-x) + (closest.y-y)*(closest.y-y) + (closest.z-z)*(closest.z-z) );
-			AVD_SUM += min;
-			AVD_NUM ++;
+			double weight = sampleCell > 1 ? weights[ind] : 1;
+			AVD_SUM += min * weight;
+			AVD_NUM += weight;
 
 		}
 
@@ -416,10 +536,11 @@ public:
        double value1 = AVD_SUM; 
        double value2 = AVD_NUM+numberTruePositives; 
 	   double value3 = value1/value2; 
-	   std::cout << "------------ Average distance details: -----------------" << std::endl;
-       std::cout << "AVGDST: " << value1 <<" / " << value2 << " = " << value3 << std::endl;
-	   std::cout << "------------ Average distance details end. -----------------" << std::endl;
+	   details << "------------ Average distance details: -----------------" << std::endl;
+       details << "AVGDST: " << value1 <<" / " << value2 << " = " << value3 << std::endl;
+	   details << "------------ Average distance details end. -----------------" << std::endl;
 
+		evaluationArena().Release(marker);
 		return AVD_SUM/(AVD_NUM+numberTruePositives);
 
 	}
@@ -569,7 +690,7 @@ public:
 	}
 
 #ifdef _DEBUG
-	void saveImage(VoxelInfo* points, int num_points, char* path, int width, int length, int height){
+	void saveImage(VoxelInfo* points, long long num_points, char* path, int width, int length, int height){
 		ImageType::Pointer image1 = ImageType::New();
 		ImageType::IndexType start;
 		start[0] = 0;
@@ -589,7 +710,7 @@ public:
 			++initIt;
 		}
 
-		for(int i=0; i< num_points ;i++){
+		for(long long i=0; i< num_points ;i++){
 			VoxelInfo vi= points[i];
 			ImageType::IndexType ind;
 			ind[0]=vi.x;
@@ -612,8 +733,8 @@ public:
 //-------------------------------- balanced Average Distance -------------------
 
 	double CalcBalancedAverageDistace(){
-		int N_GT = 0;
-		IteratorType fixedIt(fixedImage, fixedImage->GetRequestedRegion());
+		long long N_GT = 0;
+		IteratorType fixedIt(fixedImage, distanceRegion);
 		fixedIt.GoToBegin();
 		while (!fixedIt.IsAtEnd()){
 			if(fixedIt.Get()>thd){
@@ -622,22 +743,26 @@ public:
 			}
 			++fixedIt;
 		}
-		double dist1 = calc_balanced(fixedImage, movingImage, false)/N_GT;
-		double dist2 = calc_balanced(movingImage, fixedImage, false)/N_GT;
+		double dist1 = calc_balanced(fixedImage, movingImage, backend == DISTANCE_BRUTE_FORCE)/N_GT;
+		double dist2 = calc_balanced(movingImage, fixedImage, backend == DISTANCE_BRUTE_FORCE)/N_GT;
 		return (dist1 + dist2)/2;
 	}
 	
 	
     double calc_balanced(ImageType *image1, ImageType *image2, bool exhaust_search){
-		std::vector<VoxelInfo> empSeg;
-		int numberfalseNegatives=0;
-		int numberTruePositives=0;
-		int numberFalsePositives=0;
+		if(backend == DISTANCE_EDT){
+			return calcEdt(image1, image2, true);
+		}
+		long long numberfalseNegatives=0;
+		long long numberMoving=0;
+		long long numberTruePositives=0;
+		long long numberFalsePositives=0;
 		max_x =0;
 		max_y =0;
 		max_z =0;
-		IteratorType fixedIt(image1, image1->GetRequestedRegion());
-		IteratorType movingIt(image2, image2->GetRequestedRegion());
+		// the region contains the foreground of both images (see DistanceBackends.h)
+		IteratorType fixedIt(image1, distanceRegion);
+		IteratorType movingIt(image2, distanceRegion);
 		emp_f=true;
 		emp_m=true;
 		fixedIt.GoToBegin();
@@ -650,6 +775,7 @@ public:
 			}
 			if(movingIt.Get()>thd){
 				emp_m=false;
+				numberMoving++;
 				if(fixedIt.Get()>thd){
 					emp_f=false;
 					numberTruePositives++;
@@ -686,21 +812,25 @@ public:
 		if(numberfalseNegatives==0){
 			return 0;
 		}
-		std::vector<Cell> index = build();
-		VoxelInfo* falseNegatives = new VoxelInfo[numberfalseNegatives];
-		int fp_ind=0;
-		int tp_ind=0;
+		// the voxel lists and the grid are freed from the arena when the distance is computed
+		Arena::Marker marker = evaluationArena().Mark();
+		Cell* index = build();
+		VoxelInfo* falseNegatives = evaluationArena().Allocate<VoxelInfo>(numberfalseNegatives);
+		// the surface of the moving image, at most all of its foreground voxels
+		VoxelInfo* empSeg = evaluationArena().Allocate<VoxelInfo>(numberMoving);
+		long long fp_ind=0;
+		long long tp_ind=0;
 #ifdef _DEBUG
 		VoxelInfo* truePositives;
 		VoxelInfo* falsePositives;
-		falsePositives = new VoxelInfo[numberFalsePositives];
-		truePositives = new VoxelInfo[numberTruePositives];
+		falsePositives = evaluationArena().Allocate<VoxelInfo>(numberFalsePositives);
+		truePositives = evaluationArena().Allocate<VoxelInfo>(numberTruePositives);
 #endif
 
 		fixedIt.GoToBegin();
 		movingIt.GoToBegin();
-		int FP_index=0;
-		int FN_index=0;
+		long long FP_index=0;
+		long long FN_index=0;
 
 		while (!fixedIt.IsAtEnd() && !movingIt.IsAtEnd()){
 			if(fixedIt.Get()>thd && movingIt.Get()<=thd){
@@ -719,13 +849,8 @@ public:
 				vi.z = movingIt.GetIndex()[2];
 				bool surface = isBoundary(movingIt.GetIndex(), image2);
 				if(surface){
-					empSeg.push_back(vi);
-					int x_ind = vi.x/grid_len;
-					int y_ind = vi.y/grid_len;
-					int z_ind = vi.z/grid_len;
-					Cell *gc = &index[z_ind + y_ind * grid_num_z + x_ind * grid_num_y*grid_num_z];
-					gc->voxels.push_back(vi);
-					gc->emp=false;
+					empSeg[FP_index] = vi;
+					index[cellIndex(vi)].size++;
 					FP_index++;
 				}
 			}
@@ -751,6 +876,8 @@ public:
 			++fixedIt;
 		}
 
+		fillCells(index, empSeg, FP_index);
+
 		double AVD_SUM = 0;
 		double AVD_NUM = 0;
 		maxValue = 10000000000;
@@ -758,7 +885,7 @@ public:
 
 		int rcount=0;
 
-		for(int ind=0 ; ind< numberfalseNegatives ; ind++){
+		for(long long ind=0 ; ind< numberfalseNegatives ; ind++){
 			VoxelInfo p1 = falseNegatives[ind];   
 			double x = p1.x;
 			double y = p1.y;
@@ -804,9 +931,9 @@ public:
 							if(gc->emp){
 								continue;
 							}
-							int size=gc->voxels.size();
+							long long size=gc->size;
 							//std::cout << " size: "<< size<< std::endl;
-							for(int i=0; i< size;i++){
+							for(long long i=0; i< size;i++){
 								VoxelInfo p2 = gc->voxels[i];
 								
 								double dist =std::sqrt((double)(
@@ -830,8 +957,8 @@ public:
 			}
 			else{
 				rcount++;
-				int size=empSeg.size();
-				for(int i=0; i< size;i++){
+				long long size=FP_index;
+				for(long long i=0; i< size;i++){
 					VoxelInfo p2 = empSeg[i];
 					
 					double dist =std::sqrt((double)(
@@ -886,6 +1013,7 @@ public:
        //std::cout << "AVGDST: " << value1 <<" / " << value2 << " = " << value3 << std::endl;
 	   //std::cout << "------------ Average distance details end. -----------------" << std::endl;
 
+		evaluationArena().Release(marker);
 		return AVD_SUM;
 
 	}
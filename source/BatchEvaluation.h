@@ -0,0 +1,293 @@
+/*
+// BatchEvaluation.h
+//
+// Description:
+//
+// This file evaluates all images of a submission archive (option -batch), e.g. the archive of
+// .nii.gz files uploaded by a challenge participant, without extracting it. Each member is
+// compared with the truth image of the same name, found in the truth directory or truth archive.
+// A truth archive is read in a single pass as long as its members are stored in about the order of
+// the submission (see ArchiveWalker).
+//
+// The members are read from the archive in the order they are stored and decoded by a pool of
+// threads while the previous cases are evaluated, each decoder using its share of the cores. The
+// evaluation itself is sequential (it shares global buffers), and at most BATCH_PENDING_CASES cases
+// per thread and BATCH_PENDING_BYTES of members are read or decoded ahead, so that memory stays
+// bounded independently of the size of the archive. -roi and -max-memory do not apply to batch
+// evaluations; the cases are decoded as a whole, and their sizes are compared after decoding. The
+// exit code is EXIT_FAILURE if a case could not be evaluated. If the truth images are given
+// by a base URL, the truth images of the cases read ahead are downloaded concurrently over keep-alive
+// connections (see HttpFetcher.h) while earlier cases are evaluated. With -xml, one xml result file
+// per case is written to the given directory.
+//
+*/
+
+#ifndef _BATCHEVALUATION
+#define _BATCHEVALUATION
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include "ArchiveReader.h"
+#include "HttpFetcher.h"
+#include "Parallel.h"
+#include "Segmentation.h"
+
+// number of cases per decoder thread that may be read ahead of the evaluation
+static const int BATCH_PENDING_CASES = 2;
+// bytes of the members read ahead and not yet decoded (a larger member is read when it is the only one)
+static const long long BATCH_PENDING_BYTES = 1024LL * 1024 * 1024;
+
+typedef struct BatchCase{
+	std::string member;
+	// member bytes as stored in the archive, released after decoding
+	std::vector<char> data;
+	long long size;
+	ImageType::Pointer truthImg;
+	ImageType::Pointer testImg;
+	std::string error;
+	bool decoded;
+} BatchCase;
+
+bool isBatchImage(const std::string &name){
+	if(name.compare(0, 9, "__MACOSX/") == 0){
+		return false;
+	}
+	return endsWith(name, ".nii") || endsWith(name, ".nii.gz");
+}
+
+// truth image with the same name as a member, in a directory or an archive
+std::string batchTruthPath(const std::string &truthPath, const std::string &member){
+	if(isArchive(truthPath)){
+		return truthPath + "!/" + member;
+	}
+	return truthPath + "/" + member;
+}
+
+std::string batchResultFile(const std::string &targetDir, const std::string &member){
+	std::string name = member;
+	for(size_t i = 0; i < name.size(); i++){
+		if(name[i] == '/' || name[i] == '\\'){
+			name[i] = '_';
+		}
+	}
+	if(endsWith(name, ".gz")){
+		name.erase(name.size() - 3);
+	}
+	if(endsWith(name, ".nii")){
+		name.erase(name.size() - 4);
+	}
+	return targetDir + "/" + name + ".xml";
+}
+
+int evaluateBatch(const char* truthPath, const char* archive, double threshold, const char* targetDir, char *options, const char* unit, bool useStreamingFilter, const char* roi){
+	if(!isArchive(archive)){
+		std::cout << "-batch needs a zip or tar archive of segmentations: " << archive << std::endl;
+		return EXIT_FAILURE;
+	}
+	if(roi != NULL || maxMemoryBytes > 0){
+		std::cout << "-roi and -max-memory are not supported with -batch, the images are read in full" << std::endl;
+	}
+	if(targetDir != NULL){
+		itksys::SystemTools::MakeDirectory(targetDir);
+	}
+
+	int threads = getNumberOfThreads();
+	long long window = (long long)threads * BATCH_PENDING_CASES;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::map<long long, BatchCase*> pending;
+	std::deque<BatchCase*> toDecode;
+	std::vector<std::string> toFetch;
+	bool truthUrl = isUrl(truthPath) && !isUrlCacheEnabled();
+	long long numberRead = 0;
+	long long numberEvaluated = 0;
+	long long pendingBytes = 0;
+	bool readerDone = false;
+	std::string readerError;
+	// a truth archive is read in one pass instead of being searched for every member
+	std::unique_ptr<ArchiveWalker> truthArchive;
+	if(isArchive(truthPath)){
+		truthArchive.reset(new ArchiveWalker(truthPath));
+	}
+
+	// reads the members sequentially, never more than window cases ahead of the evaluation
+	std::thread reader([&](){
+		try
+		{
+			ArchiveIterator iterator(archive);
+			std::string name;
+			while(iterator.Next(name)){
+				if(!isBatchImage(name)){
+					continue;
+				}
+				BatchCase *c = new BatchCase();
+				c->member = name;
+				c->decoded = false;
+				c->size = iterator.GetSize();
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					changed.wait(lock, [&](){ return numberRead - numberEvaluated < window && (pendingBytes == 0 || pendingBytes + c->size <= BATCH_PENDING_BYTES); });
+					pendingBytes += c->size;
+				}
+				readArchiveMember(iterator.GetSource(), c->data);
+
+				std::unique_lock<std::mutex> lock(mutex);
+				if(truthUrl){
+					// announced before decoding starts, so that loading the truth waits for the fetch
+					std::string truth = batchTruthPath(truthPath, name);
+					urlPrefetchCache.Expect(truth);
+					toFetch.push_back(truth);
+				}
+				pending[numberRead++] = c;
+				toDecode.push_back(c);
+				changed.notify_all();
+			}
+		}
+		catch(std::exception &e)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			readerError = e.what();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		readerDone = true;
+		changed.notify_all();
+	});
+
+	// downloads the truth images of the cases read ahead, all pending ones at once
+	std::thread fetcher([&](){
+		while(truthUrl){
+			std::vector<std::string> urls;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&](){ return !toFetch.empty() || readerDone; });
+				if(toFetch.empty()){
+					return;
+				}
+				urls.swap(toFetch);
+			}
+			prefetchUrlList(urls);
+		}
+	});
+
+	// decodes the test image from the member bytes and loads the corresponding truth image
+	std::vector<std::thread> decoders;
+	for(int t = 0; t < threads; t++){
+		decoders.push_back(std::thread([&](){
+			setThreadShare(threads);
+			while(true){
+				BatchCase *c;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					changed.wait(lock, [&](){ return !toDecode.empty() || readerDone; });
+					if(toDecode.empty()){
+						return;
+					}
+					c = toDecode.front();
+					toDecode.pop_front();
+				}
+				try
+				{
+					MemoryByteSource source(c->data.empty() ? NULL : &c->data[0], c->data.size());
+					c->testImg = readNiftiStream(&source);
+					std::string truth = batchTruthPath(truthPath, c->member);
+					if(truthArchive){
+						std::vector<char> truthData;
+						truthArchive->Read(c->member, truthData);
+						MemoryByteSource truthSource(truthData.empty() ? NULL : &truthData[0], truthData.size());
+						c->truthImg = readNiftiStream(&truthSource);
+					}
+					else{
+						c->truthImg = loadImage(truth.c_str(), useStreamingFilter, NULL, c->testImg);
+					}
+					if(c->truthImg.IsNull()){
+						c->error = "Unable to load truth image: " + truth;
+					}
+				}
+				catch(itk::ExceptionObject &e)
+				{
+					c->error = e.GetDescription();
+				}
+				catch(std::exception &e)
+				{
+					c->error = e.what();
+				}
+				std::vector<char>().swap(c->data);
+				std::lock_guard<std::mutex> lock(mutex);
+				pendingBytes -= c->size;
+				c->decoded = true;
+				changed.notify_all();
+			}
+		}));
+	}
+
+	// evaluates the cases in archive order
+	long long failed = 0;
+	for(long long k = 0; ; k++){
+		BatchCase *c;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [&](){ return (pending.count(k) > 0 && pending[k]->decoded) || (readerDone && k >= numberRead); });
+			if(pending.count(k) == 0){
+				break;
+			}
+			c = pending[k];
+		}
+
+		std::string truth = batchTruthPath(truthPath, c->member);
+		std::string test = std::string(archive) + "!/" + c->member;
+		std::string resultFile = targetDir != NULL ? batchResultFile(targetDir, c->member) : "";
+		const char* xml = targetDir != NULL ? resultFile.c_str() : NULL;
+		std::cout << "\n=== Case " << k + 1 << ": " << c->member << " ===\n" << std::endl;
+		clock_t t = clock();
+		long long case_start = ((double)t*1000)/CLOCKS_PER_SEC;
+		try
+		{
+			if(c->error != ""){
+				failed++;
+				ProgressEvaluation progress(truth.c_str(), test.c_str());
+				pushMessage(c->error.c_str(), xml, truth.c_str(), test.c_str());
+			}
+			else if(validateImage(truth.c_str(), test.c_str(), threshold, xml, options, unit, case_start, useStreamingFilter, NULL, c->truthImg, c->testImg) != EXIT_SUCCESS){
+				failed++;
+			}
+		}
+		catch(itk::ExceptionObject &e)
+		{
+			failed++;
+			std::cerr << e << std::endl;
+		}
+		catch(std::exception &e)
+		{
+			failed++;
+			std::cerr << "Exception: " << e.what() << std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.erase(k);
+		numberEvaluated++;
+		changed.notify_all();
+		delete c;
+	}
+
+	reader.join();
+	fetcher.join();
+	for(size_t t = 0; t < decoders.size(); t++){
+		decoders[t].join();
+	}
+	if(readerError != ""){
+		std::cout << "Error reading " << archive << ": " << readerError << std::endl;
+	}
+	if(truthArchive && truthArchive->passes > 1){
+		std::cout << "The truth archive was read " << truthArchive->passes << " times, its members are stored in another order than those of " << archive << std::endl;
+	}
+	std::cout << "\nBatch evaluation: " << numberEvaluated << " cases, " << failed << " failed" << std::endl;
+	return readerError == "" && failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
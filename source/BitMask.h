@@ -0,0 +1,259 @@
+/*
+// BitMask.h
+//
+// Description:
+//
+// This file evaluates crisp segmentations given as NIfTI files (.nii, .nii.gz) without creating
+// dense images. Each image is thresholded while it is decoded and stored as a mask of one bit per
+// voxel, so a pair of 1024^3 images needs 256 MB instead of several GB of float and 8 bit images.
+// The contingency table is counted from the masks with population counts of 64 bit words.
+//
+// As loadImage rescales the intensity range of an image to 0..255 before it is thresholded, the
+// minimum and maximum of the image are needed first: the file is decoded twice, once for the value
+// range and once for the mask, block by block. Only overlap based metrics can be computed this way;
+// if a file cannot be decoded here (e.g. 4D images), the images are read as dense images. Because
+// of the second pass the masks are only used when the dense images do not fit (see MemoryBudget.h).
+//
+*/
+
+#ifndef _BITMASK
+#define _BITMASK
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+#include <iostream>
+#include "ByteSource.h"
+#include "NiftiStreamReader.h"
+#include "NumpyReader.h"
+#include "ChunkedOverlap.h"
+#include "JointHistogram.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// number of voxels decoded at once
+static const long long BITMASK_BLOCK_VOXELS = 1 << 16;
+
+int popcount64(unsigned long long x){
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+bool isNiftiFile(const char* path){
+	std::string p = path;
+	return endsWith(p, ".nii") || endsWith(p, ".nii.gz");
+}
+
+class BitMask
+{
+public:
+	long long size[3];
+	double spacing[3];
+	long long numberElements;
+	// bit i % 64 of words[i / 64] is set for foreground voxels
+	std::vector<unsigned long long> words;
+
+	void Allocate(const long long *size, const double *spacing){
+		numberElements = 1;
+		for(int a = 0; a < 3; a++){
+			this->size[a] = size[a];
+			this->spacing[a] = spacing[a];
+			numberElements *= size[a];
+		}
+		words.assign((numberElements + 63) / 64, 0);
+	}
+
+	void Set(long long i){
+		words[i >> 6] |= 1ULL << (i & 63);
+	}
+
+	long long Count() const{
+		long long n = 0;
+		for(size_t w = 0; w < words.size(); w++){
+			n += popcount64(words[w]);
+		}
+		return n;
+	}
+
+	// number of voxels in the foreground of both masks
+	long long CountIntersection(const BitMask &other) const{
+		long long n = 0;
+		for(size_t w = 0; w < words.size(); w++){
+			n += popcount64(words[w] & other.words[w]);
+		}
+		return n;
+	}
+
+	bool HasSameSize(const BitMask &other) const{
+		return size[0] == other.size[0] && size[1] == other.size[1] && size[2] == other.size[2];
+	}
+};
+
+// calls func(index, value) for the voxels of an uncompressed NIfTI stream, with the intensity
+// scaling of the header applied
+template<class T, class Function>
+void forEachNiftiValueOfType(ByteSource *source, const NiftiHeader &header, Function func){
+	long long count = header.size[0] * header.size[1] * header.size[2];
+	bool scaled = header.slope != 0 && (header.slope != 1 || header.inter != 0);
+	std::vector<T> block(BITMASK_BLOCK_VOXELS);
+	for(long long start = 0; start < count; start += BITMASK_BLOCK_VOXELS){
+		long long n = std::min(BITMASK_BLOCK_VOXELS, count - start);
+		if(!source->ReadFully((char*)&block[0], n * sizeof(T))){
+			throw std::runtime_error("Truncated NIfTI image");
+		}
+		for(long long i = 0; i < n; i++){
+			T v = block[i];
+			if(header.swap){
+				swapBytes(v);
+			}
+			func(start + i, scaled ? (float)(v * header.slope + header.inter) : (float)v);
+		}
+	}
+}
+
+template<class Function>
+void forEachNiftiValue(ByteSource *source, NiftiHeader &header, Function func){
+	header = readNiftiHeader(source);
+	if(header.voxOffset > header.headerSize && !source->Skip(header.voxOffset - header.headerSize)){
+		throw std::runtime_error("Truncated NIfTI image");
+	}
+	switch(header.type){
+		case RAW_UINT8: forEachNiftiValueOfType<unsigned char>(source, header, func); break;
+		case RAW_INT8: forEachNiftiValueOfType<signed char>(source, header, func); break;
+		case RAW_UINT16: forEachNiftiValueOfType<unsigned short>(source, header, func); break;
+		case RAW_INT16: forEachNiftiValueOfType<short>(source, header, func); break;
+		case RAW_UINT32: forEachNiftiValueOfType<unsigned int>(source, header, func); break;
+		case RAW_INT32: forEachNiftiValueOfType<int>(source, header, func); break;
+		case RAW_UINT64: forEachNiftiValueOfType<unsigned long long>(source, header, func); break;
+		case RAW_INT64: forEachNiftiValueOfType<long long>(source, header, func); break;
+		case RAW_FLOAT32: forEachNiftiValueOfType<float>(source, header, func); break;
+		case RAW_FLOAT64: forEachNiftiValueOfType<double>(source, header, func); break;
+		default: throw std::runtime_error("Unsupported pixel type");
+	}
+}
+
+// decodes a NIfTI file (gzip compressed or not) from the beginning
+template<class Function>
+void forEachNiftiFileValue(const std::string &path, NiftiHeader &header, Function func){
+	FileByteSource file(path);
+	PeekableByteSource peekable(&file);
+	unsigned char magic[2];
+	if(peekable.Peek((char*)magic, 2) == 2 && magic[0] == 0x1f && magic[1] == 0x8b){
+		InflateByteSource inflater(&peekable, InflateByteSource::INFLATE_AUTO);
+		forEachNiftiValue(&inflater, header, func);
+	}
+	else{
+		forEachNiftiValue(&peekable, header, func);
+	}
+}
+
+/*
+// Reads the foreground of a NIfTI file at the threshold, rescaling the values as loadImage does
+*/
+void readNiftiBitMask(const std::string &path, double threshold, BitMask &mask){
+	NiftiHeader header;
+	float min = 0;
+	float max = 0;
+	forEachNiftiFileValue(path, header, [&](long long i, float value){
+		if(i == 0){
+			min = max = value;
+		}
+		else if(value < min){
+			min = value;
+		}
+		else if(value > max){
+			max = value;
+		}
+	});
+
+	IntensityScaling scaling(min, max);
+	double thd = threshold * PIXEL_VALUE_RANGE_MAX;
+	mask.Allocate(header.size, header.spacing);
+	forEachNiftiFileValue(path, header, [&](long long i, float value){
+		if(scaling.Map(value) > thd){
+			mask.Set(i);
+		}
+	});
+}
+
+/*
+// Overlap of two bit masks, with the foreground at PIXEL_VALUE_RANGE_MAX like the thresholded
+// images of VoxelPreprocessor
+*/
+class BitMaskOverlap : public JointHistogram
+{
+public:
+	BitMaskOverlap(const BitMask &fixedMask, const BitMask &movingMask, double threshold){
+		numberElements = fixedMask.numberElements;
+		for(int a = 0; a < 3; a++){
+			size[a] = fixedMask.size[a];
+		}
+		vspx = fixedMask.spacing[0];
+		vspy = fixedMask.spacing[1];
+		vspz = fixedMask.spacing[2];
+
+		long long intersection = fixedMask.CountIntersection(movingMask);
+		long long foreground_f = fixedMask.Count();
+		long long foreground_m = movingMask.Count();
+		jointHistogram.assign(HISTOGRAM_BINS * HISTOGRAM_BINS, 0);
+		jointHistogram[PIXEL_VALUE_RANGE_MAX * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MAX] = intersection;
+		jointHistogram[PIXEL_VALUE_RANGE_MAX * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MIN] = foreground_f - intersection;
+		jointHistogram[PIXEL_VALUE_RANGE_MIN * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MAX] = foreground_m - intersection;
+		jointHistogram[PIXEL_VALUE_RANGE_MIN * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MIN] = numberElements - foreground_f - foreground_m + intersection;
+
+		CountForeground(false, threshold);
+	}
+};
+
+/*
+// Reads both NIfTI files as bit masks (concurrently) and computes their overlap. Returns NULL if
+// they differ in size or cannot be decoded here; they are then evaluated as dense images.
+*/
+BitMaskOverlap* computeBitMaskOverlap(const char* f1, const char* f2, double threshold){
+	BitMask fixedMask, movingMask;
+	std::string error;
+	std::thread fixedReader([&](){
+		try
+		{
+			readNiftiBitMask(f1, threshold, fixedMask);
+		}
+		catch(std::exception &e)
+		{
+			error = e.what();
+		}
+	});
+	try
+	{
+		readNiftiBitMask(f2, threshold, movingMask);
+	}
+	catch(std::exception &e)
+	{
+		fixedReader.join();
+		std::cout << "Reading the images as dense images (" << e.what() << ")" << std::endl;
+		return NULL;
+	}
+	fixedReader.join();
+	if(error != ""){
+		std::cout << "Reading the images as dense images (" << error << ")" << std::endl;
+		return NULL;
+	}
+	if(!fixedMask.HasSameSize(movingMask)){
+		return NULL;
+	}
+	std::cout << "Bit mask evaluation: " << fixedMask.numberElements << " voxels, "
+		<< (fixedMask.words.size() + movingMask.words.size()) * sizeof(unsigned long long) / 1024 << " KB\n" << std::endl;
+	return new BitMaskOverlap(fixedMask, movingMask, threshold);
+}
+
+#endif
@@ -0,0 +1,378 @@
+/*
+// ByteSource.h
+//
+// Description:
+//
+// This file contains sequential byte sources used by the readers that decode images without
+// ITK's ImageIO (numpy arrays, archives, streams). A source can be a file (or a byte range in a file),
+// a memory buffer, or a zlib/gzip/deflate decoder wrapping another source. MappedFile maps a file
+// read-only into memory, so that uncompressed data can be evaluated in place.
+//
+*/
+
+#ifndef _BYTESOURCE
+#define _BYTESOURCE
+
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include "itk_zlib.h"
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__TOS_WIN__)
+#define _WINOS
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// size of the buffers used for reading compressed input
+static const int BYTESOURCE_BUFFER_SIZE = 256*1024;
+
+class ByteSource
+{
+public:
+	virtual ~ByteSource(){
+
+	}
+
+	// reads up to len bytes, returns the number of bytes read or 0 at the end of the source
+	virtual long long Read(char *buf, long long len) = 0;
+
+	// reads exactly len bytes, returns false if the source ends before
+	bool ReadFully(char *buf, long long len){
+		long long total = 0;
+		while(total < len){
+			long long n = Read(buf + total, len - total);
+			if(n <= 0){
+				return false;
+			}
+			total += n;
+		}
+		return true;
+	}
+
+	// skips len bytes, returns false if the source ends before
+	virtual bool Skip(long long len){
+		char buf[4096];
+		while(len > 0){
+			long long n = Read(buf, len < (long long)sizeof(buf) ? len : (long long)sizeof(buf));
+			if(n <= 0){
+				return false;
+			}
+			len -= n;
+		}
+		return true;
+	}
+};
+
+/*
+// Reads a file, or length bytes of it starting at offset (length -1 = up to the end of the file)
+*/
+class FileByteSource : public ByteSource
+{
+private:
+	std::ifstream stream;
+	long long remaining;
+
+public:
+	FileByteSource(const std::string &filename, long long offset = 0, long long length = -1){
+		stream.open(filename.c_str(), std::ios::in | std::ios::binary);
+		if(!stream.is_open()){
+			throw std::runtime_error("Cannot open file: " + filename);
+		}
+		if(offset > 0){
+			stream.seekg(offset, std::ios::beg);
+		}
+		remaining = length;
+	}
+
+	long long Read(char *buf, long long len){
+		if(remaining == 0){
+			return 0;
+		}
+		if(remaining > 0 && len > remaining){
+			len = remaining;
+		}
+		stream.read(buf, len);
+		long long n = stream.gcount();
+		if(remaining > 0){
+			remaining -= n;
+		}
+		return n;
+	}
+
+	bool Skip(long long len){
+		if(remaining >= 0 && len > remaining){
+			ByteSource::Skip(remaining);
+			return false;
+		}
+		stream.seekg(len, std::ios::cur);
+		if(remaining > 0){
+			remaining -= len;
+		}
+		return !stream.fail();
+	}
+};
+
+class MemoryByteSource : public ByteSource
+{
+private:
+	const char *data;
+	long long size;
+	long long pos;
+
+public:
+	MemoryByteSource(const char *data, long long size){
+		this->data = data;
+		this->size = size;
+		this->pos = 0;
+	}
+
+	long long Read(char *buf, long long len){
+		if(len > size - pos){
+			len = size - pos;
+		}
+		memcpy(buf, data + pos, len);
+		pos += len;
+		return len;
+	}
+};
+
+/*
+// Reads from a stdio stream such as stdin or a named pipe, which cannot be seeked
+*/
+class StdioByteSource : public ByteSource
+{
+private:
+	FILE *file;
+	bool owner;
+
+public:
+	StdioByteSource(FILE *file, bool owner){
+		this->file = file;
+		this->owner = owner;
+	}
+
+	~StdioByteSource(){
+		if(owner){
+			fclose(file);
+		}
+	}
+
+	long long Read(char *buf, long long len){
+		return fread(buf, 1, len, file);
+	}
+};
+
+/*
+// Allows to look at the first bytes of a source (e.g. to detect gzip compression) before
+// reading it from the beginning
+*/
+class PeekableByteSource : public ByteSource
+{
+private:
+	ByteSource *source;
+	std::vector<char> peeked;
+	size_t pos;
+
+public:
+	PeekableByteSource(ByteSource *source){
+		this->source = source;
+		this->pos = 0;
+	}
+
+	// returns up to len bytes from the beginning of the source without consuming them
+	long long Peek(char *buf, long long len){
+		while((long long)peeked.size() < len){
+			char tmp[4096];
+			long long n = source->Read(tmp, std::min(len - (long long)peeked.size(), (long long)sizeof(tmp)));
+			if(n <= 0){
+				break;
+			}
+			peeked.insert(peeked.end(), tmp, tmp + n);
+		}
+		long long n = std::min(len, (long long)peeked.size());
+		if(n > 0){
+			memcpy(buf, &peeked[0], n);
+		}
+		return n;
+	}
+
+	long long Read(char *buf, long long len){
+		if(pos < peeked.size()){
+			long long n = std::min(len, (long long)(peeked.size() - pos));
+			memcpy(buf, &peeked[pos], n);
+			pos += n;
+			return n;
+		}
+		return source->Read(buf, len);
+	}
+};
+
+/*
+// Decompresses the data of another source. With INFLATE_AUTO gzip and zlib streams are detected
+// by their header, INFLATE_RAW is used for raw deflate data as stored in zip archives.
+// Concatenated gzip members are decoded one after the other.
+*/
+class InflateByteSource : public ByteSource
+{
+private:
+	ByteSource *source;
+	z_stream zstream;
+	std::vector<char> inbuf;
+	bool finished;
+	bool sourceEnded;  // the source returned all its bytes, zlib may still hold output
+	bool raw;
+
+public:
+	enum InflateMode {INFLATE_AUTO, INFLATE_RAW};
+
+	InflateByteSource(ByteSource *source, InflateMode mode){
+		this->source = source;
+		this->raw = (mode == INFLATE_RAW);
+		this->finished = false;
+		this->sourceEnded = false;
+		inbuf.resize(BYTESOURCE_BUFFER_SIZE);
+		memset(&zstream, 0, sizeof(zstream));
+		int result = inflateInit2(&zstream, raw ? -MAX_WBITS : MAX_WBITS + 32);
+		if(result != Z_OK){
+			throw std::runtime_error("Cannot initialize zlib decoder");
+		}
+	}
+
+	~InflateByteSource(){
+		inflateEnd(&zstream);
+	}
+
+	long long Read(char *buf, long long len){
+		if(finished || len == 0){
+			return 0;
+		}
+		zstream.next_out = (Bytef*)buf;
+		zstream.avail_out = (uInt)(len > 0x40000000 ? 0x40000000 : len);
+		uInt requested = zstream.avail_out;
+		while(zstream.avail_out == requested){
+			if(zstream.avail_in == 0 && !sourceEnded){
+				long long n = source->Read(&inbuf[0], inbuf.size());
+				if(n <= 0){
+					sourceEnded = true;
+				}
+				else{
+					zstream.next_in = (Bytef*)&inbuf[0];
+					zstream.avail_in = (uInt)n;
+				}
+			}
+			int result = inflate(&zstream, Z_NO_FLUSH);
+			if(result == Z_STREAM_END){
+				// a gzip file may consist of several members
+				if(!raw && (zstream.avail_in > 0 || refill())){
+					inflateReset(&zstream);
+					continue;
+				}
+				finished = true;
+				break;
+			}
+			if(result != Z_OK && result != Z_BUF_ERROR){
+				throw std::runtime_error("Corrupt compressed data");
+			}
+			// after the end of the source, zlib is drained until it makes no more progress
+			if(sourceEnded && zstream.avail_out == requested){
+				finished = true;
+				break;
+			}
+		}
+		return requested - zstream.avail_out;
+	}
+
+private:
+	bool refill(){
+		if(sourceEnded){
+			return false;
+		}
+		long long n = source->Read(&inbuf[0], inbuf.size());
+		if(n <= 0){
+			sourceEnded = true;
+			return false;
+		}
+		zstream.next_in = (Bytef*)&inbuf[0];
+		zstream.avail_in = (uInt)n;
+		return true;
+	}
+};
+
+/*
+// Maps length bytes of a file starting at offset read-only into memory. On systems without
+// mmap the bytes are read into a buffer instead.
+*/
+class MappedFile
+{
+private:
+	char *mapping;
+	long long mappingLength;
+	std::vector<char> buffer;
+	const char *data;
+	long long length;
+
+public:
+	MappedFile(const std::string &filename, long long offset, long long length){
+		this->mapping = NULL;
+		this->mappingLength = 0;
+		this->length = length;
+#ifndef _WINOS
+		int fd = open(filename.c_str(), O_RDONLY);
+		if(fd < 0){
+			throw std::runtime_error("Cannot open file: " + filename);
+		}
+		// mmap fails on empty ranges, e.g. of empty files
+		if(length == 0){
+			close(fd);
+			data = NULL;
+			return;
+		}
+		// mmap offsets have to be aligned to the page size
+		long long pageSize = sysconf(_SC_PAGESIZE);
+		long long alignedOffset = (offset / pageSize) * pageSize;
+		mappingLength = length + (offset - alignedOffset);
+		void *p = mmap(NULL, mappingLength, PROT_READ, MAP_SHARED, fd, alignedOffset);
+		close(fd);
+		if(p == MAP_FAILED){
+			throw std::runtime_error("Cannot map file: " + filename);
+		}
+		madvise(p, mappingLength, MADV_SEQUENTIAL);
+		mapping = (char*)p;
+		data = mapping + (offset - alignedOffset);
+#else
+		FileByteSource source(filename, offset, length);
+		buffer.resize(length);
+		if(length > 0 && !source.ReadFully(&buffer[0], length)){
+			throw std::runtime_error("Unexpected end of file: " + filename);
+		}
+		data = length > 0 ? &buffer[0] : NULL;
+#endif
+	}
+
+	~MappedFile(){
+#ifndef _WINOS
+		if(mapping != NULL){
+			munmap(mapping, mappingLength);
+		}
+#endif
+	}
+
+	const char* GetData(){
+		return data;
+	}
+
+	long long GetLength(){
+		return length;
+	}
+};
+
+#endif
@@ -0,0 +1,439 @@
+/*
+// ChunkedArrayReader.h
+//
+// Description:
+//
+// This file reads chunked arrays stored on the local file system in the Zarr (version 2) and
+// N5 layouts, as used for very large volumes (micro-CT, light-sheet microscopy). The path of an
+// input is the directory of the array, i.e. the directory containing .zarray (Zarr) or
+// attributes.json (N5). Chunks can be uncompressed or compressed with zlib/gzip; chunks that
+// do not exist on disk hold the fill value of the array.
+//
+// As for numpy arrays, the fastest running axis in memory is the x axis and singleton axes are
+// dropped. The voxel spacing is taken from the option -spacing, a sidecar file <path>.spacing,
+// or the N5 attribute "resolution"/"pixelResolution", and defaults to 1.
+//
+*/
+
+#ifndef _CHUNKEDARRAYREADER
+#define _CHUNKEDARRAYREADER
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include "ByteSource.h"
+#include "JsonParser.h"
+#include "ImageImport.h"
+#include "NumpyReader.h"
+#include "Parallel.h"
+
+static const int CHUNKED_MAX_DIMENSIONS = 8;
+
+/*
+// Copies the voxels of a region of a decoded chunk into values (x fastest), stride holding the
+// distance in elements between neighbouring voxels along x, y and z in the chunk.
+*/
+template<class T>
+void extractChunkValues(const char *data, bool swap, const long long *count, const long long *stride, float *values){
+	long long i = 0;
+	for(long long z = 0; z < count[2]; z++){
+		for(long long y = 0; y < count[1]; y++){
+			const char *row = data + (y*stride[1] + z*stride[2]) * sizeof(T);
+			for(long long x = 0; x < count[0]; x++){
+				T v;
+				memcpy(&v, row + x*stride[0]*sizeof(T), sizeof(T));
+				if(swap){
+					swapBytes(v);
+				}
+				values[i++] = (float)v;
+			}
+		}
+	}
+}
+
+class ChunkedArray
+{
+public:
+	enum ChunkedFormat {CHUNKED_ZARR, CHUNKED_N5};
+
+	ChunkedFormat format;
+	RawPixelType type;
+	bool bigEndian;
+	bool compressed;
+	float fillValue;
+	// image size, chunk size and number of chunks in ITK order (x fastest)
+	long long size[3];
+	long long chunkSize[3];
+	long long chunkCount[3];
+	double spacing[3];
+
+private:
+	std::string path;
+	std::string separator;
+	bool fortranOrder;
+	int ndims;
+	long long dimChunk[CHUNKED_MAX_DIMENSIONS];
+	// image axis of each array dimension, -1 for singleton dimensions
+	int axisOfDim[CHUNKED_MAX_DIMENSIONS];
+
+	static long long jsonInteger(const JsonValue *v, const char *name){
+		if(v == NULL || v->type != JsonValue::JSON_NUMBER){
+			throw std::runtime_error(std::string("Invalid chunked array metadata: ") + name);
+		}
+		return (long long)v->number;
+	}
+
+	static void jsonIntegerArray(const JsonValue *v, const char *name, std::vector<long long> &out){
+		if(v == NULL || v->type != JsonValue::JSON_ARRAY){
+			throw std::runtime_error(std::string("Invalid chunked array metadata: ") + name);
+		}
+		for(size_t i = 0; i < v->items.size(); i++){
+			out.push_back(jsonInteger(&v->items[i], name));
+		}
+	}
+
+	void readZarrMetadata(){
+		JsonValue meta = parseJsonFile(path + "/.zarray");
+		if(jsonInteger(meta.Get("zarr_format"), "zarr_format") != 2){
+			throw std::runtime_error("Only Zarr version 2 arrays are supported: " + path);
+		}
+		std::vector<long long> shape, chunks;
+		jsonIntegerArray(meta.Get("shape"), "shape", shape);
+		jsonIntegerArray(meta.Get("chunks"), "chunks", chunks);
+
+		const JsonValue *dtype = meta.Get("dtype");
+		if(dtype == NULL || dtype->type != JsonValue::JSON_STRING || dtype->string.size() < 3){
+			throw std::runtime_error("Unsupported zarr data type: " + path);
+		}
+		type = parseNumpyType("<" + dtype->string.substr(1));
+		bigEndian = dtype->string[0] == '>';
+		if(type == RAW_UNKNOWN){
+			throw std::runtime_error("Unsupported zarr data type: " + dtype->string);
+		}
+
+		const JsonValue *compressor = meta.Get("compressor");
+		compressed = false;
+		if(compressor != NULL && !compressor->IsNull()){
+			const JsonValue *id = compressor->Get("id");
+			std::string name = id != NULL ? id->string : "";
+			if(name != "zlib" && name != "gzip"){
+				throw std::runtime_error("Unsupported zarr compressor: " + name + " (supported are zlib, gzip and no compression)");
+			}
+			compressed = true;
+		}
+		const JsonValue *filters = meta.Get("filters");
+		if(filters != NULL && !filters->IsNull() && !filters->items.empty()){
+			throw std::runtime_error("Zarr filters are not supported: " + path);
+		}
+
+		const JsonValue *fill = meta.Get("fill_value");
+		fillValue = (fill != NULL && fill->type == JsonValue::JSON_NUMBER) ? (float)fill->number : 0;
+		const JsonValue *order = meta.Get("order");
+		fortranOrder = order != NULL && order->string == "F";
+		const JsonValue *sep = meta.Get("dimension_separator");
+		separator = (sep != NULL && sep->type == JsonValue::JSON_STRING) ? sep->string : ".";
+		setDimensions(shape, chunks);
+		resolveInputSpacing(path, spacing);
+	}
+
+	void readN5Metadata(){
+		JsonValue meta = parseJsonFile(path + "/attributes.json");
+		if(meta.Get("dimensions") == NULL){
+			throw std::runtime_error("Not an N5 dataset: " + path);
+		}
+		std::vector<long long> shape, chunks;
+		jsonIntegerArray(meta.Get("dimensions"), "dimensions", shape);
+		jsonIntegerArray(meta.Get("blockSize"), "blockSize", chunks);
+
+		const JsonValue *dataType = meta.Get("dataType");
+		std::string name = dataType != NULL ? dataType->string : "";
+		const char* names[] = {"uint8", "int8", "uint16", "int16", "uint32", "int32", "uint64", "int64", "float32", "float64"};
+		type = RAW_UNKNOWN;
+		for(int i = 0; i < 10; i++){
+			if(name == names[i]){
+				type = (RawPixelType)i;
+			}
+		}
+		if(type == RAW_UNKNOWN){
+			throw std::runtime_error("Unsupported N5 data type: " + name);
+		}
+		bigEndian = true;
+
+		// "compression" object since N5 2.0, "compressionType" string before
+		std::string compression = "raw";
+		const JsonValue *c = meta.Get("compression");
+		if(c != NULL && c->Get("type") != NULL){
+			compression = c->Get("type")->string;
+		}
+		else if(meta.Get("compressionType") != NULL){
+			compression = meta.Get("compressionType")->string;
+		}
+		if(compression != "raw" && compression != "gzip"){
+			throw std::runtime_error("Unsupported N5 compression: " + compression + " (supported are raw and gzip)");
+		}
+		compressed = (compression == "gzip");
+		fillValue = 0;
+		fortranOrder = true;
+		separator = "/";
+		setDimensions(shape, chunks);
+
+		resolveInputSpacing(path, spacing);
+		const JsonValue *resolution = meta.Get("resolution");
+		if(meta.Get("pixelResolution") != NULL){
+			resolution = meta.Get("pixelResolution")->Get("dimensions");
+		}
+		bool sidecar = itksys::SystemTools::FileExists((path + ".spacing").c_str(), true);
+		if(inputSpacing[0] <= 0 && !sidecar && resolution != NULL && resolution->type == JsonValue::JSON_ARRAY){
+			for(int d = 0; d < ndims && d < (int)resolution->items.size(); d++){
+				if(axisOfDim[d] >= 0 && resolution->items[d].number > 0){
+					spacing[axisOfDim[d]] = resolution->items[d].number;
+				}
+			}
+		}
+	}
+
+	void setDimensions(const std::vector<long long> &shape, const std::vector<long long> &chunks){
+		ndims = shape.size();
+		if(ndims > CHUNKED_MAX_DIMENSIONS || chunks.size() != shape.size()){
+			throw std::runtime_error("Invalid chunked array dimensions: " + path);
+		}
+		for(int a = 0; a < 3; a++){
+			size[a] = 1;
+			chunkSize[a] = 1;
+		}
+		// image axes are assigned from the fastest to the slowest running dimension
+		int axis = 0;
+		for(int i = 0; i < ndims; i++){
+			int d = fortranOrder ? i : ndims - 1 - i;
+			dimChunk[d] = chunks[d];
+			axisOfDim[d] = -1;
+			if(chunks[d] <= 0){
+				throw std::runtime_error("Invalid chunk size: " + path);
+			}
+			if(shape[d] != 1){
+				if(axis == 3){
+					throw std::runtime_error("Only 2D and 3D chunked arrays are supported: " + path);
+				}
+				axisOfDim[d] = axis;
+				size[axis] = shape[d];
+				chunkSize[axis] = chunks[d];
+				axis++;
+			}
+		}
+		if(axis < 2){
+			throw std::runtime_error("Only 2D and 3D chunked arrays are supported: " + path);
+		}
+		for(int a = 0; a < 3; a++){
+			chunkCount[a] = (size[a] + chunkSize[a] - 1) / chunkSize[a];
+		}
+	}
+
+	std::string chunkFileName(long long chunk){
+		long long grid[3];
+		grid[0] = chunk % chunkCount[0];
+		grid[1] = (chunk / chunkCount[0]) % chunkCount[1];
+		grid[2] = chunk / (chunkCount[0] * chunkCount[1]);
+		std::ostringstream name;
+		name << path << "/";
+		for(int d = 0; d < ndims; d++){
+			if(d > 0){
+				name << separator;
+			}
+			name << (axisOfDim[d] >= 0 ? grid[axisOfDim[d]] : 0);
+		}
+		return name.str();
+	}
+
+	static unsigned int be16(const unsigned char *p){
+		return (p[0] << 8) | p[1];
+	}
+
+	static unsigned int be32(const unsigned char *p){
+		return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	}
+
+	static void inflateChunk(const char *data, long long length, long long expected, std::vector<char> &out){
+		MemoryByteSource source(data, length);
+		InflateByteSource inflater(&source, InflateByteSource::INFLATE_AUTO);
+		out.resize(expected);
+		if(expected > 0 && !inflater.ReadFully(&out[0], expected)){
+			throw std::runtime_error("Truncated compressed chunk");
+		}
+	}
+
+public:
+	ChunkedArray(const char* filename){
+		path = filename;
+		while(path.size() > 1 && (path[path.size()-1] == '/' || path[path.size()-1] == '\\')){
+			path.erase(path.size()-1);
+		}
+		if(itksys::SystemTools::FileExists((path + "/.zarray").c_str(), true)){
+			format = CHUNKED_ZARR;
+			readZarrMetadata();
+		}
+		else{
+			format = CHUNKED_N5;
+			readN5Metadata();
+		}
+	}
+
+	long long GetNumberOfChunks(){
+		return chunkCount[0] * chunkCount[1] * chunkCount[2];
+	}
+
+	long long GetNumberOfElements(){
+		return size[0] * size[1] * size[2];
+	}
+
+	// voxel index and size of a chunk, clipped to the image
+	void GetChunkRegion(long long chunk, long long *start, long long *count){
+		long long grid[3];
+		grid[0] = chunk % chunkCount[0];
+		grid[1] = (chunk / chunkCount[0]) % chunkCount[1];
+		grid[2] = chunk / (chunkCount[0] * chunkCount[1]);
+		for(int a = 0; a < 3; a++){
+			start[a] = grid[a] * chunkSize[a];
+			count[a] = std::min(chunkSize[a], size[a] - start[a]);
+		}
+	}
+
+	bool HasSameChunkGrid(const ChunkedArray &other){
+		for(int a = 0; a < 3; a++){
+			if(size[a] != other.size[a] || chunkSize[a] != other.chunkSize[a]){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*
+	// Reads the stored (possibly compressed) bytes of a chunk without decoding them. Returns false
+	// if the chunk does not exist, i.e. holds the fill value only.
+	*/
+	bool ReadChunkBytes(long long chunk, std::vector<char> &raw){
+		std::ifstream stream(chunkFileName(chunk).c_str(), std::ios::in | std::ios::binary);
+		if(!stream.is_open()){
+			return false;
+		}
+		raw.assign((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	/*
+	// Decodes a chunk into values (x fastest, clipped to the image). Returns false without reading
+	// anything if the chunk does not exist, i.e. holds the fill value only.
+	*/
+	bool ReadChunk(long long chunk, std::vector<float> &values){
+		std::vector<char> raw;
+		if(!ReadChunkBytes(chunk, raw)){
+			return false;
+		}
+		DecodeChunk(chunk, raw, values);
+		return true;
+	}
+
+	// decodes the stored bytes of a chunk read by ReadChunkBytes
+	void DecodeChunk(long long chunk, const std::vector<char> &raw, std::vector<float> &values){
+		std::string filename = chunkFileName(chunk);
+		long long blockDims[CHUNKED_MAX_DIMENSIONS];
+		for(int d = 0; d < ndims; d++){
+			blockDims[d] = dimChunk[d];
+		}
+		long long headerLength = 0;
+		if(format == CHUNKED_N5){
+			// block header: mode, number of dimensions, block size per dimension (big endian)
+			const unsigned char *h = (const unsigned char*)(raw.empty() ? NULL : &raw[0]);
+			if(raw.size() < 4 || be16(h) > 1 || (int)be16(h + 2) != ndims || (long long)raw.size() < 4 + 4*ndims){
+				throw std::runtime_error("Invalid N5 block: " + filename);
+			}
+			for(int d = 0; d < ndims; d++){
+				blockDims[d] = be32(h + 4 + 4*d);
+			}
+			headerLength = 4 + 4*ndims + (be16(h) == 1 ? 4 : 0);
+		}
+
+		long long stride[CHUNKED_MAX_DIMENSIONS];
+		long long elements = 1;
+		for(int i = 0; i < ndims; i++){
+			int d = fortranOrder ? i : ndims - 1 - i;
+			stride[d] = elements;
+			elements *= blockDims[d];
+		}
+		long long expected = elements * rawPixelSize(type);
+
+		std::vector<char> decoded;
+		const char *data = raw.empty() ? NULL : &raw[0] + headerLength;
+		long long length = raw.size() - headerLength;
+		if(compressed){
+			inflateChunk(data, length, expected, decoded);
+			data = &decoded[0];
+			length = expected;
+		}
+		if(length < expected){
+			throw std::runtime_error("Truncated chunk: " + filename);
+		}
+
+		long long start[3], count[3], axisStride[3] = {0, 0, 0};
+		GetChunkRegion(chunk, start, count);
+		for(int d = 0; d < ndims; d++){
+			if(axisOfDim[d] >= 0){
+				axisStride[axisOfDim[d]] = stride[d];
+				if(blockDims[d] < count[axisOfDim[d]]){
+					throw std::runtime_error("Chunk smaller than expected: " + filename);
+				}
+			}
+		}
+		values.resize(count[0] * count[1] * count[2]);
+		bool swap = bigEndian != isHostBigEndian();
+		switch(type){
+			case RAW_UINT8: extractChunkValues<unsigned char>(data, false, count, axisStride, &values[0]); break;
+			case RAW_INT8: extractChunkValues<signed char>(data, false, count, axisStride, &values[0]); break;
+			case RAW_UINT16: extractChunkValues<unsigned short>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_INT16: extractChunkValues<short>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_UINT32: extractChunkValues<unsigned int>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_INT32: extractChunkValues<int>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_UINT64: extractChunkValues<unsigned long long>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_INT64: extractChunkValues<long long>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_FLOAT32: extractChunkValues<float>(data, swap, count, axisStride, &values[0]); break;
+			case RAW_FLOAT64: extractChunkValues<double>(data, swap, count, axisStride, &values[0]); break;
+			default: throw std::runtime_error("Unsupported pixel type");
+		}
+	}
+};
+
+bool isChunkedArray(const char* path){
+	std::string p = path;
+	return itksys::SystemTools::FileIsDirectory(p.c_str()) &&
+		(itksys::SystemTools::FileExists((p + "/.zarray").c_str(), true) || itksys::SystemTools::FileExists((p + "/attributes.json").c_str(), true));
+}
+
+/*
+// Assembles a chunked array into a dense image. This is needed by the metrics that require the
+// full image (distances, voxel-wise correlation); the chunks are decoded in parallel.
+*/
+ImageType::Pointer loadChunkedImage(const char* path){
+	ChunkedArray array(path);
+	std::vector<float> volume(array.GetNumberOfElements(), array.fillValue);
+	int threads = getNumberOfThreads();
+	std::vector< std::vector<float> > buffers(threads);
+	parallelFor(array.GetNumberOfChunks(), threads, [&](long long chunk, int thread){
+		std::vector<float> &values = buffers[thread];
+		if(!array.ReadChunk(chunk, values)){
+			return;
+		}
+		long long start[3], count[3];
+		array.GetChunkRegion(chunk, start, count);
+		long long i = 0;
+		for(long long z = 0; z < count[2]; z++){
+			for(long long y = 0; y < count[1]; y++){
+				float *row = &volume[((start[2] + z) * array.size[1] + start[1] + y) * array.size[0] + start[0]];
+				memcpy(row, &values[i], count[0] * sizeof(float));
+				i += count[0];
+			}
+		}
+	});
+	return importTypedImage(&volume[0], array.size, array.spacing);
+}
+
+#endif
@@ -0,0 +1,355 @@
+/*
+// ChunkedOverlap.h
+//
+// Description:
+//
+// This file computes the overlap of two chunked arrays chunk by chunk in parallel, without
+// assembling the images. The result is the joint histogram of the rescaled voxel values of both
+// images, from which the contingency table (and thus all overlap based metrics) is built.
+//
+// The voxel values are rescaled exactly as loadImage does (the intensity range of each image is
+// mapped to 0..255), which needs the global minimum and maximum of each image. The first pass
+// therefore finds the value range of every chunk and, for chunks with few distinct value pairs
+// (label maps), the counts of the pairs of raw values, which are rescaled once the range is
+// known. Chunks are decompressed only if needed:
+//
+// - chunks missing on disk hold the fill value and are not read.
+// - the stored bytes of a chunk are compared with those of the constant chunks found so far (of
+//   the same size and shape): a compressor writes the same bytes for the same content, so all
+//   stored background chunks but the first are recognised as constant without decompressing them.
+// - only chunks with many distinct value pairs (fuzzy images) are decompressed again in the
+//   second pass.
+//
+*/
+#ifndef _CHUNKEDOVERLAP
+#define _CHUNKEDOVERLAP
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <iostream>
+#include "ChunkedArrayReader.h"
+#include "JointHistogram.h"
+#include "Parallel.h"
+
+typedef struct ChunkSummary{
+	bool constant;
+	float min;
+	float max;
+} ChunkSummary;
+
+// counts of the pairs of raw values of a chunk
+typedef struct ValuePair{
+	float fixed;
+	float moving;
+	long long count;
+} ValuePair;
+
+// distinct value pairs kept per chunk, chunks with more are decompressed again in the second pass
+static const size_t CHUNKED_MAX_VALUE_PAIRS = 1024;
+// constant chunks remembered per image
+static const size_t CHUNKED_MAX_CONSTANT_CHUNKS = 64;
+
+/*
+// The stored bytes and the value of the constant chunks of an array found so far, to recognise
+// further constant chunks from their stored bytes. Chunks are only compared with chunks of the
+// same shape, since the bytes of an edge chunk also hold the padding outside the image.
+*/
+class ConstantChunks
+{
+private:
+	typedef struct Entry{
+		unsigned long long hash;
+		long long count[3];
+		std::vector<char> bytes;
+		float value;
+	} Entry;
+
+	std::vector<Entry> entries;
+	std::mutex lock;
+
+public:
+	static unsigned long long Hash(const std::vector<char> &bytes){
+		unsigned long long hash = 14695981039346656037ULL;
+		for(size_t i = 0; i < bytes.size(); i++){
+			hash = (hash ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	bool Find(const std::vector<char> &bytes, unsigned long long hash, const long long *count, float &value){
+		std::lock_guard<std::mutex> guard(lock);
+		for(size_t i = 0; i < entries.size(); i++){
+			const Entry &e = entries[i];
+			if(e.hash == hash && e.count[0] == count[0] && e.count[1] == count[1] && e.count[2] == count[2] && e.bytes == bytes){
+				value = e.value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Add(const std::vector<char> &bytes, unsigned long long hash, const long long *count, float value){
+		std::lock_guard<std::mutex> guard(lock);
+		if(entries.size() >= CHUNKED_MAX_CONSTANT_CHUNKS){
+			return;
+		}
+		Entry e;
+		e.hash = hash;
+		for(int a = 0; a < 3; a++){
+			e.count[a] = count[a];
+		}
+		e.bytes = bytes;
+		e.value = value;
+		entries.push_back(e);
+	}
+};
+
+/*
+// Linear intensity mapping of RescaleIntensityImageFilter for an input range min..max
+*/
+typedef struct IntensityScaling{
+	double scale;
+	double shift;
+
+	IntensityScaling(double min, double max){
+		if(max != min){
+			scale = ((double)PIXEL_VALUE_RANGE_MAX - PIXEL_VALUE_RANGE_MIN) / (max - min);
+		}
+		else if(max != 0){
+			scale = ((double)PIXEL_VALUE_RANGE_MAX - PIXEL_VALUE_RANGE_MIN) / max;
+		}
+		else{
+			scale = 0;
+		}
+		shift = PIXEL_VALUE_RANGE_MIN - min * scale;
+	}
+
+	// rescaled value as float, cast to the pixel type like CastImageFilter
+	pixeltype Map(float value) const{
+		return (pixeltype)(float)(scale * (double)value + shift);
+	}
+} IntensityScaling;
+
+class ChunkedOverlap : public JointHistogram
+{
+private:
+	typedef struct ChunkState{
+		ChunkSummary fixed;
+		ChunkSummary moving;
+		bool pairsKept;  // pairs holds the value pairs of the chunk
+		std::vector<ValuePair> pairs;
+	} ChunkState;
+
+	std::atomic<long long> decompressed;
+	std::atomic<long long> recognised;
+	std::atomic<long long> missing;
+	std::atomic<long long> decompressedAgain;
+
+	/*
+	// Value range of a chunk. The chunk is decompressed into values unless it is missing or its
+	// stored bytes are those of a known constant chunk; returns whether values holds it.
+	*/
+	bool summarize(ChunkedArray &array, ConstantChunks &constants, long long chunk, std::vector<char> &bytes, std::vector<float> &values, ChunkSummary &summary){
+		summary.constant = true;
+		summary.min = summary.max = array.fillValue;
+		if(!array.ReadChunkBytes(chunk, bytes)){
+			missing++;
+			return false;
+		}
+		long long start[3], count[3];
+		array.GetChunkRegion(chunk, start, count);
+		unsigned long long hash = ConstantChunks::Hash(bytes);
+		if(constants.Find(bytes, hash, count, summary.min)){
+			summary.max = summary.min;
+			recognised++;
+			return false;
+		}
+		array.DecodeChunk(chunk, bytes, values);
+		decompressed++;
+		if(!values.empty()){
+			summary.min = summary.max = values[0];
+		}
+		for(size_t i = 1; i < values.size(); i++){
+			if(values[i] < summary.min){
+				summary.min = values[i];
+			}
+			else if(values[i] > summary.max){
+				summary.max = values[i];
+			}
+		}
+		summary.constant = summary.min == summary.max;
+		if(summary.constant){
+			constants.Add(bytes, hash, count, summary.min);
+		}
+		return true;
+	}
+
+	// counts the value pairs of a chunk, false if there are more than CHUNKED_MAX_VALUE_PAIRS
+	static bool countPairs(const std::vector<float> &values_f, const std::vector<float> &values_m, long long voxels, std::vector<ValuePair> &pairs){
+		pairs.clear();
+		size_t last = 0;
+		for(long long i = 0; i < voxels; i++){
+			float f = values_f[i];
+			float m = values_m[i];
+			// neighbouring voxels mostly have the same values
+			if(!pairs.empty() && pairs[last].fixed == f && pairs[last].moving == m){
+				pairs[last].count++;
+				continue;
+			}
+			size_t k = 0;
+			while(k < pairs.size() && (pairs[k].fixed != f || pairs[k].moving != m)){
+				k++;
+			}
+			if(k == pairs.size()){
+				if(pairs.size() == CHUNKED_MAX_VALUE_PAIRS){
+					pairs.clear();
+					return false;
+				}
+				ValuePair pair = {f, m, 0};
+				pairs.push_back(pair);
+			}
+			pairs[k].count++;
+			last = k;
+		}
+		return true;
+	}
+
+	static IntensityScaling globalScaling(const std::vector<ChunkState> &states, bool fixed){
+		float min = fixed ? states[0].fixed.min : states[0].moving.min;
+		float max = fixed ? states[0].fixed.max : states[0].moving.max;
+		for(size_t i = 1; i < states.size(); i++){
+			const ChunkSummary &s = fixed ? states[i].fixed : states[i].moving;
+			min = std::min(min, s.min);
+			max = std::max(max, s.max);
+		}
+		return IntensityScaling(min, max);
+	}
+
+	// values of a chunk in the second pass: decompressed again unless constant
+	void chunkValues(ChunkedArray &array, long long chunk, const ChunkSummary &summary, long long voxels, std::vector<float> &values){
+		if(summary.constant){
+			values.assign(voxels, summary.min);
+			return;
+		}
+		array.ReadChunk(chunk, values);
+		decompressedAgain++;
+	}
+
+public:
+	long long numberChunks;
+	// stored chunks of both images decompressed in the first pass, recognised as constant from
+	// their stored bytes, missing on disk, and decompressed again in the second pass
+	long long decompressedChunks;
+	long long recognisedChunks;
+	long long missingChunks;
+	long long decompressedAgainChunks;
+
+	ChunkedOverlap(ChunkedArray &fixedArray, ChunkedArray &movingArray, bool fuzzy, double threshold){
+		numberChunks = fixedArray.GetNumberOfChunks();
+		numberElements = fixedArray.GetNumberOfElements();
+		for(int a = 0; a < 3; a++){
+			size[a] = fixedArray.size[a];
+		}
+		vspx = fixedArray.spacing[0];
+		vspy = fixedArray.spacing[1];
+		vspz = fixedArray.spacing[2];
+		decompressed = 0;
+		recognised = 0;
+		missing = 0;
+		decompressedAgain = 0;
+
+		int threads = getNumberOfThreads();
+		std::vector< std::vector<char> > bytes(threads);
+		std::vector< std::vector<float> > buffers_f(threads);
+		std::vector< std::vector<float> > buffers_m(threads);
+		ConstantChunks constants_f, constants_m;
+
+		// pass 1: value range of each chunk and the value pairs of the chunks with few of them
+		std::vector<ChunkState> states(numberChunks);
+		parallelFor(numberChunks, threads, [&](long long chunk, int thread){
+			ChunkState &state = states[chunk];
+			std::vector<float> &values_f = buffers_f[thread];
+			std::vector<float> &values_m = buffers_m[thread];
+			bool decoded_f = summarize(fixedArray, constants_f, chunk, bytes[thread], values_f, state.fixed);
+			bool decoded_m = summarize(movingArray, constants_m, chunk, bytes[thread], values_m, state.moving);
+			state.pairsKept = false;
+			if(state.fixed.constant && state.moving.constant){
+				return;
+			}
+			long long start[3], count[3];
+			fixedArray.GetChunkRegion(chunk, start, count);
+			long long voxels = count[0] * count[1] * count[2];
+			if(!decoded_f){
+				values_f.assign(voxels, state.fixed.min);
+			}
+			if(!decoded_m){
+				values_m.assign(voxels, state.moving.min);
+			}
+			state.pairsKept = countPairs(values_f, values_m, voxels, state.pairs);
+		});
+		IntensityScaling scaling_f = globalScaling(states, true);
+		IntensityScaling scaling_m = globalScaling(states, false);
+
+		// pass 2: joint histogram, only the chunks with many value pairs are decompressed again
+		std::vector< std::vector<long long> > histograms(threads, std::vector<long long>(HISTOGRAM_BINS * HISTOGRAM_BINS, 0));
+		parallelFor(numberChunks, threads, [&](long long chunk, int thread){
+			long long *histogram = &histograms[thread][0];
+			const ChunkState &state = states[chunk];
+			long long start[3], count[3];
+			fixedArray.GetChunkRegion(chunk, start, count);
+			long long voxels = count[0] * count[1] * count[2];
+			if(state.fixed.constant && state.moving.constant){
+				histogram[scaling_f.Map(state.fixed.min) * HISTOGRAM_BINS + scaling_m.Map(state.moving.min)] += voxels;
+				return;
+			}
+			if(state.pairsKept){
+				for(size_t k = 0; k < state.pairs.size(); k++){
+					const ValuePair &pair = state.pairs[k];
+					histogram[scaling_f.Map(pair.fixed) * HISTOGRAM_BINS + scaling_m.Map(pair.moving)] += pair.count;
+				}
+				return;
+			}
+			std::vector<float> &values_f = buffers_f[thread];
+			std::vector<float> &values_m = buffers_m[thread];
+			chunkValues(fixedArray, chunk, state.fixed, voxels, values_f);
+			chunkValues(movingArray, chunk, state.moving, voxels, values_m);
+			for(long long i = 0; i < voxels; i++){
+				histogram[scaling_f.Map(values_f[i]) * HISTOGRAM_BINS + scaling_m.Map(values_m[i])]++;
+			}
+		});
+		decompressedChunks = decompressed;
+		recognisedChunks = recognised;
+		missingChunks = missing;
+		decompressedAgainChunks = decompressedAgain;
+
+		jointHistogram.assign(HISTOGRAM_BINS * HISTOGRAM_BINS, 0);
+		for(int t = 0; t < threads; t++){
+			for(int i = 0; i < HISTOGRAM_BINS * HISTOGRAM_BINS; i++){
+				jointHistogram[i] += histograms[t][i];
+			}
+		}
+
+		CountForeground(fuzzy, threshold);
+	}
+};
+
+/*
+// Computes the overlap of two chunked arrays if they share the same chunk grid, otherwise
+// returns NULL and the arrays are evaluated as dense images.
+*/
+ChunkedOverlap* computeChunkedOverlap(const char* f1, const char* f2, bool fuzzy, double threshold){
+	ChunkedArray fixedArray(f1);
+	ChunkedArray movingArray(f2);
+	if(!fixedArray.HasSameChunkGrid(movingArray)){
+		std::cout << "Chunked arrays differ in size or chunk size, evaluating them as dense images" << std::endl;
+		return NULL;
+	}
+	ChunkedOverlap *overlap = new ChunkedOverlap(fixedArray, movingArray, fuzzy, threshold);
+	std::cout << "Chunked evaluation: " << overlap->numberChunks << " chunks per image; of both images "
+		<< overlap->decompressedChunks << " decompressed, " << overlap->recognisedChunks << " recognised as constant without decompressing, "
+		<< overlap->missingChunks << " missing, " << overlap->decompressedAgainChunks << " decompressed a second time\n" << std::endl;
+	return overlap;
+}
+
+#endif
@@ -32,17 +32,19 @@
 
 #include "itkImage.h"
 #include "itkImageRegionIterator.h"
+#include "MetricAccumulators.h"
 
 class ContingencyTable
 {
-
-
 private:
-	VoxelPreprocessor *voxelprocesser;
+	bool fuzzy;
+	double threshold;
 
 public: 
-	int numberElements_f;
-    int numberElements_m;
+	static const unsigned artifacts = ARTIFACT_CONTINGENCY;
+
+	long long numberElements_f;
+    long long numberElements_m;
 	double tn; //TN
 	double fn; //FN
 	double fp; //FP
@@ -62,19 +64,18 @@ public:
 
 	}
 
-	ContingencyTable(VoxelPreprocessor *voxelprocesser, bool fuzzy, double threshold){
-		this->voxelprocesser= voxelprocesser;
-		double mean_f= voxelprocesser->mean_f;
-		double mean_m= voxelprocesser->mean_m;
-		numberElements_f = voxelprocesser->numberElements_f;
-		numberElements_m = voxelprocesser->numberElements_m;
-
-		this->vspx = voxelprocesser->vspx;
-		this->vspy = voxelprocesser->vspy;
-		this->vspz = voxelprocesser->vspz;
-		
-		double sum_f = 0;
-		double sum_m = 0;
+	// accumulated from the voxels of the images (see MetricAccumulators.h)
+	ContingencyTable(){
+	}
+
+	void init(const AccumulatorSettings &settings){
+		fuzzy = settings.fuzzy;
+		threshold = settings.threshold;
+		vspx = settings.vspx;
+		vspy = settings.vspy;
+		vspz = settings.vspz;
+		numberElements_f = 0;
+		numberElements_m = 0;
 		tn = 0;
 		fp = 0;
 		fn = 0;
@@ -83,20 +84,83 @@ public:
 		b = 0;
 		c = 0;
 		d = 0;
-		for (int i = 0; i < numberElements_f && i < numberElements_m; i++)
+		n = 0;
+	}
+
+	void accumulate(const VoxelBlock &block){
+		for (long long i = 0; i < block.count; i++)
 		{
-				double x1 =((double)values_f[i])/((double)PIXEL_VALUE_RANGE_MAX);
+				double x1 =((double)preprocessVoxel(block.fixed[i], fuzzy, threshold))/((double)PIXEL_VALUE_RANGE_MAX);
 				double y1 =1-x1;
-				double x2 = ((double)values_m[i])/((double)PIXEL_VALUE_RANGE_MAX);
+				double x2 = ((double)preprocessVoxel(block.moving[i], fuzzy, threshold))/((double)PIXEL_VALUE_RANGE_MAX);
 				double y2 =1-x2;
 				tn += std::min(y1,y2);
 				fn += x1>x2?x1-x2:0;
 				fp += x2>x1?x2-x1:0;
 				tp += std::min(x1,x2);
-				
 		}
-		//-------------------
+		numberElements_f += block.count;
+		numberElements_m += block.count;
+	}
+
+	void merge(const ContingencyTable &other){
+		numberElements_f += other.numberElements_f;
+		numberElements_m += other.numberElements_m;
+		tn += other.tn;
+		fp += other.fp;
+		fn += other.fn;
+		tp += other.tp;
+	}
+
+	void finalize(){
 		n = std::min(numberElements_f, numberElements_m);
+		calcPairCounts();
+	}
+
+	/*
+	// Builds the table from the joint histogram of the rescaled voxel values of both images
+	// (jointHistogram[f*(PIXEL_VALUE_RANGE_MAX+1) + m] = number of voxels with value f in the fixed
+	// and m in the moving image), e.g. as computed chunk by chunk for chunked arrays.
+	*/
+	ContingencyTable(const long long *jointHistogram, long long numberElements, double vspx, double vspy, double vspz, bool fuzzy, double threshold){
+		this->fuzzy = fuzzy;
+		this->threshold = threshold;
+		numberElements_f = numberElements;
+		numberElements_m = numberElements;
+		this->vspx = vspx;
+		this->vspy = vspy;
+		this->vspz = vspz;
+
+		int bins = PIXEL_VALUE_RANGE_MAX + 1;
+		tn = 0;
+		fp = 0;
+		fn = 0;
+		tp = 0;
+		for (int f = 0; f < bins; f++){
+			for (int m = 0; m < bins; m++){
+				double count = (double)jointHistogram[f * bins + m];
+				if(count == 0){
+					continue;
+				}
+				// same values as VoxelPreprocessor
+				int value_f = fuzzy ? f : (f > threshold*PIXEL_VALUE_RANGE_MAX ? PIXEL_VALUE_RANGE_MAX : PIXEL_VALUE_RANGE_MIN);
+				int value_m = fuzzy ? m : (m > threshold*PIXEL_VALUE_RANGE_MAX ? PIXEL_VALUE_RANGE_MAX : PIXEL_VALUE_RANGE_MIN);
+				double x1 = ((double)value_f)/((double)PIXEL_VALUE_RANGE_MAX);
+				double y1 = 1-x1;
+				double x2 = ((double)value_m)/((double)PIXEL_VALUE_RANGE_MAX);
+				double y2 = 1-x2;
+				tn += count * std::min(y1,y2);
+				fn += count * (x1>x2?x1-x2:0);
+				fp += count * (x2>x1?x2-x1:0);
+				tp += count * std::min(x1,x2);
+			}
+		}
+		n = numberElements;
+		calcPairCounts();
+	}
+
+	// parameters a,b,c,d (pairs of voxels) derived from tp, fp, fn, tn
+	void calcPairCounts(){
 		double coltot1 = tn + fp;
 		double coltot2 = fn + tp;
 		double rowtot1 = tn + fn;
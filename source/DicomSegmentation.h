@@ -0,0 +1,750 @@
+/*
+// DicomSegmentation.h
+//
+// Description:
+//
+// This file reads DICOM Segmentation Storage objects (DICOM-SEG). A SEG holds one frame per
+// segment and slice, each placed by its own position (Per-frame Functional Groups) in the patient
+// coordinate system, and frames without foreground are usually left out, so its frames are not a
+// volume. The frames of the selected segments are placed voxel by voxel, through their physical
+// positions, onto the grid of the other image of the evaluation, i.e. the image the SEG refers to
+// (e.g. the CT series, or a NIfTI image made from it). If there is no such image (both inputs are
+// SEGs), the grid is made from the frames: their orientation and pixel spacing, and the slices from
+// the first to the last frame position along the normal.
+//
+// Segments are selected by appending #<numbers or labels> to the path, e.g. seg.dcm#2 or
+// seg.dcm#Liver,Spleen; without a selection all segments together are the foreground. BINARY
+// segmentations give 0/1 voxels, FRACTIONAL ones their fraction (the maximum of overlapping
+// segments), which are then rescaled like any other input (see ImageImport.h).
+//
+// The dataset is parsed here (explicit and implicit VR little endian, deflated explicit VR little
+// endian), so a SEG is also read without GDCM. Encapsulated (compressed) pixel data is refused.
+//
+*/
+
+#ifndef _DICOMSEGMENTATION
+#define _DICOMSEGMENTATION
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include "itkImage.h"
+#include "itksys/SystemTools.hxx"
+#include "itksys/Directory.hxx"
+#include "ByteSource.h"
+#include "ImageImport.h"
+
+// SOP class of DICOM Segmentation Storage
+static const char* DICOM_SEG_SOP_CLASS = "1.2.840.10008.5.1.4.1.1.66.4";
+
+static const char* DICOM_IMPLICIT_LITTLE_ENDIAN = "1.2.840.10008.1.2";
+static const char* DICOM_EXPLICIT_LITTLE_ENDIAN = "1.2.840.10008.1.2.1";
+static const char* DICOM_DEFLATED_LITTLE_ENDIAN = "1.2.840.10008.1.2.1.99";
+
+// tags as (group << 16) | element
+static const unsigned DICOM_MEDIA_SOP_CLASS = 0x00020002;
+static const unsigned DICOM_TRANSFER_SYNTAX = 0x00020010;
+static const unsigned DICOM_SOP_CLASS = 0x00080016;
+static const unsigned DICOM_SLICE_THICKNESS = 0x00180050;
+static const unsigned DICOM_SPACING_BETWEEN_SLICES = 0x00180088;
+static const unsigned DICOM_IMAGE_POSITION = 0x00200032;
+static const unsigned DICOM_IMAGE_ORIENTATION = 0x00200037;
+static const unsigned DICOM_PLANE_POSITION_SEQUENCE = 0x00209113;
+static const unsigned DICOM_PLANE_ORIENTATION_SEQUENCE = 0x00209116;
+static const unsigned DICOM_NUMBER_OF_FRAMES = 0x00280008;
+static const unsigned DICOM_ROWS = 0x00280010;
+static const unsigned DICOM_COLUMNS = 0x00280011;
+static const unsigned DICOM_PIXEL_SPACING = 0x00280030;
+static const unsigned DICOM_BITS_ALLOCATED = 0x00280100;
+static const unsigned DICOM_PIXEL_MEASURES_SEQUENCE = 0x00289110;
+static const unsigned DICOM_SEGMENTATION_TYPE = 0x00620001;
+static const unsigned DICOM_SEGMENT_SEQUENCE = 0x00620002;
+static const unsigned DICOM_SEGMENT_NUMBER = 0x00620004;
+static const unsigned DICOM_SEGMENT_LABEL = 0x00620005;
+static const unsigned DICOM_SEGMENT_IDENTIFICATION_SEQUENCE = 0x0062000A;
+static const unsigned DICOM_REFERENCED_SEGMENT_NUMBER = 0x0062000B;
+static const unsigned DICOM_SHARED_GROUPS_SEQUENCE = 0x52009229;
+static const unsigned DICOM_PER_FRAME_GROUPS_SEQUENCE = 0x52009230;
+static const unsigned DICOM_PIXEL_DATA = 0x7FE00010;
+static const unsigned DICOM_ITEM = 0xFFFEE000;
+static const unsigned DICOM_ITEM_DELIMITER = 0xFFFEE00D;
+static const unsigned DICOM_SEQUENCE_DELIMITER = 0xFFFEE0DD;
+static const unsigned DICOM_UNDEFINED_LENGTH = 0xFFFFFFFF;
+
+// an element of a dataset: its value in the buffer of the file, or the items of a sequence
+typedef struct DicomElement{
+	const char* value;
+	long long length;
+	std::vector<int> items;  // datasets of the items (DicomFile::GetDataSet)
+} DicomElement;
+
+typedef std::map<unsigned, DicomElement> DicomDataSet;
+
+/*
+// The datasets of a DICOM file (Part 10, with preamble and file meta information), the values
+// pointing into the file read into memory.
+*/
+class DicomFile
+{
+private:
+	std::string path;
+	std::vector<char> data;
+	std::deque<DicomDataSet> sets;
+	bool explicitVR;
+
+	unsigned readUInt16(long long pos) const{
+		const unsigned char* p = (const unsigned char*)&data[pos];
+		return p[0] | (p[1] << 8);
+	}
+
+	unsigned readUInt32(long long pos) const{
+		const unsigned char* p = (const unsigned char*)&data[pos];
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+	}
+
+	void malformed() const{
+		throw std::runtime_error("Malformed DICOM file: " + path);
+	}
+
+	// value representations with a 4 byte length in explicit VR
+	static bool hasLongLength(const char* vr){
+		const char* vrs[] = {"OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV"};
+		for(size_t i = 0; i < sizeof(vrs) / sizeof(vrs[0]); i++){
+			if(vr[0] == vrs[i][0] && vr[1] == vrs[i][1]){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the sequences read here, which implicit VR does not mark as such
+	static bool isSequence(unsigned tag){
+		return tag == DICOM_PLANE_POSITION_SEQUENCE || tag == DICOM_PLANE_ORIENTATION_SEQUENCE || tag == DICOM_PIXEL_MEASURES_SEQUENCE
+			|| tag == DICOM_SEGMENT_SEQUENCE || tag == DICOM_SEGMENT_IDENTIFICATION_SEQUENCE
+			|| tag == DICOM_SHARED_GROUPS_SEQUENCE || tag == DICOM_PER_FRAME_GROUPS_SEQUENCE;
+	}
+
+	/*
+	// Parses the elements from pos up to end into the dataset set. An item of undefined length ends
+	// with the item delimiter (untilDelimiter). Returns the position after the elements.
+	*/
+	long long parse(long long pos, long long end, int set, bool untilDelimiter, bool metaOnly){
+		while(pos < end){
+			if(pos + 8 > end){
+				malformed();
+			}
+			unsigned group = readUInt16(pos);
+			unsigned tag = (group << 16) | readUInt16(pos + 2);
+			if(metaOnly && group != 0x0002){
+				return pos;
+			}
+			if(tag == DICOM_ITEM_DELIMITER){
+				return pos + 8;
+			}
+			bool sequence = false;
+			long long length;
+			if((explicitVR || group == 0x0002) && group != 0xFFFE){
+				const char* vr = &data[pos + 4];
+				if(hasLongLength(vr)){
+					if(pos + 12 > end){
+						malformed();
+					}
+					length = readUInt32(pos + 8);
+					pos += 12;
+				}
+				else{
+					length = readUInt16(pos + 6);
+					pos += 8;
+				}
+				sequence = vr[0] == 'S' && vr[1] == 'Q';
+			}
+			else{
+				length = readUInt32(pos + 4);
+				pos += 8;
+				sequence = isSequence(tag);
+			}
+
+			DicomElement element;
+			element.value = NULL;
+			element.length = 0;
+			if(sequence || (length == DICOM_UNDEFINED_LENGTH && tag != DICOM_PIXEL_DATA)){
+				long long sequenceEnd = length == DICOM_UNDEFINED_LENGTH ? end : pos + length;
+				if(sequenceEnd > end){
+					malformed();
+				}
+				while(pos < sequenceEnd){
+					if(pos + 8 > sequenceEnd){
+						malformed();
+					}
+					unsigned itemTag = (readUInt16(pos) << 16) | readUInt16(pos + 2);
+					long long itemLength = readUInt32(pos + 4);
+					pos += 8;
+					if(itemTag == DICOM_SEQUENCE_DELIMITER){
+						break;
+					}
+					if(itemTag != DICOM_ITEM){
+						malformed();
+					}
+					int item = (int)sets.size();
+					sets.push_back(DicomDataSet());
+					element.items.push_back(item);
+					if(itemLength == DICOM_UNDEFINED_LENGTH){
+						pos = parse(pos, sequenceEnd, item, true, false);
+					}
+					else{
+						if(pos + itemLength > sequenceEnd){
+							malformed();
+						}
+						parse(pos, pos + itemLength, item, false, false);
+						pos += itemLength;
+					}
+				}
+			}
+			else if(length == DICOM_UNDEFINED_LENGTH){
+				throw std::runtime_error("DICOM file with compressed pixel data is not supported: " + path);
+			}
+			else{
+				if(pos + length > end){
+					malformed();
+				}
+				element.value = &data[pos];
+				element.length = length;
+				pos += length;
+			}
+			sets[set][tag] = element;
+		}
+		if(untilDelimiter){
+			malformed();
+		}
+		return pos;
+	}
+
+public:
+	/*
+	// Reads the file, only its file meta information if metaOnly.
+	*/
+	DicomFile(const std::string &path, bool metaOnly){
+		this->path = path;
+		this->explicitVR = true;
+		FileByteSource source(path);
+		// the meta information is small, the dataset follows it
+		data.resize(metaOnly ? 16384 : 0);
+		long long length = 0;
+		if(metaOnly){
+			length = source.Read(&data[0], data.size());
+			while(length > 0 && length < (long long)data.size()){
+				long long n = source.Read(&data[length], data.size() - length);
+				if(n <= 0){
+					break;
+				}
+				length += n;
+			}
+			data.resize(std::max(0LL, length));
+		}
+		else{
+			std::vector<char> block(BYTESOURCE_BUFFER_SIZE);
+			for(long long n; (n = source.Read(&block[0], block.size())) > 0;){
+				data.insert(data.end(), block.begin(), block.begin() + n);
+			}
+		}
+		if(data.size() < 132 || memcmp(&data[128], "DICM", 4) != 0){
+			throw std::runtime_error("Not a DICOM file (no DICM prefix): " + path);
+		}
+		sets.push_back(DicomDataSet());
+		long long metaEnd;
+		try
+		{
+			metaEnd = parse(132, data.size(), 0, false, true);
+		}
+		catch(std::runtime_error &)
+		{
+			if(!metaOnly){
+				throw;
+			}
+			// the meta information did not fit into the part read
+			return;
+		}
+		if(metaOnly){
+			return;
+		}
+
+		std::string syntax = GetString(0, DICOM_TRANSFER_SYNTAX);
+		if(syntax == DICOM_IMPLICIT_LITTLE_ENDIAN){
+			explicitVR = false;
+		}
+		else if(syntax == DICOM_DEFLATED_LITTLE_ENDIAN){
+			MemoryByteSource compressed(&data[metaEnd], data.size() - metaEnd);
+			InflateByteSource inflated(&compressed, InflateByteSource::INFLATE_RAW);
+			std::vector<char> dataset;
+			std::vector<char> block(BYTESOURCE_BUFFER_SIZE);
+			for(long long n; (n = inflated.Read(&block[0], block.size())) > 0;){
+				dataset.insert(dataset.end(), block.begin(), block.begin() + n);
+			}
+			data.resize(metaEnd);
+			data.insert(data.end(), dataset.begin(), dataset.end());
+		}
+		else if(syntax != DICOM_EXPLICIT_LITTLE_ENDIAN){
+			throw std::runtime_error("Unsupported transfer syntax " + syntax + " of DICOM file " + path + " (supported are uncompressed and deflated little endian)");
+		}
+		parse(metaEnd, data.size(), 0, false, false);
+	}
+
+	// the dataset of the file is 0, the items of sequences follow
+	const DicomDataSet& GetDataSet(int set) const{
+		return sets[set];
+	}
+
+	const DicomElement* Find(int set, unsigned tag) const{
+		DicomDataSet::const_iterator element = sets[set].find(tag);
+		return element == sets[set].end() ? NULL : &element->second;
+	}
+
+	// a text value without trailing blanks and zeros, "" if missing
+	std::string GetString(int set, unsigned tag) const{
+		const DicomElement* element = Find(set, tag);
+		if(element == NULL || element->value == NULL){
+			return "";
+		}
+		std::string value(element->value, element->length);
+		while(!value.empty() && (value[value.size() - 1] == ' ' || value[value.size() - 1] == '\0')){
+			value.erase(value.size() - 1);
+		}
+		return value;
+	}
+
+	// the numbers of a multi-valued decimal or integer string (DS, IS), e.g. "0.5\0.5"
+	std::vector<double> GetNumbers(int set, unsigned tag) const{
+		std::vector<double> numbers;
+		std::istringstream values(GetString(set, tag));
+		std::string value;
+		while(std::getline(values, value, '\\')){
+			numbers.push_back(atof(value.c_str()));
+		}
+		return numbers;
+	}
+
+	// an unsigned short value (US), defaultValue if missing
+	long long GetUInt16(int set, unsigned tag, long long defaultValue) const{
+		const DicomElement* element = Find(set, tag);
+		if(element == NULL || element->value == NULL || element->length < 2){
+			return defaultValue;
+		}
+		const unsigned char* p = (const unsigned char*)element->value;
+		return p[0] | (p[1] << 8);
+	}
+
+	// the dataset of item index of a sequence, -1 if missing
+	int GetItem(int set, unsigned tag, size_t index) const{
+		const DicomElement* element = Find(set, tag);
+		if(element == NULL || index >= element->items.size()){
+			return -1;
+		}
+		return element->items[index];
+	}
+
+	size_t GetNumberOfItems(int set, unsigned tag) const{
+		const DicomElement* element = Find(set, tag);
+		return element == NULL ? 0 : element->items.size();
+	}
+};
+
+// splits seg.dcm#2,Liver into the path and the selected segments
+void splitDicomSegmentPath(const std::string &input, std::string &path, std::vector<std::string> &selection){
+	size_t sep = input.rfind('#');
+	path = input.substr(0, sep);
+	selection.clear();
+	if(sep == std::string::npos){
+		return;
+	}
+	std::istringstream segments(input.substr(sep + 1));
+	std::string segment;
+	while(std::getline(segments, segment, ',')){
+		if(!segment.empty()){
+			selection.push_back(segment);
+		}
+	}
+}
+
+// whether the file is a DICOM-SEG, by the SOP class of its file meta information
+bool isDicomSegmentationFile(const std::string &path){
+	if(itksys::SystemTools::FileIsDirectory(path.c_str()) || !itksys::SystemTools::FileExists(path.c_str(), true)){
+		return false;
+	}
+	try
+	{
+		DicomFile meta(path, true);
+		return meta.GetString(0, DICOM_MEDIA_SOP_CLASS) == DICOM_SEG_SOP_CLASS;
+	}
+	catch(std::exception &)
+	{
+		return false;
+	}
+}
+
+/*
+// The DICOM-SEG of a directory holding no other DICOM files, "" if there is none. The first DICOM
+// file that is not a SEG ends the search, so that directories of series cost one file.
+*/
+std::string findDicomSegmentationFile(const std::string &directory){
+	itksys::Directory files;
+	if(!files.Load(directory)){
+		return "";
+	}
+	std::string segmentation;
+	for(unsigned long i = 0; i < files.GetNumberOfFiles(); i++){
+		std::string name = files.GetFile(i);
+		std::string path = directory + "/" + name;
+		if(name == "." || name == ".." || itksys::SystemTools::FileIsDirectory(path.c_str())){
+			continue;
+		}
+		if(isDicomSegmentationFile(path)){
+			if(segmentation != ""){
+				throw std::runtime_error("Several DICOM-SEG files in " + directory + ", give the file instead");
+			}
+			segmentation = path;
+			continue;
+		}
+		try
+		{
+			DicomFile meta(path, true);
+			return "";
+		}
+		catch(std::exception &)
+		{
+			// not a DICOM file
+		}
+	}
+	return segmentation;
+}
+
+// whether an input (file or directory, with an optional #segment selection) is a DICOM-SEG
+bool isDicomSegmentation(const char* input){
+	std::string path;
+	std::vector<std::string> selection;
+	splitDicomSegmentPath(input, path, selection);
+	if(itksys::SystemTools::FileIsDirectory(path.c_str())){
+		try
+		{
+			return findDicomSegmentationFile(path) != "";
+		}
+		catch(std::exception &)
+		{
+			return true;
+		}
+	}
+	return isDicomSegmentationFile(path);
+}
+
+// voxel grid of an image in patient coordinates; direction[a] is the direction of axis a
+typedef struct DicomGrid{
+	long long size[3];
+	double spacing[3];
+	double origin[3];
+	double direction[3][3];
+} DicomGrid;
+
+// frame of a DICOM-SEG: its position, orientation (row and column direction), pixel spacing
+// (between rows, between columns) and segment
+typedef struct DicomSegmentFrame{
+	double position[3];
+	double orientation[6];
+	double pixelSpacing[2];
+	int segment;
+} DicomSegmentFrame;
+
+/*
+// The frames and pixel data of a DICOM-SEG, without the frames of the segments not selected.
+*/
+class DicomSegmentation
+{
+public:
+	long long rows;
+	long long columns;
+	bool fractional;
+	double sliceSpacing;  // 0 if not given
+	std::vector<DicomSegmentFrame> frames;
+	std::vector<long long> frameIndex;  // of each frame in the pixel data
+	const unsigned char* pixels;
+	std::unique_ptr<DicomFile> file;
+
+	DicomSegmentation(const std::string &input){
+		std::string path;
+		std::vector<std::string> selection;
+		splitDicomSegmentPath(input, path, selection);
+		if(itksys::SystemTools::FileIsDirectory(path.c_str())){
+			path = findDicomSegmentationFile(path);
+		}
+		file.reset(new DicomFile(path, false));
+		const DicomFile &dicom = *file;
+		if(dicom.GetString(0, DICOM_SOP_CLASS) != DICOM_SEG_SOP_CLASS){
+			throw std::runtime_error("Not a DICOM-SEG: " + path);
+		}
+		rows = dicom.GetUInt16(0, DICOM_ROWS, 0);
+		columns = dicom.GetUInt16(0, DICOM_COLUMNS, 0);
+		std::vector<double> numberOfFrames = dicom.GetNumbers(0, DICOM_NUMBER_OF_FRAMES);
+		long long count = numberOfFrames.empty() ? 1 : (long long)numberOfFrames[0];
+		long long bits = dicom.GetUInt16(0, DICOM_BITS_ALLOCATED, 0);
+		fractional = dicom.GetString(0, DICOM_SEGMENTATION_TYPE) == "FRACTIONAL";
+		if(rows <= 0 || columns <= 0 || count <= 0 || bits != (fractional ? 8 : 1)){
+			throw std::runtime_error("Unsupported DICOM-SEG (frame size, number of frames or bits allocated): " + path);
+		}
+		const DicomElement* pixelData = dicom.Find(0, DICOM_PIXEL_DATA);
+		long long frameVoxels = rows * columns;
+		long long needed = fractional ? count * frameVoxels : (count * frameVoxels + 7) / 8;
+		if(pixelData == NULL || pixelData->value == NULL || pixelData->length < needed){
+			throw std::runtime_error("DICOM-SEG with missing or truncated pixel data: " + path);
+		}
+		pixels = (const unsigned char*)pixelData->value;
+		if(dicom.GetNumberOfItems(0, DICOM_PER_FRAME_GROUPS_SEQUENCE) != (size_t)count){
+			throw std::runtime_error("DICOM-SEG without the position of each frame (Per-frame Functional Groups): " + path);
+		}
+
+		// the segments and the selection by number or label
+		std::set<int> selected;
+		std::ostringstream segments;
+		for(size_t i = 0; i < dicom.GetNumberOfItems(0, DICOM_SEGMENT_SEQUENCE); i++){
+			int item = dicom.GetItem(0, DICOM_SEGMENT_SEQUENCE, i);
+			int number = (int)dicom.GetUInt16(item, DICOM_SEGMENT_NUMBER, -1);
+			std::string label = dicom.GetString(item, DICOM_SEGMENT_LABEL);
+			segments << (i > 0 ? ", " : "") << number << " " << label;
+			for(size_t s = 0; s < selection.size(); s++){
+				if(selection[s] == std::to_string((long long)number) || itksys::SystemTools::LowerCase(selection[s]) == itksys::SystemTools::LowerCase(label)){
+					selected.insert(number);
+				}
+			}
+		}
+		std::cout << "DICOM-SEG " << path << ": " << count << " frames of " << columns << "x" << rows << ", segments " << segments.str() << std::endl;
+		if(!selection.empty() && selected.size() == 0){
+			throw std::runtime_error("None of the selected segments is in the DICOM-SEG " + path + " (segments " + segments.str() + ")");
+		}
+
+		// geometry of the frames, from the per-frame or else the shared functional groups
+		int shared = dicom.GetItem(0, DICOM_SHARED_GROUPS_SEQUENCE, 0);
+		sliceSpacing = 0;
+		for(long long f = 0; f < count; f++){
+			int perFrame = dicom.GetItem(0, DICOM_PER_FRAME_GROUPS_SEQUENCE, f);
+			DicomSegmentFrame frame;
+			int identification = getFunctionalGroup(perFrame, shared, DICOM_SEGMENT_IDENTIFICATION_SEQUENCE);
+			frame.segment = identification < 0 ? -1 : (int)dicom.GetUInt16(identification, DICOM_REFERENCED_SEGMENT_NUMBER, -1);
+			if(!selected.empty() && selected.count(frame.segment) == 0){
+				continue;
+			}
+			std::vector<double> position = getFunctionalValues(perFrame, shared, DICOM_PLANE_POSITION_SEQUENCE, DICOM_IMAGE_POSITION);
+			std::vector<double> orientation = getFunctionalValues(perFrame, shared, DICOM_PLANE_ORIENTATION_SEQUENCE, DICOM_IMAGE_ORIENTATION);
+			std::vector<double> spacing = getFunctionalValues(perFrame, shared, DICOM_PIXEL_MEASURES_SEQUENCE, DICOM_PIXEL_SPACING);
+			if(position.size() != 3 || orientation.size() != 6 || spacing.size() != 2 || spacing[0] <= 0 || spacing[1] <= 0){
+				throw std::runtime_error("DICOM-SEG without the position, orientation or pixel spacing of frame " + std::to_string(f + 1) + ": " + path);
+			}
+			for(int a = 0; a < 3; a++){
+				frame.position[a] = position[a];
+			}
+			for(int a = 0; a < 6; a++){
+				frame.orientation[a] = orientation[a];
+			}
+			frame.pixelSpacing[0] = spacing[0];
+			frame.pixelSpacing[1] = spacing[1];
+			frames.push_back(frame);
+			frameIndex.push_back(f);
+			if(sliceSpacing == 0){
+				std::vector<double> between = getFunctionalValues(perFrame, shared, DICOM_PIXEL_MEASURES_SEQUENCE, DICOM_SPACING_BETWEEN_SLICES);
+				if(between.size() == 1 && between[0] > 0){
+					sliceSpacing = between[0];
+				}
+			}
+		}
+	}
+
+	// the voxel grid spanned by the frames, with the orientation of the first frame
+	DicomGrid GetFrameGrid() const{
+		if(frames.empty()){
+			throw std::runtime_error("DICOM-SEG without frames of the selected segments");
+		}
+		const DicomSegmentFrame &first = frames[0];
+		DicomGrid grid;
+		for(int a = 0; a < 3; a++){
+			grid.direction[0][a] = first.orientation[a];
+			grid.direction[1][a] = first.orientation[3 + a];
+		}
+		grid.direction[2][0] = first.orientation[1] * first.orientation[5] - first.orientation[2] * first.orientation[4];
+		grid.direction[2][1] = first.orientation[2] * first.orientation[3] - first.orientation[0] * first.orientation[5];
+		grid.direction[2][2] = first.orientation[0] * first.orientation[4] - first.orientation[1] * first.orientation[3];
+		grid.spacing[0] = first.pixelSpacing[1];
+		grid.spacing[1] = first.pixelSpacing[0];
+
+		// the frame positions along the axes
+		double lower[3], upper[3];
+		std::vector<double> normal;
+		for(size_t f = 0; f < frames.size(); f++){
+			for(int a = 0; a < 3; a++){
+				double t = 0;
+				for(int k = 0; k < 3; k++){
+					t += frames[f].position[k] * grid.direction[a][k];
+				}
+				lower[a] = f == 0 ? t : std::min(lower[a], t);
+				upper[a] = f == 0 ? t : std::max(upper[a], t);
+				if(a == 2){
+					normal.push_back(t);
+				}
+			}
+		}
+		grid.spacing[2] = sliceSpacing;
+		if(grid.spacing[2] <= 0){
+			// the smallest distance between the slices
+			std::sort(normal.begin(), normal.end());
+			for(size_t i = 1; i < normal.size(); i++){
+				double gap = normal[i] - normal[i - 1];
+				if(gap > 1e-3 && (grid.spacing[2] <= 0 || gap < grid.spacing[2])){
+					grid.spacing[2] = gap;
+				}
+			}
+			if(grid.spacing[2] <= 0){
+				int perFrame = file->GetItem(0, DICOM_PER_FRAME_GROUPS_SEQUENCE, frameIndex[0]);
+				int shared = file->GetItem(0, DICOM_SHARED_GROUPS_SEQUENCE, 0);
+				std::vector<double> thickness = getFunctionalValues(perFrame, shared, DICOM_PIXEL_MEASURES_SEQUENCE, DICOM_SLICE_THICKNESS);
+				grid.spacing[2] = thickness.size() == 1 && thickness[0] > 0 ? thickness[0] : 1;
+			}
+		}
+		grid.size[0] = (long long)std::floor((upper[0] - lower[0]) / grid.spacing[0] + 0.5) + columns;
+		grid.size[1] = (long long)std::floor((upper[1] - lower[1]) / grid.spacing[1] + 0.5) + rows;
+		grid.size[2] = (long long)std::floor((upper[2] - lower[2]) / grid.spacing[2] + 0.5) + 1;
+		for(int k = 0; k < 3; k++){
+			grid.origin[k] = lower[0] * grid.direction[0][k] + lower[1] * grid.direction[1][k] + lower[2] * grid.direction[2][k];
+		}
+		return grid;
+	}
+
+	/*
+	// Writes the selected segments into voxels on grid (0 = background, 1 or the fraction), each
+	// frame pixel into the voxel nearest to its position. Returns the number of foreground pixels
+	// outside the grid.
+	*/
+	long long Place(const DicomGrid &grid, unsigned char* voxels) const{
+		long long outside = 0;
+		bool aligned = true;
+		long long frameVoxels = rows * columns;
+		for(size_t f = 0; f < frames.size(); f++){
+			const DicomSegmentFrame &frame = frames[f];
+			// continuous index of the first pixel and its steps along a row and a column
+			double start[3], stepColumn[3], stepRow[3];
+			for(int a = 0; a < 3; a++){
+				double p = 0, r = 0, c = 0;
+				for(int k = 0; k < 3; k++){
+					p += (frame.position[k] - grid.origin[k]) * grid.direction[a][k];
+					r += frame.orientation[k] * frame.pixelSpacing[1] * grid.direction[a][k];
+					c += frame.orientation[3 + k] * frame.pixelSpacing[0] * grid.direction[a][k];
+				}
+				start[a] = p / grid.spacing[a];
+				stepColumn[a] = r / grid.spacing[a];
+				stepRow[a] = c / grid.spacing[a];
+				aligned &= std::fabs(stepColumn[a] - std::floor(stepColumn[a] + 0.5)) < 0.01 && std::fabs(stepRow[a] - std::floor(stepRow[a] + 0.5)) < 0.01;
+			}
+			long long first = frameIndex[f] * frameVoxels;
+			for(long long y = 0; y < rows; y++){
+				for(long long x = 0; x < columns; x++){
+					long long i = first + y * columns + x;
+					unsigned char value = fractional ? pixels[i] : (pixels[i >> 3] >> (i & 7)) & 1;
+					if(value == 0){
+						continue;
+					}
+					long long index[3];
+					bool inside = true;
+					for(int a = 0; a < 3; a++){
+						index[a] = (long long)std::floor(start[a] + x * stepColumn[a] + y * stepRow[a] + 0.5);
+						inside &= index[a] >= 0 && index[a] < grid.size[a];
+					}
+					if(!inside){
+						outside++;
+						continue;
+					}
+					unsigned char &voxel = voxels[index[0] + grid.size[0] * (index[1] + grid.size[1] * index[2])];
+					voxel = std::max(voxel, value);
+				}
+			}
+		}
+		if(!aligned){
+			std::cout << "The pixels of the DICOM-SEG do not match the voxels of the image it is placed on, each pixel is placed on the nearest voxel" << std::endl;
+		}
+		return outside;
+	}
+
+private:
+	// the item of a functional group sequence of a frame, else of the shared groups, -1 if missing
+	int getFunctionalGroup(int perFrame, int shared, unsigned sequence) const{
+		int item = file->GetItem(perFrame, sequence, 0);
+		if(item < 0 && shared >= 0){
+			item = file->GetItem(shared, sequence, 0);
+		}
+		return item;
+	}
+
+	std::vector<double> getFunctionalValues(int perFrame, int shared, unsigned sequence, unsigned tag) const{
+		int item = file->GetItem(perFrame, sequence, 0);
+		std::vector<double> values = item < 0 ? std::vector<double>() : file->GetNumbers(item, tag);
+		if(values.empty() && shared >= 0){
+			item = file->GetItem(shared, sequence, 0);
+			values = item < 0 ? std::vector<double>() : file->GetNumbers(item, tag);
+		}
+		return values;
+	}
+};
+
+/*
+// Reads a DICOM-SEG onto the grid of reference (the other image of the evaluation), or onto the grid
+// spanned by its frames if reference is NULL.
+*/
+ImageType::Pointer loadDicomSegmentation(const char* input, ImageType* reference){
+	DicomSegmentation segmentation(input);
+	DicomGrid grid;
+	if(reference != NULL){
+		ImageType::RegionType region = reference->GetBufferedRegion();
+		ImageType::DirectionType direction = reference->GetDirection();
+		ImageType::SpacingType spacing = reference->GetSpacing();
+		ImageType::PointType origin;
+		reference->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+		for(int a = 0; a < 3; a++){
+			grid.size[a] = region.GetSize(a);
+			grid.spacing[a] = spacing[a] != 0 ? spacing[a] : 1;
+			grid.origin[a] = origin[a];
+			for(int k = 0; k < 3; k++){
+				grid.direction[a][k] = direction(k, a);
+			}
+		}
+	}
+	else{
+		grid = segmentation.GetFrameGrid();
+	}
+
+	ImageType::Pointer img = allocateImportImage(grid.size, grid.spacing);
+	long long count = grid.size[0] * grid.size[1] * grid.size[2];
+	unsigned char* voxels = (unsigned char*)img->GetBufferPointer();
+	memset(voxels, 0, count);
+	long long outside = segmentation.Place(grid, voxels);
+	if(outside > 0){
+		std::cout << outside << " foreground pixels of the DICOM-SEG lie outside the grid of the image it is placed on" << std::endl;
+	}
+	ImageType::PointType origin;
+	ImageType::DirectionType direction;
+	for(int a = 0; a < 3; a++){
+		origin[a] = grid.origin[a];
+		for(int k = 0; k < 3; k++){
+			direction(k, a) = grid.direction[a][k];
+		}
+	}
+	img->SetOrigin(origin);
+	img->SetDirection(direction);
+	rescaleRawToPixels(voxels, RAW_UINT8, count, img->GetBufferPointer());
+	return img;
+}
+
+#endif
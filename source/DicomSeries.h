@@ -0,0 +1,285 @@
+/*
+// DicomSeries.h
+//
+// Description:
+//
+// This file reads DICOM images without converting them to another format first. An input is
+// read as DICOM if it is a directory (other than a Zarr/N5 array) or a file ending with .dcm:
+//
+// - a directory holding a series of slices is sorted by the image position of the slices
+//   (GDCMSeriesFileNames). If it contains several series, the one with the most slices is used.
+//   The slices are decoded by all cores at once, each thread writing its slices straight into
+//   their place in the volume.
+//
+// - a single file, e.g. a multi-frame image, or a directory holding only such a file, is read as
+//   a volume by GDCMImageIO.
+//
+// The voxels are decoded in their stored pixel type (after the rescale slope and intercept, which
+// may widen it), 8 bit images straight into the image evaluated, wider types into a volume of that
+// type; the volume is then rescaled in one pass like any other input (see ImageImport.h). Only if
+// the slices of a series have different types, e.g. because of different rescale slopes, are they
+// read as float.
+//
+// DICOM-SEG (Segmentation Storage) is read by DicomSegmentation.h, which places its frames on the
+// grid of the other image of the evaluation. The segments to read are selected by a suffix of the
+// path, e.g. seg.dcm#2.
+//
+// GDCMImageIO is used directly, so DICOM is also read by the lean build (see ImageIOFactories.h).
+// A lean build without GDCM (EVALUATESEGMENTATION_NO_GDCM) reads only DICOM-SEG.
+//
+*/
+
+#ifndef _DICOMSERIES
+#define _DICOMSERIES
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#ifndef EVALUATESEGMENTATION_NO_GDCM
+#include "itkGDCMImageIO.h"
+#include "itkGDCMSeriesFileNames.h"
+#endif
+#include "itksys/SystemTools.hxx"
+#include "ImageImport.h"
+#include "ChunkedArrayReader.h"
+#include "Parallel.h"
+#include "DicomSegmentation.h"
+
+bool isDicomInput(const char* path){
+	std::string p = path;
+	std::vector<std::string> selection;
+	if(!itksys::SystemTools::FileExists(p.c_str())){
+		// a DICOM-SEG with a selection of segments (seg.dcm#2)
+		splitDicomSegmentPath(path, p, selection);
+	}
+	std::string extension = itksys::SystemTools::LowerCase(itksys::SystemTools::GetFilenameLastExtension(p));
+	if(extension == ".dcm"){
+		return true;
+	}
+	return itksys::SystemTools::FileIsDirectory(p.c_str()) && !isChunkedArray(path);
+}
+
+// whether an input is a DICOM-SEG, to be read by loadDicomSegmentation
+bool isDicomSegmentationInput(const char* path){
+	return isDicomInput(path) && isDicomSegmentation(path);
+}
+
+#ifndef EVALUATESEGMENTATION_NO_GDCM
+
+std::string getDicomTag(itk::GDCMImageIO *io, const char* tag){
+	std::string value;
+	if(!io->GetValueFromTag(tag, value)){
+		return "";
+	}
+	while(!value.empty() && (value[value.size() - 1] == ' ' || value[value.size() - 1] == '\0')){
+		value.erase(value.size() - 1);
+	}
+	return value;
+}
+
+// reads the header of a DICOM file, refusing the files that cannot be read as a volume
+itk::GDCMImageIO::Pointer readDicomInformation(const std::string &file){
+	itk::GDCMImageIO::Pointer io = itk::GDCMImageIO::New();
+	io->SetFileName(file);
+	try
+	{
+		io->ReadImageInformation();
+	}
+	catch( itk::ExceptionObject & err )
+	{
+		throw std::runtime_error("Cannot read DICOM file " + file + ": " + err.GetDescription());
+	}
+	if(getDicomTag(io, "0008|0016") == DICOM_SEG_SOP_CLASS || getDicomTag(io, "0008|0060") == "SEG"){
+		throw std::runtime_error("DICOM-SEG in a series of images: " + file + " (give the file of the DICOM-SEG instead)");
+	}
+	if(io->GetNumberOfComponents() != 1){
+		throw std::runtime_error("DICOM image with several components per pixel: " + file);
+	}
+	return io;
+}
+
+// the type of the voxels read by GDCMImageIO, RAW_UNKNOWN if not supported
+RawPixelType getDicomPixelType(itk::GDCMImageIO *io){
+	switch(io->GetComponentType()){
+		case itk::ImageIOBase::UCHAR:
+			return RAW_UINT8;
+		case itk::ImageIOBase::CHAR:
+			return RAW_INT8;
+		case itk::ImageIOBase::USHORT:
+			return RAW_UINT16;
+		case itk::ImageIOBase::SHORT:
+			return RAW_INT16;
+		case itk::ImageIOBase::UINT:
+			return RAW_UINT32;
+		case itk::ImageIOBase::INT:
+			return RAW_INT32;
+		case itk::ImageIOBase::FLOAT:
+			return RAW_FLOAT32;
+		case itk::ImageIOBase::DOUBLE:
+			return RAW_FLOAT64;
+		default:
+			return RAW_UNKNOWN;
+	}
+}
+
+// decodes the voxels of a DICOM file in their stored type into buffer
+void readDicomVoxels(itk::GDCMImageIO *io, const std::string &file, void* buffer){
+	try
+	{
+		io->Read(buffer);
+	}
+	catch( itk::ExceptionObject & err )
+	{
+		throw std::runtime_error("Cannot read DICOM file " + file + ": " + err.GetDescription());
+	}
+}
+
+// reads a DICOM file as float with its rescale slope and intercept applied
+void readDicomFloatVoxels(const std::string &file, long long count, float* buffer){
+	typedef itk::Image<float, 3> DicomImageType;
+	typedef itk::ImageFileReader<DicomImageType> DicomReaderType;
+	DicomReaderType::Pointer reader = DicomReaderType::New();
+	reader->SetImageIO(itk::GDCMImageIO::New());
+	reader->SetFileName(file);
+	try
+	{
+		reader->Update();
+	}
+	catch( itk::ExceptionObject & err )
+	{
+		throw std::runtime_error("Cannot read DICOM file " + file + ": " + err.GetDescription());
+	}
+	DicomImageType::Pointer img = reader->GetOutput();
+	if((long long)img->GetLargestPossibleRegion().GetNumberOfPixels() != count){
+		throw std::runtime_error("DICOM slice with a different size: " + file);
+	}
+	memcpy(buffer, img->GetBufferPointer(), count * sizeof(float));
+}
+
+// file names of the slices of the largest series in directory, sorted by position
+std::vector<std::string> getDicomSeriesFiles(const char* directory){
+	itk::GDCMSeriesFileNames::Pointer names = itk::GDCMSeriesFileNames::New();
+	names->SetUseSeriesDetails(true);
+	names->SetDirectory(directory);
+	const std::vector<std::string> &uids = names->GetSeriesUIDs();
+	if(uids.empty()){
+		throw std::runtime_error(std::string("No DICOM series in ") + directory);
+	}
+	std::vector<std::string> files;
+	std::string uid;
+	for(size_t i = 0; i < uids.size(); i++){
+		std::vector<std::string> series = names->GetFileNames(uids[i]);
+		if(series.size() > files.size()){
+			files = series;
+			uid = uids[i];
+		}
+	}
+	if(uids.size() > 1){
+		std::cout << directory << " contains " << uids.size() << " series, reading " << uid << " (" << files.size() << " files)" << std::endl;
+	}
+	return files;
+}
+
+/*
+// Reads a DICOM series (directory) or file. The slices of a series are decoded in parallel; the
+// spacing between slices is the distance of their positions.
+*/
+ImageType::Pointer loadDicomImage(const char* path){
+	std::vector<std::string> files;
+	if(itksys::SystemTools::FileIsDirectory(path)){
+		files = getDicomSeriesFiles(path);
+	}
+	else{
+		files.push_back(path);
+	}
+
+	// the first slice gives the grid of all slices
+	itk::GDCMImageIO::Pointer io = readDicomInformation(files[0]);
+	long long size[3] = {(long long)io->GetDimensions(0), (long long)io->GetDimensions(1), 1};
+	double spacing[3] = {io->GetSpacing(0), io->GetSpacing(1), io->GetNumberOfDimensions() > 2 ? io->GetSpacing(2) : 1};
+	if(io->GetNumberOfDimensions() > 2){
+		size[2] = io->GetDimensions(2);
+	}
+	long long sliceElements = size[0] * size[1] * size[2];
+	std::vector<RawPixelType> types(files.size(), getDicomPixelType(io));
+	if(files.size() > 1){
+		if(size[2] != 1){
+			throw std::runtime_error("DICOM series of multi-frame images: " + std::string(path));
+		}
+		size[2] = files.size();
+		itk::GDCMImageIO::Pointer io1 = readDicomInformation(files[1]);
+		double distance = 0;
+		for(unsigned int a = 0; a < 3 && a < io->GetNumberOfDimensions() && a < io1->GetNumberOfDimensions(); a++){
+			distance += (io1->GetOrigin(a) - io->GetOrigin(a)) * (io1->GetOrigin(a) - io->GetOrigin(a));
+		}
+		if(distance > 0){
+			spacing[2] = sqrt(distance);
+		}
+	}
+	for(int a = 0; a < 3; a++){
+		if(spacing[a] <= 0){
+			spacing[a] = 1;
+		}
+	}
+
+	int threads = getNumberOfThreads();
+	if(files.size() > 1){
+		std::cout << "Reading DICOM series: " << files.size() << " slices on " << std::min<long long>(threads, files.size()) << " threads" << std::endl;
+	}
+	// the headers are read in parallel as well, they tell the size and type of each slice
+	std::vector<itk::GDCMImageIO::Pointer> slices(files.size());
+	slices[0] = io;
+	parallelFor(files.size() - 1, threads, [&](long long i, int t){
+		slices[i + 1] = readDicomInformation(files[i + 1]);
+		if((long long)slices[i + 1]->GetDimensions(0) != size[0] || (long long)slices[i + 1]->GetDimensions(1) != size[1]
+			|| (slices[i + 1]->GetNumberOfDimensions() > 2 && slices[i + 1]->GetDimensions(2) != 1)){
+			throw std::runtime_error("DICOM slice with a different size: " + files[i + 1]);
+		}
+		types[i + 1] = getDicomPixelType(slices[i + 1]);
+	});
+	RawPixelType type = types[0];
+	for(size_t i = 1; i < types.size(); i++){
+		if(types[i] != type){
+			type = RAW_FLOAT32;
+		}
+	}
+	if(rawPixelSize(type) == 0){
+		throw std::runtime_error("Unsupported pixel type of DICOM image " + files[0]);
+	}
+
+	// 8 bit voxels are decoded straight into the image and rescaled in place
+	ImageType::Pointer img = allocateImportImage(size, spacing);
+	std::vector<char> volume;
+	char* voxels = (char*)img->GetBufferPointer();
+	int pixelSize = rawPixelSize(type);
+	if(pixelSize != (int)sizeof(pixeltype)){
+		volume.resize(size[0] * size[1] * size[2] * pixelSize);
+		voxels = &volume[0];
+	}
+	parallelFor(files.size(), threads, [&](long long i, int t){
+		char* slice = voxels + i * sliceElements * pixelSize;
+		if(types[i] == type){
+			readDicomVoxels(slices[i], files[i], slice);
+		}
+		else{
+			readDicomFloatVoxels(files[i], sliceElements, (float*)slice);
+		}
+		slices[i] = itk::GDCMImageIO::Pointer();
+	});
+	rescaleRawToPixels(voxels, type, size[0] * size[1] * size[2], img->GetBufferPointer());
+	return img;
+}
+
+#else
+
+ImageType::Pointer loadDicomImage(const char* path){
+	throw std::runtime_error(std::string("DICOM images other than DICOM-SEG are not read by this build (EVALUATESEGMENTATION_LEAN_DICOM): ") + path);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,325 @@
+/*
+// DistanceBackends.h
+//
+// Description:
+//
+// This file chooses how the distance metrics (HDRFDST, AVGDIST, bAVD) search the nearest voxels.
+// Their runtime depends on the shapes far more than on the image size, so for each of them the cost
+// of the available backends is estimated and the cheapest is used:
+//
+// - brute force: HDRFDST compares each voxel with the voxels of the other image until one is closer
+//   than the largest distance found so far; AVGDIST compares with all surface voxels.
+// - spatial index (AVGDIST, bAVD): the surface voxels are put into a grid and only the cells within
+//   the distance to the other foreground along a ray are searched.
+// - distance transform (EDT): the exact euclidean distance to the foreground of the other image is
+//   computed for all voxels of the bounding box of the foreground, in time linear in its size.
+//
+// The estimate uses what the pass over the images found out (ImageStatistics): the foreground and
+// intersection counts, the bounding boxes of both foregrounds and their separation, an estimate of
+// the surface voxels, and the speed of the pass. Brute force and the distance transform give the
+// exact distances, the spatial index gives those of the former implementation.
+//
+// The memory of the backends is estimated as well: the distance transform holds a float per voxel
+// of the bounding box for each image, the other backends lists of foreground and surface voxels.
+// With a memory budget (-max-memory) a backend is only used if it fits into what the images leave
+// of the budget; if none fits, the one needing the least memory is used.
+//
+*/
+
+#ifndef _DISTANCEBACKENDS
+#define _DISTANCEBACKENDS
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+#include "Metric_constants.h"
+#include "Arena.h"
+#include "Parallel.h"
+
+enum DistanceBackend {DISTANCE_BRUTE_FORCE, DISTANCE_SPATIAL_INDEX, DISTANCE_EDT};
+
+// a distance computation costs about as much as visiting this many voxels in the pass
+static const double DISTANCE_COST = 4;
+// voxel visits per voxel of the three passes of a distance transform
+static const double DISTANCE_EDT_COST = 8;
+// edge of the cells of the spatial index of AverageDistanceMetric
+static const double DISTANCE_GRID_CELL = 7;
+// bytes of a voxel of the point lists (VoxelInfo) and of a cell of the spatial index (Cell)
+static const double DISTANCE_POINT_BYTES = 24;
+static const double DISTANCE_CELL_BYTES = 72;
+
+const char* getDistanceBackendName(DistanceBackend backend){
+	const char* names[] = {"brute-force", "spatial-index", "edt"};
+	return names[backend];
+}
+
+// what the pass over the images found out about the work of the distance metrics
+typedef struct DistanceWorkload{
+	long long numberElements;  // voxels of the bounding box of the foreground scanned by the metrics
+	long long num_nonzero_points_f;
+	long long num_nonzero_points_m;
+	long long num_intersection;
+	double surface_f;          // estimated surface voxels
+	double surface_m;
+	double extent_f;           // largest size of the bounding box of the foreground along an axis
+	double extent_m;
+	double separation;         // distance between the bounding boxes of the foregrounds, in voxels
+	int extent;                // largest size of the scanned box along an axis
+	int dimension;             // 2 or 3
+} DistanceWorkload;
+
+typedef struct DistancePlan{
+	DistanceBackend backend;
+	int sampleCell;            // voxels per axis of the cells of which one query voxel is searched
+	double predictedSeconds;
+	long long memoryBytes;     // estimated memory of the backend
+} DistancePlan;
+
+// foreground threshold of the distance metrics
+double getDistanceThreshold(bool fuzzy, double threshold){
+	return (!fuzzy && threshold!=-1) ? threshold*PIXEL_VALUE_RANGE_MAX : 0.5*PIXEL_VALUE_RANGE_MAX;
+}
+
+// share of a foreground with the given extent that lies within a distance of a voxel
+double shareWithin(double distance, double extent, int dimension){
+	if(extent <= 0){
+		return 1;
+	}
+	return std::min(1.0, std::pow((2 * distance + 1) / extent, dimension));
+}
+
+/*
+// Estimated voxel visits of a distance metric with a backend, its query voxels sampled with cells
+// of cell voxels per axis (see FastProfile.h). Returns -1 if the backend cannot be used.
+// The query voxels (the voxels of one image missing in the other) mostly lie in a thin layer along
+// the surfaces, so sampling reduces them by cell^(dimension-1) only; the mean thickness of that
+// layer plus the separation of the foregrounds is taken as the typical nearest distance.
+*/
+double estimateDistanceVisits(MetricId id, DistanceBackend backend, const DistanceWorkload &w, int cell){
+	double n = (double)w.numberElements;
+	double missing_f = (double)(w.num_nonzero_points_f - w.num_intersection);
+	double missing_m = (double)(w.num_nonzero_points_m - w.num_intersection);
+	double sampling = std::pow((double)cell, w.dimension - 1);
+	double queries_f = missing_f / sampling;
+	double queries_m = missing_m / sampling;
+	double distance = w.separation + (missing_f + missing_m) / std::max(1.0, w.surface_f + w.surface_m) + 1;
+
+	if(backend == DISTANCE_EDT){
+		// an empty foreground has no distance transform; the other backends handle it as before
+		if(w.num_nonzero_points_f == 0 || w.num_nonzero_points_m == 0){
+			return -1;
+		}
+		// per direction a scan building the transform and a scan reading the distances
+		return 2 * (n * (1 + DISTANCE_EDT_COST) + n);
+	}
+	if(id == HDRFDST){
+		if(backend != DISTANCE_BRUTE_FORCE){
+			return -1;
+		}
+		// six scans collecting the voxel lists; a search ends at the first voxel closer than the
+		// largest distance found so far, i.e. after about 1/share tries
+		double tries_f = std::min((double)w.num_nonzero_points_m, 1 / shareWithin(distance, w.extent_m, w.dimension));
+		double tries_m = std::min((double)w.num_nonzero_points_f, 1 / shareWithin(distance, w.extent_f, w.dimension));
+		return 6 * n + (queries_f * tries_f + queries_m * tries_m) * DISTANCE_COST;
+	}
+	if(id == AVGDIST || id == bAVD){
+		// per direction three scans and the surface test of the foreground of the other image
+		double visits = 6 * n + 6.0 * (w.num_nonzero_points_f + w.num_nonzero_points_m);
+		if(id == bAVD){
+			visits += n;
+		}
+		if(backend == DISTANCE_BRUTE_FORCE){
+			return visits + (queries_f * w.surface_m + queries_m * w.surface_f) * DISTANCE_COST;
+		}
+		// a ray to the other foreground, then the surface voxels of the cells within its length
+		double window_f = w.surface_m * shareWithin(distance + DISTANCE_GRID_CELL, w.extent_m, w.dimension - 1);
+		double window_m = w.surface_f * shareWithin(distance + DISTANCE_GRID_CELL, w.extent_f, w.dimension - 1);
+		return visits + queries_f * (distance + window_f * DISTANCE_COST) + queries_m * (distance + window_m * DISTANCE_COST);
+	}
+	return -1;
+}
+
+/*
+// Estimated peak memory of a distance metric with a backend in bytes: the distance transforms of
+// both images (also when shared by the metrics, see TaskGraph.h), else the voxel lists of both
+// foregrounds and for the spatial index its grid and surface voxels.
+*/
+long long estimateDistanceBytes(MetricId id, DistanceBackend backend, const DistanceWorkload &w){
+	if(backend == DISTANCE_EDT){
+		return 2 * w.numberElements * (long long)sizeof(float);
+	}
+	double bytes = (double)(w.num_nonzero_points_f + w.num_nonzero_points_m) * DISTANCE_POINT_BYTES;
+	if(id != HDRFDST && backend == DISTANCE_SPATIAL_INDEX){
+		double cells = w.numberElements / std::pow(DISTANCE_GRID_CELL, w.dimension);
+		bytes += cells * DISTANCE_CELL_BYTES + (w.surface_f + w.surface_m) * DISTANCE_POINT_BYTES;
+	}
+	return (long long)bytes;
+}
+
+/*
+// Chooses the cheapest backend of a distance metric. voxelRate is the speed of the pass over the
+// images in voxels per second of one thread. The distance transform searches all query voxels, so
+// sampleCell only applies to the other backends. exactOnly restricts HDRFDST with a quantile to
+// brute force, whose distances of the single voxels the quantile has always been taken from.
+// memoryLimit is the memory left for the metric in bytes, 0 = no limit; the backends that do not
+// fit are skipped unless none fits, then the one needing the least memory is used.
+*/
+DistancePlan planDistanceMetric(MetricId id, const DistanceWorkload &w, double voxelRate, int sampleCell, bool exactOnly, long long memoryLimit){
+	DistancePlan plan;
+	plan.backend = id == HDRFDST ? DISTANCE_BRUTE_FORCE : DISTANCE_SPATIAL_INDEX;
+	plan.sampleCell = sampleCell;
+	plan.predictedSeconds = estimateDistanceVisits(id, plan.backend, w, sampleCell) / voxelRate;
+	plan.memoryBytes = estimateDistanceBytes(id, plan.backend, w);
+	if(exactOnly){
+		return plan;
+	}
+	DistanceBackend backends[] = {DISTANCE_BRUTE_FORCE, DISTANCE_SPATIAL_INDEX, DISTANCE_EDT};
+	for(int i = 0; i < 3; i++){
+		int cell = backends[i] == DISTANCE_EDT ? 1 : sampleCell;
+		double visits = estimateDistanceVisits(id, backends[i], w, cell);
+		if(visits < 0){
+			continue;
+		}
+		long long bytes = estimateDistanceBytes(id, backends[i], w);
+		bool fits = memoryLimit == 0 || bytes <= memoryLimit;
+		bool planFits = memoryLimit == 0 || plan.memoryBytes <= memoryLimit;
+		bool better = visits / voxelRate < plan.predictedSeconds;
+		if((fits && (better || !planFits)) || (!fits && !planFits && bytes < plan.memoryBytes)){
+			plan.backend = backends[i];
+			plan.sampleCell = cell;
+			plan.predictedSeconds = visits / voxelRate;
+			plan.memoryBytes = bytes;
+		}
+	}
+	return plan;
+}
+
+void printDistancePlan(MetricId id, const DistancePlan &plan){
+	std::cout << metricInfo[id].metrId << ": " << getDistanceBackendName(plan.backend) << " backend, predicted " << plan.predictedSeconds
+		<< " s, " << (plan.memoryBytes + 1024 * 1024 - 1) / (1024 * 1024) << " MB" << std::endl;
+}
+
+/*
+// Squared euclidean distance to the nearest foreground voxel of an image for all voxels of a
+// region, in the unit of the spacing. The separable algorithm of Felzenszwalb and Huttenlocher
+// transforms the lines along x, y and z in turn; the lines of an axis are transformed in parallel
+// on the given number of threads, a share of the cores when other metrics run at the same time.
+// The squared distances are computed in double along each line and stored as float, a float per
+// voxel of the region (see estimateDistanceBytes), which keeps their relative error below 1e-7.
+// The field is allocated from the evaluation arena of the constructing thread. The same field serves
+// all distance metrics measuring with its threshold and spacing (see TaskGraph.h).
+*/
+class DistanceField
+{
+private:
+	float* d;
+	long long size[3];
+	long long start[3];
+	double thd;
+	double spacing[3];
+	int threads;
+
+	typedef struct LineBuffers{
+		std::vector<double> f;
+		std::vector<double> z;
+		std::vector<long long> v;
+	} LineBuffers;
+
+	// lower envelope of the parabolas w2*(q-p)^2 + f(p) of the finite values of a line
+	static void transformLine(float* line, long long n, long long stride, double w2, LineBuffers &b){
+		b.f.resize(n);
+		b.v.resize(n);
+		b.z.resize(n + 1);
+		for(long long q = 0; q < n; q++){
+			b.f[q] = line[q * stride];
+		}
+		long long k = -1;
+		for(long long q = 0; q < n; q++){
+			if(b.f[q] == INFINITY){
+				continue;
+			}
+			double s = -INFINITY;
+			while(k >= 0){
+				long long p = b.v[k];
+				s = ((b.f[q] + w2*q*q) - (b.f[p] + w2*p*p)) / (2*w2*(q - p));
+				if(s > b.z[k]){
+					break;
+				}
+				k--;
+			}
+			k++;
+			b.v[k] = q;
+			b.z[k] = k == 0 ? -INFINITY : s;
+			b.z[k + 1] = INFINITY;
+		}
+		if(k < 0){
+			return;
+		}
+		long long j = 0;
+		for(long long q = 0; q < n; q++){
+			while(b.z[j + 1] < q){
+				j++;
+			}
+			long long p = b.v[j];
+			line[q * stride] = (float)(w2*(q - p)*(q - p) + b.f[p]);
+		}
+	}
+
+	void transformAxis(int axis, double w2){
+		long long strides[3] = {1, size[0], size[0] * size[1]};
+		int a1 = axis == 0 ? 1 : 0;
+		int a2 = axis == 2 ? 1 : 2;
+		long long lines = size[a1] * size[a2];
+		std::vector<LineBuffers> buffers(threads);
+		parallelFor(lines, threads, [&](long long line, int thread){
+			long long i1 = line % size[a1];
+			long long i2 = line / size[a1];
+			transformLine(d + i1 * strides[a1] + i2 * strides[a2], size[axis], strides[axis], w2, buffers[thread]);
+		});
+	}
+
+public:
+	DistanceField(ImageType *image, const ImageType::RegionType &region, double thd, double spx, double spy, double spz, int threads){
+		for(int i = 0; i < 3; i++){
+			size[i] = region.GetSize(i);
+			start[i] = region.GetIndex(i);
+		}
+		this->thd = thd;
+		this->threads = threads > 0 ? threads : 1;
+		spacing[0] = spx;
+		spacing[1] = spy;
+		spacing[2] = spz;
+		d = evaluationArena().Allocate<float>(size[0] * size[1] * size[2]);
+		typedef itk::ImageRegionConstIterator<ImageType> IteratorType;
+		IteratorType it(image, region);
+		long long i = 0;
+		for(it.GoToBegin(); !it.IsAtEnd(); ++it){
+			d[i++] = it.Get() > thd ? 0 : INFINITY;
+		}
+		transformAxis(0, spx*spx);
+		transformAxis(1, spy*spy);
+		transformAxis(2, spz*spz);
+	}
+
+	// whether the field measures the distances a metric with this threshold and spacing needs
+	bool Matches(const ImageType::RegionType &region, double thd, double spx, double spy, double spz) const{
+		for(int i = 0; i < 3; i++){
+			if(size[i] != (long long)region.GetSize(i) || start[i] != (long long)region.GetIndex(i)){
+				return false;
+			}
+		}
+		return this->thd == thd && spacing[0] == spx && spacing[1] == spy && spacing[2] == spz;
+	}
+
+	// distance of the voxel at index, which must lie in the region
+	double Distance(const ImageType::IndexType &index) const{
+		long long x = index[0] - start[0];
+		long long y = index[1] - start[1];
+		long long z = index[2] - start[2];
+		return std::sqrt(d[x + size[0] * (y + size[1] * z)]);
+	}
+};
+
+#endif
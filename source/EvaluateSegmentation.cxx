@@ -34,15 +34,22 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <algorithm>
 #include <cstdio>
 #include <time.h>
 #include <sys/timeb.h>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
 #include "Global.h"
 #include "Metric_constants.h"
 #include "Outputter.h"
+#include "ImageIOFactories.h"
 #include "Segmentation.h" 
 #include "Localization.h" 
 #include "LesionDetection.h" 
+#include "BatchEvaluation.h"
 
 #define MAX_OPTION_CHAR_ARRAY_SIZE 128
 
@@ -51,19 +58,29 @@ using namespace std;
 
 void usage(int argc, char** argv){
 	std::cout << "\nUSAGE:\n\n1) For volume segmentation:\n\n"  
-		<<argv[0]<< " groundtruthPath segmentPath [-thd threshold] [-xml xmlpath] [-unit millimeter|voxel] [-use all|fast|DICE,JACRD,....]" << std::endl;
+		<<argv[0]<< " groundtruthPath segmentPath [-thd threshold] [-xml xmlpath] [-unit millimeter|voxel] [-roi x0,y0,z0,x1,y1,z1|auto] [-spacing sx,sy,sz] [-batch] [-cache dir] [-cachesize megabytes] [-max-memory bytes] [-explain] [-deadline seconds] [-progress path|-] [-use all|fast|DICE,JACRD,....]" << std::endl;
 	std::cout << "\nwhere:" << std::endl;
-	std::cout << "groundtruthPath	=path (or URL) to groundtruth image. URLs should be enclosed with quotations" << std::endl;
-	std::cout << "segmentPath	=path (or URL) to image beeing evaluated. URLs should be enclosed with quotations" << std::endl;
+	std::cout << "groundtruthPath	=path (or URL) to groundtruth image. URLs should be enclosed with quotations. '-' reads a nii/nii.gz image from stdin, shm://name an image in POSIX shared memory, archive.zip!/name.nii.gz a member of a zip/tar archive. Binary masks can also be given as run-length encoding (.rle.json) or foreground coordinate list (.coords). A directory is read as a DICOM series, seg.dcm#2 as segment 2 of a DICOM-SEG" << std::endl;
+	std::cout << "segmentPath	=path (or URL) to image beeing evaluated. URLs should be enclosed with quotations. '-' reads a nii/nii.gz image from stdin, shm://name an image in POSIX shared memory, archive.zip!/name.nii.gz a member of a zip/tar archive. Binary masks can also be given as run-length encoding (.rle.json) or foreground coordinate list (.coords). A directory is read as a DICOM series, seg.dcm#2 as segment 2 of a DICOM-SEG" << std::endl;
 	std::cout << "-thd	=before evaluation convert fuzzy images to binary using threshold" << std::endl;
 	std::cout << "-xml	=path to xml file where result should be saved" << std::endl;
 	std::cout << "-nostreaming	=Don't use streaming filter! Streaming filter is used to handle very large images. Use this option with small images (up to 200X200X200 voxels) to avoid time efort related with streaming." << std::endl;
 	std::cout << "-help	=more information" << std::endl;	
+	std::cout << "-batch	=evaluate all nii/nii.gz members of the zip/tar archive segmentPath against the images of the same name in the directory or archive groundtruthPath. With -xml, xmlpath is a directory receiving one xml file per case" << std::endl;
+	std::cout << "-roi	=read and evaluate only the region x0,y0,z0,x1,y1,z1 (inclusive voxel indices) of both images. 'auto' uses the foreground extent of both images plus a margin, read from the sidecar <image>.extent (x0,y0,z0,x1,y1,z1 or empty) or else found by reading both files once more. Formats supporting partial reading (mha/nrrd with raw data, uncompressed nii) only read the region. Note that true negatives (and metrics using them) are counted inside the region only." << std::endl;
+	std::cout << "-spacing	=voxel spacing of inputs without spacing information (numpy .npy/.npz arrays, Zarr/N5 chunked arrays, sparse masks). Without this option a sidecar file <path>.spacing containing 'sx sy sz' is used, otherwise the spacing is 1" << std::endl;
+	std::cout << "-cache	=directory where images given by URL are cached. Cached images are revalidated with the server (ETag/Last-Modified) and only downloaded again if they changed. The directory can be shared by parallel runs" << std::endl;
+	std::cout << "-cachesize	=size limit of the cache in megabytes (default 4096), least recently used images are removed" << std::endl;
+	std::cout << "-max-memory	=memory budget of the evaluation in bytes (suffixes k, m, g allowed, e.g. 2g). The memory needed is estimated from the image headers and the images are read in full, streamed in slabs, as bit masks or cropped to their foreground, whichever fits. If nothing fits, the evaluation is refused before the images are read" << std::endl;
+	std::cout << "-explain	=print which passes over the images are needed for the requested metrics (the contingency table, moments, voxel copies, point lists of the distance metrics) before they are computed" << std::endl;
+	std::cout << "-deadline	=seconds an evaluation with -use fast may take (default 1). The distance metrics are sampled more coarsely the shorter the deadline" << std::endl;
+	std::cout << "-progress	=write each metric result as a line of JSON to the file path as soon as it is computed, followed by a summary line per evaluation. '-' writes to stdout and the usual output to stderr" << std::endl;
 	std::cout << "-unit	=specify whether millimeter or voxel to be used as a unit for distances and  volumes (default is voxel)" << std::endl;
 	std::cout << "-use	=the metrics to be used. Note that additional options can be given between two @ characters:\n" << std::endl;
 	std::cout << "	all	:use all available metrics (default)" << std::endl;
+	std::cout << "	fast	:the metrics computed in one pass over the images and HDRFDST and AVGDIST, approximated if needed to finish within the deadline. The xml result reports the error bound of approximated values" << std::endl;
 	for(int i=0 ; i< METRIC_COUNT ; i++){
-		if(!metricInfo[i].testmetric){
+		if(metricInfo[i].metrId != NULL && !metricInfo[i].testmetric){
 			std::cout << "	" << metricInfo[i].metrId << "	:" << metricInfo[i].help<< std::endl;
 		}
 	}
@@ -102,6 +119,9 @@ bool shouldUse(MetricId id, char* options){
 	if(opt.compare ("all") == 0){
 		return true;
 	}
+	if(isFastProfile(options)){
+		return isFastMetric(id);
+	}
 	if(opt.compare ("visceral") == 0){
 		int size = sizeof(VisceralMetrics)/sizeof(MetricId);
 		for(int i=0 ; i< size; i++){
@@ -118,6 +138,11 @@ bool shouldUse(MetricId id, char* options){
 	return false;
 }
 
+// true if none of the requested metrics needs more than the contingency table
+bool usesOnlyContingencyTable(char* options){
+	return (getRequiredArtifacts(options) & ~ARTIFACT_CONTINGENCY) == 0;
+}
+
 std::string getOptions(MetricId id, char* options){
 
 	string opt = options;
@@ -169,13 +194,135 @@ vector<string> parseDefaults(){
 	return options;
 }
 
+// options of the volume segmentation, read from default.txt and the command line
+typedef struct SegmentationOptions{
+	std::string targetfile;
+	std::string options;
+	std::string unit;
+	std::string roi;
+	std::string progress;  // opened after all options are parsed
+	double threshold;
+	bool useStreamingFilter;
+	bool batch;
+
+	SegmentationOptions() : options("all"), unit("voxel"), threshold(-1), useStreamingFilter(true), batch(false){
+	}
+} SegmentationOptions;
+
+/*
+// Parses the options of default.txt or of the command line into parsed, options given again
+// override the earlier ones. Returns false after writing the error of an invalid value.
+*/
+bool parseSegmentationOptions(const vector<string> &arguments, SegmentationOptions &parsed){
+	for (size_t i = 0; i < arguments.size(); i++) { 
+		const std::string &option = arguments[i];
+		if ( (i + 1) != arguments.size()){ 
+			const char* value = arguments[i + 1].c_str();
+			if (option == "-thd") {
+				parsed.threshold = atof(value);
+			}else if (option == "-xml") {
+				parsed.targetfile = value;
+			}else if (option == "-use") {
+				parsed.options = value;
+			}
+			else if(option == "-unit"){
+				parsed.unit = value;
+			}
+			else if(option == "-roi"){
+				parsed.roi = value;
+			}
+			else if(option == "-cache"){
+				urlCacheDirectory = value;
+			}
+			else if(option == "-cachesize"){
+				urlCacheLimit = atoll(value) * 1024 * 1024;
+			}
+			else if(option == "-max-memory"){
+				if(!parseMemorySize(value, maxMemoryBytes)){
+					std::cout << "Invalid memory size: " << value << std::endl;
+					return false;
+				}
+			}
+			else if(option == "-deadline"){
+				evaluationDeadline = atof(value);
+				if(evaluationDeadline <= 0){
+					std::cout << "Invalid deadline: " << value << std::endl;
+					return false;
+				}
+			}
+			else if(option == "-progress"){
+				parsed.progress = value;
+			}
+			else if(option == "-spacing"){
+				if(!parseSpacing(value, inputSpacing)){
+					std::cout << "Invalid spacing: " << value << std::endl;
+					return false;
+				}
+			}
+		}
+		if (option == "-nostreaming") {
+			parsed.useStreamingFilter = false;
+		}
+		else if (option == "-batch") {
+			parsed.batch = true;
+		}
+		else if (option == "-explain") {
+			explainPlan = true;
+		}
+	}
+	return true;
+}
+
+/*
+// Wall time in milliseconds since the process was started, in the resolution of the clock ticks
+// of the kernel (usually 10 ms). On Linux the start time of the process in /proc/self/stat is
+// compared with the boot based clock it is measured with; elsewhere the processor time used so
+// far is returned, which does not include the time spent waiting, e.g. for loading libraries.
+*/
+long long getStartupMilliseconds(){
+#if defined(__linux__)
+	std::ifstream stat("/proc/self/stat");
+	std::string line;
+	long ticks = sysconf(_SC_CLK_TCK);
+	struct timespec now;
+#if defined(CLOCK_BOOTTIME)
+	int measured = clock_gettime(CLOCK_BOOTTIME, &now);
+#else
+	int measured = clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	// the fields after the command name, which is in parentheses and may contain spaces;
+	// starttime is the 22nd field, the 20th after the name
+	size_t name = std::getline(stat, line) ? line.rfind(')') : std::string::npos;
+	if(name != std::string::npos && ticks > 0 && measured == 0){
+		std::istringstream fields(line.substr(name + 1));
+		std::string field;
+		unsigned long long starttime = 0;
+		for(int i = 0; i < 20 && fields >> field; i++){
+			if(i == 19){
+				starttime = strtoull(field.c_str(), NULL, 10);
+			}
+		}
+		if(starttime > 0){
+			long long elapsed = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000 - (long long)(starttime * 1000 / ticks);
+			return elapsed > 0 ? elapsed : 0;
+		}
+	}
+#endif
+	clock_t t = clock();
+	return (long long)(((double)t*1000)/CLOCKS_PER_SEC);
+}
+
 int main(int argc, char** argv)
 {
-	initMetricInfo();
-
+	// the time since the process was started is the time of the startup, including the
+	// registration of the ImageIO factories of the lean build
+	registerImageIOFactories();
+	startup_milliseconds = getStartupMilliseconds();
 	clock_t t = clock();
     long long time_start= ((double)t*1000)/CLOCKS_PER_SEC;	
 
+	initMetricInfo();
+
 	if(argc < 3){
 		if(argc ==2 && std::string(argv[1])=="-loc"){
 			usage_landmark(argc, argv);
@@ -282,63 +429,35 @@ int main(int argc, char** argv)
 	else { 
 		const char* groundtruthfile =  argv[1];
 		const char* testfile =  argv[2];
-		char* targetfile = ITK_NULLPTR;
-		char options [MAX_OPTION_CHAR_ARRAY_SIZE] ="all" ;
-		const char* unit = "voxel";
-		double threshold = -1;
-		bool use_default_config =false;
-		bool useStreamingFilter=true;
+		SegmentationOptions parsed;
 		if(is2Dimage(groundtruthfile) && is2Dimage(testfile)){
-		    useStreamingFilter=false;
+		    parsed.useStreamingFilter=false;
 		}
-		for (int i = 1; i < argc; i++) { 
-			if (std::string(argv[i]) == "-def" || std::string(argv[i]) == "-default") {
-				use_default_config = true;
-			}
-			else if (std::string(argv[i]) == "-nostreaming") {
-				useStreamingFilter = false;
-			}
+		vector<string> arguments(argv + 1, argv + argc);
+		bool use_default_config = std::find(arguments.begin(), arguments.end(), "-def") != arguments.end()
+			|| std::find(arguments.begin(), arguments.end(), "-default") != arguments.end();
+		// the command line overrides the defaults
+		if(use_default_config && !parseSegmentationOptions(parseDefaults(), parsed)){
+			return -1;
 		}
-
-		if(use_default_config){
-			vector<string> default_options = parseDefaults();
-			if(default_options.size()>0){
-				for(int i=0; i<default_options.size(); i++){
-					if ( (i + 1) != default_options.size()){ 
-						if (default_options[i] == "-thd") {
-							threshold = atof(default_options[i + 1].c_str());
-						}else if (default_options[i] == "-xml") {
-							 targetfile = new char[default_options[i + 1].length()];
-							 strcpy(targetfile,default_options[i + 1].c_str());
-						}else if (default_options[i] == "-use") {
-               strcpy(options,default_options[i + 1].c_str());
-						}
-					}
-				}
-			}
+		if(!parseSegmentationOptions(arguments, parsed)){
+			return -1;
 		}
-
-		for (int i = 1; i < argc; i++) { 
-			if ( (i + 1) != argc){ 
-				if (std::string(argv[i]) == "-thd") {
-					threshold = atof(argv[i + 1]);
-				}else if (std::string(argv[i]) == "-xml") {
-					targetfile = argv[i + 1];
-				}else if (std::string(argv[i]) == "-use") {
-					strncpy(options, argv[i + 1],MAX_OPTION_CHAR_ARRAY_SIZE);
-				}
-				else if(std::string(argv[i]) == "-unit"){
-					unit = argv[i + 1];
-				}
-			}
-			if (std::string(argv[i]) == "-def" || std::string(argv[i]) == "-default") {
-				use_default_config = true;
-			}
-			else if (std::string(argv[i]) == "-nostreaming") {
-				useStreamingFilter = false;
-			}
+		if(!parsed.progress.empty() && !openProgressEvents(parsed.progress.c_str())){
+			std::cout << "Unable to open the progress file: " << parsed.progress << std::endl;
+			return -1;
 		}
 
+		const char* targetfile = parsed.targetfile.empty() ? ITK_NULLPTR : parsed.targetfile.c_str();
+		char options [MAX_OPTION_CHAR_ARRAY_SIZE];
+		strncpy(options, parsed.options.c_str(), MAX_OPTION_CHAR_ARRAY_SIZE - 1);
+		options[MAX_OPTION_CHAR_ARRAY_SIZE - 1] = 0;
+		const char* unit = parsed.unit.c_str();
+		const char* roi = parsed.roi.empty() ? ITK_NULLPTR : parsed.roi.c_str();
+		double threshold = parsed.threshold;
+		bool useStreamingFilter = parsed.useStreamingFilter;
+		bool batch = parsed.batch;
+
 		if(use_default_config){
 		    cout << "\nUsing defalut.txt options: -use " << options;
 			if(targetfile!=NULL){
@@ -353,7 +472,10 @@ int main(int argc, char** argv)
 
 		try 
 		{
-			validateImage(groundtruthfile, testfile, threshold, targetfile, options, unit, time_start, useStreamingFilter);
+			if(batch){
+				return evaluateBatch(groundtruthfile, testfile, threshold, targetfile, options, unit, useStreamingFilter, roi);
+			}
+			validateImage(groundtruthfile, testfile, threshold, targetfile, options, unit, time_start, useStreamingFilter, roi);
 		} 
 		catch (itk::ExceptionObject& e)
 		{
@@ -0,0 +1,137 @@
+/*
+// FastProfile.h
+//
+// Description:
+//
+// This file contains the metric profile "fast" (-use fast) for interactive use: all metrics computed
+// in the pass over the images (the overlap based metrics, MAHLNBS, ICCORR, PROBDST) and the distance
+// metrics HDRFDST and AVGDIST, approximated so that the evaluation ends within the deadline
+// (option -deadline, default 1 second).
+//
+// The distance metrics are approximated by searching the nearest voxels for one voxel per cell of
+// sampleCell^3 voxels of their query lists, unless their distance transform backend, which is exact,
+// is the cheapest. Any two voxels of a cell are at most the diagonal of the cell, errorBound, apart,
+// so the approximated HDRFDST is at most errorBound smaller than the exact one and the approximated
+// AVGDIST, whose samples are weighted by the number of voxels of their cell, differs by at most
+// errorBound. The cell size is the smallest whose estimated cost (see DistanceBackends.h) fits the
+// time left after the pass over the images. The distance metrics scan only the bounding box of the
+// foreground, found in the same pass.
+//
+*/
+
+#ifndef _FASTPROFILE
+#define _FASTPROFILE
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+#include "Metric_constants.h"
+#include "DistanceBackends.h"
+
+bool shouldUse(MetricId, char* options);
+
+// seconds an evaluation with -use fast may take (option -deadline)
+static double evaluationDeadline = 1;
+
+// largest cell, in voxels per axis, sampled by the approximated distance metrics
+static const int FAST_MAX_SAMPLE_CELL = 16;
+
+bool isFastProfile(const char* options){
+	return std::string(options) == "fast";
+}
+
+// metrics of the fast profile
+bool isFastMetric(MetricId id){
+	if(metricInfo[id].metrId == NULL || metricInfo[id].testmetric){
+		return false;
+	}
+	if(id == HDRFDST || id == AVGDIST){
+		return true;
+	}
+	return (metricInfo[id].artifacts & ~(ARTIFACT_CONTINGENCY | ARTIFACT_VOXEL_STATISTICS | ARTIFACT_MOMENTS)) == 0;
+}
+
+double secondsSince(const std::chrono::steady_clock::time_point &start){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+typedef struct FastPlan{
+	double deadline;
+	double elapsed;     // seconds of the evaluation before the distance metrics
+	double estimate;    // estimated seconds of the distance metrics
+	int sampleCell;     // 1 for the exact distance metrics
+	double errorBound;  // of the sampled distance metrics, in their unit
+} FastPlan;
+
+/*
+// Chooses the smallest sample cell with which the requested distance metrics, each with its
+// cheapest backend (DistanceBackends.h), are estimated to end before the deadline. voxelRate is the
+// speed of the pass over the images in voxels per second of one thread, spacingDiagonal the length
+// of the diagonal of a voxel in the unit of the distances. If the metrics run concurrently
+// (TaskGraph.h), the slowest of them takes the time, otherwise their sum. memoryLimit restricts
+// the backends as in planDistanceMetric().
+*/
+FastPlan planFastProfile(char* options, const DistanceWorkload &w, double voxelRate, double elapsed, double spacingDiagonal, bool concurrent, long long memoryLimit){
+	FastPlan plan;
+	plan.deadline = evaluationDeadline;
+	plan.elapsed = elapsed;
+	plan.estimate = 0;
+	MetricId metrics[] = {HDRFDST, AVGDIST};
+	for(plan.sampleCell = 1; plan.sampleCell <= FAST_MAX_SAMPLE_CELL; plan.sampleCell++){
+		plan.estimate = 0;
+		for(int i = 0; i < 2; i++){
+			if(shouldUse(metrics[i], options)){
+				double seconds = planDistanceMetric(metrics[i], w, voxelRate, plan.sampleCell, false, memoryLimit).predictedSeconds;
+				plan.estimate = concurrent ? std::max(plan.estimate, seconds) : plan.estimate + seconds;
+			}
+		}
+		if(elapsed + plan.estimate <= plan.deadline || plan.sampleCell == FAST_MAX_SAMPLE_CELL){
+			break;
+		}
+	}
+	plan.errorBound = (plan.sampleCell - 1) * spacingDiagonal;
+	return plan;
+}
+
+void printFastPlan(const FastPlan &plan){
+	std::cout << "Fast profile: " << plan.elapsed << " s elapsed, distance metrics estimated at " << plan.estimate << " s";
+	if(plan.sampleCell > 1){
+		std::cout << ", sampled with cells of " << plan.sampleCell << " voxels per axis (error at most " << plan.errorBound << ")";
+	}
+	std::cout << std::endl;
+	if(plan.elapsed + plan.estimate > plan.deadline){
+		std::cout << "The deadline of " << plan.deadline << " s cannot be met" << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+/*
+// Keeps the first voxel of each cell of cell^3 voxels, in the order of the list, and returns their
+// number. weights receives for each kept voxel the number of voxels of its cell in the list.
+*/
+template<class Voxel>
+long long sampleVoxels(Voxel* voxels, long long number, int cell, std::vector<long long> &weights){
+	// position of the voxel kept for a cell
+	std::unordered_map<long long, long long> kept;
+	weights.clear();
+	long long count = 0;
+	for(long long i=0; i < number; i++){
+		long long key = (((long long)(voxels[i].x / cell)) << 42) | (((long long)(voxels[i].y / cell)) << 21) | (long long)(voxels[i].z / cell);
+		std::unordered_map<long long, long long>::iterator it = kept.find(key);
+		if(it != kept.end()){
+			weights[it->second]++;
+			continue;
+		}
+		kept[key] = count;
+		voxels[count] = voxels[i];
+		weights.push_back(1);
+		count++;
+	}
+	return count;
+}
+
+#endif
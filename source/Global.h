@@ -40,6 +40,10 @@
 static const int PIXEL_VALUE_RANGE_MIN=0;
 static const int PIXEL_VALUE_RANGE_MAX=255;
 
+// wall time in milliseconds from the start of the process to main() (loading libraries, static
+// initializers), see getStartupMilliseconds()
+static long long startup_milliseconds = 0;
+
 //#define DATATYPE_UNSIGNED_INT
 //#define DATATYPE_INT
 //#define DATATYPE_FLOAT
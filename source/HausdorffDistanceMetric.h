@@ -27,7 +27,11 @@
 //
 */
 
+#include <memory>
+#include <random>
 #include "itkImage.h"
+#include "Arena.h"
+#include "FastProfile.h"
 #include <itkVector.h>
 
 
@@ -56,16 +60,16 @@ private:
 	double threshold;
 	bool empty_f;
 	bool empty_m;
-	int numberElements_f;
-	int numberElements_m;
+	long long numberElements_f;
+	long long numberElements_m;
 	double maxValue;
 	int max_tries;
 
 	
 public:
      
-	int N1;
-	int N2;
+	long long N1;
+	long long N2;
 	long long int tries;
  	long long int count_less;
 	long long int count_more;
@@ -76,6 +80,19 @@ public:
     double spx;
     double spy;
     double spz;
+	// voxels per axis of the cells of which one voxel is searched, 1 = all (see FastProfile.h)
+	int sampleCell;
+	// how the nearest voxels are searched, and the region containing the foreground of both images
+	// scanned by the distance transform (see DistanceBackends.h)
+	DistanceBackend backend;
+	ImageType::RegionType distanceRegion;
+	// distance transforms of the fixed and the moving image shared with the other distance
+	// metrics, NULL or not matching = made by this metric
+	const DistanceField* field_f;
+	const DistanceField* field_m;
+	// threads of the distance transforms made by this metric, fewer than the cores when other
+	// metrics run at the same time
+	int threads;
 	   
 	~HausdorffDistanceMetric(){
 
@@ -86,6 +103,12 @@ public:
 		this->movingImage = movingImage;
 		this->fuzzy = fuzzy;
 		this->threshold = threshold;
+		this->sampleCell = 1;
+		this->backend = DISTANCE_BRUTE_FORCE;
+		this->distanceRegion = fixedImage->GetRequestedRegion();
+		this->field_f = NULL;
+		this->field_m = NULL;
+		this->threads = getNumberOfThreads();
 		const ImageType::SpacingType & ImageSpacing = fixedImage->GetSpacing();
 		if(millimeter){
            this->spx = ImageSpacing[0];
@@ -115,11 +138,11 @@ public:
 	double CalcHausdorffDistace(double quantile){
 		
 		std::vector<double> distances1;
-		double hd = calc0(fixedImage, movingImage, &distances1);
+		double hd = backend == DISTANCE_EDT ? calcEdt(&distances1) : calc0(fixedImage, movingImage, &distances1);
 
 		if(quantile<1 && distances1.size()>1){
 			std::sort(distances1.begin(), distances1.end());
-			return distances1[(int)(quantile*(distances1.size() - 1))];
+			return distances1[(size_t)(quantile*(distances1.size() - 1))];
 		}
 		else{
 		   return hd;
@@ -138,18 +161,21 @@ public:
 		    thd = 0.5*PIXEL_VALUE_RANGE_MAX;
 		}
 
+		// the voxel lists are freed from the arena when the distance is computed
+		Arena::Marker marker = evaluationArena().Mark();
 		VoxelInfo* retrievedVoxels_1;
-		int numberRetr_1;
+		long long numberRetr_1;
 		VoxelInfo* trueVoxels_1;
-		int numberTrue_1;
+		long long numberTrue_1;
 
 		VoxelInfo* retrievedVoxels_2;
-		int numberRetr_2;
+		long long numberRetr_2;
 		VoxelInfo* trueVoxels_2;
-		int numberTrue_2;
+		long long numberTrue_2;
 
-		IteratorType fixedIt(image1, image1->GetRequestedRegion());
-		IteratorType movingIt(image2, image2->GetRequestedRegion());
+		// the region contains the foreground of both images (see DistanceBackends.h)
+		IteratorType fixedIt(image1, distanceRegion);
+		IteratorType movingIt(image2, distanceRegion);
 
 		numberElements_f = 0;
 		numberTrue_1=0;
@@ -195,13 +221,13 @@ public:
 			}
 			++fixedIt;
 		}
-		retrievedVoxels_1 = new VoxelInfo[numberRetr_1];
-		trueVoxels_1 = new VoxelInfo[numberTrue_1];
+		retrievedVoxels_1 = evaluationArena().Allocate<VoxelInfo>(numberRetr_1);
+		trueVoxels_1 = evaluationArena().Allocate<VoxelInfo>(numberTrue_1);
 
 		fixedIt.GoToBegin();
 		movingIt.GoToBegin();
-		int FP_index=0;
-		int FN_index=0;
+		long long FP_index=0;
+		long long FN_index=0;
 		while (!movingIt.IsAtEnd() && !fixedIt.IsAtEnd()){
 			if(fixedIt.Get()>thd && movingIt.Get()<=thd){
 				trueVoxels_1[FN_index].value = fixedIt.Get();
@@ -224,8 +250,8 @@ public:
 
 		//------------------ begin
 
-		retrievedVoxels_2 = new VoxelInfo[numberRetr_2];
-		trueVoxels_2 = new VoxelInfo[numberTrue_2];
+		retrievedVoxels_2 = evaluationArena().Allocate<VoxelInfo>(numberRetr_2);
+		trueVoxels_2 = evaluationArena().Allocate<VoxelInfo>(numberTrue_2);
 
 		fixedIt.GoToBegin();
 		movingIt.GoToBegin();
@@ -250,27 +276,35 @@ public:
 			++fixedIt;
 		}
 
+		// the fast profile searches the nearest voxels for one voxel per cell of the query lists
+		if(sampleCell > 1){
+			std::vector<long long> weights;
+			numberTrue_1 = sampleVoxels(trueVoxels_1, numberTrue_1, sampleCell, weights);
+			numberTrue_2 = sampleVoxels(trueVoxels_2, numberTrue_2, sampleCell, weights);
+		}
+
 		maxValue = 100000000;
 		double globalmax = 0;
-		int index_1=0;
-		int index_2=0;
+		long long index_1=0;
+		long long index_2=0;
 		max_tries=0;
 		shuttle(retrievedVoxels_1,numberRetr_1);
         shuttle(retrievedVoxels_2, numberRetr_2);
 		shuttle(trueVoxels_1, numberTrue_1);
 		shuttle(trueVoxels_2, numberTrue_2);
+		distances->reserve(distances->size() + numberTrue_1 + numberTrue_2);
 		while(index_1 < numberTrue_1 || index_2 < numberTrue_2){
 
 			if(index_1 < numberTrue_1){
 				VoxelInfo p = trueVoxels_1[index_1];
 				double min = maxValue;
 
-				 for(int x=0; x < numberRetr_1 ; x++){
+				 for(long long x=0; x < numberRetr_1 ; x++){
 					 VoxelInfo testpoint = retrievedVoxels_1[x];    
  			         double dist =std::sqrt((double)(
-					     (testpoint.x-p.x)*(testpoint.x-p.x) *this->spx*this->spx
-					   + (testpoint.y-p.y)*(testpoint.y-p.y) *this->spy*this->spy
-					   + (testpoint.z-p.z)*(testpoint.z-p.z) *this->spz*this->spz
+					     (double)(testpoint.x-p.x)*(testpoint.x-p.x) *this->spx*this->spx
+					   + (double)(testpoint.y-p.y)*(testpoint.y-p.y) *this->spy*this->spy
+					   + (double)(testpoint.z-p.z)*(testpoint.z-p.z) *this->spz*this->spz
 					   ));
 					 min = std::min(min, dist);
 					 if(dist < globalmax){
@@ -296,12 +330,12 @@ public:
 
 				VoxelInfo p = trueVoxels_2[index_2];
 				double min = maxValue;
-				 for(int x=0; x < numberRetr_2 ; x++){
+				 for(long long x=0; x < numberRetr_2 ; x++){
 					 VoxelInfo testpoint = retrievedVoxels_2[x];  
                       double dist =std::sqrt((double)(
-					     (testpoint.x-p.x)*(testpoint.x-p.x) *this->spx*this->spx
-					   + (testpoint.y-p.y)*(testpoint.y-p.y) *this->spy*this->spy
-					   + (testpoint.z-p.z)*(testpoint.z-p.z) *this->spz*this->spz
+					     (double)(testpoint.x-p.x)*(testpoint.x-p.x) *this->spx*this->spx
+					   + (double)(testpoint.y-p.y)*(testpoint.y-p.y) *this->spy*this->spy
+					   + (double)(testpoint.z-p.z)*(testpoint.z-p.z) *this->spz*this->spz
 					   ));
 					   
 					   
@@ -322,15 +356,49 @@ public:
 		}
 
 		//  std::cout << " true "<< numberTrue_1<< std::endl;
+		evaluationArena().Release(marker);
 		return globalmax;
 	}
 
 	
 
-	int GetFixedImageVoxelCount(){
+	// the exact distances of the voxels of each image missing in the other, from distance transforms
+	double calcEdt(std::vector<double> *distances){
+		double thd = 0.5*PIXEL_VALUE_RANGE_MAX;
+		if(!fuzzy && threshold!=-1){
+		    thd = threshold*PIXEL_VALUE_RANGE_MAX;
+		}
+		Arena::Marker marker = evaluationArena().Mark();
+		double hd = calcEdtDirected(fixedImage, movingImage, field_m, thd, distances);
+		hd = std::max(hd, calcEdtDirected(movingImage, fixedImage, field_f, thd, distances));
+		evaluationArena().Release(marker);
+		return hd;
+	}
+
+	double calcEdtDirected(ImageType *image1, ImageType *image2, const DistanceField *shared, double thd, std::vector<double> *distances){
+		std::unique_ptr<DistanceField> own;
+		if(shared == NULL || !shared->Matches(distanceRegion, thd, spx, spy, spz)){
+			own.reset(new DistanceField(image2, distanceRegion, thd, spx, spy, spz, threads));
+			shared = own.get();
+		}
+		const DistanceField &field = *shared;
+		IteratorType it1(image1, distanceRegion);
+		IteratorType it2(image2, distanceRegion);
+		double max = 0;
+		for(it1.GoToBegin(), it2.GoToBegin(); !it1.IsAtEnd(); ++it1, ++it2){
+			if(it1.Get()>thd && it2.Get()<=thd){
+				double dist = field.Distance(it1.GetIndex());
+				distances->push_back(dist);
+				max = std::max(max, dist);
+			}
+		}
+		return max;
+	}
+
+	long long GetFixedImageVoxelCount(){
 		return numberElements_f;
 	}
-	int GetMovingImageVoxelCount(){
+	long long GetMovingImageVoxelCount(){
 		return numberElements_m;
 	}
 	bool IsDifferentImageSize(){
@@ -364,11 +432,11 @@ public:
 		return mat;
 	}
 
-	void shuttle(VoxelInfo* arr, int len){
-		   srand (time(NULL));
-		   for(int i=0 ; i< len ; i++){
-			   int r1 = std::abs(rand()*rand() + rand());
-		       r1 = r1 %len;
+	void shuttle(VoxelInfo* arr, long long len){
+		   // a generator of its own, the metrics run concurrently (see TaskGraph.h)
+		   std::mt19937_64 random((unsigned long long)len);
+		   for(long long i=0 ; i< len ; i++){
+		       long long r1 = (long long)(random() % (unsigned long long)len);
 			   VoxelInfo v1 = arr[i];
 			   VoxelInfo v2 = arr[r1];
 			   arr[i]=v2;
@@ -377,6 +445,5 @@ public:
 		   }
 	}
 
-
 };
 
@@ -0,0 +1,604 @@
+/*
+// HttpFetcher.h
+//
+// Description:
+//
+// This file fetches several URLs at once, e.g. the truth, test and mask images of an evaluation,
+// instead of downloading them one after another. The requests are driven by one non-blocking event
+// loop (epoll); requests to the same host share up to HTTP_CONNECTIONS_PER_HOST keep-alive
+// connections, so that a series of images from one server needs only a few TCP connections.
+//
+// The fetched bodies are put into the prefetch cache (see Imagedownloader.h), where loadImage and
+// download_image take them from. The batch evaluation uses this to download the truth images of
+// the cases read ahead while earlier cases are evaluated.
+//
+// On platforms without epoll the URLs are fetched sequentially with HttpByteSource.
+//
+*/
+
+#ifndef _HTTPFETCHER
+#define _HTTPFETCHER
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include "Imagedownloader.h"
+#include "UrlCache.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <fcntl.h>
+#define _HTTP_EPOLL
+#endif
+
+static const int HTTP_CONNECTIONS_PER_HOST = 4;
+// a fetch fails if none of its connections makes progress for this time
+static const int HTTP_TIMEOUT_MILLISECONDS = 60000;
+
+#ifdef _HTTP_EPOLL
+
+/*
+// One keep-alive connection, sending the requests of its host one after the other
+*/
+typedef struct HttpConnection{
+	enum State {CONNECTING, STATUS_LINE, HEADERS, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILERS};
+
+	int fd;
+	std::string host;
+	size_t address;
+	State state;
+	// index of the request being transferred, -1 if none
+	long long request;
+	// number of responses received on this connection
+	int responses;
+	std::string out;
+	size_t outPos;
+	std::string in;
+	long long remaining;
+	bool chunked;
+	bool untilClose;
+	bool keepAlive;
+	std::string location;
+} HttpConnection;
+
+class HttpFetcher
+{
+private:
+	typedef struct HttpHost{
+		std::string hostname;
+		std::string port;
+		std::vector<sockaddr_storage> addresses;
+		std::vector<socklen_t> addressLengths;
+		std::deque<long long> queue;
+		int connections;
+	} HttpHost;
+
+	std::vector<HttpResponse> &responses;
+	std::vector<std::string> paths;
+	std::vector<int> redirects;
+	std::vector<bool> done;
+	std::map<std::string, HttpHost> hosts;
+	std::map<int, HttpConnection*> connections;
+	int epollFd;
+	long long open;
+
+	void Finish(long long request, const std::string &error){
+		done[request] = true;
+		responses[request].error = error;
+		if(error != ""){
+			std::vector<char>().swap(responses[request].body);
+		}
+		open--;
+	}
+
+	// queues a request for its host, returns false if the url cannot be fetched
+	bool Queue(long long request, const std::string &url){
+		std::string hostname, port, path;
+		if(!ParseHttpUrl(url, hostname, port, path)){
+			Finish(request, "Only http URLs are supported: " + url);
+			return false;
+		}
+		std::string key = hostname + ":" + port;
+		paths[request] = path;
+		if(hosts.count(key) == 0){
+			HttpHost &host = hosts[key];
+			host.hostname = hostname;
+			host.port = port;
+			host.connections = 0;
+			addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			addrinfo* addresses = NULL;
+			if(getaddrinfo(hostname.c_str(), port.c_str(), &hints, &addresses) == 0){
+				for(addrinfo* a = addresses; a != NULL; a = a->ai_next){
+					sockaddr_storage address;
+					memcpy(&address, a->ai_addr, a->ai_addrlen);
+					host.addresses.push_back(address);
+					host.addressLengths.push_back(a->ai_addrlen);
+				}
+				freeaddrinfo(addresses);
+			}
+		}
+		HttpHost &host = hosts[key];
+		if(host.addresses.empty()){
+			Finish(request, "Host can not be resolved: " + hostname);
+			return false;
+		}
+		host.queue.push_back(request);
+		if(host.connections < HTTP_CONNECTIONS_PER_HOST){
+			Connect(key, 0);
+		}
+		return true;
+	}
+
+	void Watch(HttpConnection *c, bool add){
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | (c->state == HttpConnection::CONNECTING || c->outPos < c->out.size() ? EPOLLOUT : 0);
+		event.data.fd = c->fd;
+		epoll_ctl(epollFd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &event);
+	}
+
+	void Connect(const std::string &key, size_t address){
+		HttpHost &host = hosts[key];
+		while(address < host.addresses.size()){
+			int fd = socket(host.addresses[address].ss_family, SOCK_STREAM, 0);
+			if(fd != -1){
+				int window = HTTP_RECEIVE_WINDOW;
+				setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+				if(connect(fd, (sockaddr*)&host.addresses[address], host.addressLengths[address]) == 0 || errno == EINPROGRESS){
+					HttpConnection *c = new HttpConnection();
+					c->fd = fd;
+					c->host = key;
+					c->address = address;
+					c->state = HttpConnection::CONNECTING;
+					c->request = -1;
+					c->responses = 0;
+					c->outPos = 0;
+					connections[fd] = c;
+					host.connections++;
+					Watch(c, true);
+					return;
+				}
+				CloseSocket(fd);
+			}
+			address++;
+		}
+		// no address accepts connections, fail the requests of the host without a connection
+		if(host.connections == 0){
+			while(!host.queue.empty()){
+				Finish(host.queue.front(), "connection not successful: " + key);
+				host.queue.pop_front();
+			}
+		}
+	}
+
+	void Close(HttpConnection *c){
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+		CloseSocket(c->fd);
+		hosts[c->host].connections--;
+		connections.erase(c->fd);
+		delete c;
+	}
+
+	// sends the next request of the host, closes the connection if there is none. Returns false
+	// if the connection was closed.
+	bool SendNext(HttpConnection *c){
+		HttpHost &host = hosts[c->host];
+		if(host.queue.empty()){
+			Close(c);
+			return false;
+		}
+		c->request = host.queue.front();
+		host.queue.pop_front();
+		std::string hostHeader = host.port == "80" ? host.hostname : host.hostname + ":" + host.port;
+		c->out = "GET " + paths[c->request] + " HTTP/1.1\r\nHost: " + hostHeader + "\r\nConnection: keep-alive\r\n\r\n";
+		c->outPos = 0;
+		c->in = "";
+		c->state = HttpConnection::STATUS_LINE;
+		c->chunked = false;
+		c->untilClose = false;
+		c->keepAlive = true;
+		c->remaining = -1;
+		c->location = "";
+		responses[c->request].body.clear();
+		return Flush(c);
+	}
+
+	bool Flush(HttpConnection *c){
+		while(c->outPos < c->out.size()){
+			ssize_t n = send(c->fd, c->out.data() + c->outPos, c->out.size() - c->outPos, MSG_NOSIGNAL);
+			if(n < 0){
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					break;
+				}
+				Fail(c, CreateSocketError().what());
+				return false;
+			}
+			c->outPos += n;
+		}
+		Watch(c, false);
+		return true;
+	}
+
+	// the connection broke: the current request is retried on a new connection if this one was
+	// reused (the server closed it while idle), otherwise it fails
+	void Fail(HttpConnection *c, const std::string &error){
+		std::string key = c->host;
+		long long request = c->request;
+		bool retry = c->responses > 0 && c->state == HttpConnection::STATUS_LINE && c->in.empty();
+		Close(c);
+		if(request >= 0){
+			if(retry){
+				hosts[key].queue.push_front(request);
+			}
+			else{
+				Finish(request, error);
+			}
+		}
+		if(!hosts[key].queue.empty() && hosts[key].connections < HTTP_CONNECTIONS_PER_HOST){
+			Connect(key, 0);
+		}
+	}
+
+	// finishes the current response, returns false if the connection was closed
+	bool Complete(HttpConnection *c){
+		long long request = c->request;
+		HttpResponse &response = responses[request];
+		c->request = -1;
+		c->responses++;
+		bool keepAlive = c->keepAlive && !c->untilClose;
+
+		if(response.status >= 300 && response.status < 400 && c->location != ""){
+			std::string location = c->location;
+			if(location[0] == '/'){
+				HttpHost &host = hosts[c->host];
+				location = "http://" + host.hostname + ":" + host.port + location;
+			}
+			if(redirects[request]++ >= HTTP_MAX_REDIRECTS){
+				Finish(request, "Too many redirects: " + response.url);
+			}
+			else{
+				response.body.clear();
+				Queue(request, location);
+			}
+		}
+		else if(response.status != 200){
+			std::ostringstream message;
+			message << "Error #" << response.status << " fetching " << response.url;
+			Finish(request, message.str());
+		}
+		else{
+			Finish(request, "");
+		}
+
+		if(keepAlive){
+			return SendNext(c);
+		}
+		std::string key = c->host;
+		Close(c);
+		if(!hosts[key].queue.empty() && hosts[key].connections < HTTP_CONNECTIONS_PER_HOST){
+			Connect(key, 0);
+		}
+		return false;
+	}
+
+	bool ReadLine(HttpConnection *c, std::string &line){
+		size_t pos = c->in.find('\n');
+		if(pos == std::string::npos){
+			return false;
+		}
+		line = c->in.substr(0, pos);
+		if(!line.empty() && line[line.size() - 1] == '\r'){
+			line.erase(line.size() - 1);
+		}
+		c->in.erase(0, pos + 1);
+		return true;
+	}
+
+	// consumes the received bytes, returns false if the connection was closed
+	bool Parse(HttpConnection *c){
+		std::string line;
+		while(c->request >= 0){
+			HttpResponse &response = responses[c->request];
+			if(c->state == HttpConnection::STATUS_LINE){
+				if(!ReadLine(c, line)){
+					return true;
+				}
+				std::stringstream status(line);
+				std::string protocol;
+				status >> protocol >> response.status;
+				c->keepAlive = protocol != "HTTP/1.0";
+				c->state = HttpConnection::HEADERS;
+			}
+			else if(c->state == HttpConnection::HEADERS){
+				if(!ReadLine(c, line)){
+					return true;
+				}
+				if(line == ""){
+					if(response.status == 100){
+						c->state = HttpConnection::STATUS_LINE;
+					}
+					else if(response.status == 204 || response.status == 304){
+						c->remaining = 0;
+						if(!Complete(c)){
+							return false;
+						}
+					}
+					else if(c->chunked){
+						c->state = HttpConnection::CHUNK_SIZE;
+					}
+					else{
+						c->untilClose = c->remaining < 0;
+						c->state = HttpConnection::BODY;
+						if(c->remaining > 0){
+							response.body.reserve(c->remaining);
+						}
+					}
+					continue;
+				}
+				size_t colon = line.find(':');
+				if(colon == std::string::npos){
+					continue;
+				}
+				std::string name = line.substr(0, colon);
+				for(size_t i = 0; i < name.size(); i++){
+					name[i] = tolower(name[i]);
+				}
+				size_t start = line.find_first_not_of(" \t", colon + 1);
+				std::string value = start == std::string::npos ? "" : line.substr(start);
+				if(name == "content-length"){
+					c->remaining = atoll(value.c_str());
+				}
+				else if(name == "transfer-encoding" && value.find("chunked") != std::string::npos){
+					c->chunked = true;
+				}
+				else if(name == "connection"){
+					if(value.find("close") != std::string::npos){
+						c->keepAlive = false;
+					}
+					else if(value.find("keep-alive") != std::string::npos){
+						c->keepAlive = true;
+					}
+				}
+				else if(name == "location"){
+					c->location = value;
+				}
+			}
+			else if(c->state == HttpConnection::BODY || c->state == HttpConnection::CHUNK_DATA){
+				long long n = c->in.size();
+				if(c->remaining >= 0 && n > c->remaining){
+					n = c->remaining;
+				}
+				response.body.insert(response.body.end(), c->in.begin(), c->in.begin() + n);
+				c->in.erase(0, n);
+				if(c->remaining >= 0){
+					c->remaining -= n;
+				}
+				if(c->remaining != 0){
+					return true;
+				}
+				if(c->state == HttpConnection::CHUNK_DATA){
+					c->state = HttpConnection::CHUNK_END;
+				}
+				else if(!Complete(c)){
+					return false;
+				}
+			}
+			else if(c->state == HttpConnection::CHUNK_END){
+				if(!ReadLine(c, line)){
+					return true;
+				}
+				c->state = HttpConnection::CHUNK_SIZE;
+			}
+			else if(c->state == HttpConnection::CHUNK_SIZE){
+				if(!ReadLine(c, line)){
+					return true;
+				}
+				c->remaining = strtoll(line.c_str(), NULL, 16);
+				c->state = c->remaining > 0 ? HttpConnection::CHUNK_DATA : HttpConnection::TRAILERS;
+			}
+			else if(c->state == HttpConnection::TRAILERS){
+				if(!ReadLine(c, line)){
+					return true;
+				}
+				if(line == "" && !Complete(c)){
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void OnEvent(HttpConnection *c, unsigned int events){
+		if(c->state == HttpConnection::CONNECTING){
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			if(error != 0){
+				// try the next address of the host
+				std::string key = c->host;
+				size_t address = c->address;
+				Close(c);
+				Connect(key, address + 1);
+				return;
+			}
+			SendNext(c);
+			return;
+		}
+		if((events & EPOLLOUT) && c->outPos < c->out.size() && !Flush(c)){
+			return;
+		}
+		if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+			std::vector<char> buffer(BYTESOURCE_BUFFER_SIZE);
+			while(true){
+				ssize_t n = recv(c->fd, &buffer[0], buffer.size(), 0);
+				if(n < 0){
+					if(errno != EAGAIN && errno != EWOULDBLOCK){
+						Fail(c, CreateSocketError().what());
+					}
+					return;
+				}
+				if(n == 0){
+					if(c->request >= 0 && c->state == HttpConnection::BODY && c->untilClose){
+						c->keepAlive = false;
+						Complete(c);
+					}
+					else if(c->request >= 0){
+						Fail(c, "Connection closed by the server: " + responses[c->request].url);
+					}
+					else{
+						Close(c);
+					}
+					return;
+				}
+				if(c->request < 0){
+					continue;
+				}
+				c->in.append(&buffer[0], n);
+				if(!Parse(c)){
+					return;
+				}
+			}
+		}
+	}
+
+public:
+	HttpFetcher(const std::vector<std::string> &urls, std::vector<HttpResponse> &responses) : responses(responses){
+		responses.resize(urls.size());
+		paths.resize(urls.size());
+		redirects.assign(urls.size(), 0);
+		done.assign(urls.size(), false);
+		open = urls.size();
+		epollFd = epoll_create1(0);
+		if(epollFd < 0){
+			throw CreateSocketError();
+		}
+		for(size_t i = 0; i < urls.size(); i++){
+			responses[i].url = urls[i];
+			responses[i].status = 0;
+			Queue(i, urls[i]);
+		}
+	}
+
+	~HttpFetcher(){
+		while(!connections.empty()){
+			Close(connections.begin()->second);
+		}
+		CloseSocket(epollFd);
+	}
+
+	void Run(){
+		std::vector<epoll_event> events(64);
+		while(open > 0 && !connections.empty()){
+			int n = epoll_wait(epollFd, &events[0], events.size(), HTTP_TIMEOUT_MILLISECONDS);
+			if(n < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				throw CreateSocketError();
+			}
+			if(n == 0){
+				break;
+			}
+			for(int i = 0; i < n; i++){
+				// events of connections closed while handling the previous events are dropped
+				std::map<int, HttpConnection*>::iterator c = connections.find(events[i].data.fd);
+				if(c != connections.end()){
+					OnEvent(c->second, events[i].events);
+				}
+			}
+		}
+		for(size_t i = 0; i < responses.size(); i++){
+			if(!done[i]){
+				responses[i].error = "Timeout fetching " + responses[i].url;
+				std::vector<char>().swap(responses[i].body);
+			}
+		}
+	}
+};
+
+#endif
+
+/*
+// Fetches all urls concurrently, responses[i] belongs to urls[i]
+*/
+void fetchUrls(const std::vector<std::string> &urls, std::vector<HttpResponse> &responses){
+#ifdef _HTTP_EPOLL
+	HttpFetcher fetcher(urls, responses);
+	fetcher.Run();
+#else
+	responses.resize(urls.size());
+	for(size_t i = 0; i < urls.size(); i++){
+		responses[i].url = urls[i];
+		responses[i].status = 0;
+		try
+		{
+			HttpByteSource source(urls[i]);
+			responses[i].status = source.status;
+			std::vector<char> buf(BYTESOURCE_BUFFER_SIZE);
+			long long n;
+			while((n = source.Read(&buf[0], buf.size())) > 0){
+				responses[i].body.insert(responses[i].body.end(), buf.begin(), buf.begin() + n);
+			}
+		}
+		catch(std::exception &e)
+		{
+			responses[i].error = e.what();
+			std::vector<char>().swap(responses[i].body);
+		}
+	}
+#endif
+}
+
+/*
+// Fetches urls concurrently into the prefetch cache
+*/
+void prefetchUrlList(const std::vector<std::string> &urls){
+	for(size_t i = 0; i < urls.size(); i++){
+		urlPrefetchCache.Expect(urls[i]);
+	}
+	std::vector<HttpResponse> responses;
+	try
+	{
+		fetchUrls(urls, responses);
+	}
+	catch(std::exception &e)
+	{
+		responses.resize(urls.size());
+		for(size_t i = 0; i < urls.size(); i++){
+			responses[i].url = urls[i];
+			responses[i].status = 0;
+			responses[i].error = e.what();
+		}
+	}
+	for(size_t i = 0; i < responses.size(); i++){
+		urlPrefetchCache.Put(responses[i]);
+	}
+}
+
+/*
+// Fetches the urls among the inputs of an evaluation concurrently. A single url is not
+// prefetched, it is streamed by its reader. With the url cache, urls are revalidated by the cache.
+*/
+void prefetchUrls(const std::vector<std::string> &paths){
+	if(isUrlCacheEnabled()){
+		return;
+	}
+	std::vector<std::string> urls;
+	for(size_t i = 0; i < paths.size(); i++){
+		if(paths[i].compare(0, 7, "http://") == 0 && std::find(urls.begin(), urls.end(), paths[i]) == urls.end()){
+			urls.push_back(paths[i]);
+		}
+	}
+	if(urls.size() >= 2){
+		prefetchUrlList(urls);
+	}
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+// ImageHeader.h
+//
+// Description:
+//
+// This file reads the meta information (dimensionality, grid size, spacing) of images without
+// loading their voxel data. It is used to reject incompatible image pairs before any voxel
+// data is read, decoded or allocated.
+//
+*/
+
+#ifndef _IMAGEHEADER
+#define _IMAGEHEADER
+
+#include <string>
+#include <sstream>
+#include <cmath>
+#include "itkImageIOFactory.h"
+#include "itkImageIOBase.h"
+#include "itksys/SystemTools.hxx"
+#include "DicomSegmentation.h"
+
+// relative tolerance used when comparing the voxel spacing of two images
+static const double SPACING_TOLERANCE = 1e-3;
+
+typedef struct ImageHeader{
+	bool valid;
+	unsigned int dimensions;
+	long long size[3];
+	double spacing[3];
+	long long numberElements;
+	itk::ImageIOBase::IOComponentType componentType;
+	bool canStreamRead;
+} ImageHeader;
+
+ImageHeader readImageHeader(const char* filename){
+	ImageHeader header;
+	header.valid = false;
+	header.dimensions = 0;
+	header.numberElements = 0;
+	header.componentType = itk::ImageIOBase::UCHAR;
+	header.canStreamRead = false;
+	for(int i=0; i<3 ; i++){
+		header.size[i] = 1;
+		header.spacing[i] = 1;
+	}
+
+	// the frames of a DICOM-SEG are not its grid, which is known only once it is placed
+	std::string extension = itksys::SystemTools::LowerCase(itksys::SystemTools::GetFilenameLastExtension(filename));
+	if(extension == ".dcm" && isDicomSegmentation(filename)){
+		return header;
+	}
+
+	itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(filename, itk::ImageIOFactory::ReadMode);
+	if(imageIO.IsNull()){
+		return header;
+	}
+	try
+	{
+		imageIO->SetFileName(filename);
+		imageIO->ReadImageInformation();
+	}
+	catch( itk::ExceptionObject & )
+	{
+		return header;
+	}
+
+	header.dimensions = imageIO->GetNumberOfDimensions();
+	header.componentType = imageIO->GetComponentType();
+	// compressed files can only be decoded as a whole, even if the ImageIO supports streaming
+	header.canStreamRead = imageIO->CanStreamRead() && extension != ".gz";
+	header.numberElements = 1;
+	for(unsigned int i=0; i < 3 && i < header.dimensions ; i++){
+		header.size[i] = imageIO->GetDimensions(i);
+		header.spacing[i] = imageIO->GetSpacing(i);
+		if(header.spacing[i]==0){
+			header.spacing[i]=1;
+		}
+	}
+	for(int i=0; i<3 ; i++){
+		header.numberElements *= header.size[i];
+	}
+	header.valid = true;
+	return header;
+}
+
+bool isSameSpacing(double s1, double s2){
+	return std::fabs(s1 - s2) <= SPACING_TOLERANCE * std::max(std::fabs(s1), std::fabs(s2));
+}
+
+/*
+// Compares the headers of two local images. Returns an empty string if they are compatible
+// (or if the headers cannot be read, in which case the decision is left to the image loader),
+// otherwise a message describing the mismatch.
+*/
+std::string checkImageHeaders(const char* f1, const char* f2){
+	std::ostringstream  message;
+	if(itksys::SystemTools::FileExists(f1,true) && itksys::SystemTools::FileLength(f1) == 0){
+		message << "Fixed image file is empty: " << f1;
+		return message.str();
+	}
+	if(itksys::SystemTools::FileExists(f2,true) && itksys::SystemTools::FileLength(f2) == 0){
+		message << "Moving image file is empty: " << f2;
+		return message.str();
+	}
+
+	ImageHeader h1 = readImageHeader(f1);
+	ImageHeader h2 = readImageHeader(f2);
+	if(!h1.valid || !h2.valid){
+		return "";
+	}
+
+	if(h1.numberElements == 0){
+		message << "Fixed image has no voxels!";
+		return message.str();
+	}
+	if(h2.numberElements == 0){
+		message << "Moving image has no voxels!";
+		return message.str();
+	}
+
+	bool sameSize = true;
+	for(int i=0; i<3 ; i++){
+		if(h1.size[i] != h2.size[i]){
+			sameSize = false;
+		}
+	}
+	if(!sameSize){
+		if(h1.dimensions != h2.dimensions){
+			message << "Images have different dimensionality: fixedImage=" << h1.dimensions << "D movingImage=" << h2.dimensions << "D" ;
+		}
+		else{
+			message << "Images are from different Sizes: fixedImage=" << h1.numberElements << " (" << h1.size[0] << "x" << h1.size[1] << "x" << h1.size[2] << ")"
+				<< " movingImage=" << h2.numberElements << " (" << h2.size[0] << "x" << h2.size[1] << "x" << h2.size[2] << ")";
+		}
+		return message.str();
+	}
+
+	for(unsigned int i=0; i < 3 && i < h1.dimensions && i < h2.dimensions ; i++){
+		if(!isSameSpacing(h1.spacing[i], h2.spacing[i])){
+			message << "Images have different voxel spacing: fixedImage=" << h1.spacing[0] << "x" << h1.spacing[1] << "x" << h1.spacing[2]
+				<< " movingImage=" << h2.spacing[0] << "x" << h2.spacing[1] << "x" << h2.spacing[2];
+			return message.str();
+		}
+	}
+
+	return "";
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+// ImageIOFactories.h
+//
+// Description:
+//
+// This file registers the ImageIO factories of the image formats that are read. By default ITK
+// registers the factories of all IO modules it was built with before main() is entered, which
+// takes a noticeable part of the run time for small images. The lean build (CMake option
+// EVALUATESEGMENTATION_LEAN_IO) links only the ITK modules that are used, disables this automatic
+// registration and registers the NIfTI, MetaImage (.mha/.mhd) and NRRD factories here instead.
+// Formats read by the tool itself (NumPy, Zarr, sparse masks, ...) are not affected.
+// The lean build links GDCM for DICOM images only with EVALUATESEGMENTATION_LEAN_DICOM, see
+// DicomSeries.h.
+//
+*/
+
+#ifndef _IMAGEIOFACTORIES
+#define _IMAGEIOFACTORIES
+
+#ifdef EVALUATESEGMENTATION_LEAN_IO
+#include "itkNiftiImageIOFactory.h"
+#include "itkMetaImageIOFactory.h"
+#include "itkNrrdImageIOFactory.h"
+#endif
+
+void registerImageIOFactories(){
+#ifdef EVALUATESEGMENTATION_LEAN_IO
+	itk::NiftiImageIOFactory::RegisterOneFactory();
+	itk::MetaImageIOFactory::RegisterOneFactory();
+	itk::NrrdImageIOFactory::RegisterOneFactory();
+#endif
+}
+
+#endif
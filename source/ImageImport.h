@@ -0,0 +1,238 @@
+/*
+// ImageImport.h
+//
+// Description:
+//
+// This file turns voxel buffers decoded outside of ITK's ImageIO (numpy arrays, streams,
+// shared memory, ...) into the image type used by the metrics. The buffer is read in place and
+// rescaled in one pass into the pixels of the image, with the same intensity rescaling as images
+// read by loadImage, so all inputs are evaluated identically.
+//
+*/
+
+#ifndef _IMAGEIMPORT
+#define _IMAGEIMPORT
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include "itkImage.h"
+#include "Global.h"
+#include "Parallel.h"
+
+// voxel spacing for inputs without spacing information (option -spacing), 0 = not given
+static double inputSpacing[3] = {0, 0, 0};
+
+// pixel types of raw voxel buffers
+enum RawPixelType {RAW_UINT8, RAW_INT8, RAW_UINT16, RAW_INT16, RAW_UINT32, RAW_INT32, RAW_UINT64, RAW_INT64, RAW_FLOAT32, RAW_FLOAT64, RAW_UNKNOWN};
+
+int rawPixelSize(RawPixelType type){
+	switch(type){
+		case RAW_UINT8:
+		case RAW_INT8:
+			return 1;
+		case RAW_UINT16:
+		case RAW_INT16:
+			return 2;
+		case RAW_UINT32:
+		case RAW_INT32:
+		case RAW_FLOAT32:
+			return 4;
+		case RAW_UINT64:
+		case RAW_INT64:
+		case RAW_FLOAT64:
+			return 8;
+		default:
+			return 0;
+	}
+}
+
+bool isHostBigEndian(){
+	unsigned short one = 1;
+	return *((unsigned char*)&one) == 0;
+}
+
+template<class T>
+void swapBytes(T &value){
+	unsigned char *p = (unsigned char*)&value;
+	for(size_t i = 0; i < sizeof(T)/2; i++){
+		unsigned char tmp = p[i];
+		p[i] = p[sizeof(T)-1-i];
+		p[sizeof(T)-1-i] = tmp;
+	}
+}
+
+// swaps the byte order of count values of the given size in place
+void swapRawBuffer(char *data, long long count, int size){
+	if(size < 2){
+		return;
+	}
+	for(long long i = 0; i < count; i++){
+		std::reverse(data + i*size, data + (i+1)*size);
+	}
+}
+
+// parses sx,sy,sz (commas or blanks as separators)
+bool parseSpacing(const char* s, double *spacing){
+	double sx, sy, sz;
+	if(sscanf(s, "%lf,%lf,%lf", &sx, &sy, &sz) != 3 && sscanf(s, "%lf %lf %lf", &sx, &sy, &sz) != 3){
+		return false;
+	}
+	if(sx <= 0 || sy <= 0 || sz <= 0){
+		return false;
+	}
+	spacing[0] = sx;
+	spacing[1] = sy;
+	spacing[2] = sz;
+	return true;
+}
+
+/*
+// Determines the spacing of a raw array input: the option -spacing has priority, otherwise a
+// sidecar file <path>.spacing containing "sx sy sz" is used, otherwise the spacing is 1.
+*/
+void resolveInputSpacing(const std::string &path, double *spacing){
+	spacing[0] = spacing[1] = spacing[2] = 1;
+	if(inputSpacing[0] > 0){
+		spacing[0] = inputSpacing[0];
+		spacing[1] = inputSpacing[1];
+		spacing[2] = inputSpacing[2];
+		return;
+	}
+	std::string sidecar = path + ".spacing";
+	std::ifstream i_stream(sidecar.c_str());
+	if(i_stream.is_open()){
+		std::string line;
+		getline(i_stream, line);
+		if(!parseSpacing(line.c_str(), spacing)){
+			std::cout << "Ignoring invalid spacing file: " << sidecar << std::endl;
+			spacing[0] = spacing[1] = spacing[2] = 1;
+		}
+	}
+}
+
+// voxels per work item of the rescaling
+static const long long IMPORT_BLOCK_VOXELS = 1 << 20;
+
+/*
+// Rescales count values of buffer to the pixel range into out, in one pass after the minimum and
+// maximum are found, both on all cores. The values are mapped as RescaleIntensityImageFilter and
+// CastImageFilter do (linear in double, rounded to float, truncated), so the pixels equal those of
+// the filters. buffer and out may be the same memory if TPixel is a byte type.
+*/
+template<class TPixel>
+void rescaleToPixels(const TPixel* buffer, long long count, pixeltype* out){
+	long long blocks = (count + IMPORT_BLOCK_VOXELS - 1) / IMPORT_BLOCK_VOXELS;
+	int threads = getNumberOfThreads();
+	std::vector<TPixel> minima(threads, count > 0 ? buffer[0] : TPixel(0));
+	std::vector<TPixel> maxima(minima);
+	parallelFor(blocks, threads, [&](long long block, int thread){
+		long long end = std::min(count, (block + 1) * IMPORT_BLOCK_VOXELS);
+		TPixel lo = minima[thread];
+		TPixel hi = maxima[thread];
+		for(long long i = block * IMPORT_BLOCK_VOXELS; i < end; i++){
+			lo = std::min(lo, buffer[i]);
+			hi = std::max(hi, buffer[i]);
+		}
+		minima[thread] = lo;
+		maxima[thread] = hi;
+	});
+	double inputMin = (double)*std::min_element(minima.begin(), minima.end());
+	double inputMax = (double)*std::max_element(maxima.begin(), maxima.end());
+	double outputMin = PIXEL_VALUE_RANGE_MIN;
+	double outputMax = PIXEL_VALUE_RANGE_MAX;
+	double scale = 0;
+	if(inputMin != inputMax){
+		scale = (outputMax - outputMin) / (inputMax - inputMin);
+	}
+	else if(inputMax != 0){
+		scale = (outputMax - outputMin) / inputMax;
+	}
+	double shift = outputMin - inputMin * scale;
+	parallelFor(blocks, threads, [&](long long block, int thread){
+		long long end = std::min(count, (block + 1) * IMPORT_BLOCK_VOXELS);
+		for(long long i = block * IMPORT_BLOCK_VOXELS; i < end; i++){
+			double value = std::max(outputMin, std::min(outputMax, (double)buffer[i] * scale + shift));
+			out[i] = (pixeltype)(float)value;
+		}
+	});
+}
+
+// an image of the given size and spacing at the origin, not initialized
+ImageType::Pointer allocateImportImage(const long long *size, const double *spacing){
+	ImageType::IndexType start;
+	ImageType::SizeType imageSize;
+	double origin[3] = {0, 0, 0};
+	for(int i=0; i<3 ; i++){
+		start[i] = 0;
+		imageSize[i] = size[i];
+	}
+	ImageType::RegionType region(start, imageSize);
+	ImageType::Pointer img = ImageType::New();
+	img->SetRegions(region);
+	img->SetOrigin(origin);
+	img->SetSpacing(spacing);
+	img->Allocate();
+	return img;
+}
+
+/*
+// The buffer is rescaled straight into the pixels of the image, without an intermediate float or
+// imported image.
+*/
+template<class TPixel>
+ImageType::Pointer importTypedImage(const TPixel* buffer, const long long *size, const double *spacing){
+	ImageType::Pointer img = allocateImportImage(size, spacing);
+	rescaleToPixels(buffer, size[0] * size[1] * size[2], img->GetBufferPointer());
+	return img;
+}
+
+/*
+// Rescales count values of a raw voxel buffer of the given pixel type into out (see
+// rescaleToPixels()).
+*/
+void rescaleRawToPixels(const void* buffer, RawPixelType type, long long count, pixeltype* out){
+	switch(type){
+		case RAW_UINT8:
+			return rescaleToPixels((const unsigned char*)buffer, count, out);
+		case RAW_INT8:
+			return rescaleToPixels((const signed char*)buffer, count, out);
+		case RAW_UINT16:
+			return rescaleToPixels((const unsigned short*)buffer, count, out);
+		case RAW_INT16:
+			return rescaleToPixels((const short*)buffer, count, out);
+		case RAW_UINT32:
+			return rescaleToPixels((const unsigned int*)buffer, count, out);
+		case RAW_INT32:
+			return rescaleToPixels((const int*)buffer, count, out);
+		case RAW_UINT64:
+			return rescaleToPixels((const unsigned long long*)buffer, count, out);
+		case RAW_INT64:
+			return rescaleToPixels((const long long*)buffer, count, out);
+		case RAW_FLOAT32:
+			return rescaleToPixels((const float*)buffer, count, out);
+		case RAW_FLOAT64:
+			return rescaleToPixels((const double*)buffer, count, out);
+		default:
+			throw std::runtime_error("Unsupported pixel type");
+	}
+}
+
+/*
+// Imports a raw voxel buffer of the given pixel type, x being the fastest running index.
+// The buffer only has to stay valid during the call.
+*/
+ImageType::Pointer importRawImage(const void* buffer, RawPixelType type, const long long *size, const double *spacing){
+	if(rawPixelSize(type) == 0){
+		throw std::runtime_error("Unsupported pixel type");
+	}
+	ImageType::Pointer img = allocateImportImage(size, spacing);
+	rescaleRawToPixels(buffer, type, size[0] * size[1] * size[2], img->GetBufferPointer());
+	return img;
+}
+
+#endif
@@ -21,51 +21,82 @@
 // 
 // Description:
 //
-// This class counts some statistics like number of pixels etc.
+// This class counts some statistics like number of pixels etc. Both images are scanned once by
+// the accumulators of the registry (MetricRegistry.h): the foreground counts, the contingency table
+// and, if requested, the moments of the foreground and the voxel statistics of ICCORR and PROBDST
+// are accumulated in the same pass, so no metric needs copies of the voxel values.
 //
 */
 
 #ifndef _IMAGESTATISTICS
 #define _IMAGESTATISTICS
+
 #include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+#include "Metric_constants.h"
+#include "MetricRegistry.h"
+#include "DistanceBackends.h"
+#include "Parallel.h"
+#include <chrono>
 
 class ImageStatistics
 {
-	
+private:
+	ImageType::SizeType size_f;
+	ImageType::SizeType size_m;
+
+	static int maxIndex(const ImageType::RegionType &region, int axis){
+		long long max = (long long)region.GetIndex(axis) + (long long)region.GetSize(axis) - 1;
+		return max > 0 ? (int)max : 0;
+	}
+
+	static long long countForeground(ImageType *image, double thd){
+		typedef itk::ImageRegionConstIterator<ImageType> IteratorType;
+		IteratorType it(image, image->GetRequestedRegion());
+		long long count = 0;
+		for(it.GoToBegin(); !it.IsAtEnd(); ++it){
+			if(it.Get()>thd){
+				count++;
+			}
+		}
+		return count;
+	}
 
 public: 
-	int numberElements_f;
-	int numberElements_m;
-	int num_nonzero_points_f;
-	int num_nonzero_points_m;
-	int num_intersection;
+	// voxel counts are 64 bit, volumes may have more than 2^31 voxels
+	long long numberElements_f;
+	long long numberElements_m;
+	long long num_nonzero_points_f;
+	long long num_nonzero_points_m;
+	long long num_intersection;
 	int max_x_f;
 	int max_y_f;
 	int max_z_f;
 	int max_x_m;
 	int max_y_m;
 	int max_z_m;
-
     double vspx; // Voxelspacing x
     double vspy; // Voxelspacing y
     double vspz; // Voxelspacing z
 
+	// results of the accumulators, e.g. voxelMetrics.Get<ContingencyTable>()
+	VoxelMetricVisitor voxelMetrics;
+	// duration of the pass over the images
+	double passSeconds;
+
 	~ImageStatistics(){
 
 	}
 
-	ImageStatistics(ImageType *fixedImage, ImageType *movingImage, bool fuzzy, double threshold){
-		typedef itk::ImageRegionConstIterator<ImageType> FixedIteratorType;
-		typedef itk::ImageRegionConstIterator<ImageType> MovingIteratorType;
-		FixedIteratorType fixedIt(fixedImage, fixedImage->GetRequestedRegion());
-		MovingIteratorType movingIt(movingImage, movingImage->GetRequestedRegion());
-
-
+	/*
+	// artifacts (see Metric_constants.h) selects the accumulators run besides the foreground counts
+	// and the contingency table. If the images differ in size only the foreground is counted.
+	*/
+	ImageStatistics(ImageType *fixedImage, ImageType *movingImage, bool fuzzy, double threshold, unsigned artifacts = 0){
         const ImageType::SpacingType & ImageSpacing = fixedImage->GetSpacing();
 		this->vspx = ImageSpacing[0];
 		this->vspy = ImageSpacing[1];
 		this->vspz = ImageSpacing[2];
-
 		if(this->vspx==0){
 			this->vspx=1;
 		}
@@ -76,74 +107,93 @@ public:
 			this->vspz=1;
 		}
 
-		double thd = 0;
-		if(!fuzzy && threshold!=-1){
-		    thd = threshold*PIXEL_VALUE_RANGE_MAX;
+		const ImageType::RegionType &region_f = fixedImage->GetRequestedRegion();
+		const ImageType::RegionType &region_m = movingImage->GetRequestedRegion();
+		numberElements_f = region_f.GetNumberOfPixels();
+		numberElements_m = region_m.GetNumberOfPixels();
+		size_f = region_f.GetSize();
+		size_m = region_m.GetSize();
+		max_x_f = maxIndex(region_f, 0);
+		max_y_f = maxIndex(region_f, 1);
+		max_z_f = maxIndex(region_f, 2);
+		max_x_m = maxIndex(region_m, 0);
+		max_y_m = maxIndex(region_m, 1);
+		max_z_m = maxIndex(region_m, 2);
+
+		passSeconds = 0;
+		if(IsDifferentImageSize()){
+			double thd = getForegroundThreshold(fuzzy, threshold);
+			num_nonzero_points_f = countForeground(fixedImage, thd);
+			num_nonzero_points_m = countForeground(movingImage, thd);
+			num_intersection = 0;
+			return;
 		}
-		numberElements_f = 0;
-		num_nonzero_points_f=0;
-		fixedIt.GoToBegin();
-	    max_x_f = 0;
-	    max_y_f = 0;
-	    max_z_f = 0;
-	    max_x_m = 0;
-	    max_y_m = 0;
-	    max_z_m = 0;
-		while (!fixedIt.IsAtEnd()){
-			numberElements_f++;
-			if(fixedIt.Get()>thd){
-				num_nonzero_points_f++;
-			}
 
-			ImageType::IndexType ind = fixedIt.GetIndex();
-			if(ind[0]>max_x_f){
-			   max_x_f=ind[0];
-			}
-			if(ind[1]>max_y_f){
-			   max_y_f=ind[1];
-			}
-			if(ind[2]>max_z_f){
-			   max_z_f=ind[2];
-			}
-			++fixedIt;
-		}
+		AccumulatorSettings settings;
+		settings.fuzzy = fuzzy;
+		settings.threshold = threshold;
+		settings.vspx = vspx;
+		settings.vspy = vspy;
+		settings.vspz = vspz;
+		voxelMetrics.Init(settings, artifacts | ARTIFACT_CONTINGENCY);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		sweepImages(fixedImage, movingImage, voxelMetrics);
+		passSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		const ForegroundCounts &counts = voxelMetrics.Get<ForegroundCounts>();
+		num_nonzero_points_f = counts.num_nonzero_points_f;
+		num_nonzero_points_m = counts.num_nonzero_points_m;
+		num_intersection = counts.num_intersection;
+	}
 
-		numberElements_m = 0;
-		num_nonzero_points_m=0;
-		movingIt.GoToBegin();
-		while (!movingIt.IsAtEnd()){
-			numberElements_m++;
-		   if(movingIt.Get()>thd){
-				num_nonzero_points_m++;
-			}
-		   ImageType::IndexType ind = movingIt.GetIndex();
-			if(ind[0]>max_x_m){
-			   max_x_m=ind[0];
-			}
-			if(ind[1]>max_y_m){
-			   max_y_m=ind[1];
-			}
-			if(ind[2]>max_z_m){
-			   max_z_m=ind[2];
-			}
+	// voxels per second and thread of the pass over the images
+	double GetVoxelRate(){
+		return numberElements_f / (std::max(passSeconds, 1e-4) * getNumberOfThreads());
+	}
 
-			++movingIt;
+	/*
+	// The bounding box of the foreground of both images with a margin of one voxel, so that the
+	// surfaces are found as in the whole images, and the work of the distance metrics scanning it.
+	// Returns false if ARTIFACT_DISTANCE_WORKLOAD was not requested.
+	*/
+	bool GetDistanceWorkload(const ImageType::RegionType &imageRegion, ImageType::RegionType &region, DistanceWorkload &workload){
+		if(!voxelMetrics.IsEnabled<ForegroundBox>() || voxelMetrics.Get<ForegroundBox>().IsEmpty()){
+			return false;
 		}
-
-		num_intersection=0;
-		movingIt.GoToBegin();
-		fixedIt.GoToBegin();
-		while (!movingIt.IsAtEnd() && !fixedIt.IsAtEnd()){
-		   if(movingIt.Get()>thd && fixedIt.Get()>thd){
-				num_intersection++;
-			}
-			++movingIt;
-			++fixedIt;
+		const ForegroundBox &box = voxelMetrics.Get<ForegroundBox>();
+		const SurfaceEstimate &surface = voxelMetrics.Get<SurfaceEstimate>();
+		double gap2 = 0;
+		double extent_f = 0;
+		double extent_m = 0;
+		for(int i = 0; i < 3; i++){
+			region.SetIndex(i, box.GetMin(i));
+			region.SetSize(i, box.GetMax(i) - box.GetMin(i) + 1);
+			double gap = std::max(0LL, std::max(box.min_m[i] - box.max_f[i], box.min_f[i] - box.max_m[i]));
+			gap2 += gap*gap;
+			extent_f = std::max(extent_f, (double)(box.max_f[i] - box.min_f[i] + 1));
+			extent_m = std::max(extent_m, (double)(box.max_m[i] - box.min_m[i] + 1));
 		}
+		region.PadByRadius(1);
+		region.Crop(imageRegion);
+
+		workload.numberElements = region.GetNumberOfPixels();
+		workload.num_nonzero_points_f = num_nonzero_points_f;
+		workload.num_nonzero_points_m = num_nonzero_points_m;
+		workload.num_intersection = num_intersection;
+		workload.surface_f = surface.GetSurfaceVoxels_f();
+		workload.surface_m = surface.GetSurfaceVoxels_m();
+		workload.extent_f = extent_f;
+		workload.extent_m = extent_m;
+		workload.separation = std::sqrt(gap2);
+		workload.extent = std::max(region.GetSize(0), std::max(region.GetSize(1), region.GetSize(2)));
+		workload.dimension = size_f[2] > 1 ? 3 : 2;
+		return true;
 	}
 
-
-
+	// the images are compared voxel by voxel, so they must have the same size along each axis
+	bool IsDifferentImageSize(){
+		return size_f != size_m;
+	}
 };
 
 #endif
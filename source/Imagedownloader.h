@@ -1,36 +1,69 @@
 /*
 // Imagedownloader.h
-// 
+//
 // Description:
 //
-// This file enables evaluating files in the network (e.g. on the web) by referencing them using URL 
-// without explicitly downloading them. Note that these functions use sockets which are differently 
+// This file enables evaluating files in the network (e.g. on the web) by referencing them using URL
+// without explicitly downloading them. Note that these functions use sockets which are differently
 // handled in windows and UNIX OS. This is why some code parts are seperated by compiler switches
 //
+// HttpByteSource streams the body of an HTTP response (with Content-Length, chunked, or delimited by
+// closing the connection) through a large receive buffer, so that NIfTI images are decoded while
+// they are received, without writing them to disk. Other formats are downloaded to a temporary file
+// with a name unique to the process, so that concurrent runs in one directory do not collide,
+// through a partial file named after the url, so that an interrupted download is resumed.
+// Bodies fetched ahead (see HttpFetcher.h) are taken from the prefetch cache.
+//
+// Files are downloaded with RangedDownload: if the server supports byte ranges, a large file is
+// fetched as several ranges over concurrent connections, written into place. A range that fails is
+// fetched again, and an interrupted download is resumed from the ranges recorded in its journal.
+//
 */
 
 #ifndef _IMAGEDOWNLOADER
 #define _IMAGEDOWNLOADER
 
-#include <iostream> 
-#include <fstream> 
-#include <stdexcept> 
-#include <sstream> 
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "ByteSource.h"
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__TOS_WIN__)
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
 #define _WINOS
 #else
 #include <sys/types.h>
-#include <sys/socket.h> 
-#include <arpa/inet.h> 
-#include <netdb.h> 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
-#include <errno.h> 
-#endif 
+#include <errno.h>
+#endif
+
+// receive buffer of the socket, the body of a response is read in blocks of BYTESOURCE_BUFFER_SIZE
+static const int HTTP_RECEIVE_WINDOW = 1024*1024;
+static const int HTTP_MAX_REDIRECTS = 5;
+// downloads are split into ranges of httpRangeSize bytes, fetched over httpRangeConnections connections
+static long long httpRangeSize = 16LL*1024*1024;
+static int httpRangeConnections = 4;
+static const int HTTP_RANGE_RETRIES = 3;
 
 std::runtime_error CreateSocketError()
 {
@@ -62,11 +95,11 @@ std::runtime_error CreateSocketError()
 
 void SendAll(int socket, const char* const buf, const int size)
 {
-    int bytesSent = 0; 
+    int bytesSent = 0;
     do
     {
         int result = send(socket, buf + bytesSent, size - bytesSent, 0);
-        if(result < 0) 
+        if(result < 0)
         {
             throw CreateSocketError();
         }
@@ -74,315 +107,972 @@ void SendAll(int socket, const char* const buf, const int size)
     } while(bytesSent < size);
 }
 
-std::string globalBuffer; 
-
-
-void GetLine(int socket, std::stringstream& line)
+void CloseSocket(int socket)
 {
-    char buf[1024];
-    int recvSize;
-    std::string::size_type pos;
-    while((pos = globalBuffer.find('\n')) == std::string::npos)
-    {
-        if((recvSize = recv(socket, buf, sizeof(buf), 0)) <= 0)
-        {
-            throw CreateSocketError();
-        }
-        globalBuffer.append(buf, recvSize);
-    }
-    line << globalBuffer.substr(0, pos);
-    globalBuffer.erase(0, pos + 1);
+#ifndef  _WINOS
+    close(socket);
+#else
+    closesocket(socket);
+#endif
 }
 
-int Recv(int socket, char *buf, int len, unsigned int flags) 
+/*
+// Splits http://host[:port]/path into its parts, returns false for other schemes
+*/
+bool ParseHttpUrl(const std::string& url, std::string& hostname, std::string& port, std::string& path)
 {
-    if(!globalBuffer.empty())
+    std::string rest = url;
+    if(rest.compare(0, 7, "http://") != 0)
     {
-        int copySize = len <= globalBuffer.size() ? len : globalBuffer.size();
-        globalBuffer.copy(reinterpret_cast<char*>(buf), copySize);
-        globalBuffer.erase(0, copySize);
-        return copySize;
+        return false;
+    }
+    rest.erase(0, 7);
+    size_t pos = rest.find("/");
+    std::string authority = pos == std::string::npos ? rest : rest.substr(0, pos);
+    path = pos == std::string::npos ? "/" : rest.substr(pos);
+    // user info is not supported, IPv6 literals are given in brackets
+    size_t colon = authority.rfind(":");
+    if(colon != std::string::npos && authority.find("]", colon) == std::string::npos)
+    {
+        hostname = authority.substr(0, colon);
+        port = authority.substr(colon + 1);
     }
     else
     {
-        return recv(socket, buf, len, flags);
+        hostname = authority;
+        port = "80";
+    }
+    if(hostname.size() > 1 && hostname[0] == '[')
+    {
+        hostname = hostname.substr(1, hostname.size() - 2);
     }
+    return !hostname.empty();
 }
 
-
-void RemoveHttp(std::string& URL)
+int ConnectToHost(const std::string& hostname, const std::string& port)
 {
-    size_t pos = URL.find("http://");
-    if(pos != std::string::npos)
+#ifdef _WINOS
+    WSADATA w;
+    if(int result = WSAStartup(MAKEWORD(2,2), &w) != 0)
+    {
+        std::ostringstream message;
+        message << "Winsock 2 can not be started, error #" << result;
+        throw std::runtime_error(message.str());
+    }
+#endif
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = NULL;
+    if(getaddrinfo(hostname.c_str(), port.c_str(), &hints, &addresses) != 0 || addresses == NULL)
+    {
+        throw std::runtime_error("Host can not be resolved: " + hostname);
+    }
+    int Socket = -1;
+    for(addrinfo* a = addresses; a != NULL && Socket == -1; a = a->ai_next)
     {
-        URL.erase(0, 7);
+        Socket = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if(Socket == -1)
+        {
+            continue;
+        }
+        int window = HTTP_RECEIVE_WINDOW;
+        setsockopt(Socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&window), sizeof(window));
+        if(connect(Socket, a->ai_addr, a->ai_addrlen) == -1)
+        {
+            CloseSocket(Socket);
+            Socket = -1;
+        }
     }
+    freeaddrinfo(addresses);
+    if(Socket == -1)
+    {
+        throw std::runtime_error("connection not successful: " + hostname + ":" + port);
+    }
+    return Socket;
 }
 
-
-std::string GetFileEnding(std::string& URL)
+/*
+// Body of the response to an HTTP GET request, read sequentially from the socket. Redirects are
+// followed; responses other than 200, 206 (to a Range request) and 304 throw an exception.
+*/
+class HttpByteSource : public ByteSource
 {
-    using namespace std;
-    size_t pos = URL.rfind(".");
-    if(pos == string::npos)
+private:
+    int socket;
+    std::vector<char> buffer;
+    size_t bufferPos;
+    size_t bufferEnd;
+    bool chunked;
+    bool finished;
+    // bytes left in the body (Content-Length) or in the current chunk, -1 if unknown
+    long long remaining;
+
+    // receives into the buffer, returns false if the connection was closed
+    bool Fill()
     {
-        return "";
+        bufferPos = 0;
+        bufferEnd = 0;
+        int bytesRecv = recv(socket, &buffer[0], buffer.size(), 0);
+        if(bytesRecv < 0)
+        {
+            throw CreateSocketError();
+        }
+        bufferEnd = bytesRecv;
+        return bytesRecv > 0;
     }
-    URL.erase(0, pos);
-    string ending = ".";
 
-    for(string::iterator it = URL.begin() + 1; it != URL.end(); ++it)
+    std::string GetLine()
     {
-        if(isalpha(*it))
+        std::string line;
+        while(true)
         {
-            ending += *it;
+            if(bufferPos == bufferEnd && !Fill())
+            {
+                throw std::runtime_error("Connection closed by the server");
+            }
+            char c = buffer[bufferPos++];
+            if(c == '\n')
+            {
+                break;
+            }
+            if(c != '\r')
+            {
+                line += c;
+            }
         }
-        else
+        return line;
+    }
+
+    void Open(const std::string& url, int redirects)
+    {
+        std::string hostname, port, path;
+        if(!ParseHttpUrl(url, hostname, port, path))
         {
-            break;
+            throw std::runtime_error("Only http URLs are supported: " + url);
         }
-    }
-    return ending;
-}
+        socket = ConnectToHost(hostname, port);
+        bufferPos = 0;
+        bufferEnd = 0;
 
+        std::string host = port == "80" ? hostname : hostname + ":" + port;
+        std::string request = "GET " + path + " HTTP/1.1\r\n";
+        request += "Host: " + host + "\r\nConnection: close\r\n";
+        for(size_t i = 0; i < requestHeaders.size(); i++)
+        {
+            request += requestHeaders[i] + "\r\n";
+        }
+        request += "\r\n";
+        SendAll(socket, request.c_str(), request.size());
 
-std::string RemoveHostname(std::string& URL)
-{
-    size_t pos = URL.find("/");
-    if(pos == std::string::npos)
-    {
-        std::string temp = URL;
-        URL = "/";
-        return temp;
+        int code = 100;
+        while(code == 100)
+        {
+            std::stringstream firstLine(GetLine());
+            std::string protocol;
+            firstLine >> protocol >> code;
+            if(code == 100)
+            {
+                // interim response, skip its (empty) header
+                while(GetLine() != "")
+                {
+                }
+            }
+            else
+            {
+                firstLine.ignore();
+                getline(firstLine, reason);
+            }
+        }
+        status = code;
+
+        std::string location;
+        while(true)
+        {
+            std::string line = GetLine();
+            if(line == "")
+            {
+                break;
+            }
+            size_t colon = line.find(':');
+            if(colon == std::string::npos)
+            {
+                continue;
+            }
+            std::string name = line.substr(0, colon);
+            for(size_t i = 0; i < name.size(); i++)
+            {
+                name[i] = tolower(name[i]);
+            }
+            size_t start = line.find_first_not_of(" \t", colon + 1);
+            std::string value = start == std::string::npos ? "" : line.substr(start);
+            if(name == "content-length")
+            {
+                contentLength = atoll(value.c_str());
+            }
+            else if(name == "transfer-encoding" && value.find("chunked") != std::string::npos)
+            {
+                chunked = true;
+            }
+            else if(name == "location")
+            {
+                location = value;
+            }
+            else if(name == "etag")
+            {
+                etag = value;
+            }
+            else if(name == "last-modified")
+            {
+                lastModified = value;
+            }
+            else if(name == "content-range")
+            {
+                // bytes <first>-<last>/<total or *>
+                size_t dash = value.find('-');
+                size_t slash = value.find('/');
+                if(value.compare(0, 6, "bytes ") == 0 && dash != std::string::npos && slash != std::string::npos)
+                {
+                    rangeStart = atoll(value.c_str() + 6);
+                    totalLength = value[slash + 1] == '*' ? -1 : atoll(value.c_str() + slash + 1);
+                }
+            }
+        }
+
+        if((code == 301 || code == 302 || code == 303 || code == 307 || code == 308) && location != "")
+        {
+            CloseSocket(socket);
+            socket = -1;
+            if(redirects >= HTTP_MAX_REDIRECTS)
+            {
+                throw std::runtime_error("Too many redirects: " + url);
+            }
+            if(location[0] == '/')
+            {
+                location = "http://" + host + location;
+            }
+            chunked = false;
+            contentLength = -1;
+            rangeStart = 0;
+            totalLength = -1;
+            etag = "";
+            lastModified = "";
+            Open(location, redirects + 1);
+            return;
+        }
+        if(code == 304)
+        {
+            // not modified (conditional request), there is no body
+            finished = true;
+            return;
+        }
+        if(code != 200 && code != 206)
+        {
+            std::ostringstream message;
+            message << "Error #" << code << " - " << reason;
+            throw std::runtime_error(message.str());
+        }
+        remaining = chunked ? 0 : contentLength;
     }
-    std::string temp = URL.substr(0, pos);
-    URL.erase(0, pos);
-    return temp;
-}
 
-std::string download_image(const char* url, std::string filename)
-{
-    using namespace std;
+public:
+    int status;
+    std::string reason;
+    long long contentLength;
+    // position of the body in the file and size of the file for status 206 (partial content),
+    // totalLength is -1 if unknown
+    long long rangeStart;
+    long long totalLength;
+    // validators of the response for conditional requests, empty if not sent by the server
+    std::string etag;
+    std::string lastModified;
+    // additional header lines of the request, e.g. "If-None-Match: ..."
+    std::vector<std::string> requestHeaders;
 
- 
-	string URL = url;
-    
-    
+    // requestHeaders are sent with the request (and its redirects). Status 304 (for conditional
+    // requests) gives an empty body.
+    HttpByteSource(const std::string& url, const std::vector<std::string>& requestHeaders = std::vector<std::string>())
+    {
+        this->requestHeaders = requestHeaders;
+        socket = -1;
+        buffer.resize(BYTESOURCE_BUFFER_SIZE);
+        chunked = false;
+        finished = false;
+        remaining = -1;
+        contentLength = -1;
+        rangeStart = 0;
+        totalLength = -1;
+        status = 0;
+        try
+        {
+            Open(url, 0);
+        }
+        catch(...)
+        {
+            if(socket != -1)
+            {
+                CloseSocket(socket);
+            }
+            throw;
+        }
+    }
 
-#ifdef _WINOS
-    WSADATA w;
-    if(int result = WSAStartup(MAKEWORD(2,2), &w) != 0)
+    ~HttpByteSource()
     {
-        cout << "Winsock 2 can not be started, error #" << result << endl;
-        return "";
+        if(socket != -1)
+        {
+            CloseSocket(socket);
+        }
     }
-#endif
 
-    RemoveHttp(URL);
+    long long Read(char *buf, long long len)
+    {
+        if(finished || len <= 0)
+        {
+            return 0;
+        }
+        if(chunked && remaining == 0)
+        {
+            // chunk size line, the previous chunk is followed by an empty line
+            std::string line = GetLine();
+            if(line == "")
+            {
+                line = GetLine();
+            }
+            remaining = strtoll(line.c_str(), NULL, 16);
+            if(remaining <= 0)
+            {
+                finished = true;
+                return 0;
+            }
+        }
+        if(remaining == 0)
+        {
+            finished = true;
+            return 0;
+        }
+        if(remaining > 0 && len > remaining)
+        {
+            len = remaining;
+        }
+
+        long long n;
+        if(bufferPos < bufferEnd)
+        {
+            n = std::min<long long>(len, bufferEnd - bufferPos);
+            memcpy(buf, &buffer[bufferPos], n);
+            bufferPos += n;
+        }
+        else
+        {
+            // large reads bypass the buffer
+            n = recv(socket, buf, (int)std::min<long long>(len, 1 << 30), 0);
+            if(n < 0)
+            {
+                throw CreateSocketError();
+            }
+            if(n == 0)
+            {
+                finished = true;
+                if(remaining > 0)
+                {
+                    throw std::runtime_error("Connection closed before the end of the body");
+                }
+                return 0;
+            }
+        }
+        if(remaining > 0)
+        {
+            remaining -= n;
+        }
+        return n;
+    }
+};
 
-    string hostname = RemoveHostname(URL);
+typedef struct HttpResponse
+{
+    std::string url;
+    int status;
+    std::vector<char> body;
+    // empty if the body was received completely
+    std::string error;
+} HttpResponse;
 
-    hostent* phe = gethostbyname(hostname.c_str());
+/*
+// Responses of urls fetched ahead, kept until they are taken by the reader
+*/
+class PrefetchCache
+{
+private:
+    std::mutex mutex;
+    std::condition_variable fetched;
+    // NULL while the url is being fetched
+    std::map<std::string, HttpResponse*> responses;
 
-    if(phe == NULL)
+public:
+    // announces that url will be fetched
+    void Expect(const std::string& url)
     {
-        cout << "Host can not be resolved!" << endl;
-        return "";
+        std::lock_guard<std::mutex> lock(mutex);
+        if(responses.count(url) == 0)
+        {
+            responses[url] = NULL;
+        }
     }
 
-    if(phe->h_addrtype != AF_INET)
+    void Put(HttpResponse& response)
     {
-        cout << "invalid address type!" << endl;
-        return "";
+        std::lock_guard<std::mutex> lock(mutex);
+        HttpResponse* stored = new HttpResponse();
+        stored->url = response.url;
+        stored->status = response.status;
+        stored->error = response.error;
+        stored->body.swap(response.body);
+        delete responses[response.url];
+        responses[response.url] = stored;
+        fetched.notify_all();
     }
 
-    if(phe->h_length != 4)
+    // takes the response of a prefetched url, waiting while it is being fetched. Returns false if
+    // the url was not prefetched.
+    bool Take(const std::string& url, HttpResponse& response)
     {
-        cout << "invalid IP-Type!" << endl;
-        return "";
+        std::unique_lock<std::mutex> lock(mutex);
+        if(responses.count(url) == 0)
+        {
+            return false;
+        }
+        fetched.wait(lock, [&](){ return responses.count(url) == 0 || responses[url] != NULL; });
+        if(responses.count(url) == 0)
+        {
+            return false;
+        }
+        HttpResponse* stored = responses[url];
+        responses.erase(url);
+        response.url = stored->url;
+        response.status = stored->status;
+        response.error = stored->error;
+        response.body.swap(stored->body);
+        delete stored;
+        return true;
     }
+};
 
-    int Socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(Socket == -1)
+static PrefetchCache urlPrefetchCache;
+
+// 64 bit FNV-1a hash of the url as 16 hex digits
+std::string urlCacheKey(const std::string& url)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < url.size(); i++)
     {
-        cout << "Socket cannot be created!" << endl;
-        return "";
+        hash ^= (unsigned char)url[i];
+        hash *= 1099511628211ULL;
     }
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", hash);
+    return key;
+}
 
-    sockaddr_in service;
-    service.sin_family = AF_INET;
-    service.sin_port = htons(80); 
+/*
+// Advisory lock on a file, released when the object is destroyed
+*/
+class FileLock
+{
+private:
+    int fd;
 
-    char** p = phe->h_addr_list; 
-    int result; 
-    do
+public:
+    bool locked;
+
+    // wait=false returns immediately with locked=false if the lock is held by another process
+    FileLock(const std::string& path, bool exclusive, bool wait = true)
     {
-        if(*p == NULL) 
+        fd = -1;
+        locked = false;
+#ifndef _WINOS
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+        if(fd < 0)
         {
-            cout << "connection not successful!" << endl;
-            return "";
+            return;
         }
+        int operation = (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB);
+        locked = flock(fd, operation) == 0;
+#else
+        locked = true;
+#endif
+    }
 
-        service.sin_addr.s_addr = *reinterpret_cast<unsigned long*>(*p);
-        ++p;
-        result = connect(Socket, reinterpret_cast<sockaddr*>(&service), sizeof(service));
+    ~FileLock()
+    {
+#ifndef _WINOS
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+#endif
     }
-    while(result == -1);
+};
 
+/*
+// Downloads url into path. The first request asks for the first range; if the server answers with
+// 206 (partial content), the file is fetched as ranges of httpRangeSize bytes over up to
+// httpRangeConnections concurrent connections, each range written into place in the partial file
+// (path.part unless given). Every completed range is recorded in the journal <partial>.journal, so
+// a range that fails is fetched again, and an interrupted download is resumed from the completed
+// ranges if the file on the server did not change (same length and ETag/Last-Modified). Servers
+// without range support are read sequentially. The partial file is renamed to path when all ranges
+// are complete; failures throw and keep the partial file and its journal.
+*/
+class RangedDownload
+{
+private:
+    std::string partPath;
+    std::string journalPath;
+    long long rangeSize;
+    std::vector<bool> done;
+    size_t nextRange;
+    std::string error;
+    std::mutex mutex;
 
-    string request = "GET ";
-    request += URL;    // 
-    request += " HTTP/1.1\n";
-    request += "Host: " + hostname + "\nConnection: close\n\n";
+    std::vector<std::string> RangeHeaders(size_t i)
+    {
+        long long start = i * rangeSize;
+        long long end = std::min(start + rangeSize, totalLength) - 1;
+        std::ostringstream range;
+        range << "Range: bytes=" << start << "-" << end;
+        std::vector<std::string> headers(1, range.str());
+        // the server sends the whole (changed) file instead of the range if the validator differs
+        if(etag != "" && etag.compare(0, 2, "W/") != 0)
+        {
+            headers.push_back("If-Range: " + etag);
+        }
+        else if(lastModified != "")
+        {
+            headers.push_back("If-Range: " + lastModified);
+        }
+        return headers;
+    }
 
-    try
+    // loads the completed ranges of an earlier attempt, returns false if there are none or the
+    // file changed since
+    bool ReadJournal()
     {
-        SendAll(Socket, request.c_str(), request.size());
-        int code = 100; 
-        string Protokoll;
-        stringstream firstLine; 
-        while(code == 100)
+        std::ifstream in(journalPath.c_str());
+        std::string line;
+        std::string journalUrl, journalEtag, journalLastModified;
+        long long journalLength = -1, journalRangeSize = -1;
+        std::vector<size_t> completed;
+        while(std::getline(in, line))
         {
-            GetLine(Socket, firstLine);
-            firstLine >> Protokoll;
-            firstLine >> code;
-            if(code == 100)
+            if(in.eof())
+            {
+                // last line without newline, written partially
+                break;
+            }
+            size_t space = line.find(' ');
+            std::string key = line.substr(0, space);
+            std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+            if(key == "url")
+            {
+                journalUrl = value;
+            }
+            else if(key == "length")
+            {
+                journalLength = atoll(value.c_str());
+            }
+            else if(key == "range-size")
+            {
+                journalRangeSize = atoll(value.c_str());
+            }
+            else if(key == "etag")
+            {
+                journalEtag = value;
+            }
+            else if(key == "last-modified")
+            {
+                journalLastModified = value;
+            }
+            else if(key == "done")
             {
-                GetLine(Socket, firstLine); 
+                completed.push_back(atoll(value.c_str()));
             }
         }
-        
+        std::ifstream part(partPath.c_str(), std::ios::binary | std::ios::ate);
+        if(journalUrl != url || journalLength != totalLength || journalRangeSize != rangeSize
+            || (etag == "" && lastModified == "") || journalEtag != etag || journalLastModified != lastModified
+            || !part || (long long)part.tellg() != totalLength)
+        {
+            return false;
+        }
+        for(size_t i = 0; i < completed.size(); i++)
+        {
+            if(completed[i] < done.size())
+            {
+                done[completed[i]] = true;
+            }
+        }
+        return true;
+    }
 
-        if(code != 200)
+    // creates path.part with the size of the file and a new journal
+    void StartJournal()
+    {
         {
-            firstLine.ignore(); 
-            string msg;
-            getline(firstLine, msg);
-            cout << "Error #" << code << " - " << msg << endl;
-            return "";
+            std::ofstream part(partPath.c_str(), std::ios::binary | std::ios::trunc);
+            if(totalLength > 0)
+            {
+                part.seekp(totalLength - 1);
+                part.put(0);
+            }
+            if(!part)
+            {
+                throw std::runtime_error("Could Not Create File: " + partPath);
+            }
+        }
+        std::ofstream journal(journalPath.c_str(), std::ios::trunc);
+        journal << "url " << url << "\n" << "length " << totalLength << "\n" << "range-size " << rangeSize << "\n";
+        journal << "etag " << etag << "\n" << "last-modified " << lastModified << "\n";
+        if(!journal)
+        {
+            throw std::runtime_error("Could Not Create File: " + journalPath);
         }
+    }
 
-        bool chunked = false;
-        const int noSizeGiven = -1;
-        int size = noSizeGiven;
+    void MarkDone(size_t i)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[i] = true;
+        std::ofstream journal(journalPath.c_str(), std::ios::app);
+        journal << "done " << i << "\n";
+    }
 
-        while(true)
+    // writes the body of the response to range i into place
+    void WriteRange(size_t i, HttpByteSource& source)
+    {
+        long long start = i * rangeSize;
+        long long length = std::min(rangeSize, totalLength - start);
+        if(source.status != 206)
         {
-            stringstream sstream;
-            GetLine(Socket, sstream);
-            if(sstream.str() == "\r") 
+            throw std::runtime_error("File changed during the download: " + url);
+        }
+        if(source.rangeStart != start || source.contentLength != length)
+        {
+            throw std::runtime_error("Unexpected range in the response: " + url);
+        }
+        {
+            std::fstream part(partPath.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            part.seekp(start);
+            std::vector<char> buf(BYTESOURCE_BUFFER_SIZE);
+            long long received = 0;
+            long long n;
+            while(received < length && (n = source.Read(&buf[0], std::min<long long>(buf.size(), length - received))) > 0)
             {
-                break;
+                part.write(&buf[0], n);
+                received += n;
             }
-            string left; 
-            sstream >> left;
-            sstream.ignore(); 
-            if(left == "Content-Length:")
+            if(received < length)
             {
-                sstream >> size;
+                throw std::runtime_error("Connection closed before the end of the range");
             }
-            if(left == "Transfer-Encoding:")
+            part.close();
+            if(part.fail())
             {
-                string transferEncoding;
-                sstream >> transferEncoding;
-                if(transferEncoding == "chunked")
-                {
-                    chunked = true;
-                }
+                throw std::runtime_error("Could not write to " + partPath);
             }
         }
+        MarkDone(i);
+    }
 
-		int ind = URL.find("nii.gz");
-   if( ind != string::npos){
-      filename = filename + ".gz";
-   }
-
-        fstream fout(filename.c_str(), ios::binary | ios::out);
-        if(!fout)
+    void FetchRange(size_t i)
+    {
+        for(int attempt = 1; ; attempt++)
         {
-            cout << "Could Not Create File!" << endl;
-            return "";
+            try
+            {
+                HttpByteSource source(url, RangeHeaders(i));
+                WriteRange(i, source);
+                return;
+            }
+            catch(std::exception&)
+            {
+                if(attempt >= HTTP_RANGE_RETRIES)
+                {
+                    throw;
+                }
+            }
         }
-        int recvSize = 0; 
-        char buf[1024];
-        int bytesRecv = -1; 
+    }
 
-        if(size != noSizeGiven) 
+    // fetches the next ranges that are not complete until there are none left or one failed
+    void Work()
+    {
+        while(true)
         {
-           // cout << "0%";
-            while(recvSize < size)
+            size_t i;
             {
-                if((bytesRecv = Recv(Socket, buf, sizeof(buf), 0)) <= 0)
+                std::lock_guard<std::mutex> lock(mutex);
+                while(nextRange < done.size() && done[nextRange])
                 {
-                    throw CreateSocketError();
+                    nextRange++;
                 }
-                recvSize += bytesRecv;
-                fout.write(buf, bytesRecv);
-               // cout << "\r" << recvSize * 100 / size << "%" << flush; 
+                if(nextRange >= done.size() || error != "")
+                {
+                    return;
+                }
+                i = nextRange++;
             }
+            try
+            {
+                FetchRange(i);
+            }
+            catch(std::exception& e)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = e.what();
+                return;
+            }
+        }
+    }
+
+    void ReadSequentially(HttpByteSource& source)
+    {
+        if(source.contentLength < 0)
+        {
+            std::cout << "Downloading... (Unknown Filesize)" << std::endl;
+        }
+        std::ofstream part(partPath.c_str(), std::ios::binary | std::ios::trunc);
+        if(!part)
+        {
+            throw std::runtime_error("Could Not Create File: " + partPath);
+        }
+        std::vector<char> buf(BYTESOURCE_BUFFER_SIZE);
+        long long n;
+        while((n = source.Read(&buf[0], buf.size())) > 0)
+        {
+            part.write(&buf[0], n);
+        }
+        part.close();
+        if(part.fail())
+        {
+            throw std::runtime_error("Could not write to " + partPath);
+        }
+    }
+
+public:
+    std::string url;
+    std::string path;
+    // size of the file, ETag and Last-Modified of the response
+    long long totalLength;
+    std::string etag;
+    std::string lastModified;
+
+    RangedDownload(const std::string& url, const std::string& path, const std::string& partPath = "")
+    {
+        this->url = url;
+        this->path = path;
+        this->partPath = partPath != "" ? partPath : path + ".part";
+        journalPath = partPath + ".journal";
+        rangeSize = httpRangeSize;
+        nextRange = 0;
+        totalLength = -1;
+    }
+
+    // headers of the request of the first range, to which the caller may add conditions
+    std::vector<std::string> FirstRangeHeaders()
+    {
+        std::ostringstream range;
+        range << "Range: bytes=0-" << rangeSize - 1;
+        return std::vector<std::string>(1, range.str());
+    }
+
+    void Run()
+    {
+        HttpByteSource first(url, FirstRangeHeaders());
+        Run(first);
+    }
+
+    /*
+    // Downloads the file from the response to a request with FirstRangeHeaders() (and possibly
+    // conditions, see UrlCache.h): its body is the first range of a ranged download (206) or the
+    // whole file, which is then written as it is received, without requesting it again.
+    */
+    void Run(HttpByteSource& first)
+    {
+        etag = first.etag;
+        lastModified = first.lastModified;
+        if(first.status != 206 || first.totalLength < 0)
+        {
+            ReadSequentially(first);
         }
         else
         {
-            if(!chunked)
+            totalLength = first.totalLength;
+            size_t ranges = (size_t)((totalLength + rangeSize - 1) / rangeSize);
+            done.assign(ranges, false);
+            if(ReadJournal())
             {
-                cout << "Downloading... (Unknown Filesize)" << endl;
-                while(bytesRecv != 0) 
-                {
-                    if((bytesRecv = Recv(Socket, buf, sizeof(buf), 0)) < 0)
-                    {
-                        throw CreateSocketError();
-                    }
-                    fout.write(buf, bytesRecv);
-                }
+                size_t completed = std::count(done.begin(), done.end(), true);
+                std::cout << "Resuming the download of " << url << " (" << completed << " of " << ranges << " ranges complete)" << std::endl;
             }
             else
             {
-                cout << "Downloading... (Chunked)" << endl;
-                while(true)
+                StartJournal();
+            }
+            if(ranges > 1)
+            {
+                std::cout << "Downloading " << totalLength << " bytes in " << ranges << " ranges" << std::endl;
+            }
+
+            // the first range is read from this response while the others are fetched
+            nextRange = 1;
+            std::vector<std::thread> workers;
+            for(int t = 1; t < httpRangeConnections && t < (int)ranges; t++)
+            {
+                workers.push_back(std::thread(&RangedDownload::Work, this));
+            }
+            if(!done[0])
+            {
+                try
                 {
-                    stringstream sstream;
-                    GetLine(Socket, sstream);
-                    int chunkSize = -1;
-                    sstream >> hex >> chunkSize; 
-                    if(chunkSize <= 0)
+                    try
                     {
-                        break;
+                        WriteRange(0, first);
                     }
-                    cout << "Downloading Part (" << chunkSize << " Bytes)... " << endl;
-                    recvSize = 0; 
-                    while(recvSize < chunkSize)
+                    catch(std::exception&)
                     {
-                        int bytesToRecv = chunkSize - recvSize;
-                        if((bytesRecv = Recv(Socket, buf, bytesToRecv > sizeof(buf) ? sizeof(buf) : bytesToRecv, 0)) <= 0)
-                        {
-                            throw CreateSocketError();
-                        }
-                        recvSize += bytesRecv;
-                        fout.write(buf, bytesRecv);
-                        cout << "\r" << recvSize * 100 / chunkSize << "%" << flush;
-                    }
-                    cout << endl;
-                    for(int i = 0; i < 2; ++i)
-                    {
-                        char temp;
-                        recv(Socket, &temp, 1, 0);
+                        FetchRange(0);
                     }
                 }
+                catch(std::exception& e)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = e.what();
+                }
+            }
+            Work();
+            for(size_t t = 0; t < workers.size(); t++)
+            {
+                workers[t].join();
             }
+            if(error != "")
+            {
+                throw std::runtime_error(error);
+            }
+        }
+        remove(path.c_str());
+        if(rename(partPath.c_str(), path.c_str()) != 0)
+        {
+            throw std::runtime_error("Could not write to " + path);
         }
-        
+        remove(journalPath.c_str());
     }
-    catch(exception& e)
+};
+
+// extension of the file addressed by url (e.g. .nii.gz, .mha), "" if it has none
+std::string UrlFileEnding(const char* url)
+{
+    std::string hostname, port, path;
+    if(!ParseHttpUrl(url, hostname, port, path))
     {
-        cout << endl;
-        cerr << e.what() << endl;
+        return "";
     }
-#ifndef  _WINOS
-    close(Socket); 
+    path.erase(std::min(path.find_first_of("?#"), path.size()));
+    size_t dot = path.find(".", path.rfind("/"));
+    return dot == std::string::npos ? "" : path.substr(dot);
+}
+
+/*
+// Name of a temporary file for the download of url, unique to the process: name_<pid>_<n>.ext,
+// where ext is the extension of the url (.nii.gz, .mha, ...) or that of name if url has none.
+*/
+std::string TemporaryDownloadName(const char* url, std::string filename)
+{
+    static int counter = 0;
+    std::string ending = UrlFileEnding(url);
+    size_t nameDot = filename.find(".");
+    std::string stem = filename.substr(0, nameDot);
+    if(ending == "" && nameDot != std::string::npos)
+    {
+        ending = filename.substr(nameDot);
+    }
+    std::ostringstream name;
+#ifndef _WINOS
+    name << stem << "_" << getpid() << "_" << counter++ << ending;
 #else
-    closesocket(Socket); 
+    name << stem << "_" << _getpid() << "_" << counter++ << ending;
 #endif
+    return name.str();
+}
+
+/*
+// Name of the partial file of the download of url next to filename: name_<hash of url>.ext.part,
+// the same in every run, so that a later run resumes an interrupted download (see RangedDownload).
+*/
+std::string PartialDownloadName(const char* url, std::string filename)
+{
+    std::string ending = UrlFileEnding(url);
+    size_t nameDot = filename.find(".");
+    if(ending == "" && nameDot != std::string::npos)
+    {
+        ending = filename.substr(nameDot);
+    }
+    return filename.substr(0, nameDot) + "_" + urlCacheKey(url) + ending + ".part";
+}
+
+/*
+// Downloads url into a temporary file named after filename (see TemporaryDownloadName), returns
+// the name of the file or "" if the download failed. The download goes through a partial file
+// named after the url (see PartialDownloadName), which is kept if the download fails, so that the
+// next run resumes it; concurrent runs take turns on it by a lock.
+*/
+std::string download_image(const char* url, std::string filename)
+{
+    using namespace std;
+    std::string partial = PartialDownloadName(url, filename);
+    filename = TemporaryDownloadName(url, filename);
+    HttpResponse response;
+    if(urlPrefetchCache.Take(url, response))
+    {
+        if(response.error != "")
+        {
+            cerr << response.error << endl;
+            return "";
+        }
+        fstream fout(filename.c_str(), ios::binary | ios::out);
+        if(!fout)
+        {
+            cout << "Could Not Create File!" << endl;
+            return "";
+        }
+        fout.write(response.body.empty() ? NULL : &response.body[0], response.body.size());
+        return filename;
+    }
+    try
+    {
+        FileLock lock(partial + ".lock", true);
+        RangedDownload download(url, filename, partial);
+        download.Run();
+    }
+    catch(exception& e)
+    {
+        cerr << e.what() << endl;
+        return "";
+    }
 	return filename;
 }
 
-#endif
\ No newline at end of file
+bool isNiftiUrl(const char* url)
+{
+    std::string path = url;
+    size_t query = path.find_first_of("?#");
+    if(query != std::string::npos)
+    {
+        path.erase(query);
+    }
+    return (path.size() >= 4 && path.compare(path.size() - 4, 4, ".nii") == 0)
+        || (path.size() >= 7 && path.compare(path.size() - 7, 7, ".nii.gz") == 0);
+}
+
+#endif
@@ -22,56 +22,92 @@
 // Description:
 //
 // This algorithm calculates the interclass correlation between two volumes.
-// The algorithm uses the overlap values from the class contingencyTable.
+// The sums are accumulated voxel by voxel in the pass over the images (see MetricAccumulators.h),
+// the sum of squares between the voxels is expanded, so no second pass for the means is needed.
 //  
 //
 */
 
+#ifndef _INTERCLASSCORRELATIONMETRIC
+#define _INTERCLASSCORRELATIONMETRIC
+
 #include "itkImage.h"
+#include "MetricAccumulators.h"
 
 class InterclassCorrelationMetric
 {
-	typedef itk::ImageRegionConstIterator<ImageType> FixedIteratorType;
-	typedef itk::ImageRegionConstIterator<ImageType> MovingIteratorType;
-
 private:
-  VoxelPreprocessor *voxelprocesser;
   bool fuzzy;
   double threshold;
+  long long numberElements;
+  double sum_f;     // sum of the values of the fixed image, scaled to [0,1]
+  double sum_m;     // sum of the values of the moving image, scaled to [0,1]
+  double ssw;       // sum of squares within the voxels
+  double sum_mean;  // sum and sum of squares of the means of the voxels
+  double sum_mean2;
+  double icc;
 public: 
-   	
+	static const unsigned artifacts = ARTIFACT_VOXEL_STATISTICS;
+
 	~InterclassCorrelationMetric(){
 
 	}
 
-	InterclassCorrelationMetric(VoxelPreprocessor *voxelprocesser, bool fuzzy, double threshold){
-		this->voxelprocesser= voxelprocesser;
-		this->fuzzy = fuzzy;
-        this->threshold = threshold;
+	InterclassCorrelationMetric(){
 	}
 
-	double CalcInterClassCorrelationCoeff(){
-		double mean_f = voxelprocesser->mean_f;
-		double mean_m = voxelprocesser->mean_m;
-		int numberElements = std::min(voxelprocesser->numberElements_f, voxelprocesser->numberElements_m);
+	void init(const AccumulatorSettings &settings){
+		fuzzy = settings.fuzzy;
+		threshold = settings.threshold;
+		numberElements = 0;
+		sum_f = 0;
+		sum_m = 0;
+		ssw = 0;
+		sum_mean = 0;
+		sum_mean2 = 0;
+		icc = 0;
+	}
 
-		double ssw = 0;
-		double ssb = 0;
-		double grandmean = (mean_f + mean_m)/2;
-		for (int i = 0; i < numberElements; i++)
+	void accumulate(const VoxelBlock &block){
+		for (long long i = 0; i < block.count; i++)
 		{
-			double val_f = values_f[i];
-			double val_m = values_m[i];
+			double val_f = preprocessVoxel(block.fixed[i], fuzzy, threshold);
+			double val_m = preprocessVoxel(block.moving[i], fuzzy, threshold);
 			double m = (val_f + val_m)/2;
+			sum_f += val_f/((double)PIXEL_VALUE_RANGE_MAX);
+			sum_m += val_m/((double)PIXEL_VALUE_RANGE_MAX);
 			ssw += pow(val_f - m, 2);
 			ssw += pow(val_m - m, 2);
-			ssb += pow(m - grandmean, 2);
+			sum_mean += m;
+			sum_mean2 += m*m;
 		}
-		ssw = ssw/numberElements;
+		numberElements += block.count;
+	}
+
+	void merge(const InterclassCorrelationMetric &other){
+		numberElements += other.numberElements;
+		sum_f += other.sum_f;
+		sum_m += other.sum_m;
+		ssw += other.ssw;
+		sum_mean += other.sum_mean;
+		sum_mean2 += other.sum_mean2;
+	}
+
+	void finalize(){
+		double mean_f = sum_f/numberElements;
+		double mean_m = sum_m/numberElements;
+		double grandmean = (mean_f + mean_m)/2;
+		// sum over the voxels of (m - grandmean)^2
+		double ssb = sum_mean2 - 2*grandmean*sum_mean + numberElements*grandmean*grandmean;
+		double ssw_n = ssw/numberElements;
 		ssb = ssb/(numberElements-1) * 2;
-		double icc = (ssb - ssw)/(ssb + ssw);
+		icc = (ssb - ssw_n)/(ssb + ssw_n);
+	}
+
+	double CalcInterClassCorrelationCoeff(){
 		return icc;
-	  }
+	}
 
 };
 
+#endif
@@ -0,0 +1,61 @@
+/*
+// JointHistogram.h
+//
+// Description:
+//
+// This file contains the joint histogram of the rescaled voxel values of two images, the result of
+// evaluations that do not assemble dense images (chunked arrays, sparse masks). The contingency
+// table, and thus all overlap based metrics, is built from it.
+//
+*/
+
+#ifndef _JOINTHISTOGRAM
+#define _JOINTHISTOGRAM
+
+#include <vector>
+#include "Global.h"
+
+static const int HISTOGRAM_BINS = PIXEL_VALUE_RANGE_MAX + 1;
+
+class JointHistogram
+{
+public:
+	// jointHistogram[f * HISTOGRAM_BINS + m] = number of voxels with the rescaled value f in the
+	// fixed and m in the moving image
+	std::vector<long long> jointHistogram;
+	long long numberElements;
+	long long num_nonzero_points_f;
+	long long num_nonzero_points_m;
+	long long num_intersection;
+	long long size[3];
+	double vspx; // Voxelspacing x
+	double vspy; // Voxelspacing y
+	double vspz; // Voxelspacing z
+
+	virtual ~JointHistogram(){
+	}
+
+	// foreground counts as computed by ImageStatistics
+	void CountForeground(bool fuzzy, double threshold){
+		double thd = fuzzy ? 0 : threshold * PIXEL_VALUE_RANGE_MAX;
+		num_nonzero_points_f = 0;
+		num_nonzero_points_m = 0;
+		num_intersection = 0;
+		for(int f = 0; f < HISTOGRAM_BINS; f++){
+			for(int m = 0; m < HISTOGRAM_BINS; m++){
+				long long n = jointHistogram[f * HISTOGRAM_BINS + m];
+				if(f > thd){
+					num_nonzero_points_f += n;
+				}
+				if(m > thd){
+					num_nonzero_points_m += n;
+				}
+				if(f > thd && m > thd){
+					num_intersection += n;
+				}
+			}
+		}
+	}
+};
+
+#endif
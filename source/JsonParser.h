@@ -0,0 +1,243 @@
+/*
+// JsonParser.h
+//
+// Description:
+//
+// This file contains a small JSON parser used to read the metadata of chunked arrays
+// (.zarray of Zarr arrays, attributes.json of N5 datasets). It builds a tree of JsonValue
+// nodes and supports the complete JSON syntax except for unicode escapes beyond latin-1.
+//
+*/
+
+#ifndef _JSONPARSER
+#define _JSONPARSER
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+class JsonValue
+{
+public:
+	enum JsonType {JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT};
+
+	JsonType type;
+	bool boolean;
+	double number;
+	std::string string;
+	// elements of an array
+	std::vector<JsonValue> items;
+	// keys and values of an object, in the order of the document
+	std::vector<std::string> keys;
+	std::vector<JsonValue> values;
+
+	JsonValue(){
+		type = JSON_NULL;
+		boolean = false;
+		number = 0;
+	}
+
+	bool IsNull() const{
+		return type == JSON_NULL;
+	}
+
+	// returns the member with the given key of an object, NULL if there is none
+	const JsonValue* Get(const std::string &key) const{
+		for(size_t i = 0; i < keys.size(); i++){
+			if(keys[i] == key){
+				return &values[i];
+			}
+		}
+		return NULL;
+	}
+};
+
+class JsonParser
+{
+private:
+	const std::string &text;
+	size_t pos;
+
+	void skipWhitespace(){
+		while(pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')){
+			pos++;
+		}
+	}
+
+	void fail(const char* message){
+		throw std::runtime_error(std::string("Invalid JSON: ") + message);
+	}
+
+	bool consume(const char* literal){
+		size_t len = strlen(literal);
+		if(text.compare(pos, len, literal) == 0){
+			pos += len;
+			return true;
+		}
+		return false;
+	}
+
+	std::string parseString(){
+		std::string s;
+		pos++;
+		while(pos < text.size() && text[pos] != '"'){
+			char c = text[pos++];
+			if(c == '\\'){
+				if(pos >= text.size()){
+					break;
+				}
+				c = text[pos++];
+				switch(c){
+					case 'n': s += '\n'; break;
+					case 't': s += '\t'; break;
+					case 'r': s += '\r'; break;
+					case 'b': s += '\b'; break;
+					case 'f': s += '\f'; break;
+					case 'u':
+						if(pos + 4 > text.size()){
+							fail("truncated escape");
+						}
+						s += (char)strtol(text.substr(pos, 4).c_str(), NULL, 16);
+						pos += 4;
+						break;
+					default: s += c;
+				}
+			}
+			else{
+				s += c;
+			}
+		}
+		if(pos >= text.size()){
+			fail("unterminated string");
+		}
+		pos++;
+		return s;
+	}
+
+	JsonValue parseValue(){
+		skipWhitespace();
+		if(pos >= text.size()){
+			fail("unexpected end");
+		}
+		JsonValue value;
+		char c = text[pos];
+		if(c == '{'){
+			value.type = JsonValue::JSON_OBJECT;
+			pos++;
+			skipWhitespace();
+			if(pos < text.size() && text[pos] == '}'){
+				pos++;
+				return value;
+			}
+			while(true){
+				skipWhitespace();
+				if(pos >= text.size() || text[pos] != '"'){
+					fail("expected key");
+				}
+				value.keys.push_back(parseString());
+				skipWhitespace();
+				if(pos >= text.size() || text[pos] != ':'){
+					fail("expected ':'");
+				}
+				pos++;
+				value.values.push_back(parseValue());
+				skipWhitespace();
+				if(pos < text.size() && text[pos] == ','){
+					pos++;
+				}
+				else if(pos < text.size() && text[pos] == '}'){
+					pos++;
+					return value;
+				}
+				else{
+					fail("expected ',' or '}'");
+				}
+			}
+		}
+		if(c == '['){
+			value.type = JsonValue::JSON_ARRAY;
+			pos++;
+			skipWhitespace();
+			if(pos < text.size() && text[pos] == ']'){
+				pos++;
+				return value;
+			}
+			while(true){
+				value.items.push_back(parseValue());
+				skipWhitespace();
+				if(pos < text.size() && text[pos] == ','){
+					pos++;
+				}
+				else if(pos < text.size() && text[pos] == ']'){
+					pos++;
+					return value;
+				}
+				else{
+					fail("expected ',' or ']'");
+				}
+			}
+		}
+		if(c == '"'){
+			value.type = JsonValue::JSON_STRING;
+			value.string = parseString();
+			return value;
+		}
+		if(consume("true")){
+			value.type = JsonValue::JSON_BOOL;
+			value.boolean = true;
+			return value;
+		}
+		if(consume("false")){
+			value.type = JsonValue::JSON_BOOL;
+			return value;
+		}
+		if(consume("null")){
+			return value;
+		}
+		// numbers, including the non-standard NaN and Infinity written by python
+		const char *start = text.c_str() + pos;
+		char *end;
+		value.number = strtod(start, &end);
+		if(end == start){
+			fail("unexpected character");
+		}
+		value.type = JsonValue::JSON_NUMBER;
+		pos += end - start;
+		return value;
+	}
+
+public:
+	JsonParser(const std::string &text) : text(text){
+		pos = 0;
+	}
+
+	JsonValue Parse(){
+		JsonValue value = parseValue();
+		skipWhitespace();
+		if(pos != text.size()){
+			fail("trailing characters");
+		}
+		return value;
+	}
+};
+
+JsonValue parseJson(const std::string &text){
+	JsonParser parser(text);
+	return parser.Parse();
+}
+
+// reads and parses a JSON file
+JsonValue parseJsonFile(const std::string &filename){
+	std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+	if(!stream.is_open()){
+		throw std::runtime_error("Cannot open file: " + filename);
+	}
+	std::string text((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+	return parseJson(text);
+}
+
+#endif
@@ -492,6 +492,15 @@ static int validateLesionDetection(const char* f1, const char* f2, const char* t
 	LesionDetectionMask * organmask=NULL;
 	string l_truth_file = "";
 	string l_test_file = "";
+
+	std::vector<std::string> urls;
+	urls.push_back(f1);
+	urls.push_back(f2);
+	if(maskFile != NULL){
+		urls.push_back(maskFile);
+	}
+	prefetchUrls(urls);
+
 	bool truth_url=isUrl(f1);
 	if(truth_url){
 		l_truth_file = download_image(f1, "__temp_lesiondetection_file_truth.fcsv"); 
@@ -523,7 +532,7 @@ static int validateLesionDetection(const char* f1, const char* f2, const char* t
 		if(mask_url){
 			const string mask_file = download_image(maskFile, "__temp_lesiondetection_file_test.nii");
 			organmask = new LesionDetectionMask(mask_file.c_str());
-			remove(l_test_file.c_str());
+			remove(mask_file.c_str());
 		}
 		else{
 			if(!itksys::SystemTools::FileExists(maskFile,true)){
@@ -206,6 +206,11 @@ int validateLocalization(const char* f1, const char* f2, const char* targetFile,
 	std::vector<Landmark> truth_landmarks;
 	std::vector<Landmark> test_landmarks;
 
+	std::vector<std::string> urls;
+	urls.push_back(f1);
+	urls.push_back(f2);
+	prefetchUrls(urls);
+
 	bool truth_url=isUrl(f1);
 	if(truth_url){
 		l_truth_file = download_image(f1, "__temp_lcalization_file_truth.fcsv"); 
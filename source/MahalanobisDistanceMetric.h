@@ -28,9 +28,92 @@
 */
 
 
+#ifndef _MAHALANOBISDISTANCEMETRIC
+#define _MAHALANOBISDISTANCEMETRIC
+
 #include "itkImage.h"
 #include <itkMatrix.h>
 #include <itkVector.h>
+#include "MetricAccumulators.h"
+
+// sums over the indices of the foreground voxels of an image, from which the mean and the
+// covariance of the foreground are derived
+typedef struct ForegroundMoments{
+	long long count;
+	double sum[3];
+	double sumProducts[3][3];
+} ForegroundMoments;
+
+// moments of the foreground of both images, accumulated in the pass over the images
+class MahalanobisMoments
+{
+private:
+	double thd;
+
+	static void clear(ForegroundMoments &moments){
+		moments.count = 0;
+		for(int i=0; i < 3; i++){
+			moments.sum[i] = 0;
+			for(int j=0; j < 3; j++){
+				moments.sumProducts[i][j] = 0;
+			}
+		}
+	}
+
+	static void add(ForegroundMoments &moments, const ForegroundMoments &other){
+		moments.count += other.count;
+		for(int i=0; i < 3; i++){
+			moments.sum[i] += other.sum[i];
+			for(int j=0; j < 3; j++){
+				moments.sumProducts[i][j] += other.sumProducts[i][j];
+			}
+		}
+	}
+
+	static void add(ForegroundMoments &moments, long long x, long long y, long long z){
+		double index[3] = {(double)x, (double)y, (double)z};
+		moments.count++;
+		for(int i=0; i < 3; i++){
+			moments.sum[i] += index[i];
+			for(int j=0; j < 3; j++){
+				moments.sumProducts[i][j] += index[i] * index[j];
+			}
+		}
+	}
+
+public:
+	static const unsigned artifacts = ARTIFACT_MOMENTS;
+
+	ForegroundMoments moments_f;
+	ForegroundMoments moments_m;
+
+	void init(const AccumulatorSettings &settings){
+		thd = getForegroundThreshold(settings.fuzzy, settings.threshold);
+		clear(moments_f);
+		clear(moments_m);
+	}
+
+	void accumulate(const VoxelBlock &block){
+		for(long long i = 0; i < block.count; i++){
+			if(block.fixed[i]>thd){
+				add(moments_f, block.x + i, block.y, block.z);
+			}
+			if(block.moving[i]>thd){
+				add(moments_m, block.x + i, block.y, block.z);
+			}
+		}
+	}
+
+	void merge(const MahalanobisMoments &other){
+		add(moments_f, other.moments_f);
+		add(moments_m, other.moments_m);
+	}
+
+	void finalize(){
+	}
+};
+
+class VoxelPreprocessor;
 
 class MahalanobisDistanceMetric
 {
@@ -75,8 +158,8 @@ public:
 	double CalcMahalanobisDistace(){
 		IteratorType fixedIt(fixedImage, fixedImage -> GetRequestedRegion());
 		IteratorType movingIt(movingImage, movingImage -> GetRequestedRegion());
-		long int len_f=getImageSize(fixedIt);
-		long int len_m=getImageSize(movingIt);
+		long long len_f=getImageSize(fixedIt);
+		long long len_m=getImageSize(movingIt);
 		bool image_2d = Is2DImage(fixedIt);
 
 		if(image_2d){
@@ -101,6 +184,45 @@ public:
 		
 	}
 
+	/*
+	// Same as CalcMahalanobisDistace(), from the moments of the foreground accumulated by
+	// the pass over the images (MahalanobisMoments), instead of scanning them again
+	*/
+	double CalcMahalanobisDistace(const ForegroundMoments &moments_f, const ForegroundMoments &moments_m){
+		bool image_2d = moments_f.sum[2]==0;
+		if(image_2d){
+			VectorType2D means_f, means_m;
+			MatrixType2D covariace_f, covariace_m;
+			meanAndCovariance(moments_f, 2, means_f, covariace_f);
+			meanAndCovariance(moments_m, 2, means_m, covariace_m);
+			MatrixType2D covariace_mat = commonCovarianceMatrix2D(covariace_f, covariace_m, moments_f.count, moments_m.count);
+			MatrixType2D covariace_mat_inv  = (MatrixType2D)covariace_mat.GetInverse();
+			return mahalanobis_dist2D(means_f, means_m, covariace_mat_inv);
+		}
+		else{
+			VectorType3D means_f, means_m;
+			MatrixType3D covariace_f, covariace_m;
+			meanAndCovariance(moments_f, 3, means_f, covariace_f);
+			meanAndCovariance(moments_m, 3, means_m, covariace_m);
+			MatrixType3D covariace_mat = commonCovarianceMatrix3D(covariace_f, covariace_m, moments_f.count, moments_m.count);
+			MatrixType3D covariace_mat_inv  = (MatrixType3D)covariace_mat.GetInverse();
+			return mahalanobis_dist3D(means_f, means_m, covariace_mat_inv);
+		}
+	}
+
+	template<class VectorType, class MatrixType>
+	void meanAndCovariance(const ForegroundMoments &moments, int dimension, VectorType &means, MatrixType &covariance){
+		double count = moments.count;
+		for(int i=0 ; i < dimension; i++){
+			means[i] = moments.sum[i]/count;
+		}
+		for(int i=0 ; i < dimension; i++){
+			for(int j=0 ;j < dimension ; j++){
+				covariance(i,j) = moments.sumProducts[i][j]/count - means[i]*means[j];
+			}
+		}
+	}
+
 	bool Is2DImage(IteratorType it){
 		double sum_z=0;
 		it.GoToBegin();
@@ -116,8 +238,8 @@ public:
 		return sum_z==0;
 	}
 	
-	long int getImageSize(IteratorType it){
-		int len=0;
+	long long getImageSize(IteratorType it){
+		long long len=0;
 		it.GoToBegin();
 		while (!it.IsAtEnd()){
 			double val = it.Get();
@@ -179,7 +301,7 @@ public:
 	}
 
 
-	MatrixType2D commonCovarianceMatrix2D(MatrixType2D covmat1, MatrixType2D  covmat2, long int len1, long int len2){
+	MatrixType2D commonCovarianceMatrix2D(MatrixType2D covmat1, MatrixType2D  covmat2, long long len1, long long len2){
 		MatrixType2D  covmat;
 		covmat = (covmat1*len1+ covmat2*len2)/(len1+len2) ;
 		return covmat;
@@ -254,7 +376,7 @@ public:
 	}
 
 
-	MatrixType3D commonCovarianceMatrix3D(MatrixType3D covmat1, MatrixType3D  covmat2, long int len1, long int len2){
+	MatrixType3D commonCovarianceMatrix3D(MatrixType3D covmat1, MatrixType3D  covmat2, long long len1, long long len2){
 		MatrixType3D  covmat;
 		covmat = (covmat1*len1+ covmat2*len2)/(len1+len2) ;
 		return covmat;
@@ -280,3 +402,4 @@ public:
 
 };
 
+#endif
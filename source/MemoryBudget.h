@@ -0,0 +1,296 @@
+/*
+// MemoryBudget.h
+//
+// Description:
+//
+// This file plans how an evaluation is done within a memory budget (option -max-memory). The
+// memory needed is estimated from the image headers before any voxel data is read, and the first
+// strategy that fits the budget is used:
+//
+// - full in-memory: both images are read as a whole (no streaming filter), the fastest way.
+// - slab-streamed: the images are read piece by piece through the streaming filter, so that only
+//   a slab of the float image of the reader is held besides the 8 bit images. Needs files that
+//   can be read partially (uncompressed NIfTI, MHA/NRRD with raw data).
+// - bit-packed: crisp NIfTI images are thresholded into bit masks while decoding (see BitMask.h).
+//   Used for the metrics computed from the contingency table; metrics that need the images
+//   (distances) then read the images cropped to the foreground, see below.
+// - bounding-box-cropped: the images are read only inside the bounding box of their foreground
+//   (as with -roi auto). Only metrics that do not depend on the background outside the box can be
+//   computed this way, i.e. not the metrics using true negatives, ICCORR or PROBDST.
+//
+// If no strategy fits, the evaluation is refused with a message before any image is allocated.
+// The estimate covers the images, the intermediate float images of the reader and the voxel
+// buffers of VoxelPreprocessor (only made for ICCORR and PROBDST, see MetricPlan.h). The memory of
+// the distance metrics (distance transforms, point lists) depends on the foreground, which is not
+// known from the headers; it is estimated after the pass over the images, and each distance
+// metric uses a backend that fits into what the estimate leaves of the budget (DistanceBackends.h).
+//
+// Reading bit masks decodes each file twice (once per pass of BitMask.h), so it is slower than the
+// dense images when these fit. Without a budget it is used only for overlap based metrics of
+// images whose dense evaluation would not fit into the memory available (denseImagesFit).
+//
+*/
+
+#ifndef _MEMORYBUDGET
+#define _MEMORYBUDGET
+
+#include <string>
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include "Metric_constants.h"
+#include "ImageHeader.h"
+#include "RegionOfInterest.h"
+#include "BitMask.h"
+#include "MetricPlan.h"
+#include "MemoryUsage.h"
+
+bool shouldUse(MetricId, char* options);
+bool usesOnlyContingencyTable(char* options);
+
+// memory budget of an evaluation in bytes, 0 = no limit
+static long long maxMemoryBytes = 0;
+
+// number of pieces itk::StreamingImageFilter divides an image into by default
+static const int MEMORY_STREAMING_DIVISIONS = 10;
+
+/*
+// Parses a size in bytes with an optional suffix k, m, g or t (binary multiples, e.g. 512m or 4GB)
+*/
+bool parseMemorySize(const char* s, long long &bytes){
+	char* end;
+	double value = strtod(s, &end);
+	if(end == s || value <= 0){
+		return false;
+	}
+	double factor = 1;
+	switch(tolower(*end)){
+		case 'k': factor = 1024.0; end++; break;
+		case 'm': factor = 1024.0 * 1024; end++; break;
+		case 'g': factor = 1024.0 * 1024 * 1024; end++; break;
+		case 't': factor = 1024.0 * 1024 * 1024 * 1024; end++; break;
+	}
+	if(tolower(*end) == 'b'){
+		end++;
+	}
+	if(*end != '\0'){
+		return false;
+	}
+	bytes = (long long)(value * factor);
+	return true;
+}
+
+std::string formatMemorySize(long long bytes){
+	std::ostringstream s;
+	s << (bytes + 1024 * 1024 - 1) / (1024 * 1024) << " MB";
+	return s.str();
+}
+
+typedef struct MemoryPlan{
+	bool planned;
+	bool fits;
+	// read the images through the streaming filter
+	bool streamed;
+	// compute the contingency table from bit masks
+	bool bitPacked;
+	// read the images only inside region
+	bool cropped;
+	ImageType::RegionType region;
+	long long estimate;
+	std::string overlapStrategy;
+	std::string imageStrategy;
+	std::string message;
+} MemoryPlan;
+
+// metrics reading the voxel values of VoxelPreprocessor
+bool usesVoxelValues(char* options){
+	return (getRequiredArtifacts(options) & ARTIFACT_VOXEL_VALUES) != 0;
+}
+
+// metrics that give the same value for images cropped to the bounding box of their foreground
+bool isCropInvariant(char* options){
+	MetricId backgroundMetrics[] = {AUC, KAPPA, RNDIND, ADJRIND, ICCORR, MUTINF, VARINFO, GCOERR, PROBDST, SPCFTY, ACURCY, FALLOUT, TN};
+	int size = sizeof(backgroundMetrics)/sizeof(MetricId);
+	for(int i=0 ; i< size; i++){
+		if(shouldUse(backgroundMetrics[i], options)){
+			return false;
+		}
+	}
+	return true;
+}
+
+// peak of reading both images of n voxels each (the first image is held while the second is read)
+long long estimateImageBytes(long long n, bool streamed){
+	long long reader = sizeof(float) * n;
+	if(streamed){
+		reader /= MEMORY_STREAMING_DIVISIONS;
+	}
+	return 2 * sizeof(pixeltype) * n + reader;
+}
+
+// peak of a dense evaluation: reading the images, then the images and the voxel buffers if any
+long long estimateDenseBytes(long long n, bool streamed, bool voxelValues){
+	return std::max(estimateImageBytes(n, streamed), (voxelValues ? 4 : 2) * (long long)sizeof(pixeltype) * n);
+}
+
+long long estimateBitMaskBytes(long long n){
+	return 2 * ((n + 63) / 64) * (long long)sizeof(unsigned long long) + 2 * BITMASK_BLOCK_VOXELS * (long long)sizeof(double);
+}
+
+long long getRegionVoxels(const ImageType::RegionType &region){
+	return (long long)region.GetSize(0) * region.GetSize(1) * region.GetSize(2);
+}
+
+/*
+// Chooses the strategy of an evaluation of the local files f1 and f2 within maxMemoryBytes.
+// roi is the region given by -roi, NULL to evaluate the full images.
+*/
+MemoryPlan planMemory(const char* f1, const char* f2, bool fuzzy, char* options, const ImageType::RegionType* roi){
+	MemoryPlan plan;
+	plan.planned = false;
+	plan.fits = true;
+	plan.streamed = true;
+	plan.bitPacked = false;
+	plan.cropped = false;
+	plan.estimate = 0;
+
+	ImageHeader h1 = readImageHeader(f1);
+	ImageHeader h2 = readImageHeader(f2);
+	if(!h1.valid || !h2.valid){
+		std::cout << "-max-memory: the memory needed cannot be estimated from the headers of these inputs\n" << std::endl;
+		return plan;
+	}
+	plan.planned = true;
+	long long n = roi != NULL ? getRegionVoxels(*roi) : h1.numberElements;
+	bool canStream = h1.canStreamRead && h2.canStreamRead;
+	bool overlapOnly = usesOnlyContingencyTable(options);
+	bool voxelValues = usesVoxelValues(options);
+	bool voxelStatistics = (getRequiredArtifacts(options) & ARTIFACT_VOXEL_STATISTICS) != 0;
+	std::string fullStrategy = "full in-memory";
+	std::string streamedStrategy = "slab-streamed";
+
+	// full in-memory and slab-streamed
+	plan.estimate = estimateDenseBytes(n, false, voxelValues);
+	plan.streamed = false;
+	plan.overlapStrategy = fullStrategy;
+	plan.imageStrategy = overlapOnly ? "" : fullStrategy;
+	if(plan.estimate > maxMemoryBytes && canStream){
+		plan.estimate = estimateDenseBytes(n, true, voxelValues);
+		plan.streamed = true;
+		plan.overlapStrategy = streamedStrategy;
+		plan.imageStrategy = overlapOnly ? "" : streamedStrategy;
+	}
+	long long smallest = plan.estimate;
+	std::string smallestStrategy = plan.overlapStrategy;
+	if(plan.estimate <= maxMemoryBytes){
+		return plan;
+	}
+
+	// the foreground bounding box, determined by scanning the files slab by slab
+	bool canCrop = roi == NULL && canStream;
+	bool boxScanned = false;
+	ImageType::RegionType box;
+	bool boxFound = false;
+
+	// bit masks for the contingency table, the images cropped for the distance metrics
+	if(!fuzzy && roi == NULL && isNiftiFile(f1) && isNiftiFile(f2) && !voxelValues && !voxelStatistics){
+		long long estimate = estimateBitMaskBytes(n);
+		bool possible = true;
+		std::string imageStrategy = "";
+		if(!overlapOnly){
+			possible = false;
+			if(canCrop){
+				boxFound = computeAutoRegionOfInterest(f1, f2, h1, box);
+				boxScanned = true;
+			}
+			if(boxFound){
+				long long nc = getRegionVoxels(box);
+				bool streamed = estimateImageBytes(nc, false) > maxMemoryBytes;
+				estimate = std::max(estimate, estimateImageBytes(nc, streamed));
+				imageStrategy = std::string("bounding-box-cropped, ") + (streamed ? streamedStrategy : fullStrategy);
+				plan.streamed = streamed;
+				possible = true;
+			}
+		}
+		if(possible && estimate < smallest){
+			smallest = estimate;
+			smallestStrategy = "bit-packed";
+		}
+		if(possible && estimate <= maxMemoryBytes){
+			plan.estimate = estimate;
+			plan.bitPacked = true;
+			plan.cropped = !overlapOnly;
+			plan.region = box;
+			plan.overlapStrategy = "bit-packed";
+			plan.imageStrategy = imageStrategy;
+			return plan;
+		}
+	}
+
+	// dense evaluation of the images cropped to their foreground
+	if(canCrop && isCropInvariant(options)){
+		if(!boxScanned){
+			boxFound = computeAutoRegionOfInterest(f1, f2, h1, box);
+		}
+		if(boxFound){
+			long long nc = getRegionVoxels(box);
+			bool streamed = estimateDenseBytes(nc, false, voxelValues) > maxMemoryBytes;
+			long long estimate = estimateDenseBytes(nc, streamed, voxelValues);
+			std::string strategy = std::string("bounding-box-cropped, ") + (streamed ? streamedStrategy : fullStrategy);
+			if(estimate < smallest){
+				smallest = estimate;
+				smallestStrategy = strategy;
+			}
+			if(estimate <= maxMemoryBytes){
+				plan.estimate = estimate;
+				plan.streamed = streamed;
+				plan.cropped = true;
+				plan.region = box;
+				plan.overlapStrategy = strategy;
+				plan.imageStrategy = overlapOnly ? "" : strategy;
+				return plan;
+			}
+		}
+	}
+
+	plan.fits = false;
+	plan.estimate = smallest;
+	std::ostringstream message;
+	message << "The evaluation needs about " << formatMemorySize(smallest) << " (" << smallestStrategy << ", "
+		<< n << " voxels per image), more than the memory budget of " << formatMemorySize(maxMemoryBytes) << " (-max-memory)";
+	plan.message = message.str();
+	return plan;
+}
+
+/*
+// Whether the dense evaluation of the local files f1 and f2 fits into the memory available, for
+// evaluations without a budget. True if the headers or the available memory are unknown.
+*/
+bool denseImagesFit(const char* f1, char* options){
+	ImageHeader header = readImageHeader(f1);
+	long long available = getAvailableMemoryBytes();
+	if(!header.valid || available == 0){
+		return true;
+	}
+	return estimateDenseBytes(header.numberElements, false, usesVoxelValues(options)) <= available;
+}
+
+// memory left for a distance metric in bytes, 0 = no limit
+long long getDistanceMemoryLimit(const MemoryPlan &plan){
+	if(maxMemoryBytes == 0){
+		return 0;
+	}
+	return std::max(1LL, maxMemoryBytes - (plan.planned ? plan.estimate : 0));
+}
+
+void printMemoryPlan(const MemoryPlan &plan){
+	std::cout << "Memory plan: estimated peak " << formatMemorySize(plan.estimate) << " of " << formatMemorySize(maxMemoryBytes)
+		<< ", contingency table: " << plan.overlapStrategy;
+	if(plan.imageStrategy != ""){
+		std::cout << ", image metrics: " << plan.imageStrategy;
+	}
+	std::cout << "\n" << std::endl;
+}
+
+#endif
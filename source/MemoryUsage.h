@@ -0,0 +1,132 @@
+/*
+// MemoryUsage.h
+//
+// Description:
+//
+// This file measures the peak memory (resident set size) of the evaluation stages, so that the
+// memory needed per evaluation is known when several evaluations share a node. The peak of a
+// stage is read when the stage ends; on Linux the peak is then reset (/proc/self/clear_refs), so
+// each stage reports its own peak. Elsewhere the peak of the process so far is reported, which
+// only grows from stage to stage. It also tells the memory available to an evaluation without a
+// budget (see MemoryBudget.h).
+//
+*/
+
+#ifndef _MEMORYUSAGE
+#define _MEMORYUSAGE
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__TOS_WIN__)
+#ifndef _WINOS
+#define _WINOS
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+typedef struct MemoryStage{
+	std::string name;
+	long long peakKB;
+} MemoryStage;
+
+// stages of the current evaluation, in the order they ended
+static std::vector<MemoryStage> memoryStages;
+
+// peak resident set size since the last reset, in KB (0 if unknown)
+long long getPeakMemoryKB(){
+#if defined(__linux__)
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while(std::getline(status, line)){
+		if(line.compare(0, 6, "VmHWM:") == 0){
+			std::istringstream value(line.substr(6));
+			long long kb = 0;
+			value >> kb;
+			return kb;
+		}
+	}
+	return 0;
+#elif defined(_WINOS)
+	PROCESS_MEMORY_COUNTERS counters;
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))){
+		return (long long)(counters.PeakWorkingSetSize / 1024);
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0){
+		return 0;
+	}
+#if defined(__APPLE__)
+	// bytes on macOS
+	return (long long)usage.ru_maxrss / 1024;
+#else
+	return (long long)usage.ru_maxrss;
+#endif
+#endif
+}
+
+// resets the peak to the current resident set size, where the system supports it
+void resetPeakMemory(){
+#if defined(__linux__)
+	std::ofstream clear("/proc/self/clear_refs");
+	clear << "5";
+#endif
+}
+
+// memory the system can give to the process without swapping, in bytes (0 if unknown)
+long long getAvailableMemoryBytes(){
+#if defined(__linux__)
+	std::ifstream meminfo("/proc/meminfo");
+	std::string line;
+	while(std::getline(meminfo, line)){
+		if(line.compare(0, 13, "MemAvailable:") == 0){
+			std::istringstream value(line.substr(13));
+			long long kb = 0;
+			value >> kb;
+			return kb * 1024;
+		}
+	}
+	return 0;
+#elif defined(_WINOS)
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if(GlobalMemoryStatusEx(&status)){
+		return (long long)status.ullAvailPhys;
+	}
+	return 0;
+#else
+	return 0;
+#endif
+}
+
+void beginMemoryStages(){
+	memoryStages.clear();
+	resetPeakMemory();
+}
+
+void endMemoryStage(const char* name){
+	MemoryStage stage;
+	stage.name = name;
+	stage.peakKB = getPeakMemoryKB();
+	memoryStages.push_back(stage);
+	resetPeakMemory();
+}
+
+void printMemoryStages(){
+	std::cout << "Peak memory=";
+	for(size_t i = 0; i < memoryStages.size(); i++){
+		std::cout << (i > 0 ? ", " : " ") << memoryStages[i].name << " " << memoryStages[i].peakKB / 1024 << " MB";
+	}
+	std::cout << std::endl;
+}
+
+#endif
@@ -0,0 +1,400 @@
+/*
+// MetricAccumulators.h
+//
+// Description:
+//
+// This file contains the framework of the metrics computed voxel by voxel. Such a metric is an
+// accumulator class with
+//
+//   static const unsigned artifacts;              // artifacts it provides (Metric_constants.h)
+//   void init(const AccumulatorSettings &);       // start of an evaluation
+//   void accumulate(const VoxelBlock &);          // a line of voxels of both images
+//   void merge(const Accumulator &);              // add the partial result of another slab
+//   void finalize();                              // after all voxels are accumulated
+//
+// FusedVisitor composes the accumulators of the registry (MetricRegistry.h) at compile time into
+// one visitor, so every block is handed to all enabled accumulators while it is in the cache and
+// any number of voxel-wise metrics costs a single pass over the images. sweepImages() runs the
+// pass on slabs of the images in parallel; the partial results of the slabs are merged in the
+// order of the slabs, so the result does not depend on the number of threads.
+//
+*/
+
+#ifndef _METRICACCUMULATORS
+#define _METRICACCUMULATORS
+
+#include <tuple>
+#include <climits>
+#include <algorithm>
+#include <vector>
+#include <type_traits>
+#include "itkImage.h"
+#include "Metric_constants.h"
+#include "Parallel.h"
+
+// rows per slab of the parallel pass over 2D images, 3D images are divided into slices
+static const long long SWEEP_SLAB_ROWS = 64;
+
+typedef struct AccumulatorSettings{
+	bool fuzzy;
+	double threshold;
+	double vspx;
+	double vspy;
+	double vspz;
+} AccumulatorSettings;
+
+// a line of voxels of both images along x, starting at the index x, y, z of the fixed image
+typedef struct VoxelBlock{
+	const pixeltype* fixed;
+	const pixeltype* moving;
+	long long count;
+	long long x;
+	long long y;
+	long long z;
+} VoxelBlock;
+
+// value of a voxel as seen by the metrics: clamped to the pixel value range, or for crisp
+// evaluations PIXEL_VALUE_RANGE_MAX above the threshold and PIXEL_VALUE_RANGE_MIN otherwise
+inline pixeltype preprocessVoxel(pixeltype value, bool fuzzy, double threshold){
+	if(fuzzy){
+		if(value>PIXEL_VALUE_RANGE_MAX)
+			return PIXEL_VALUE_RANGE_MAX;
+		if(value<PIXEL_VALUE_RANGE_MIN)
+			return PIXEL_VALUE_RANGE_MIN;
+		return value;
+	}
+	return value>(threshold*PIXEL_VALUE_RANGE_MAX)?PIXEL_VALUE_RANGE_MAX:PIXEL_VALUE_RANGE_MIN;
+}
+
+// threshold above which a voxel belongs to the foreground
+inline double getForegroundThreshold(bool fuzzy, double threshold){
+	return (!fuzzy && threshold!=-1) ? threshold*PIXEL_VALUE_RANGE_MAX : 0;
+}
+
+// number of foreground voxels of both images and of their intersection
+class ForegroundCounts
+{
+private:
+	double thd;
+
+public:
+	static const unsigned artifacts = ARTIFACT_CONTINGENCY;
+
+	long long num_nonzero_points_f;
+	long long num_nonzero_points_m;
+	long long num_intersection;
+
+	void init(const AccumulatorSettings &settings){
+		thd = getForegroundThreshold(settings.fuzzy, settings.threshold);
+		num_nonzero_points_f = 0;
+		num_nonzero_points_m = 0;
+		num_intersection = 0;
+	}
+
+	void accumulate(const VoxelBlock &block){
+		for(long long i = 0; i < block.count; i++){
+			bool foreground_f = block.fixed[i]>thd;
+			bool foreground_m = block.moving[i]>thd;
+			num_nonzero_points_f += foreground_f;
+			num_nonzero_points_m += foreground_m;
+			num_intersection += foreground_f && foreground_m;
+		}
+	}
+
+	void merge(const ForegroundCounts &other){
+		num_nonzero_points_f += other.num_nonzero_points_f;
+		num_nonzero_points_m += other.num_nonzero_points_m;
+		num_intersection += other.num_intersection;
+	}
+
+	void finalize(){
+	}
+};
+
+// bounding boxes of the foreground of both images, empty if min[0] > max[0]
+class ForegroundBox
+{
+private:
+	double thd;
+
+	static void extend(long long *min, long long *max, long long first, long long last, const VoxelBlock &block){
+		if(first == -1){
+			return;
+		}
+		min[0] = std::min(min[0], block.x + first);
+		max[0] = std::max(max[0], block.x + last);
+		min[1] = std::min(min[1], block.y);
+		max[1] = std::max(max[1], block.y);
+		min[2] = std::min(min[2], block.z);
+		max[2] = std::max(max[2], block.z);
+	}
+
+public:
+	static const unsigned artifacts = ARTIFACT_DISTANCE_WORKLOAD;
+
+	long long min_f[3];
+	long long max_f[3];
+	long long min_m[3];
+	long long max_m[3];
+
+	void init(const AccumulatorSettings &settings){
+		thd = getForegroundThreshold(settings.fuzzy, settings.threshold);
+		for(int i = 0; i < 3; i++){
+			min_f[i] = min_m[i] = LLONG_MAX;
+			max_f[i] = max_m[i] = LLONG_MIN;
+		}
+	}
+
+	void accumulate(const VoxelBlock &block){
+		long long first_f = -1, last_f = -1;
+		long long first_m = -1, last_m = -1;
+		for(long long i = 0; i < block.count; i++){
+			if(block.fixed[i]>thd){
+				if(first_f == -1){
+					first_f = i;
+				}
+				last_f = i;
+			}
+			if(block.moving[i]>thd){
+				if(first_m == -1){
+					first_m = i;
+				}
+				last_m = i;
+			}
+		}
+		extend(min_f, max_f, first_f, last_f, block);
+		extend(min_m, max_m, first_m, last_m, block);
+	}
+
+	void merge(const ForegroundBox &other){
+		for(int i = 0; i < 3; i++){
+			min_f[i] = std::min(min_f[i], other.min_f[i]);
+			max_f[i] = std::max(max_f[i], other.max_f[i]);
+			min_m[i] = std::min(min_m[i], other.min_m[i]);
+			max_m[i] = std::max(max_m[i], other.max_m[i]);
+		}
+	}
+
+	void finalize(){
+	}
+
+	// bounding box of the foreground of both images
+	long long GetMin(int axis) const{
+		return std::min(min_f[axis], min_m[axis]);
+	}
+	long long GetMax(int axis) const{
+		return std::max(max_f[axis], max_m[axis]);
+	}
+	bool IsEmpty() const{
+		return GetMin(0) > GetMax(0);
+	}
+};
+
+// changes between foreground and background along the lines of both images, from which the number
+// of surface voxels is estimated
+class SurfaceEstimate
+{
+private:
+	double thd;
+
+	static long long countFaces(const pixeltype* values, long long count, double thd){
+		long long faces = 0;
+		bool previous = false;
+		for(long long i = 0; i < count; i++){
+			bool foreground = values[i]>thd;
+			faces += foreground != previous;
+			previous = foreground;
+		}
+		return faces + previous;
+	}
+
+public:
+	static const unsigned artifacts = ARTIFACT_DISTANCE_WORKLOAD;
+
+	long long faces_f;
+	long long faces_m;
+
+	void init(const AccumulatorSettings &settings){
+		thd = getForegroundThreshold(settings.fuzzy, settings.threshold);
+		faces_f = 0;
+		faces_m = 0;
+	}
+
+	void accumulate(const VoxelBlock &block){
+		faces_f += countFaces(block.fixed, block.count, thd);
+		faces_m += countFaces(block.moving, block.count, thd);
+	}
+
+	void merge(const SurfaceEstimate &other){
+		faces_f += other.faces_f;
+		faces_m += other.faces_m;
+	}
+
+	void finalize(){
+	}
+
+	// a surface has about twice as many voxels as faces across the lines along x
+	double GetSurfaceVoxels_f() const{
+		return 2.0 * faces_f;
+	}
+	double GetSurfaceVoxels_m() const{
+		return 2.0 * faces_m;
+	}
+};
+
+// position of type T in the list of types
+template<class T, class... Types>
+struct TypeIndex;
+
+template<class T, class... Types>
+struct TypeIndex<T, T, Types...>{
+	static const size_t value = 0;
+};
+
+template<class T, class U, class... Types>
+struct TypeIndex<T, U, Types...>{
+	static const size_t value = 1 + TypeIndex<T, Types...>::value;
+};
+
+template<class... Accumulators>
+class FusedVisitor
+{
+private:
+	static const size_t COUNT = sizeof...(Accumulators);
+
+	std::tuple<Accumulators...> accumulators;
+	bool enabled[COUNT];
+
+	// the loops over the accumulators are unrolled at compile time
+	template<size_t I>
+	typename std::enable_if<I == COUNT>::type initAll(const AccumulatorSettings &, unsigned){
+	}
+	template<size_t I>
+	typename std::enable_if<I < COUNT>::type initAll(const AccumulatorSettings &settings, unsigned artifacts){
+		typedef typename std::tuple_element<I, std::tuple<Accumulators...> >::type Accumulator;
+		enabled[I] = (Accumulator::artifacts & artifacts) != 0;
+		std::get<I>(accumulators).init(settings);
+		initAll<I + 1>(settings, artifacts);
+	}
+
+	template<size_t I>
+	typename std::enable_if<I == COUNT>::type accumulateAll(const VoxelBlock &){
+	}
+	template<size_t I>
+	typename std::enable_if<I < COUNT>::type accumulateAll(const VoxelBlock &block){
+		if(enabled[I]){
+			std::get<I>(accumulators).accumulate(block);
+		}
+		accumulateAll<I + 1>(block);
+	}
+
+	template<size_t I>
+	typename std::enable_if<I == COUNT>::type mergeAll(const FusedVisitor &){
+	}
+	template<size_t I>
+	typename std::enable_if<I < COUNT>::type mergeAll(const FusedVisitor &other){
+		if(enabled[I]){
+			std::get<I>(accumulators).merge(std::get<I>(other.accumulators));
+		}
+		mergeAll<I + 1>(other);
+	}
+
+	template<size_t I>
+	typename std::enable_if<I == COUNT>::type finalizeAll(){
+	}
+	template<size_t I>
+	typename std::enable_if<I < COUNT>::type finalizeAll(){
+		if(enabled[I]){
+			std::get<I>(accumulators).finalize();
+		}
+		finalizeAll<I + 1>();
+	}
+
+public:
+	FusedVisitor(){
+		for(size_t i = 0; i < COUNT; i++){
+			enabled[i] = false;
+		}
+	}
+
+	// enables the accumulators providing one of the artifacts
+	void Init(const AccumulatorSettings &settings, unsigned artifacts){
+		initAll<0>(settings, artifacts);
+	}
+
+	void Accumulate(const VoxelBlock &block){
+		accumulateAll<0>(block);
+	}
+
+	void Merge(const FusedVisitor &other){
+		mergeAll<0>(other);
+	}
+
+	void Finalize(){
+		finalizeAll<0>();
+	}
+
+	template<class Accumulator>
+	Accumulator& Get(){
+		return std::get<TypeIndex<Accumulator, Accumulators...>::value>(accumulators);
+	}
+
+	template<class Accumulator>
+	bool IsEnabled() const{
+		return enabled[TypeIndex<Accumulator, Accumulators...>::value];
+	}
+};
+
+/*
+// Passes all voxels of both images line by line to the initialized visitor and finalizes it. The
+// lines are handed over where they are in the buffers of the images, without copying them.
+// The images must have the same size.
+*/
+template<class Visitor>
+void sweepImages(ImageType *fixedImage, ImageType *movingImage, Visitor &visitor){
+	const ImageType::RegionType region_f = fixedImage->GetRequestedRegion();
+	const ImageType::RegionType region_m = movingImage->GetRequestedRegion();
+	const pixeltype* buffer_f = fixedImage->GetBufferPointer();
+	const pixeltype* buffer_m = movingImage->GetBufferPointer();
+
+	// slabs along z, or along y for 2D images
+	int axis = region_f.GetSize(2) > 1 ? 2 : 1;
+	long long length = region_f.GetSize(axis);
+	long long thickness = axis == 2 ? 1 : SWEEP_SLAB_ROWS;
+	long long numberSlabs = (length + thickness - 1) / thickness;
+
+	std::vector<Visitor> slabs(numberSlabs, visitor);
+	parallelFor(numberSlabs, getNumberOfThreads(), [&](long long slab, int thread){
+		long long start = slab * thickness;
+		long long size = std::min(thickness, length - start);
+		long long rows = axis == 2 ? region_f.GetSize(1) : size;
+		long long slices = axis == 2 ? size : region_f.GetSize(2);
+		VoxelBlock block;
+		block.count = region_f.GetSize(0);
+		for(long long k = 0; k < slices; k++){
+			for(long long j = 0; j < rows; j++){
+				// the first voxel of the line in both images
+				ImageType::IndexType index_f = region_f.GetIndex();
+				ImageType::IndexType index_m = region_m.GetIndex();
+				long long y = axis == 1 ? start + j : j;
+				long long z = axis == 2 ? start + k : k;
+				index_f[1] += y;
+				index_f[2] += z;
+				index_m[1] += y;
+				index_m[2] += z;
+				block.fixed = buffer_f + fixedImage->ComputeOffset(index_f);
+				block.moving = buffer_m + movingImage->ComputeOffset(index_m);
+				block.x = index_f[0];
+				block.y = index_f[1];
+				block.z = index_f[2];
+				slabs[slab].Accumulate(block);
+			}
+		}
+	});
+	for(long long slab = 0; slab < numberSlabs; slab++){
+		visitor.Merge(slabs[slab]);
+	}
+	visitor.Finalize();
+}
+
+#endif
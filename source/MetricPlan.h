@@ -0,0 +1,142 @@
+/*
+// MetricPlan.h
+//
+// Description:
+//
+// This file plans the passes over the images an evaluation needs. Each metric declares the
+// artifacts it is computed from (see initMetricInfo in Metric_constants.h), and only the artifacts
+// of the requested metrics are computed:
+//
+// - contingency table: the foreground counts and the sums of the contingency table are accumulated
+//   in one pass over both images (ImageStatistics), or taken from the joint histogram of chunked
+//   arrays, sparse masks and bit masks without assembling the images.
+// - foreground moments (MAHLNBS) and voxel statistics (ICCORR, PROBDST): accumulated in the same
+//   pass as the contingency table (see MetricRegistry.h).
+// - voxel values: copies of the preprocessed images (VoxelPreprocessor), made in a second pass
+//   only for the test metrics of debug builds.
+// - foreground voxel lists (HDRFDST) and surfaces (AVGDIST, bAVD): each distance metric collects
+//   its point lists from the images while it is computed. The pass over the images finds the
+//   bounding boxes of both foregrounds and estimates their surfaces, from which the backend of each
+//   distance metric is chosen (see DistanceBackends.h).
+//
+// With -explain the plan is printed before the metrics are computed.
+//
+*/
+
+#ifndef _METRICPLAN
+#define _METRICPLAN
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include "Metric_constants.h"
+
+bool shouldUse(MetricId, char* options);
+
+// print the plan of each evaluation (option -explain)
+static bool explainPlan = false;
+
+// where the contingency table is computed from
+enum OverlapSource {OVERLAP_IMAGES, OVERLAP_CHUNKED, OVERLAP_SPARSE, OVERLAP_BITMASK};
+
+typedef struct MetricPlan{
+	unsigned artifacts;
+	OverlapSource source;
+	std::vector<std::string> passes;
+} MetricPlan;
+
+// artifacts needed by the requested metrics
+unsigned getRequiredArtifacts(char* options){
+	unsigned artifacts = 0;
+	for(int i=0 ; i< METRIC_COUNT; i++){
+		if(metricInfo[i].metrId != NULL && shouldUse((MetricId)i, options)){
+			artifacts |= metricInfo[i].artifacts;
+		}
+	}
+#ifdef _DEBUG
+	std::string opt = options;
+	if(opt.find("TESTMETRICS") != std::string::npos){
+		artifacts |= ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
+	}
+#endif
+	return artifacts;
+}
+
+// the requested metrics computed from one of the artifacts, e.g. "ICCORR, PROBDST"
+std::string getMetricsUsing(unsigned artifacts, char* options){
+	std::string metrics;
+	for(int i=0 ; i< METRIC_COUNT; i++){
+		if(metricInfo[i].metrId != NULL && (metricInfo[i].artifacts & artifacts) != 0 && shouldUse((MetricId)i, options)){
+			if(metrics != ""){
+				metrics += ", ";
+			}
+			metrics += metricInfo[i].metrId;
+		}
+	}
+	return metrics;
+}
+
+/*
+// Plans the evaluation of the requested metrics. source tells where the contingency table comes
+// from; images are read cropped to their foreground if cropped is set (-max-memory).
+*/
+MetricPlan planMetrics(char* options, OverlapSource source, bool cropped){
+	MetricPlan plan;
+	plan.artifacts = getRequiredArtifacts(options);
+	// the backends of the distance metrics are chosen from the extent of the foreground
+	if(plan.artifacts & (ARTIFACT_FOREGROUND_VOXELS | ARTIFACT_SURFACES)){
+		plan.artifacts |= ARTIFACT_DISTANCE_WORKLOAD;
+	}
+	plan.source = source;
+	std::string contingencyMetrics = getMetricsUsing(ARTIFACT_CONTINGENCY, options);
+	std::string contingency = "contingency table" + (contingencyMetrics != "" ? " (" + contingencyMetrics + ")" : std::string(""));
+	bool imagesNeeded = (plan.artifacts & ~ARTIFACT_CONTINGENCY) != 0;
+
+	if(source == OVERLAP_IMAGES){
+		plan.passes.push_back("read both images");
+		std::string pass = "scan both images: foreground counts, " + contingency;
+		if(plan.artifacts & ARTIFACT_MOMENTS){
+			pass += ", foreground moments (" + getMetricsUsing(ARTIFACT_MOMENTS, options) + ")";
+		}
+		if(plan.artifacts & ARTIFACT_VOXEL_STATISTICS){
+			pass += ", voxel statistics (" + getMetricsUsing(ARTIFACT_VOXEL_STATISTICS, options) + ")";
+		}
+		if(plan.artifacts & ARTIFACT_DISTANCE_WORKLOAD){
+			pass += ", foreground boxes and surface estimates (" + getMetricsUsing(ARTIFACT_FOREGROUND_VOXELS | ARTIFACT_SURFACES, options) + ")";
+		}
+		plan.passes.push_back(pass);
+	}
+	else{
+		const char* sources[] = {"", "the chunked arrays, chunk by chunk", "the sparse masks, run by run", "bit masks thresholded while decoding the images"};
+		plan.passes.push_back(std::string("joint histogram of ") + sources[source] + ": foreground counts, " + contingency);
+		if(imagesNeeded){
+			plan.passes.push_back(cropped ? "read both images cropped to their foreground" : "read both images");
+		}
+		if(plan.artifacts & ARTIFACT_MOMENTS){
+			plan.passes.push_back("scan both images: foreground moments (" + getMetricsUsing(ARTIFACT_MOMENTS, options) + ")");
+		}
+	}
+	if(plan.artifacts & ARTIFACT_VOXEL_VALUES){
+		plan.passes.push_back("copy the preprocessed voxel values of both images (" + getMetricsUsing(ARTIFACT_VOXEL_VALUES, options) + ")");
+	}
+	if(plan.artifacts & ARTIFACT_FOREGROUND_VOXELS){
+		plan.passes.push_back("collect the foreground voxel lists of both images (" + getMetricsUsing(ARTIFACT_FOREGROUND_VOXELS, options) + ")");
+	}
+	// each average distance metric builds its own surface and search grid
+	for(int i=0 ; i< METRIC_COUNT; i++){
+		if(metricInfo[i].metrId != NULL && (metricInfo[i].artifacts & ARTIFACT_SURFACES) != 0 && shouldUse((MetricId)i, options)){
+			plan.passes.push_back(std::string("collect the surface voxels and the search grid (") + metricInfo[i].metrId + ")");
+		}
+	}
+	return plan;
+}
+
+void printMetricPlan(const MetricPlan &plan){
+	std::cout << "Evaluation plan:" << std::endl;
+	for(size_t i = 0; i < plan.passes.size(); i++){
+		std::cout << "  " << (i + 1) << ". " << plan.passes[i] << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+#endif
@@ -0,0 +1,245 @@
+/*
+// MetricRegistry.h
+//
+// Description:
+//
+// This file contains the registry of the metrics. All accumulators listed in VoxelMetricVisitor
+// are fused into the pass of ImageStatistics over both images; those that provide an artifact of
+// the requested metrics are enabled (see MetricPlan.h). The results are written by the entries of
+// metricOutputs, in the canonical order of the output, from the values validateImage
+// (Segmentation.h) collects in a MetricContext.
+//
+// To add a metric computed voxel by voxel, write its accumulator (see MetricAccumulators.h), add it
+// to VoxelMetricVisitor, declare its artifact and its entry in metricInfo (Metric_constants.h) and
+// add a function writing its result from MetricContext::voxelMetrics to metricOutputs.
+//
+*/
+
+#ifndef _METRICREGISTRY
+#define _METRICREGISTRY
+
+#include <string>
+#include <sstream>
+#include <iostream>
+#include "Outputter.h"
+#include "MetricAccumulators.h"
+#include "DistanceBackends.h"
+#include "ContingencyTable.h"
+#include "MahalanobisDistanceMetric.h"
+#include "InterclassCorrelationMetric.h"
+#include "ProbabilisticDistanceMetric.h"
+#include "DiceCoefficientMetric.h"
+#include "JaccardCoefficientMetric.h"
+#include "RandIndexMetric.h"
+#include "CohinKappaMetric.h"
+#include "VolumeSimilarityCoefficient.h"
+#include "GlobalConsistencyError.h"
+#include "VariationOfInformationMetric.h"
+#include "MutualInformationMetric.h"
+#include "ClassicMeasures.h"
+
+bool shouldUse(MetricId, char* options);
+std::string getOptions(MetricId id, char* options);
+const std::string nooption = "NOOPTION";
+
+typedef FusedVisitor<
+	ForegroundCounts,
+	ForegroundBox,
+	SurfaceEstimate,
+	ContingencyTable,
+	MahalanobisMoments,
+	InterclassCorrelationMetric,
+	ProbabilisticDistanceMetric
+> VoxelMetricVisitor;
+
+// result of a metric computed by a task of the TaskGraph, written after all tasks have finished
+typedef struct MetricResult{
+	double value;
+	int milliseconds;
+	DistancePlan plan;  // of the distance metrics if their backend was planned
+} MetricResult;
+
+// sections of the output, written in this order
+enum MetricSection {SECTION_SIMILARITY, SECTION_DISTANCE, SECTION_CLASSIC};
+
+// what the results are written from, collected by validateImage
+typedef struct MetricContext{
+	ContingencyTable* contingencyTable;
+	VoxelMetricVisitor* voxelMetrics;  // NULL if the images were not swept
+	bool fuzzy;
+	double threshold;
+	bool millimeter;
+	char* options;
+	itk::DOMNode::Pointer xmlObject;
+	bool distancePlanned;    // the backends of the distance metrics were planned
+	double spacingDiagonal;  // bounds the error of the sampled distance metrics
+	MetricResult results[LEN];   // of the metrics computed by tasks
+	std::string details[LEN];    // kept by the metrics computed by tasks, printed before their value
+} MetricContext;
+
+typedef struct MetricOutput{
+	MetricId id;
+	MetricSection section;
+	void (*push)(MetricId id, MetricContext &context);
+} MetricOutput;
+
+static void pushDice(MetricId id, MetricContext &context){
+	DiceCoefficientMetric diceCoefficient(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, diceCoefficient.CalcDiceCoeff(), context.xmlObject, false, NULL);
+}
+
+static void pushJaccard(MetricId id, MetricContext &context){
+	JaccardCoefficientMetric jaccardCoefficient(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, jaccardCoefficient.CalcJaccardCoeff(), context.xmlObject, false, NULL);
+}
+
+static void pushKappa(MetricId id, MetricContext &context){
+	CohinKappaMetric cohinKappa(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, cohinKappa.CalcCohenKappa(), context.xmlObject, false, NULL);
+}
+
+static void pushRandIndex(MetricId id, MetricContext &context){
+	RandIndexMetric randIndex(context.contingencyTable, context.fuzzy, context.threshold);
+	double value = id == ADJRIND ? randIndex.CalcAdjustedRandIndex() : randIndex.CalcRandIndex();
+	pushValue(id, value, context.xmlObject, false, NULL);
+}
+
+static void pushInterclassCorrelation(MetricId id, MetricContext &context){
+	double value = context.voxelMetrics->Get<InterclassCorrelationMetric>().CalcInterClassCorrelationCoeff();
+	pushValue(id, value, context.xmlObject, false, NULL);
+}
+
+static void pushVolumeSimilarity(MetricId id, MetricContext &context){
+	VolumeSimilarityCoefficient volumetricSimilarity(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, volumetricSimilarity.CalcVolumeSimilarityCoefficient(), context.xmlObject, false, NULL);
+}
+
+static void pushMutualInformation(MetricId id, MetricContext &context){
+	MutualInformationMetric mutualInformation(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, mutualInformation.CalcMutualInformation(), context.xmlObject, false, NULL);
+}
+
+// HDRFDST, AVGDIST and bAVD with their backend and the error bound of sampling
+static void pushDistance(MetricId id, MetricContext &context){
+	const MetricResult &result = context.results[id];
+	if(context.distancePlanned){
+		printDistancePlan(id, result.plan);
+	}
+	std::cout << context.details[id];
+	pushValue(id, result.value, result.milliseconds, context.xmlObject, context.millimeter ? "millimeter" : "voxel");
+	if(context.distancePlanned){
+		pushDistancePlan(id, getDistanceBackendName(result.plan.backend), result.plan.predictedSeconds, context.xmlObject);
+		if(result.plan.sampleCell > 1){
+			pushErrorBound(id, (result.plan.sampleCell - 1) * context.spacingDiagonal, context.xmlObject);
+		}
+	}
+}
+
+static void pushMahalanobis(MetricId id, MetricContext &context){
+	pushValue(id, context.results[id].value, context.xmlObject, false, NULL);
+}
+
+static void pushVariationOfInformation(MetricId id, MetricContext &context){
+	VariationOfInformationMetric variationOfInformation(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, variationOfInformation.CalcVariationOfInformation(), context.xmlObject, false, NULL);
+}
+
+static void pushGlobalConsistencyError(MetricId id, MetricContext &context){
+	GlobalConsistencyError globalConsistencyError(context.contingencyTable, context.fuzzy, context.threshold);
+	pushValue(id, globalConsistencyError.CalcGlobalConsistencyError(), context.xmlObject, false, NULL);
+}
+
+static void pushProbabilisticDistance(MetricId id, MetricContext &context){
+	double value = context.voxelMetrics->Get<ProbabilisticDistanceMetric>().CalcJProbabilisticDistance();
+	pushValue(id, value, context.xmlObject, false, NULL);
+}
+
+// the measures of ClassicMeasures, the counts and volumes are integers when measured in voxels
+static void pushClassic(MetricId id, MetricContext &context){
+	ClassicMeasures classicMeasures(context.contingencyTable, context.fuzzy, context.threshold);
+	double value = 0;
+	bool asInteger = false;
+	const char* unit = NULL;
+	switch(id){
+	case AUC: value = classicMeasures.CalcAUC(); break;
+	case SNSVTY: value = classicMeasures.CalcSensitivity(); break;
+	case SPCFTY: value = classicMeasures.CalcSpecificity(); break;
+	case PRCISON: value = classicMeasures.CalcPrecision(); break;
+	case FMEASR:{
+		std::string beta_s = getOptions(id, context.options);
+		double beta = 1;
+		if(beta_s != nooption){
+			std::istringstream stm(beta_s);
+			stm >> beta;
+		}
+		value = classicMeasures.CalcFMeasure(beta);
+		break;
+	}
+	case ACURCY: value = classicMeasures.CalcAccuracy(); break;
+	case FALLOUT: value = classicMeasures.CalcFallout(); break;
+	case TP: value = classicMeasures.getTP(); asInteger = true; unit = "voxel"; break;
+	case FP: value = classicMeasures.getFP(); asInteger = true; unit = "voxel"; break;
+	case TN: value = classicMeasures.getTN(); asInteger = true; unit = "voxel"; break;
+	case FN: value = classicMeasures.getFN(); asInteger = true; unit = "voxel"; break;
+	case REFVOL:
+	case SEGVOL:
+		if(context.millimeter){
+			value = id == REFVOL ? classicMeasures.CalcReferenceVolumeInMl() : classicMeasures.CalcSegmentedVolumeInMl();
+			unit = "milliliter";
+		}
+		else{
+			value = id == REFVOL ? classicMeasures.CalcReferenceVolumeInVoxel() : classicMeasures.CalcSegmentedVolumeInVoxel();
+			asInteger = true;
+			unit = "voxel";
+		}
+		break;
+	default: break;
+	}
+	pushValue(id, value, context.xmlObject, asInteger, unit);
+}
+
+// the metrics in the order of the output
+static const MetricOutput metricOutputs[] = {
+	{DICE, SECTION_SIMILARITY, pushDice},
+	{JACRD, SECTION_SIMILARITY, pushJaccard},
+	{AUC, SECTION_SIMILARITY, pushClassic},
+	{KAPPA, SECTION_SIMILARITY, pushKappa},
+	{RNDIND, SECTION_SIMILARITY, pushRandIndex},
+	{ADJRIND, SECTION_SIMILARITY, pushRandIndex},
+	{ICCORR, SECTION_SIMILARITY, pushInterclassCorrelation},
+	{VOLSMTY, SECTION_SIMILARITY, pushVolumeSimilarity},
+	{MUTINF, SECTION_SIMILARITY, pushMutualInformation},
+	{HDRFDST, SECTION_DISTANCE, pushDistance},
+	{AVGDIST, SECTION_DISTANCE, pushDistance},
+	{bAVD, SECTION_DISTANCE, pushDistance},
+	{MAHLNBS, SECTION_DISTANCE, pushMahalanobis},
+	{VARINFO, SECTION_DISTANCE, pushVariationOfInformation},
+	{GCOERR, SECTION_DISTANCE, pushGlobalConsistencyError},
+	{PROBDST, SECTION_DISTANCE, pushProbabilisticDistance},
+	{SNSVTY, SECTION_CLASSIC, pushClassic},
+	{SPCFTY, SECTION_CLASSIC, pushClassic},
+	{PRCISON, SECTION_CLASSIC, pushClassic},
+	{FMEASR, SECTION_CLASSIC, pushClassic},
+	{ACURCY, SECTION_CLASSIC, pushClassic},
+	{FALLOUT, SECTION_CLASSIC, pushClassic},
+	{TP, SECTION_CLASSIC, pushClassic},
+	{FP, SECTION_CLASSIC, pushClassic},
+	{TN, SECTION_CLASSIC, pushClassic},
+	{FN, SECTION_CLASSIC, pushClassic},
+	{REFVOL, SECTION_CLASSIC, pushClassic},
+	{SEGVOL, SECTION_CLASSIC, pushClassic}
+};
+
+/*
+// Writes the results of the requested metrics of a section.
+*/
+static void pushMetrics(MetricSection section, MetricContext &context){
+	for(size_t i = 0; i < sizeof(metricOutputs) / sizeof(metricOutputs[0]); i++){
+		const MetricOutput &output = metricOutputs[i];
+		if(output.section == section && shouldUse(output.id, context.options)){
+			output.push(output.id, context);
+		}
+	}
+}
+
+#endif
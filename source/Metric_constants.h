@@ -31,6 +31,18 @@
 
 #include "Global.h"
 
+// data the metrics are computed from, each metric declares the artifacts it needs (see MetricPlan.h)
+enum Artifact {
+	ARTIFACT_CONTINGENCY = 1,       // contingency table (TP, FP, FN, TN)
+	ARTIFACT_VOXEL_VALUES = 2,      // copies of the preprocessed voxel values of both images
+	ARTIFACT_MOMENTS = 4,           // mean and covariance of the foreground voxel indices
+	ARTIFACT_FOREGROUND_VOXELS = 8, // lists of the foreground voxels
+	ARTIFACT_SURFACES = 16,         // surface voxels and search grid
+	ARTIFACT_VOXEL_STATISTICS = 32, // sums over the voxel values of both images
+	ARTIFACT_DISTANCE_WORKLOAD = 64, // foreground boxes and surface estimates of both images (DistanceBackends.h)
+	ARTIFACT_DISTANCE_FIELDS = 128  // distance transforms of both images shared by the metrics using them (TaskGraph.h)
+};
+
 typedef struct MetricInfo{
 	const char* metrId;
 	const char* metrSymb;
@@ -38,6 +50,7 @@ typedef struct MetricInfo{
 	const char* help;
 	bool similarity;
 	bool testmetric;
+	unsigned artifacts;
 } MetricInfo;
 
 MetricInfo* metricInfo;
@@ -53,7 +66,7 @@ enum MetricId  {DICE, JACRD, AUC, KAPPA, RNDIND, ADJRIND, ICCORR, VOLSMTY, MUTIN
 };
 
 void initMetricInfo(){
-  metricInfo = new MetricInfo[LEN];
+  metricInfo = new MetricInfo[LEN]();
   MetricInfo* info = &metricInfo[DICE];
   info->metrId = "DICE";
   info->metrSymb="DICE";
@@ -61,6 +74,7 @@ void initMetricInfo(){
   info->help ="Dice Coefficient (F1-Measure)";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[JACRD];
   info->metrId = "JACRD";
@@ -69,6 +83,7 @@ void initMetricInfo(){
   info->help ="Jaccard Coefficient";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[SNSVTY];
   info->metrId = "SNSVTY";
@@ -77,6 +92,7 @@ void initMetricInfo(){
   info->help ="Sensitivity (Recall, true positive rate)";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[SPCFTY];
   info->metrId = "SPCFTY";
@@ -85,6 +101,7 @@ void initMetricInfo(){
   info->help ="Specificity (true negative rate)";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[GCOERR];
   info->metrId = "GCOERR";
@@ -93,6 +110,7 @@ void initMetricInfo(){
   info->help ="Global Consistency Error";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[VOLSMTY];
   info->metrId = "VOLSMTY";
@@ -101,6 +119,7 @@ void initMetricInfo(){
   info->help ="Volumetric Similarity Coefficient";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[KAPPA];
   info->metrId = "KAPPA";
@@ -109,6 +128,7 @@ void initMetricInfo(){
   info->help ="Cohen Kappa";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[AUC];
   info->metrId = "AUC";
@@ -117,6 +137,7 @@ void initMetricInfo(){
   info->help ="Area under ROC Curve";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[RNDIND];
   info->metrId = "RNDIND";
@@ -125,6 +146,7 @@ void initMetricInfo(){
   info->help ="Rand Index";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[ADJRIND];
   info->metrId = "ADJRIND";
@@ -133,6 +155,7 @@ void initMetricInfo(){
   info->help ="Adjusted Rand Index";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[ICCORR];
   info->metrId = "ICCORR";
@@ -141,6 +164,7 @@ void initMetricInfo(){
   info->help ="Interclass Correlation";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_VOXEL_STATISTICS;
 
   info = &metricInfo[AVGDIST];
   info->metrId = "AVGDIST";
@@ -149,6 +173,7 @@ void initMetricInfo(){
   info->help ="Average Hausdorff Distance";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_SURFACES;
   
   /*
   info = &metricInfo[AVGDIST_D];
@@ -158,6 +183,7 @@ void initMetricInfo(){
   info->help ="Average Hausdorff Distance Directed";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_SURFACES;
   */
   
   info = &metricInfo[bAVD];
@@ -167,6 +193,7 @@ void initMetricInfo(){
   info->help ="Balanced Average Hausdorff Distance (new proposed metric, publication submitted)";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_SURFACES;
   
   
   
@@ -177,6 +204,7 @@ void initMetricInfo(){
   info->help ="Hausdorff Distance, HDRFDST@0.95@ -> use 0.95 quantile to avoid outlier, default 1 (=exact distance)";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_FOREGROUND_VOXELS;
 
   info = &metricInfo[MUTINF];
   info->metrId = "MUTINF";
@@ -187,6 +215,7 @@ void initMetricInfo(){
   info->help ="Mutual Information";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[VARINFO];
   info->metrId = "VARINFO";
@@ -195,6 +224,7 @@ void initMetricInfo(){
   info->help ="Variation of Information";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[PROBDST];
   info->metrId = "PROBDST";
@@ -203,6 +233,7 @@ void initMetricInfo(){
   info->help ="Probabilistic Distance";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_VOXEL_STATISTICS;
 
   info = &metricInfo[MAHLNBS];
   info->metrId = "MAHLNBS";
@@ -211,6 +242,7 @@ void initMetricInfo(){
   info->help ="Mahanabolis Distance";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_MOMENTS;
 
   info = &metricInfo[PRCISON];
   info->metrId = "PRCISON";
@@ -219,6 +251,7 @@ void initMetricInfo(){
   info->help ="Precision (Confidence)";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[FMEASR];
   info->metrId = "FMEASR";
@@ -227,6 +260,7 @@ void initMetricInfo(){
   info->help ="F-Measure (FMEASR@0.5@ -> beta=0.5, defalut beta=1)";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[ACURCY];
   info->metrId = "ACURCY";
@@ -235,6 +269,7 @@ void initMetricInfo(){
   info->help ="Accuracy";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[FALLOUT];
   info->metrId = "FALLOUT";
@@ -243,6 +278,7 @@ void initMetricInfo(){
   info->help ="Fallout (false positive rate)";
   info->similarity =false;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
   
   info = &metricInfo[TP];
   info->metrId = "TP";
@@ -251,6 +287,7 @@ void initMetricInfo(){
   info->help ="true positive";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
   
   info = &metricInfo[TN];
   info->metrId = "TN";
@@ -259,6 +296,7 @@ void initMetricInfo(){
   info->help ="true negative";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[FP];
   info->metrId = "FP";
@@ -267,6 +305,7 @@ void initMetricInfo(){
   info->help ="false positive";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[FN];
   info->metrId = "FN";
@@ -275,6 +314,7 @@ void initMetricInfo(){
   info->help ="false negative";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   info = &metricInfo[SEGVOL];
   info->metrId = "SEGVOL";
@@ -283,6 +323,7 @@ void initMetricInfo(){
   info->help ="segmented volume";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
   
    info = &metricInfo[REFVOL];
   info->metrId = "REFVOL";
@@ -291,6 +332,7 @@ void initMetricInfo(){
   info->help ="reference volume";
   info->similarity =true;
   info->testmetric =false;
+  info->artifacts = ARTIFACT_CONTINGENCY;
 
   
 #ifdef _DEBUG
@@ -301,6 +343,7 @@ void initMetricInfo(){
   info->help ="HDRFDSTITK";
   info->similarity =false;
   info->testmetric =true;
+  info->artifacts = ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
 
   info = &metricInfo[HDRFDSTNAIVE];
   info->metrId = "HDRFDSTNAIVE";
@@ -309,6 +352,7 @@ void initMetricInfo(){
   info->help ="HDRFDSTNAIVE";
   info->similarity =false;
   info->testmetric =true;
+  info->artifacts = ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
 
   info = &metricInfo[AVGDISTITK];
   info->metrId = "AVGDISTITK";
@@ -317,6 +361,7 @@ void initMetricInfo(){
   info->help ="AVGDISTITK";
   info->similarity =false;
   info->testmetric =true;
+  info->artifacts = ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
 
   info = &metricInfo[MEANTOMEAN];
   info->metrId = "MEANTOMEAN";
@@ -325,6 +370,7 @@ void initMetricInfo(){
   info->help ="MEANTOMEAN";
   info->similarity =false;
   info->testmetric =true;
+  info->artifacts = ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
 
   info = &metricInfo[TEST];
   info->metrId = "TEST";
@@ -333,6 +379,7 @@ void initMetricInfo(){
   info->help ="TEST";
   info->similarity =true;
   info->testmetric =true;
+  info->artifacts = ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
 
 info = &metricInfo[MAHAVDIST];
   info->metrId = "MAHAVDIST";
@@ -341,6 +388,7 @@ info = &metricInfo[MAHAVDIST];
   info->help ="Mahalanobis Average Hausdorff Distance";
   info->similarity =false;
   info->testmetric =true;
+  info->artifacts = ARTIFACT_VOXEL_VALUES | ARTIFACT_SURFACES;
 #endif
 
 }
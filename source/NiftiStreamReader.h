@@ -0,0 +1,241 @@
+/*
+// NiftiStreamReader.h
+//
+// Description:
+//
+// This file reads NIfTI-1 and NIfTI-2 images (.nii, .nii.gz) from sequential byte sources such
+// as stdin and named pipes, which cannot be read by ITK's ImageIO because they cannot be seeked.
+// The header is parsed while the stream is read and the voxel data is decoded straight into the
+// voxel buffer; gzip compressed streams are detected by their magic number. No temporary files
+// are written.
+//
+// The input path "-" denotes stdin, named pipes (FIFOs) are detected by their file type.
+//
+*/
+
+#ifndef _NIFTISTREAMREADER
+#define _NIFTISTREAMREADER
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "ByteSource.h"
+#include "ImageImport.h"
+
+#ifdef _WINOS
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+typedef struct NiftiHeader{
+	int headerSize;
+	bool swap;
+	RawPixelType type;
+	long long size[3];
+	double spacing[3];
+	long long voxOffset;
+	double slope;
+	double inter;
+} NiftiHeader;
+
+template<class T>
+T niftiValue(const unsigned char *p, bool swap){
+	T value;
+	memcpy(&value, p, sizeof(T));
+	if(swap){
+		swapBytes(value);
+	}
+	return value;
+}
+
+RawPixelType niftiPixelType(int datatype){
+	switch(datatype){
+		case 2: return RAW_UINT8;
+		case 4: return RAW_INT16;
+		case 8: return RAW_INT32;
+		case 16: return RAW_FLOAT32;
+		case 64: return RAW_FLOAT64;
+		case 256: return RAW_INT8;
+		case 512: return RAW_UINT16;
+		case 768: return RAW_UINT32;
+		case 1024: return RAW_INT64;
+		case 1280: return RAW_UINT64;
+		default: return RAW_UNKNOWN;
+	}
+}
+
+NiftiHeader readNiftiHeader(ByteSource *source){
+	NiftiHeader header;
+	unsigned char h[540];
+	if(!source->ReadFully((char*)h, 4)){
+		throw std::runtime_error("Empty NIfTI stream");
+	}
+	// the header size tells NIfTI-1 from NIfTI-2 and the byte order of the file
+	int headerSize = niftiValue<int>(h, false);
+	header.swap = false;
+	if(headerSize != 348 && headerSize != 540){
+		header.swap = true;
+		headerSize = niftiValue<int>(h, true);
+	}
+	if(headerSize != 348 && headerSize != 540){
+		throw std::runtime_error("Not a NIfTI image");
+	}
+	header.headerSize = headerSize;
+	if(!source->ReadFully((char*)h + 4, headerSize - 4)){
+		throw std::runtime_error("Truncated NIfTI header");
+	}
+
+	long long dim[8];
+	double pixdim[8];
+	int datatype;
+	if(headerSize == 348){
+		if(memcmp(h + 344, "ni1", 3) == 0){
+			throw std::runtime_error("NIfTI image pairs (.hdr/.img) cannot be read from a stream");
+		}
+		if(memcmp(h + 344, "n+1", 3) != 0){
+			throw std::runtime_error("Not a NIfTI-1 image");
+		}
+		for(int i = 0; i < 8; i++){
+			dim[i] = niftiValue<short>(h + 40 + 2*i, header.swap);
+			pixdim[i] = niftiValue<float>(h + 76 + 4*i, header.swap);
+		}
+		datatype = niftiValue<short>(h + 70, header.swap);
+		header.voxOffset = (long long)niftiValue<float>(h + 108, header.swap);
+		header.slope = niftiValue<float>(h + 112, header.swap);
+		header.inter = niftiValue<float>(h + 116, header.swap);
+	}
+	else{
+		if(memcmp(h + 4, "n+2", 3) != 0){
+			throw std::runtime_error("Not a NIfTI-2 image");
+		}
+		for(int i = 0; i < 8; i++){
+			dim[i] = niftiValue<long long>(h + 16 + 8*i, header.swap);
+			pixdim[i] = niftiValue<double>(h + 104 + 8*i, header.swap);
+		}
+		datatype = niftiValue<short>(h + 12, header.swap);
+		header.voxOffset = niftiValue<long long>(h + 168, header.swap);
+		header.slope = niftiValue<double>(h + 176, header.swap);
+		header.inter = niftiValue<double>(h + 184, header.swap);
+	}
+
+	header.type = niftiPixelType(datatype);
+	if(header.type == RAW_UNKNOWN){
+		throw std::runtime_error("Unsupported NIfTI data type");
+	}
+	if(dim[0] < 2 || dim[0] > 7){
+		throw std::runtime_error("Invalid NIfTI dimensions");
+	}
+	for(int i = 4; i <= dim[0]; i++){
+		if(dim[i] > 1){
+			throw std::runtime_error("Only 2D and 3D NIfTI images are supported");
+		}
+	}
+	for(int a = 0; a < 3; a++){
+		header.size[a] = a < dim[0] ? dim[a+1] : 1;
+		header.spacing[a] = a < dim[0] && pixdim[a+1] != 0 ? fabs(pixdim[a+1]) : 1;
+		if(header.size[a] < 1){
+			throw std::runtime_error("Invalid NIfTI dimensions");
+		}
+	}
+	return header;
+}
+
+template<class T>
+void scaleNiftiValues(const char *data, long long count, double slope, double inter, float *values){
+	const T *v = (const T*)data;
+	for(long long i = 0; i < count; i++){
+		values[i] = (float)(v[i] * slope + inter);
+	}
+}
+
+/*
+// Decodes a NIfTI image from an uncompressed stream positioned at the beginning of the header
+*/
+ImageType::Pointer decodeNiftiStream(ByteSource *source){
+	NiftiHeader header = readNiftiHeader(source);
+
+	// skip header extensions
+	if(header.voxOffset > header.headerSize && !source->Skip(header.voxOffset - header.headerSize)){
+		throw std::runtime_error("Truncated NIfTI stream");
+	}
+	long long count = header.size[0] * header.size[1] * header.size[2];
+	int pixelSize = rawPixelSize(header.type);
+	std::vector<char> data(count * pixelSize);
+	if(!source->ReadFully(&data[0], data.size())){
+		throw std::runtime_error("Truncated NIfTI stream");
+	}
+	if(header.swap){
+		swapRawBuffer(&data[0], count, pixelSize);
+	}
+
+	// apply the intensity scaling of the header as ITK's NIfTI reader does
+	if(header.slope != 0 && (header.slope != 1 || header.inter != 0)){
+		std::vector<float> values(count);
+		switch(header.type){
+			case RAW_UINT8: scaleNiftiValues<unsigned char>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_INT8: scaleNiftiValues<signed char>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_UINT16: scaleNiftiValues<unsigned short>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_INT16: scaleNiftiValues<short>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_UINT32: scaleNiftiValues<unsigned int>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_INT32: scaleNiftiValues<int>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_UINT64: scaleNiftiValues<unsigned long long>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_INT64: scaleNiftiValues<long long>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_FLOAT32: scaleNiftiValues<float>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			case RAW_FLOAT64: scaleNiftiValues<double>(&data[0], count, header.slope, header.inter, &values[0]); break;
+			default: throw std::runtime_error("Unsupported pixel type");
+		}
+		std::vector<char>().swap(data);
+		return importRawImage(&values[0], RAW_FLOAT32, header.size, header.spacing);
+	}
+	return importRawImage(&data[0], header.type, header.size, header.spacing);
+}
+
+/*
+// Decodes a NIfTI image (.nii or .nii.gz) from a sequential source
+*/
+ImageType::Pointer readNiftiStream(ByteSource *source){
+	PeekableByteSource peekable(source);
+	unsigned char magic[2];
+	if(peekable.Peek((char*)magic, 2) == 2 && magic[0] == 0x1f && magic[1] == 0x8b){
+		InflateByteSource inflater(&peekable, InflateByteSource::INFLATE_AUTO);
+		return decodeNiftiStream(&inflater);
+	}
+	return decodeNiftiStream(&peekable);
+}
+
+bool isStdin(const char* path){
+	return std::string(path) == "-";
+}
+
+// true for stdin ("-") and named pipes
+bool isStreamInput(const char* path){
+	if(isStdin(path)){
+		return true;
+	}
+#ifndef _WINOS
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISFIFO(st.st_mode);
+#else
+	return false;
+#endif
+}
+
+ImageType::Pointer loadStreamImage(const char* path){
+	if(isStdin(path)){
+#ifdef _WINOS
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		StdioByteSource source(stdin, false);
+		return readNiftiStream(&source);
+	}
+	FILE *file = fopen(path, "rb");
+	if(file == NULL){
+		throw std::runtime_error(std::string("Cannot open ") + path);
+	}
+	StdioByteSource source(file, true);
+	return readNiftiStream(&source);
+}
+
+#endif
@@ -0,0 +1,271 @@
+/*
+// NumpyReader.h
+//
+// Description:
+//
+// This file reads segmentations stored as numpy arrays (.npy, .npz) without converting them to
+// another image format. Uncompressed arrays (.npy files and members stored uncompressed in .npz
+// archives) are memory mapped and rescaled from the mapping into the image evaluated, without
+// reading them into a buffer first. Compressed .npz members are decoded into a buffer of their
+// type and rescaled from there; 8 bit arrays are decoded straight into the image and rescaled in
+// place.
+//
+// Arrays in C order are indexed [z,y,x] (or [y,x] for 2D arrays), arrays in Fortran order [x,y,z].
+// numpy arrays carry no voxel spacing: it is taken from the option -spacing or a sidecar file
+// <path>.spacing containing "sx sy sz", and defaults to 1. A member of an .npz archive is selected
+// with archive.npz!/member.npy, otherwise the first array in the archive is used.
+//
+*/
+
+#ifndef _NUMPYREADER
+#define _NUMPYREADER
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <stdexcept>
+#include "ByteSource.h"
+#include "ZipArchive.h"
+#include "ImageImport.h"
+
+typedef struct NumpyHeader{
+	RawPixelType type;
+	bool fortranOrder;
+	int ndims;
+	long long shape[8];
+	// number of bytes of magic string and header preceding the array data
+	long long headerLength;
+} NumpyHeader;
+
+bool endsWith(const std::string &s, const std::string &ending){
+	return s.size() >= ending.size() && s.compare(s.size() - ending.size(), ending.size(), ending) == 0;
+}
+
+bool isNumpyFile(const char* path){
+	std::string p = path;
+	return endsWith(p, ".npy") || endsWith(p, ".npz") || p.find(".npz!/") != std::string::npos;
+}
+
+RawPixelType parseNumpyType(const std::string &descr){
+	if(descr.size() < 3){
+		return RAW_UNKNOWN;
+	}
+	char byteorder = descr[0];
+	std::string kind = descr.substr(1);
+	if(byteorder == '>' && kind != "u1" && kind != "i1" && kind != "b1"){
+		// big endian data
+		return RAW_UNKNOWN;
+	}
+	if(kind == "b1" || kind == "u1") return RAW_UINT8;
+	if(kind == "i1") return RAW_INT8;
+	if(kind == "u2") return RAW_UINT16;
+	if(kind == "i2") return RAW_INT16;
+	if(kind == "u4") return RAW_UINT32;
+	if(kind == "i4") return RAW_INT32;
+	if(kind == "u8") return RAW_UINT64;
+	if(kind == "i8") return RAW_INT64;
+	if(kind == "f4") return RAW_FLOAT32;
+	if(kind == "f8") return RAW_FLOAT64;
+	return RAW_UNKNOWN;
+}
+
+// returns the value following 'key': in the python dict literal of the npy header
+std::string numpyHeaderValue(const std::string &dict, const std::string &key){
+	size_t pos = dict.find("'" + key + "'");
+	if(pos == std::string::npos){
+		throw std::runtime_error("Invalid npy header, missing " + key);
+	}
+	pos = dict.find(':', pos);
+	size_t start = pos == std::string::npos ? pos : dict.find_first_not_of(" ", pos + 1);
+	if(start == std::string::npos){
+		throw std::runtime_error("Invalid npy header, missing value of " + key);
+	}
+	size_t end;
+	if(dict[start] == '\''){
+		end = dict.find('\'', start + 1);
+		start++;
+	}
+	else if(dict[start] == '('){
+		end = dict.find(')', start);
+		start++;
+	}
+	else{
+		end = dict.find_first_of(",}", start);
+	}
+	if(end == std::string::npos){
+		throw std::runtime_error("Invalid npy header, unterminated value of " + key);
+	}
+	return dict.substr(start, end - start);
+}
+
+NumpyHeader readNumpyHeader(ByteSource *source){
+	NumpyHeader header;
+	unsigned char preamble[10];
+	if(!source->ReadFully((char*)preamble, 10) || memcmp(preamble, "\x93NUMPY", 6) != 0){
+		throw std::runtime_error("Not a npy array");
+	}
+	long long dictLength;
+	header.headerLength = 10;
+	if(preamble[6] == 1){
+		dictLength = preamble[8] | (preamble[9] << 8);
+	}
+	else{
+		unsigned char more[2];
+		if(!source->ReadFully((char*)more, 2)){
+			throw std::runtime_error("Invalid npy header");
+		}
+		dictLength = preamble[8] | (preamble[9] << 8) | (more[0] << 16) | ((long long)more[1] << 24);
+		header.headerLength = 12;
+	}
+	std::string dict(dictLength, ' ');
+	if(!source->ReadFully(&dict[0], dictLength)){
+		throw std::runtime_error("Invalid npy header");
+	}
+	header.headerLength += dictLength;
+
+	std::string descr = numpyHeaderValue(dict, "descr");
+	header.type = parseNumpyType(descr);
+	if(header.type == RAW_UNKNOWN){
+		throw std::runtime_error("Unsupported npy data type: " + descr);
+	}
+	header.fortranOrder = numpyHeaderValue(dict, "fortran_order").find("True") != std::string::npos;
+
+	// singleton axes (e.g. channels) are dropped
+	std::string shape = numpyHeaderValue(dict, "shape");
+	header.ndims = 0;
+	const char *p = shape.c_str();
+	while(*p != 0){
+		char *end;
+		long long dim = strtoll(p, &end, 10);
+		if(end == p){
+			p++;
+			continue;
+		}
+		p = end;
+		if(dim != 1 && header.ndims < 8){
+			header.shape[header.ndims++] = dim;
+		}
+	}
+	if(header.ndims < 2 || header.ndims > 3){
+		throw std::runtime_error("Only 2D and 3D numpy arrays are supported");
+	}
+	return header;
+}
+
+// image size in ITK order (x fastest)
+void numpyImageSize(const NumpyHeader &header, long long *size){
+	size[2] = 1;
+	for(int i = 0; i < header.ndims; i++){
+		if(header.fortranOrder){
+			size[i] = header.shape[i];
+		}
+		else{
+			size[i] = header.shape[header.ndims - 1 - i];
+		}
+	}
+}
+
+long long numpyDataLength(const NumpyHeader &header){
+	long long length = rawPixelSize(header.type);
+	for(int i = 0; i < header.ndims; i++){
+		length *= header.shape[i];
+	}
+	return length;
+}
+
+// maps the uncompressed array data starting at offset in the file and rescales it into the image
+ImageType::Pointer importMappedNumpyArray(const std::string &filename, long long offset, const NumpyHeader &header, const double *spacing){
+	long long size[3];
+	numpyImageSize(header, size);
+	MappedFile mapped(filename, offset + header.headerLength, numpyDataLength(header));
+	return importRawImage(mapped.GetData(), header.type, size, spacing);
+}
+
+ImageType::Pointer loadNumpyImage(const char* path){
+	std::string p = path;
+	std::string filename = p;
+	std::string member = "";
+	size_t sep = p.find(".npz!/");
+	if(sep != std::string::npos){
+		filename = p.substr(0, sep + 4);
+		member = p.substr(sep + 6);
+	}
+	double spacing[3];
+	resolveInputSpacing(filename, spacing);
+
+	if(endsWith(filename, ".npy")){
+		FileByteSource source(filename);
+		NumpyHeader header = readNumpyHeader(&source);
+		long long fileLength = itksys::SystemTools::FileLength(filename);
+		if(fileLength < header.headerLength + numpyDataLength(header)){
+			throw std::runtime_error("Truncated npy file: " + filename);
+		}
+		return importMappedNumpyArray(filename, 0, header, spacing);
+	}
+
+	ZipArchive archive(filename);
+	const ZipEntry *entry = NULL;
+	if(member != ""){
+		entry = archive.FindEntry(member);
+		if(entry == NULL){
+			entry = archive.FindEntry(member + ".npy");
+		}
+		if(entry == NULL){
+			throw std::runtime_error("Array not found in archive: " + member);
+		}
+	}
+	else{
+		for(size_t i = 0; i < archive.entries.size() && entry == NULL; i++){
+			if(endsWith(archive.entries[i].name, ".npy")){
+				entry = &archive.entries[i];
+			}
+		}
+		if(entry == NULL){
+			throw std::runtime_error("No array found in archive: " + filename);
+		}
+		if(archive.entries.size() > 1){
+			std::cout << "Using array " << entry->name << " of " << filename << std::endl;
+		}
+	}
+
+	ByteSource *source = archive.OpenEntry(*entry);
+	try
+	{
+		NumpyHeader header = readNumpyHeader(source);
+		if(entry->method == 0){
+			// the mapping must not reach beyond the member (or the file), reading there faults
+			long long dataOffset = archive.GetDataOffset(*entry);
+			if(entry->uncompressedSize < header.headerLength + numpyDataLength(header)
+				|| itksys::SystemTools::FileLength(filename) < dataOffset + header.headerLength + numpyDataLength(header)){
+				throw std::runtime_error("Truncated array in archive: " + entry->name);
+			}
+			delete source;
+			source = NULL;
+			return importMappedNumpyArray(filename, dataOffset, header, spacing);
+		}
+		// compressed member: 8 bit arrays are decoded straight into the voxel buffer
+		long long size[3];
+		numpyImageSize(header, size);
+		ImageType::Pointer img = allocateImportImage(size, spacing);
+		std::vector<char> data;
+		char* buffer = (char*)img->GetBufferPointer();
+		if(rawPixelSize(header.type) != (int)sizeof(pixeltype)){
+			data.resize(numpyDataLength(header));
+			buffer = &data[0];
+		}
+		if(!source->ReadFully(buffer, numpyDataLength(header))){
+			throw std::runtime_error("Truncated array in archive: " + entry->name);
+		}
+		delete source;
+		source = NULL;
+		rescaleRawToPixels(buffer, header.type, size[0] * size[1] * size[2], img->GetBufferPointer());
+		return img;
+	}
+	catch(...)
+	{
+		delete source;
+		throw;
+	}
+}
+
+#endif
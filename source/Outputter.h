@@ -34,6 +34,8 @@
 #include <itkDOMNodeXMLWriter.h>
 #include "itkFileTools.h"
 #include "Metric_constants.h"
+#include "MemoryUsage.h"
+#include "ProgressEvents.h"
 
 
 
@@ -55,7 +57,7 @@ itk::DOMNode*  AddNodeWithAttributeIfNotExists(itk::DOMNode* parentNode, const c
 }
 
 
-itk::DOMNode::Pointer  OpenSegmentationResultXML(const char* targtfile, const char* fixedImage, const char* movingImage, int num_pt_f, int num_pt_m, int num_intersec){
+itk::DOMNode::Pointer  OpenSegmentationResultXML(const char* targtfile, const char* fixedImage, const char* movingImage, long long num_pt_f, long long num_pt_m, long long num_intersec){
 	if(targtfile != NULL){
 
 		const char* xMLFileName = targtfile;
@@ -74,15 +76,15 @@ itk::DOMNode::Pointer  OpenSegmentationResultXML(const char* targtfile, const ch
 		char val [50];
 
 		AddNodeWithAttributeIfNotExists(dOMObject, "fixed-image", "filename", fixedImage);
-		sprintf(val, "%d", num_pt_f-num_intersec);
+		sprintf(val, "%lld", num_pt_f-num_intersec);
 		AddNodeWithAttributeIfNotExists(dOMObject, "fixed-image", "nonzeropoints", val);
-		sprintf(val, "%d", num_intersec);
+		sprintf(val, "%lld", num_intersec);
 		AddNodeWithAttributeIfNotExists(dOMObject, "fixed-image", "intersection", val);
 
 		AddNodeWithAttributeIfNotExists(dOMObject, "moving-image", "filename", movingImage);
-		sprintf(val, "%d", num_pt_m-num_intersec);
+		sprintf(val, "%lld", num_pt_m-num_intersec);
 		AddNodeWithAttributeIfNotExists(dOMObject, "moving-image", "nonzeropoints", val);
-		sprintf(val, "%d", num_intersec);
+		sprintf(val, "%lld", num_intersec);
 		AddNodeWithAttributeIfNotExists(dOMObject, "moving-image", "intersection", val);
 
 
@@ -107,6 +109,22 @@ void  pushTotalExecutionTime(long time,  itk::DOMNode::Pointer xmlObject){
 	}
 }
 
+void  pushStartupTime(long time,  itk::DOMNode::Pointer xmlObject){
+	if(xmlObject != NULL){
+		char val [50];
+		sprintf(val, "%ld", time);
+		const char* name="time";
+		itk::DOMNode* node = dOMObject->GetChild(name);
+		if(node == NULL){ 
+			itk::DOMNode::Pointer n = itk::DOMNode::New();
+			node = (itk::DOMNode *)n;
+			dOMObject->AddChildAtEnd( node );
+			node->SetName( name); 
+		}
+		node->SetAttribute( "startup-time", val );
+	}
+}
+
 void  pushDimentions(int max_x, int max_y, int max_z, double vsp_x, double vsp_y, double vsp_z, itk::DOMNode::Pointer xmlObject){
 	if(xmlObject != NULL){
 		char* name="dimention";
@@ -137,6 +155,88 @@ void  pushDimentions(int max_x, int max_y, int max_z, double vsp_x, double vsp_y
 	}
 }
 
+void  pushRegionOfInterest(long long x, long long y, long long z, long long size_x, long long size_y, long long size_z, itk::DOMNode::Pointer xmlObject){
+	if(xmlObject != NULL){
+		itk::DOMNode* node = AddNodeWithAttributeIfNotExists(dOMObject, "roi", NULL, NULL);
+		char val [50];
+		sprintf(val, "%lld", x);
+		node->SetAttribute( "x", val );
+		sprintf(val, "%lld", y);
+		node->SetAttribute( "y", val );
+		sprintf(val, "%lld", z);
+		node->SetAttribute( "z", val );
+		sprintf(val, "%lld", size_x);
+		node->SetAttribute( "size_x", val );
+		sprintf(val, "%lld", size_y);
+		node->SetAttribute( "size_y", val );
+		sprintf(val, "%lld", size_z);
+		node->SetAttribute( "size_z", val );
+	}
+}
+
+void  pushMemoryUsage(const std::vector<MemoryStage> &stages, itk::DOMNode::Pointer xmlObject){
+	if(xmlObject != NULL){
+		itk::DOMNode* node = AddNodeWithAttributeIfNotExists(dOMObject, "peak-memory", "unit", "kilobyte");
+		char val [50];
+		for(size_t i = 0; i < stages.size(); i++){
+			sprintf(val, "%lld", stages[i].peakKB);
+			node->SetAttribute( stages[i].name, val );
+		}
+	}
+}
+
+void  pushMemoryPlan(long long budget, long long estimate, const char* overlapStrategy, const char* imageStrategy, itk::DOMNode::Pointer xmlObject){
+	if(xmlObject != NULL){
+		itk::DOMNode* node = AddNodeWithAttributeIfNotExists(dOMObject, "memory-plan", "unit", "byte");
+		char val [50];
+		sprintf(val, "%lld", budget);
+		node->SetAttribute( "budget", val );
+		sprintf(val, "%lld", estimate);
+		node->SetAttribute( "estimate", val );
+		node->SetAttribute( "contingency-table", overlapStrategy );
+		if(imageStrategy[0] != '\0'){
+			node->SetAttribute( "image-metrics", imageStrategy );
+		}
+	}
+}
+
+void  pushFastProfile(double deadline, double elapsed, double estimate, int sampleCell, itk::DOMNode::Pointer xmlObject){
+	if(xmlObject != NULL){
+		itk::DOMNode* node = AddNodeWithAttributeIfNotExists(dOMObject, "fast-profile", "unit", "second");
+		char val [50];
+		sprintf(val, "%.3f", deadline);
+		node->SetAttribute( "deadline", val );
+		sprintf(val, "%.3f", elapsed);
+		node->SetAttribute( "elapsed", val );
+		sprintf(val, "%.3f", estimate);
+		node->SetAttribute( "distance-estimate", val );
+		sprintf(val, "%d", sampleCell);
+		node->SetAttribute( "sample-cell", val );
+	}
+}
+
+// backend chosen for a distance metric and its predicted time (see DistanceBackends.h)
+static void pushDistancePlan(MetricId id, const char* backend, double predictedSeconds, itk::DOMNode::Pointer xmlObject){
+	if(xmlObject != NULL){
+		char val [50];
+		sprintf(val, "%.3f", predictedSeconds);
+		itk::DOMNode* metricnode = AddNodeWithAttributeIfNotExists((itk::DOMNode*)xmlObject, "metrics", NULL, NULL);
+		AddNodeWithAttributeIfNotExists(metricnode, metricInfo[id].metrId, "backend", backend);
+		AddNodeWithAttributeIfNotExists(metricnode, metricInfo[id].metrId, "predicted-time", val);
+	}
+}
+
+// largest error of an approximated metric value, in the unit of the value
+static void pushErrorBound(MetricId id, double bound, itk::DOMNode::Pointer xmlObject){
+	char val [50];
+	sprintf(val, "%.6f", bound);
+	std::cout << "\t(approximated, error at most " << val << ")" << std::endl;
+	if(xmlObject != NULL){
+		itk::DOMNode* metricnode = AddNodeWithAttributeIfNotExists((itk::DOMNode*)xmlObject, "metrics", NULL, NULL);
+		AddNodeWithAttributeIfNotExists(metricnode, metricInfo[id].metrId, "error-bound", val);
+	}
+}
+
 void SaveXmlObject(itk::DOMNode::Pointer xmlObject, const char* targtfile){
 	if(targtfile != NULL && xmlObject != NULL){
 		itk::DOMNodeXMLWriter::Pointer writer = itk::DOMNodeXMLWriter::New();
@@ -174,6 +274,7 @@ static void pushValue(MetricId id, double value, itk::DOMNode::Pointer xmlObject
 		sprintf(unit_s, " %s", "");
 
 	std::cout << metricInfo[id].metrSymb << "\t= " << val << "\t" << metricInfo[id].metrInfo << unit_s << std::endl;
+	pushProgressMetric(id, value, asInteger, unit, -1);
 	if(xmlObject != NULL){
 		itk::DOMNode* metricnode = AddNodeWithAttributeIfNotExists((itk::DOMNode*)xmlObject, "metrics", NULL, NULL);
 		AddNodeWithAttributeIfNotExists(metricnode, metricInfo[id].metrId, "name", metricInfo[id].metrInfo);
@@ -202,6 +303,7 @@ static void pushValue(MetricId id, double value, double executiontime,  itk::DOM
 
 
 	std::cout << metricInfo[id].metrSymb << "\t= " << val << "\t" << metricInfo[id].metrInfo << unit_s << std::endl;
+	pushProgressMetric(id, value, false, unit, executiontime);
 
 	if(xmlObject != (itk::DOMNode*)NULL){
 		itk::DOMNode* metricnode = AddNodeWithAttributeIfNotExists((itk::DOMNode*)xmlObject, "metrics", NULL, NULL);
@@ -225,6 +327,7 @@ static void pushValue(MetricId id, double value, double executiontime,  itk::DOM
 
 void pushMessage(const char *message, const char* targtfile, const char* fixedImage, const char* movingImage){
 	std::cout <<  message << std::endl;
+	pushProgressMessage(message);
 	if(targtfile != NULL){
 		itk::DOMNode::Pointer dOMObject;
 		const char* xMLFileName = targtfile;
@@ -279,45 +382,15 @@ bool isUrl(const char* path){
 }
 
 bool is2Dimage(const char* path){
-	 
 	string name = path;
-	string extension = ".png";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-	extension = ".PNG";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-
-	 extension = ".jpg";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-		extension = ".JPG";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-
-	extension = ".gif";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-	extension = ".GIF";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-
-	 extension = ".bmp";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-	extension = ".BMP";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-
-	 extension = ".tiff";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-	extension = ".TIFF";
-	if (0 == name.compare (name.length() - extension.length(), extension.length(), extension))
-		return true;
-
+	const char* extensions[] = {".png", ".PNG", ".jpg", ".JPG", ".gif", ".GIF", ".bmp", ".BMP", ".tiff", ".TIFF"};
+	for(size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++){
+		string extension = extensions[i];
+		// names shorter than the extension, e.g. "-" for stdin, are no 2D images
+		if(name.length() >= extension.length() && 0 == name.compare (name.length() - extension.length(), extension.length(), extension))
+			return true;
+	}
 	return false;
-
 }
 
 
@@ -0,0 +1,86 @@
+/*
+// Parallel.h
+//
+// Description:
+//
+// This file contains a minimal helper to run independent work items (e.g. the chunks of a
+// chunked array) on all available cores. Work items are handed out dynamically, so that items
+// of different cost (empty and full chunks) are balanced between the threads.
+//
+*/
+
+#ifndef _PARALLEL
+#define _PARALLEL
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+
+// number of worker threads, 0 = number of cores
+static int numberOfThreads = 0;
+// number of worker threads of the calling thread if it shares the cores with others, e.g. the
+// decoders of a batch evaluation (see setThreadShare), 0 = getNumberOfThreads()
+static thread_local int threadShare = 0;
+
+int getNumberOfThreads(){
+	if(threadShare > 0){
+		return threadShare;
+	}
+	if(numberOfThreads > 0){
+		return numberOfThreads;
+	}
+	int n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+// gives the calling thread the share of the cores of one of shares threads running at once
+void setThreadShare(int shares){
+	threadShare = 0;
+	threadShare = std::max(1, getNumberOfThreads() / std::max(1, shares));
+}
+
+/*
+// Calls func(item, thread) for all items 0..count-1, thread being the index (0..threads-1) of
+// the calling worker thread so that each thread can accumulate into its own partial result.
+// The first exception thrown by a work item is rethrown after all threads have finished.
+*/
+template<class Function>
+void parallelFor(long long count, int threads, Function func){
+	if(threads > count){
+		threads = count > 0 ? (int)count : 1;
+	}
+	std::atomic<long long> next(0);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+
+	std::vector<std::thread> workers;
+	for(int t = 0; t < threads; t++){
+		workers.push_back(std::thread([&, t](){
+			try
+			{
+				for(long long i = next++; i < count; i = next++){
+					func(i, t);
+				}
+			}
+			catch(...)
+			{
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if(!error){
+					error = std::current_exception();
+				}
+				next = count;
+			}
+		}));
+	}
+	for(size_t t = 0; t < workers.size(); t++){
+		workers[t].join();
+	}
+	if(error){
+		std::rethrow_exception(error);
+	}
+}
+
+#endif
@@ -22,57 +22,70 @@
 // Description:
 //
 // This algorithm calculates the Probabilistic Distance between two volumes.
-//
+// The sums are accumulated voxel by voxel in the pass over the images (see MetricAccumulators.h).
 //  
 //
 */
 
+#ifndef _PROBABILISTICDISTANCEMETRIC
+#define _PROBABILISTICDISTANCEMETRIC
+
+#include <cmath>
 #include "itkImage.h"
+#include "MetricAccumulators.h"
 
 class ProbabilisticDistanceMetric
 {
-	typedef itk::ImageRegionConstIterator<ImageType> FixedIteratorType;
-	typedef itk::ImageRegionConstIterator<ImageType> MovingIteratorType;
-
 private:
-	VoxelPreprocessor *voxelprocesser;
 	bool fuzzy;
 	double threshold;
+	double probability_joint;
+	double probability_diff;
+	double pd;
 public: 
+	static const unsigned artifacts = ARTIFACT_VOXEL_STATISTICS;
 
 	~ProbabilisticDistanceMetric(){
 
 	}
 
-	ProbabilisticDistanceMetric(VoxelPreprocessor *voxelprocesser, bool fuzzy, double threshold){
-		this->voxelprocesser= voxelprocesser;
-		this->fuzzy = fuzzy;
-		this->threshold = threshold;
+	ProbabilisticDistanceMetric(){
 	}
 
-	double CalcJProbabilisticDistance(){ //[{00121}]
-		double mean_f = voxelprocesser->mean_f;
-		double mean_m = voxelprocesser->mean_m;
-		int numberElements = std::min(voxelprocesser->numberElements_f, voxelprocesser->numberElements_m);
-
-		double probability_joint = 0;
-		double probability_diff = 0;  
+	void init(const AccumulatorSettings &settings){
+		fuzzy = settings.fuzzy;
+		threshold = settings.threshold;
+		probability_joint = 0;
+		probability_diff = 0;
+		pd = -1;
+	}
 
-		for (int i = 0; i < numberElements; i++)
+	void accumulate(const VoxelBlock &block){ //[{00121}]
+		for (long long i = 0; i < block.count; i++)
 		{
-			double f =values_f[i];
-			double m =values_m[i];
-			probability_diff += abs(f - m);
+			double f = preprocessVoxel(block.fixed[i], fuzzy, threshold);
+			double m = preprocessVoxel(block.moving[i], fuzzy, threshold);
+			probability_diff += std::abs(f - m);
 			probability_joint += f * m;
 		}
+	}
 
-		double pd= -1;
+	void merge(const ProbabilisticDistanceMetric &other){
+		probability_diff += other.probability_diff;
+		probability_joint += other.probability_joint;
+	}
+
+	void finalize(){
+		pd = -1;
 		if(probability_joint != 0)
 			pd = probability_diff/(2*probability_joint);
-		return pd;
+	}
 
+	double CalcJProbabilisticDistance(){
+		return pd;
 	}
 
 
 };
 
+#endif
@@ -0,0 +1,183 @@
+/*
+// ProgressEvents.h
+//
+// Description:
+//
+// This file writes the results of an evaluation as they are computed (option -progress), one JSON
+// object per line, so that a caller can show the cheap metrics (DICE, JACRD, KAPPA, ...) while the
+// distance metrics are still running. The events are:
+//
+// {"event":"start","fixed":"truth.nii.gz","moving":"segment.nii.gz"}
+// {"event":"metric","metric":"DICE","symbol":"DICE","name":"...","type":"similarity","value":0.912345,"elapsed":12}
+// {"event":"message","message":"Moving image is empty!"}
+// {"event":"summary","fixed":"...","moving":"...","status":"ok","metrics":20,"elapsed":3456}
+//
+// elapsed is the time since the start of the evaluation in milliseconds; metric events of the
+// distance metrics also have "unit" and "executiontime". The metrics computed concurrently (see
+// TaskGraph.h) are written when they finish, so the order of the metric events may differ from
+// the order of the metrics; each metric is written once per evaluation. With "-progress -" the
+// events go to stdout and the usual output to stderr. Each event is flushed when written.
+//
+*/
+
+#ifndef _PROGRESSEVENTS
+#define _PROGRESSEVENTS
+
+#include <cstdio>
+#include <cmath>
+#include <set>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include "Metric_constants.h"
+
+// file the events are written to, NULL = no events (option -progress)
+static FILE* progressFile = NULL;
+// events are also written by the metrics computed concurrently
+static std::mutex progressMutex;
+
+// state of the current evaluation
+static bool progressFailed = false;
+static std::set<int> progressSent;
+static std::chrono::steady_clock::time_point progressStart;
+
+/*
+// Writes the events to the file target, or to stdout if target is "-"; the usual output then goes
+// to stderr. Returns false if the file cannot be opened.
+*/
+bool openProgressEvents(const char* target){
+	if(progressFile != NULL && progressFile != stdout){
+		fclose(progressFile);
+	}
+	progressStart = std::chrono::steady_clock::now();
+	if(std::string(target) == "-"){
+		progressFile = stdout;
+		std::cout.rdbuf(std::cerr.rdbuf());
+		return true;
+	}
+	progressFile = fopen(target, "w");
+	return progressFile != NULL;
+}
+
+std::string jsonEscape(const char* s){
+	std::string escaped = "\"";
+	for(; s != NULL && *s != '\0'; s++){
+		unsigned char c = (unsigned char)*s;
+		if(c == '"' || c == '\\'){
+			escaped += '\\';
+			escaped += (char)c;
+		}
+		else if(c == '\n'){
+			escaped += "\\n";
+		}
+		else if(c == '\t'){
+			escaped += "\\t";
+		}
+		else if(c < 0x20){
+			char code[8];
+			sprintf(code, "\\u%04x", c);
+			escaped += code;
+		}
+		else{
+			escaped += (char)c;
+		}
+	}
+	return escaped + "\"";
+}
+
+long long progressElapsed(){
+	return (long long)(std::chrono::duration<double>(std::chrono::steady_clock::now() - progressStart).count() * 1000);
+}
+
+// writes one event, called with progressMutex locked
+void writeProgressEvent(const std::string &fields){
+	fprintf(progressFile, "{%s}\n", fields.c_str());
+	fflush(progressFile);
+}
+
+/*
+// Writes the result of a metric unless it was already written in this evaluation.
+// executiontime < 0 = not measured, unit NULL = no unit.
+*/
+void pushProgressMetric(MetricId id, double value, bool asInteger, const char* unit, double executiontime){
+	if(progressFile == NULL){
+		return;
+	}
+	std::lock_guard<std::mutex> lock(progressMutex);
+	if(!progressSent.insert(id).second){
+		return;
+	}
+	char val [50];
+	if(!std::isfinite(value)){
+		sprintf(val, "null");
+	}
+	else if(asInteger){
+		sprintf(val, "%.0f", value);
+	}
+	else{
+		sprintf(val, "%.6f", value);
+	}
+	std::string fields = "\"event\":\"metric\",\"metric\":" + jsonEscape(metricInfo[id].metrId)
+		+ ",\"symbol\":" + jsonEscape(metricInfo[id].metrSymb)
+		+ ",\"name\":" + jsonEscape(metricInfo[id].metrInfo)
+		+ ",\"type\":" + (metricInfo[id].similarity ? "\"similarity\"" : "\"distance\"")
+		+ ",\"value\":" + val;
+	if(unit != NULL){
+		fields += ",\"unit\":" + jsonEscape(unit);
+	}
+	if(executiontime >= 0){
+		fields += ",\"executiontime\":" + std::to_string((long long)executiontime);
+	}
+	fields += ",\"elapsed\":" + std::to_string(progressElapsed());
+	writeProgressEvent(fields);
+}
+
+void pushProgressMessage(const char* message){
+	if(progressFile == NULL){
+		return;
+	}
+	std::lock_guard<std::mutex> lock(progressMutex);
+	progressFailed = true;
+	writeProgressEvent("\"event\":\"message\",\"message\":" + jsonEscape(message));
+}
+
+/*
+// Writes the start event of an evaluation when made and its summary when destroyed, also if the
+// evaluation ends early with a message or an exception.
+*/
+class ProgressEvaluation
+{
+private:
+	std::string fixedImage;
+	std::string movingImage;
+
+public:
+	ProgressEvaluation(const char* fixedImage, const char* movingImage){
+		this->fixedImage = fixedImage;
+		this->movingImage = movingImage;
+		if(progressFile == NULL){
+			return;
+		}
+		std::lock_guard<std::mutex> lock(progressMutex);
+		progressFailed = false;
+		progressSent.clear();
+		progressStart = std::chrono::steady_clock::now();
+		writeProgressEvent("\"event\":\"start\",\"fixed\":" + jsonEscape(fixedImage) + ",\"moving\":" + jsonEscape(movingImage));
+	}
+
+	~ProgressEvaluation(){
+		if(progressFile == NULL){
+			return;
+		}
+		std::lock_guard<std::mutex> lock(progressMutex);
+		bool failed = progressFailed || std::uncaught_exception();
+		writeProgressEvent("\"event\":\"summary\",\"fixed\":" + jsonEscape(fixedImage.c_str()) + ",\"moving\":" + jsonEscape(movingImage.c_str())
+			+ ",\"status\":" + (failed ? "\"failed\"" : "\"ok\"")
+			+ ",\"metrics\":" + std::to_string((long long)progressSent.size())
+			+ ",\"elapsed\":" + std::to_string(progressElapsed()));
+	}
+};
+
+#endif
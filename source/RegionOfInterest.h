@@ -0,0 +1,294 @@
+/*
+// RegionOfInterest.h
+//
+// Description:
+//
+// This file determines the region of interest (option -roi) that is read from both images.
+// The region is either given explicitly as x0,y0,z0,x1,y1,z1 (inclusive voxel indices) or
+// determined automatically (-roi auto) from the foreground extent of both images. Formats that
+// support partial reading (MHA/NRRD with raw data, uncompressed NIfTI) then only read and decode
+// the voxels inside the region.
+//
+// The extent of an image is taken from the sidecar file <image>.extent if there is one (e.g.
+// written by the tool that made the segmentation), which costs nothing. Otherwise the image is
+// scanned slab by slab, i.e. the whole file is read once more before the region is read, which
+// only pays off if the region is much smaller than the images; -roi auto is therefore only used
+// when requested (and by -max-memory when the full images do not fit, see MemoryBudget.h).
+//
+// A full read rescales the intensities from the range of the whole image to 0..255. An image read
+// in a region is rescaled from the range of the whole image as well, so that the voxels of the
+// region get the same values as in a full read; the range is taken from the scan of -roi auto, or
+// else the file is scanned once more for it.
+//
+*/
+
+#ifndef _REGIONOFINTEREST
+#define _REGIONOFINTEREST
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sys/stat.h>
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
+#include "ImageHeader.h"
+
+// number of background voxels added around the automatically detected foreground extent
+static const int ROI_AUTO_MARGIN = 2;
+// number of voxels read per slab during the foreground extent scan
+static const long long ROI_SCAN_SLAB_VOXELS = 16*1024*1024;
+
+typedef struct ForegroundExtent{
+	bool empty;
+	long long min[3];
+	long long max[3];
+} ForegroundExtent;
+
+typedef struct IntensityRange{
+	double minimum;
+	double maximum;
+	time_t modified;  // of the file scanned
+} IntensityRange;
+
+// intensity ranges of the files scanned, by file name
+static std::map<std::string, IntensityRange> intensityRanges;
+
+bool isAutoRegionOfInterest(const char* roi){
+	return roi != NULL && std::string(roi) == "auto";
+}
+
+/*
+// Parses x0,y0,z0,x1,y1,z1 and clamps the region to the image grid given by the header.
+// Returns false if the option is malformed or the region lies outside the image.
+*/
+bool parseRegionOfInterest(const char* roi, const ImageHeader &header, ImageType::RegionType &region){
+	long long x0, y0, z0, x1, y1, z1;
+	if(sscanf(roi, "%lld,%lld,%lld,%lld,%lld,%lld", &x0, &y0, &z0, &x1, &y1, &z1) != 6){
+		return false;
+	}
+	long long lower[3] = {x0, y0, z0};
+	long long upper[3] = {x1, y1, z1};
+	ImageType::IndexType start;
+	ImageType::SizeType size;
+	for(int i=0; i<3 ; i++){
+		if(lower[i] < 0){
+			lower[i] = 0;
+		}
+		if(upper[i] > header.size[i]-1){
+			upper[i] = header.size[i]-1;
+		}
+		if(lower[i] > upper[i]){
+			return false;
+		}
+		start[i] = lower[i];
+		size[i] = upper[i] - lower[i] + 1;
+	}
+	region.SetIndex(start);
+	region.SetSize(size);
+	return true;
+}
+
+/*
+// Reads the foreground extent of an image from its sidecar file <filename>.extent, containing
+// x0,y0,z0,x1,y1,z1 (inclusive voxel indices of the voxels greater than zero, commas or blanks as
+// separators) or "empty". The sidecar is ignored if it is older than the image or malformed.
+*/
+bool readForegroundExtentSidecar(const char* filename, ForegroundExtent &extent){
+	std::string sidecar = std::string(filename) + ".extent";
+	struct stat image, side;
+	if(stat(sidecar.c_str(), &side) != 0 || stat(filename, &image) != 0 || side.st_mtime < image.st_mtime){
+		return false;
+	}
+	std::ifstream i_stream(sidecar.c_str());
+	std::string line;
+	getline(i_stream, line);
+	if(line.compare(0, 5, "empty") == 0){
+		extent.empty = true;
+		return true;
+	}
+	long long v[6];
+	if(sscanf(line.c_str(), "%lld,%lld,%lld,%lld,%lld,%lld", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6
+		&& sscanf(line.c_str(), "%lld %lld %lld %lld %lld %lld", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6){
+		std::cout << "Ignoring invalid extent file: " << sidecar << std::endl;
+		return false;
+	}
+	for(int i=0; i<3 ; i++){
+		if(v[i] < 0 || v[i] > v[i + 3]){
+			std::cout << "Ignoring invalid extent file: " << sidecar << std::endl;
+			return false;
+		}
+		extent.min[i] = v[i];
+		extent.max[i] = v[i + 3];
+	}
+	extent.empty = false;
+	return true;
+}
+
+/*
+// Scans the image slab by slab and returns the bounding box of the voxels with a value
+// greater than zero (background). Only one slab is held in memory at a time. The intensity range
+// of the image is kept for getIntensityRange().
+*/
+ForegroundExtent scanForegroundExtent(const char* filename){
+	typedef itk::Image<float, 3> FloatImageType;
+	typedef itk::ImageFileReader<FloatImageType> FloatFileReaderType;
+	typedef itk::ImageRegionConstIteratorWithIndex<FloatImageType> IteratorType;
+
+	ForegroundExtent extent;
+	extent.empty = true;
+	for(int i=0; i<3 ; i++){
+		extent.min[i] = 0;
+		extent.max[i] = 0;
+	}
+
+	IntensityRange range;
+	range.minimum = INFINITY;
+	range.maximum = -INFINITY;
+	struct stat file;
+	range.modified = stat(filename, &file) == 0 ? file.st_mtime : 0;
+
+	FloatFileReaderType::Pointer reader = FloatFileReaderType::New();
+	reader->SetFileName(filename);
+	reader->UpdateOutputInformation();
+	FloatImageType::RegionType largest = reader->GetOutput()->GetLargestPossibleRegion();
+	long long sliceVoxels = (long long)largest.GetSize(0) * largest.GetSize(1);
+	long long slabSlices = ROI_SCAN_SLAB_VOXELS / (sliceVoxels > 0 ? sliceVoxels : 1);
+	if(slabSlices < 1){
+		slabSlices = 1;
+	}
+
+	long long lastSlice = largest.GetIndex(2) + largest.GetSize(2);
+	for(long long z = largest.GetIndex(2); z < lastSlice; z += slabSlices){
+		FloatImageType::RegionType slab = largest;
+		slab.SetIndex(2, z);
+		slab.SetSize(2, std::min(slabSlices, lastSlice - z));
+		reader->GetOutput()->SetRequestedRegion(slab);
+		reader->GetOutput()->Update();
+
+		IteratorType it(reader->GetOutput(), slab);
+		it.GoToBegin();
+		while (!it.IsAtEnd()){
+			range.minimum = std::min(range.minimum, (double)it.Get());
+			range.maximum = std::max(range.maximum, (double)it.Get());
+			if(it.Get() > 0){
+				FloatImageType::IndexType ind = it.GetIndex();
+				for(int i=0; i<3 ; i++){
+					if(extent.empty || ind[i] < extent.min[i]){
+						extent.min[i] = ind[i];
+					}
+					if(extent.empty || ind[i] > extent.max[i]){
+						extent.max[i] = ind[i];
+					}
+				}
+				extent.empty = false;
+			}
+			++it;
+		}
+	}
+	intensityRanges[filename] = range;
+	return extent;
+}
+
+/*
+// The minimum and maximum intensity of the whole image, from a previous scan of the unchanged file
+// or else by scanning it slab by slab.
+*/
+IntensityRange getIntensityRange(const char* filename){
+	struct stat file;
+	std::map<std::string, IntensityRange>::iterator cached = intensityRanges.find(filename);
+	if(cached != intensityRanges.end() && stat(filename, &file) == 0 && file.st_mtime == cached->second.modified){
+		return cached->second;
+	}
+	std::cout << "-roi: scanning the intensity range of " << filename << " (reads the file once more)" << std::endl;
+	scanForegroundExtent(filename);
+	return intensityRanges[filename];
+}
+
+// the foreground extent of an image, from its sidecar or else by a scan of the file
+ForegroundExtent getForegroundExtent(const char* filename){
+	ForegroundExtent extent;
+	if(readForegroundExtentSidecar(filename, extent)){
+		return extent;
+	}
+	std::cout << "-roi auto: scanning the foreground extent of " << filename << " (reads the file once more; " << filename << ".extent avoids the scan)" << std::endl;
+	return scanForegroundExtent(filename);
+}
+
+/*
+// Determines the region of interest as the union of the foreground extents of both images plus
+// a margin. Returns false if the region cannot be determined cheaply (compressed or non-streamable
+// files) or if both images are empty, in which case the full images are read.
+*/
+bool computeAutoRegionOfInterest(const char* f1, const char* f2, const ImageHeader &header, ImageType::RegionType &region){
+	ImageHeader header2 = readImageHeader(f2);
+	if(!header.canStreamRead || !header2.canStreamRead){
+		std::cout << "-roi auto: partial reading is not supported for these files, reading full images" << std::endl;
+		return false;
+	}
+	ForegroundExtent e1 = getForegroundExtent(f1);
+	ForegroundExtent e2 = getForegroundExtent(f2);
+	if(e1.empty && e2.empty){
+		return false;
+	}
+
+	ImageType::IndexType start;
+	ImageType::SizeType size;
+	for(int i=0; i<3 ; i++){
+		long long lower = e1.empty ? e2.min[i] : (e2.empty ? e1.min[i] : std::min(e1.min[i], e2.min[i]));
+		long long upper = e1.empty ? e2.max[i] : (e2.empty ? e1.max[i] : std::max(e1.max[i], e2.max[i]));
+		lower = std::max(0LL, lower - ROI_AUTO_MARGIN);
+		upper = std::min(header.size[i] - 1, upper + ROI_AUTO_MARGIN);
+		start[i] = lower;
+		size[i] = upper - lower + 1;
+	}
+	region.SetIndex(start);
+	region.SetSize(size);
+	return true;
+}
+
+/*
+// Copies the region of an image read as a whole (formats without partial reading) into an image
+// indexed from zero, with the origin moved to the start of the region.
+*/
+ImageType::Pointer cropImage(ImageType *img, const ImageType::RegionType &region){
+	ImageType::Pointer cropped = ImageType::New();
+	ImageType::RegionType target = region;
+	ImageType::IndexType start;
+	start.Fill(0);
+	target.SetIndex(start);
+	cropped->SetRegions(target);
+	cropped->SetSpacing(img->GetSpacing());
+	cropped->SetDirection(img->GetDirection());
+	ImageType::PointType origin;
+	img->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+	cropped->SetOrigin(origin);
+	cropped->Allocate();
+	itk::ImageRegionConstIterator<ImageType> in(img, region);
+	itk::ImageRegionIterator<ImageType> out(cropped, target);
+	for(in.GoToBegin(), out.GoToBegin(); !in.IsAtEnd(); ++in, ++out){
+		out.Set(in.Get());
+	}
+	return cropped;
+}
+
+/*
+// The metrics assume images indexed from zero. Shifts the buffered region of an image read
+// with a region of interest to index zero and moves the origin accordingly.
+*/
+void shiftRegionToZeroIndex(ImageType *img){
+	ImageType::RegionType region = img->GetBufferedRegion();
+	ImageType::PointType origin;
+	img->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+	ImageType::IndexType start;
+	start.Fill(0);
+	region.SetIndex(start);
+	img->SetRegions(region);
+	img->SetOrigin(origin);
+}
+
+#endif
@@ -35,6 +35,7 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <memory>
 #include <cstdio>
 #include <time.h>
 #include <sys/timeb.h>
@@ -51,20 +52,29 @@
 #include "InterclassCorrelationMetric.h"
 #include "MahalanobisDistanceMetric.h"
 #include "AverageDistanceMetric.h"
-#include "DiceCoefficientMetric.h"
-#include "JaccardCoefficientMetric.h"
-#include "RandIndexMetric.h"
-#include "CohinKappaMetric.h"
-#include "VolumeSimilarityCoefficient.h"
-#include "GlobalConsistencyError.h"
 #include "ProbabilisticDistanceMetric.h"
-#include "VariationOfInformationMetric.h"
-#include "MutualInformationMetric.h"
-#include "ClassicMeasures.h"
 #include "Imagedownloader.h" 
+#include "HttpFetcher.h"
+#include "UrlCache.h"
+#include "ImageHeader.h"
+#include "RegionOfInterest.h"
+#include "NumpyReader.h"
+#include "ChunkedArrayReader.h"
+#include "ChunkedOverlap.h"
+#include "NiftiStreamReader.h"
+#include "SharedMemoryInput.h"
+#include "ArchiveReader.h"
+#include "SparseMask.h"
+#include "BitMask.h"
+#include "MemoryBudget.h"
+#include "MetricPlan.h"
+#include "FastProfile.h"
+#include "DicomSeries.h"
+#include "TaskGraph.h"
 
 #include "ImageStatistics.h"
 #include "itkRescaleIntensityImageFilter.h"
+#include "itkIntensityWindowingImageFilter.h"
 #include "itkStreamingImageFilter.h"
 #include "itkBinaryThresholdImageFilter.h"
 #include "itkCastImageFilter.h"
@@ -75,16 +85,21 @@
 using namespace std;
 
 int validateImage(const char* f1, const char* f2, double threshold, const char* targetFile, char *options);
-bool shouldUse(MetricId, char* options);
-std::string getOptions(MetricId id, char* options);
 bool isUrl(const char* path);
+bool usesOnlyContingencyTable(char* options);
 void testHausdorf(ImageType::Pointer truthImg, ImageType::Pointer testImg, double threshold, bool fuzzy, MetricId metricId, itk::DOMNode::Pointer xmlObject, int option, VoxelPreprocessor *);
-const std::string nooption = "NOOPTION";
-ImageType::Pointer loadImage(const char* filename,  bool useStreamingFilter);
+ImageType::Pointer loadImage(const char* filename,  bool useStreamingFilter, const ImageType::RegionType* roi = NULL, ImageType* reference = NULL);
+bool loadImages(const char* f1, const char* f2, bool useStreamingFilter, const ImageType::RegionType* roi, ImageType::Pointer &truthImg, ImageType::Pointer &testImg);
 
 
-static int validateImage(const char* f1, const char* f2, double threshold, const char* targetFile, char *options, const char* unit, long long int time_start, bool useStreamingFilter)
+/*
+// Evaluates the segmentation f2 against the truth f1. Images decoded beforehand (batch evaluation)
+// can be passed as truthImage and testImage, f1 and f2 are then only used for the output.
+*/
+static int validateImage(const char* f1, const char* f2, double threshold, const char* targetFile, char *options, const char* unit, long long int time_start, bool useStreamingFilter, const char* roi, ImageType::Pointer truthImage = ITK_NULLPTR, ImageType::Pointer testImage = ITK_NULLPTR)
 {
+	// start and summary events of -progress, written also when the evaluation ends early
+	ProgressEvaluation progress(f1, f2);
 
     bool use_millimeter=false;
 	string units = unit;
@@ -92,65 +107,239 @@ static int validateImage(const char* f1, const char* f2, double threshold, const
 	if(pos != string::npos){
 	    use_millimeter = true;
 	}
-	VoxelPreprocessor *voxelPreprocessor;
-	ImageStatistics *imagestatistics;
+	// the objects of the evaluation are freed when it returns, the transient buffers of the metrics
+	// are taken from the arena
+	std::unique_ptr<VoxelPreprocessor> voxelPreprocessor;
+	std::unique_ptr<ImageStatistics> imagestatistics;
+	resetEvaluationArenas();
 
 	bool fuzzy  = (threshold == -1);
 	if(!fuzzy){
 		std::cout << "Crisp segmentation at threshold= " << threshold << "\n" << std::endl;
 	}
-	ImageType::Pointer truthImg = loadImage(f1, useStreamingFilter);
-	if(truthImg ==  0){
-		return EXIT_FAILURE;
+	beginMemoryStages();
+	// the fast profile plans the distance metrics from the time left after the pass over the images
+	std::chrono::steady_clock::time_point evaluationStart = std::chrono::steady_clock::now();
+
+	if(isStdin(f1) && isStdin(f2)){
+		pushMessage("Only one of the images can be read from stdin", targetFile, f1, f2);
+		return 0;
 	}
 
-	ImageType::Pointer testImg = loadImage(f2, useStreamingFilter);
+	// both images from the network are fetched concurrently
+	if(truthImage.IsNull()){
+		std::vector<std::string> urls;
+		urls.push_back(f1);
+		urls.push_back(f2);
+		prefetchUrls(urls);
+	}
 
-	if(testImg ==  0){
-		return EXIT_FAILURE;
+	// reject incompatible images by their headers before any voxel data is read (the other inputs,
+	// e.g. streams, which can be read only once, are compared after they are decoded)
+	bool seekable = !isUrl(f1) && !isUrl(f2) && !isStreamInput(f1) && !isStreamInput(f2) && !isSharedMemory(f1) && !isSharedMemory(f2)
+		&& !isArchiveMember(f1) && !isArchiveMember(f2) && truthImage.IsNull();
+	if(seekable){
+		std::string message = checkImageHeaders(f1, f2);
+		if(message != ""){
+			pushMessage(message.c_str(), targetFile, f1, f2);
+			return 0;
+		}
 	}
 
-	imagestatistics = new ImageStatistics(truthImg, testImg, fuzzy, threshold);
+	// restrict reading to a region of interest
+	ImageType::RegionType roiRegion;
+	bool useRoi = false;
+	if(roi != NULL){
+		ImageHeader header;
+		header.valid = false;
+		if(seekable){
+			header = readImageHeader(f1);
+		}
+		if(!header.valid){
+			std::cout << "-roi is not supported for these inputs, reading full images" << std::endl;
+		}
+		else if(isAutoRegionOfInterest(roi)){
+			useRoi = computeAutoRegionOfInterest(f1, f2, header, roiRegion);
+		}
+		else{
+			useRoi = parseRegionOfInterest(roi, header, roiRegion);
+			if(!useRoi){
+				std::ostringstream  message;
+				message << "Invalid region of interest: " << roi ;
+				pushMessage(message.str().c_str(), targetFile, f1, f2);
+				return 0;
+			}
+		}
+		if(useRoi){
+			std::cout << "Region of interest: index=" << roiRegion.GetIndex(0) << "," << roiRegion.GetIndex(1) << "," << roiRegion.GetIndex(2)
+				<< " size=" << roiRegion.GetSize(0) << "x" << roiRegion.GetSize(1) << "x" << roiRegion.GetSize(2) << "\n" << std::endl;
+		}
+	}
 
-	values_f = (pixeltype*) malloc(imagestatistics->numberElements_f * sizeof(pixeltype));
-	if(values_f == NULL){
-		std::cout << "Memory allocation 1 !" << std::endl;
-		return  EXIT_FAILURE ;
+	// the strategy within the memory budget is chosen from the headers, before any image is read
+	if(maxMemoryBytes > 0 && !seekable && truthImage.IsNull()){
+		std::cout << "-max-memory is not supported for these inputs (URLs, streams, shared memory, archive members), reading full images" << std::endl;
+	}
+	MemoryPlan plan;
+	plan.planned = false;
+	plan.bitPacked = false;
+	plan.cropped = false;
+	if(maxMemoryBytes > 0 && seekable){
+		plan = planMemory(f1, f2, fuzzy, options, useRoi ? &roiRegion : NULL);
+		if(!plan.fits){
+			pushMessage(plan.message.c_str(), targetFile, f1, f2);
+			return 0;
+		}
+		if(plan.planned){
+			printMemoryPlan(plan);
+			useStreamingFilter = plan.streamed;
+			if(plan.cropped && !plan.bitPacked){
+				roiRegion = plan.region;
+				useRoi = true;
+			}
+		}
 	}
 
-	for(int i=0; i< imagestatistics->numberElements_f ; i++){
-		values_f[i]=0;
+	ImageType::Pointer truthImg;
+	ImageType::Pointer testImg;
+	std::unique_ptr<ContingencyTable> contingenceTable;
+	itk::DOMNode::Pointer xmlObject;
+	int max_x, max_y, max_z;
+	double vspx, vspy, vspz;
+
+	// chunked arrays are evaluated chunk by chunk and sparse masks run by run, as long as only
+	// overlap based metrics are requested
+	std::unique_ptr<JointHistogram> overlap;
+	OverlapSource overlapSource = OVERLAP_IMAGES;
+	if(isChunkedArray(f1) && isChunkedArray(f2)){
+		if(usesOnlyContingencyTable(options)){
+			overlap.reset(computeChunkedOverlap(f1, f2, fuzzy, threshold));
+			overlapSource = OVERLAP_CHUNKED;
+		}
+		else{
+			std::cout << "The requested metrics need the full images, assembling the chunked arrays\n" << std::endl;
+		}
 	}
-	values_m = (pixeltype*) malloc(imagestatistics->numberElements_m * sizeof(pixeltype));
-	if(values_m == NULL){
-		std::cout << "Memory allocation 2 !" << std::endl;
-		return  EXIT_FAILURE;
+	if(isSparseMask(f1) && isSparseMask(f2)){
+		if(usesOnlyContingencyTable(options)){
+			overlap.reset(computeSparseOverlap(f1, f2, fuzzy, threshold));
+			overlapSource = OVERLAP_SPARSE;
+		}
+		else{
+			std::cout << "The requested metrics need the full images, creating dense volumes of the sparse masks\n" << std::endl;
+		}
 	}
-	for(int i=0; i< imagestatistics->numberElements_m ; i++){
-		values_m[i]=0;
+	// crisp NIfTI files are thresholded while decoding, into masks of one bit per voxel, when the
+	// memory plan chose it (-max-memory) or, without a budget, when the dense images would not fit
+	bool bitMasks = plan.bitPacked || (maxMemoryBytes == 0 && usesOnlyContingencyTable(options) && !denseImagesFit(f1, options));
+	if(overlap == NULL && !fuzzy && seekable && !useRoi && isNiftiFile(f1) && isNiftiFile(f2) && bitMasks){
+		overlap.reset(computeBitMaskOverlap(f1, f2, threshold));
+		if(overlap == NULL && plan.bitPacked){
+			pushMessage("The images cannot be read as bit masks and do not fit into the memory budget (-max-memory) as dense images", targetFile, f1, f2);
+			return 0;
+		}
+		overlapSource = OVERLAP_BITMASK;
+	}
+	if(overlap == NULL){
+		overlapSource = OVERLAP_IMAGES;
 	}
-	voxelPreprocessor = new VoxelPreprocessor(truthImg, testImg, fuzzy, threshold, imagestatistics);
-	ContingencyTable *contingenceTable= new ContingencyTable(voxelPreprocessor, fuzzy, threshold);
-
-	itk::DOMNode::Pointer xmlObject = OpenSegmentationResultXML(targetFile, f1, f2, voxelPreprocessor->num_nonzero_points_f, voxelPreprocessor->num_nonzero_points_m, voxelPreprocessor->num_intersection);
 
-	if(voxelPreprocessor->IsDifferentImageSize()){
-		std::ostringstream  message;
-		message << "Images are from different Sizes: fixedImage=" << voxelPreprocessor->GetFixedImageVoxelCount() << " movingImage=" << voxelPreprocessor->GetMovingImageVoxelCount() ;
-		pushMessage(message.str().c_str(), targetFile, f1, f2);
-		return 0;
+	// only the artifacts of the requested metrics are computed
+	MetricPlan metricPlan = planMetrics(options, overlapSource, plan.cropped);
+	if(explainPlan){
+		printMetricPlan(metricPlan);
 	}
-	if(voxelPreprocessor->IsFixedImageEmpty()){
-		std::ostringstream  message;
-		message << "Fixed image is empty!" ;
-		pushMessage(message.str().c_str(), targetFile, f1, f2);
-		return 0;
+
+	if(overlap != NULL){
+		contingenceTable.reset(new ContingencyTable(&overlap->jointHistogram[0], overlap->numberElements, overlap->vspx, overlap->vspy, overlap->vspz, fuzzy, threshold));
+		max_x = overlap->size[0] - 1;
+		max_y = overlap->size[1] - 1;
+		max_z = overlap->size[2] - 1;
+		vspx = overlap->vspx;
+		vspy = overlap->vspy;
+		vspz = overlap->vspz;
+
+		xmlObject = OpenSegmentationResultXML(targetFile, f1, f2, overlap->num_nonzero_points_f, overlap->num_nonzero_points_m, overlap->num_intersection);
+
+		if(overlap->num_nonzero_points_f == 0){
+			pushMessage("Fixed image is empty!", targetFile, f1, f2);
+			return 0;
+		}
+		if(overlap->num_nonzero_points_m == 0){
+			pushMessage("Moving image is empty!", targetFile, f1, f2);
+			return 0;
+		}
+
+		// the metrics needing the images read them cropped to the foreground (-max-memory)
+		if(plan.cropped){
+			if(!loadImages(f1, f2, useStreamingFilter, &plan.region, truthImg, testImg)){
+				return EXIT_FAILURE;
+			}
+		}
+		endMemoryStage("load");
 	}
-	if(voxelPreprocessor->IsMovingImageEmpty()){
-		std::ostringstream  message;
-		message << "Moving image is empty!" ;
-		pushMessage(message.str().c_str(), targetFile, f1, f2);
-		return 0;
+	else{
+		truthImg = truthImage;
+		testImg = testImage;
+		if(!loadImages(f1, f2, useStreamingFilter, useRoi ? &roiRegion : NULL, truthImg, testImg)){
+			return EXIT_FAILURE;
+		}
+		endMemoryStage("load");
+
+		// one pass over both images for the counts, the contingency table, the moments and the voxel statistics
+		imagestatistics.reset(new ImageStatistics(truthImg, testImg, fuzzy, threshold, metricPlan.artifacts));
+		max_x = imagestatistics->max_x_f;
+		max_y = imagestatistics->max_y_f;
+		max_z = imagestatistics->max_z_f;
+		vspx = imagestatistics->vspx;
+		vspy = imagestatistics->vspy;
+		vspz = imagestatistics->vspz;
+		contingenceTable.reset(new ContingencyTable(imagestatistics->voxelMetrics.Get<ContingencyTable>()));
+
+		xmlObject = OpenSegmentationResultXML(targetFile, f1, f2, imagestatistics->num_nonzero_points_f, imagestatistics->num_nonzero_points_m, imagestatistics->num_intersection);
+
+		if(imagestatistics->IsDifferentImageSize()){
+			std::ostringstream  message;
+			message << "Images are from different Sizes: fixedImage=" << imagestatistics->numberElements_f << " movingImage=" << imagestatistics->numberElements_m ;
+			pushMessage(message.str().c_str(), targetFile, f1, f2);
+			return 0;
+		}
+		if(imagestatistics->num_nonzero_points_f == 0){
+			std::ostringstream  message;
+			message << "Fixed image is empty!" ;
+			pushMessage(message.str().c_str(), targetFile, f1, f2);
+			return 0;
+		}
+		if(imagestatistics->num_nonzero_points_m == 0){
+			std::ostringstream  message;
+			message << "Moving image is empty!" ;
+			pushMessage(message.str().c_str(), targetFile, f1, f2);
+			return 0;
+		}
+
+		// buffers of a previous evaluation (batch mode)
+		releaseVoxelValues();
+		if(metricPlan.artifacts & ARTIFACT_VOXEL_VALUES){
+			values_f = (pixeltype*) malloc(imagestatistics->numberElements_f * sizeof(pixeltype));
+			if(values_f == NULL){
+				std::cout << "Memory allocation 1 !" << std::endl;
+				return  EXIT_FAILURE ;
+			}
+
+			for(long long i=0; i< imagestatistics->numberElements_f ; i++){
+				values_f[i]=0;
+			}
+			values_m = (pixeltype*) malloc(imagestatistics->numberElements_m * sizeof(pixeltype));
+			if(values_m == NULL){
+				std::cout << "Memory allocation 2 !" << std::endl;
+				return  EXIT_FAILURE;
+			}
+			for(long long i=0; i< imagestatistics->numberElements_m ; i++){
+				values_m[i]=0;
+			}
+			voxelPreprocessor.reset(new VoxelPreprocessor(truthImg, testImg, fuzzy, threshold, imagestatistics.get()));
+		}
+		endMemoryStage("preprocessing");
 	}
 
 #ifdef _DEBUG
@@ -159,15 +348,17 @@ static int validateImage(const char* f1, const char* f2, double threshold, const
 	if(ind1 != string::npos){
 		std::cout << "TestMetrics begin" << std::endl;
 		double quantile = 1;
-		StartAdditionalTestMetrics( truthImg,  testImg,  threshold,  fuzzy,   xmlObject, options, voxelPreprocessor);
+		StartAdditionalTestMetrics( truthImg,  testImg,  threshold,  fuzzy,   xmlObject, options, voxelPreprocessor.get());
 		std::cout << "TestMetrics end" << std::endl;	
 		
 	    clock_t t = clock();
         long long time_end= ((double)t*1000)/CLOCKS_PER_SEC;	
 		int total_milliseconds =  (time_end-time_start);
+		std::cout << "\nStartup time= "<< startup_milliseconds << " milliseconds"<< std::endl;
 		std::cout << "\nTotal execution time= "<< total_milliseconds << " milliseconds\n"<< std::endl;
 		std::cout << "\n  ---** VISCERAL 2013, www.visceral.eu **---\n" << std::endl;	
 		pushTotalExecutionTime(total_milliseconds, xmlObject);
+		pushStartupTime(startup_milliseconds, xmlObject);
 		pushDimentions(imagestatistics->max_x_f, imagestatistics->max_y_f, imagestatistics->max_z_f, xmlObject);
 		
 		SaveXmlObject(xmlObject, targetFile);
@@ -181,70 +372,20 @@ static int validateImage(const char* f1, const char* f2, double threshold, const
 	
        
 
-	std::cout << "Similarity:" << std::endl;
-	double value=0;
-	MetricId metricId = DICE;
-	if(shouldUse(metricId, options)){
-		DiceCoefficientMetric *diceCoefficient = new DiceCoefficientMetric(contingenceTable, fuzzy, threshold);
-		value = diceCoefficient->CalcDiceCoeff();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-	metricId = JACRD;
-	if(shouldUse(metricId, options)){
-		JaccardCoefficientMetric *jaccardCoefficient = new JaccardCoefficientMetric(contingenceTable, fuzzy, threshold);
-		value =  jaccardCoefficient->CalcJaccardCoeff();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
+	// the results are written by the registry of the metrics (MetricRegistry.h)
+	MetricContext context;
+	context.contingencyTable = contingenceTable.get();
+	context.voxelMetrics = imagestatistics != NULL ? &imagestatistics->voxelMetrics : NULL;
+	context.fuzzy = fuzzy;
+	context.threshold = threshold;
+	context.millimeter = use_millimeter;
+	context.options = options;
+	context.xmlObject = xmlObject;
 
-	ClassicMeasures *classicMeasures = new ClassicMeasures(contingenceTable, fuzzy, threshold);
-	metricId = AUC;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->CalcAUC();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-
-	metricId = KAPPA;
-	if(shouldUse(metricId, options)){
-		CohinKappaMetric *cohinKappa = new CohinKappaMetric(contingenceTable, fuzzy, threshold);
-		value =  cohinKappa->CalcCohenKappa();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-	metricId = RNDIND;
-	RandIndexMetric *randIndex = new RandIndexMetric(contingenceTable, fuzzy, threshold);
-	if(shouldUse(metricId, options)){
-		value =  randIndex->CalcRandIndex();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-	metricId = ADJRIND;
-	if(shouldUse(metricId, options)){
-		value =  randIndex->CalcAdjustedRandIndex();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-
-	metricId = ICCORR;
-	if(shouldUse(metricId, options)){
-		InterclassCorrelationMetric *interclassCorrelation = new InterclassCorrelationMetric(voxelPreprocessor, fuzzy, threshold);
-		value =  interclassCorrelation->CalcInterClassCorrelationCoeff();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-	metricId = VOLSMTY;
-	if(shouldUse(metricId, options)){
-		VolumeSimilarityCoefficient *volumetricSimilarity = new VolumeSimilarityCoefficient(contingenceTable, fuzzy, threshold);
-		value =  volumetricSimilarity->CalcVolumeSimilarityCoefficient();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-	metricId = MUTINF;
-	if(shouldUse(metricId, options)){
-		MutualInformationMetric *mutualInformation = new MutualInformationMetric(contingenceTable, fuzzy, threshold);
-		value =  mutualInformation->CalcMutualInformation();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
+	std::cout << "Similarity:" << std::endl;
+	MetricId metricId;
+	pushMetrics(SECTION_SIMILARITY, context);
+	endMemoryStage("similarity");
 
 
 
@@ -257,239 +398,341 @@ static int validateImage(const char* f1, const char* f2, double threshold, const
 
 	std::cout << "\nDistance:" << std::endl;
 
+	// the backends of the distance metrics are chosen from the foreground found by the pass over
+	// the images, the fast profile also samples them to end before the deadline
+	DistanceWorkload workload;
+	ImageType::RegionType foreground;
+	bool distancePlanned = imagestatistics != NULL && imagestatistics->GetDistanceWorkload(truthImg->GetRequestedRegion(), foreground, workload);
+	double voxelRate = distancePlanned ? imagestatistics->GetVoxelRate() : 0;
+	double spacingDiagonal = std::sqrt(workload.dimension == 3 ? 3.0 : 2.0);
+	if(use_millimeter){
+		spacingDiagonal = std::sqrt(vspx*vspx + vspy*vspy + (workload.dimension == 3 ? vspz*vspz : 0));
+	}
+	// with a memory budget the metrics run one after the other, each with a backend that fits into
+	// the memory the images leave
+	int metricWorkers = maxMemoryBytes > 0 ? 1 : getNumberOfThreads();
+	long long distanceMemory = getDistanceMemoryLimit(plan);
+	FastPlan fastPlan;
+	fastPlan.sampleCell = 1;
+	fastPlan.errorBound = 0;
+	if(isFastProfile(options) && distancePlanned){
+		fastPlan = planFastProfile(options, workload, voxelRate, secondsSince(evaluationStart), spacingDiagonal, metricWorkers > 1, distanceMemory);
+		printFastPlan(fastPlan);
+		pushFastProfile(fastPlan.deadline, fastPlan.elapsed, fastPlan.estimate, fastPlan.sampleCell, xmlObject);
+	}
+
+	// HDRFDST, AVGDIST, bAVD and MAHLNBS are independent of each other and are computed
+	// concurrently (TaskGraph.h). The metrics are configured here, the tasks only compute and write
+	// their progress event (ProgressEvents.h), and the results and their details (kept by the
+	// metrics instead of written to the console) are written below in the order of the metrics.
+	TaskGraph metricTasks;
+	const char* distanceUnit = use_millimeter ? "millimeter" : "voxel";
+	std::unique_ptr<HausdorffDistanceMetric> hausdorffDistanceMetric;
+	std::unique_ptr<AverageDistanceMetric> averageDistanceMetric;
+	std::unique_ptr<AverageDistanceMetric> balancedDistanceMetric;
+	MetricResult &hausdorffResult = context.results[HDRFDST];
+	MetricResult &averageResult = context.results[AVGDIST];
+	MetricResult &balancedResult = context.results[bAVD];
+	MetricResult &mahalanobisResult = context.results[MAHLNBS];
+	bool useFields = false;
 
 	metricId = HDRFDST;
+	double quantile=1;
 	if(shouldUse(metricId, options)){
 		std::string quantile_s=getOptions(metricId, options);
-	    clock_t t = clock();
-        long long s1= ((double)t*1000)/CLOCKS_PER_SEC;	
-
-	    double quantile=1;
 		if(quantile_s!=nooption){
 			std::istringstream stm(quantile_s);
 			stm>>quantile;
 		}
-		HausdorffDistanceMetric *hausdorffDistanceMetric = new HausdorffDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter);  
-		value =  hausdorffDistanceMetric->CalcHausdorffDistace(quantile);
-	    t = clock();
-        long long s2= ((double)t*1000)/CLOCKS_PER_SEC;	
-
-	int milliseconds =  (s2-s1);
-	    if(use_millimeter){
-		   pushValue(metricId, value, milliseconds, xmlObject, "millimeter");
-	    }
-		else{
-		    pushValue(metricId, value, milliseconds, xmlObject, "voxel");
+		hausdorffDistanceMetric.reset(new HausdorffDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter));
+		if(distancePlanned){
+			hausdorffResult.plan = planDistanceMetric(metricId, workload, voxelRate, fastPlan.sampleCell, quantile < 1, distanceMemory);
+			hausdorffDistanceMetric->backend = hausdorffResult.plan.backend;
+			hausdorffDistanceMetric->sampleCell = hausdorffResult.plan.sampleCell;
+			hausdorffDistanceMetric->distanceRegion = foreground;
+			useFields |= hausdorffResult.plan.backend == DISTANCE_EDT;
 		}
 	}
 
 	metricId = AVGDIST;
 	if(shouldUse(metricId, options)){
-	    clock_t t = clock();
-        long long s1= ((double)t*1000)/CLOCKS_PER_SEC;	
-		AverageDistanceMetric *averageDistanceMetric = new AverageDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter);
-		value =  averageDistanceMetric->CalcAverageDistace(false);
-	    t = clock();
-        long long s2= ((double)t*1000)/CLOCKS_PER_SEC;	
-		int milliseconds =  (s2-s1);
-		if(use_millimeter){
-		    pushValue(metricId, value, milliseconds, xmlObject, "millimeter");
+		averageDistanceMetric.reset(new AverageDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter));
+		if(distancePlanned){
+			averageResult.plan = planDistanceMetric(metricId, workload, voxelRate, fastPlan.sampleCell, false, distanceMemory);
+			averageDistanceMetric->backend = averageResult.plan.backend;
+			averageDistanceMetric->sampleCell = averageResult.plan.sampleCell;
+			averageDistanceMetric->distanceRegion = foreground;
+			useFields |= averageResult.plan.backend == DISTANCE_EDT;
 		}
-		else{
-		    pushValue(metricId, value, milliseconds, xmlObject, "voxel");
-		}
-		
-	}
-	
-	/*
-	metricId = AVGDIST_D;
-	if(shouldUse(metricId, options)){
-	    clock_t t = clock();
-        long long s1= ((double)t*1000)/CLOCKS_PER_SEC;	
-		AverageDistanceMetric *averageDistanceMetric = new AverageDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter);
-		value =  averageDistanceMetric->CalcAverageDistaceDirected();
-	    t = clock();
-        long long s2= ((double)t*1000)/CLOCKS_PER_SEC;	
-		int milliseconds =  (s2-s1);
-		if(use_millimeter){
-		    pushValue(metricId, value, milliseconds, xmlObject, "millimeter");
-		}
-		else{
-		    pushValue(metricId, value, milliseconds, xmlObject, "voxel");
-		}
-		
 	}
-	*/
-	
+
 	metricId = bAVD;
 	if(shouldUse(metricId, options)){
-	    clock_t t = clock();
-        long long s1= ((double)t*1000)/CLOCKS_PER_SEC;	
-		AverageDistanceMetric *averageDistanceMetric = new AverageDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter);
-		value =  averageDistanceMetric->CalcBalancedAverageDistace();
-	    t = clock();
-        long long s2= ((double)t*1000)/CLOCKS_PER_SEC;	
-		int milliseconds =  (s2-s1);
-		if(use_millimeter){
-		    pushValue(metricId, value, milliseconds, xmlObject, "millimeter");
+		balancedDistanceMetric.reset(new AverageDistanceMetric(truthImg, testImg, fuzzy, threshold, use_millimeter));
+		// the balanced average distance is not sampled
+		if(distancePlanned){
+			balancedResult.plan = planDistanceMetric(metricId, workload, voxelRate, 1, false, distanceMemory);
+			balancedDistanceMetric->backend = balancedResult.plan.backend;
+			balancedDistanceMetric->distanceRegion = foreground;
+			useFields |= balancedResult.plan.backend == DISTANCE_EDT;
 		}
-		else{
-		    pushValue(metricId, value, milliseconds, xmlObject, "voxel");
+	}
+
+	// the distance transforms are made once for all metrics using them (with a memory budget each
+	// metric makes and frees its own), allocated from the arenas of the workers and freed with them.
+	// They are made in parallel on a share of the cores, see fieldThreads below.
+	std::unique_ptr<DistanceField> field_f, field_m;
+	int fieldThreads = 1;
+	Arena::Marker fieldMarker = evaluationArena().Mark();
+	if(useFields && maxMemoryBytes == 0){
+		const ImageType::SpacingType &spacing = truthImg->GetSpacing();
+		double sp[3];
+		for(int i = 0; i < 3; i++){
+			sp[i] = use_millimeter && spacing[i] != 0 ? spacing[i] : 1;
 		}
-		
+		double thd = getDistanceThreshold(fuzzy, threshold);
+		metricTasks.Add("distance transform of the fixed image", [&, sp, thd](){
+			field_f.reset(new DistanceField(truthImg, foreground, thd, sp[0], sp[1], sp[2], fieldThreads));
+		}, 0, ARTIFACT_DISTANCE_FIELDS);
+		metricTasks.Add("distance transform of the moving image", [&, sp, thd](){
+			field_m.reset(new DistanceField(testImg, foreground, thd, sp[0], sp[1], sp[2], fieldThreads));
+		}, 0, ARTIFACT_DISTANCE_FIELDS);
+	}
+
+	if(hausdorffDistanceMetric){
+		bool edt = hausdorffDistanceMetric->backend == DISTANCE_EDT;
+		metricTasks.Add("HDRFDST", [&](){
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			hausdorffDistanceMetric->field_f = field_f.get();
+			hausdorffDistanceMetric->field_m = field_m.get();
+			hausdorffResult.value = hausdorffDistanceMetric->CalcHausdorffDistace(quantile);
+			hausdorffResult.milliseconds = (int)(secondsSince(start) * 1000);
+			pushProgressMetric(HDRFDST, hausdorffResult.value, false, distanceUnit, hausdorffResult.milliseconds);
+		}, metricInfo[HDRFDST].artifacts | (edt ? ARTIFACT_DISTANCE_FIELDS : 0), 0);
+	}
+	if(averageDistanceMetric){
+		bool edt = averageDistanceMetric->backend == DISTANCE_EDT;
+		metricTasks.Add("AVGDIST", [&](){
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			averageDistanceMetric->field_f = field_f.get();
+			averageDistanceMetric->field_m = field_m.get();
+			averageResult.value = averageDistanceMetric->CalcAverageDistace(false);
+			averageResult.milliseconds = (int)(secondsSince(start) * 1000);
+			pushProgressMetric(AVGDIST, averageResult.value, false, distanceUnit, averageResult.milliseconds);
+		}, metricInfo[AVGDIST].artifacts | (edt ? ARTIFACT_DISTANCE_FIELDS : 0), 0);
+	}
+	if(balancedDistanceMetric){
+		bool edt = balancedDistanceMetric->backend == DISTANCE_EDT;
+		metricTasks.Add("bAVD", [&](){
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			balancedDistanceMetric->field_f = field_f.get();
+			balancedDistanceMetric->field_m = field_m.get();
+			balancedResult.value = balancedDistanceMetric->CalcBalancedAverageDistace();
+			balancedResult.milliseconds = (int)(secondsSince(start) * 1000);
+			pushProgressMetric(bAVD, balancedResult.value, false, distanceUnit, balancedResult.milliseconds);
+		}, metricInfo[bAVD].artifacts | (edt ? ARTIFACT_DISTANCE_FIELDS : 0), 0);
 	}
-	
-	
 
 	metricId = MAHLNBS;
 	if(shouldUse(metricId, options)){
-		MahalanobisDistanceMetric *mahalanobisDistance = new MahalanobisDistanceMetric(truthImg, testImg, voxelPreprocessor, fuzzy, threshold);
-		value =  mahalanobisDistance->CalcMahalanobisDistace();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-	metricId = VARINFO;
-	if(shouldUse(metricId, options)){
-		VariationOfInformationMetric *variationOfInformation = new VariationOfInformationMetric(contingenceTable, fuzzy, threshold);
-		value =  variationOfInformation->CalcVariationOfInformation();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
+		metricTasks.Add("MAHLNBS", [&](){
+			MahalanobisDistanceMetric mahalanobisDistance(truthImg, testImg, voxelPreprocessor.get(), fuzzy, threshold);
+			if(imagestatistics != NULL && imagestatistics->voxelMetrics.IsEnabled<MahalanobisMoments>()){
+				const MahalanobisMoments &moments = imagestatistics->voxelMetrics.Get<MahalanobisMoments>();
+				mahalanobisResult.value =  mahalanobisDistance.CalcMahalanobisDistace(moments.moments_f, moments.moments_m);
+			}
+			else{
+				mahalanobisResult.value =  mahalanobisDistance.CalcMahalanobisDistace();
+			}
+			pushProgressMetric(MAHLNBS, mahalanobisResult.value, false, NULL, -1);
+		}, metricInfo[MAHLNBS].artifacts, 0);
+	}
+
+	// the cores are divided among the tasks that start at the same time, so that the parallel
+	// distance transforms do not run more threads than there are cores
+	int concurrentTasks = std::max(1, std::min(metricWorkers, metricTasks.GetNumberOfRootTasks()));
+	fieldThreads = std::max(1, getNumberOfThreads() / concurrentTasks);
+	if(hausdorffDistanceMetric){
+		hausdorffDistanceMetric->threads = fieldThreads;
+	}
+	if(averageDistanceMetric){
+		averageDistanceMetric->threads = fieldThreads;
+	}
+	if(balancedDistanceMetric){
+		balancedDistanceMetric->threads = fieldThreads;
+	}
+	metricTasks.Run(metricWorkers);
+	field_f.reset();
+	field_m.reset();
+	evaluationArena().Release(fieldMarker);
+
+	if(averageDistanceMetric){
+		context.details[AVGDIST] = averageDistanceMetric->details.str();
+	}
+	context.distancePlanned = distancePlanned;
+	context.spacingDiagonal = spacingDiagonal;
+	hausdorffDistanceMetric.reset();
+	averageDistanceMetric.reset();
+	balancedDistanceMetric.reset();
+	// no metric below needs the images (images passed in by batch evaluations are held by the caller)
+	truthImg = ITK_NULLPTR;
+	testImg = ITK_NULLPTR;
+	truthImage = ITK_NULLPTR;
+	testImage = ITK_NULLPTR;
+	pushMetrics(SECTION_DISTANCE, context);
+	releaseVoxelValues();
+	endMemoryStage("distance");
 
 
-	metricId = GCOERR;
-	if(shouldUse(metricId, options)){
+	std::cout << "\nClassic Measures:" << std::endl;
 
-		GlobalConsistencyError *globalConsistencyError = new GlobalConsistencyError(contingenceTable, fuzzy, threshold);
-		value = globalConsistencyError->CalcGlobalConsistencyError();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
+	pushMetrics(SECTION_CLASSIC, context);
+	
+	endMemoryStage("classic");
 
-	metricId = PROBDST;
-	if(shouldUse(metricId, options)){
-		ProbabilisticDistanceMetric *probabilisticDistance = new ProbabilisticDistanceMetric(voxelPreprocessor, fuzzy, threshold);
-		value =  probabilisticDistance->CalcJProbabilisticDistance();
-		pushValue(metricId, value, xmlObject,false, NULL);
+	clock_t t = clock();
+    long long time_end= ((double)t*1000)/CLOCKS_PER_SEC;	
+	int total_milliseconds =  (time_end-time_start);
+	std::cout << "\nStartup time= "<< startup_milliseconds << " milliseconds"<< std::endl;
+	std::cout << "\nTotal execution time= "<< total_milliseconds << " milliseconds"<< std::endl;
+	printMemoryStages();
+	std::cout << std::endl;
+	std::cout << "\n  ---** VISCERAL 2013, www.visceral.eu **---\n" << std::endl;	
+	pushTotalExecutionTime(total_milliseconds, xmlObject);
+	pushStartupTime(startup_milliseconds, xmlObject);
+	pushDimentions(max_x, max_y, max_z, vspx, vspy, vspz, xmlObject);
+	pushMemoryUsage(memoryStages, xmlObject);
+	if(plan.planned){
+		pushMemoryPlan(maxMemoryBytes, plan.estimate, plan.overlapStrategy.c_str(), plan.imageStrategy.c_str(), xmlObject);
 	}
-
-
-	std::cout << "\nClassic Measures:" << std::endl;
-
-	metricId = SNSVTY;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->CalcSensitivity();
-		pushValue(metricId, value, xmlObject,false, NULL);
+	if(useRoi){
+		pushRegionOfInterest(roiRegion.GetIndex(0), roiRegion.GetIndex(1), roiRegion.GetIndex(2), roiRegion.GetSize(0), roiRegion.GetSize(1), roiRegion.GetSize(2), xmlObject);
 	}
+	SaveXmlObject(xmlObject, targetFile);
 
-
-	metricId = SPCFTY;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->CalcSpecificity();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
+	return EXIT_SUCCESS;
+}
 
 
-	metricId = PRCISON;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->CalcPrecision();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
 
-	metricId = FMEASR;
-	if(shouldUse(metricId, options)){
-		std::string beta_s=getOptions(metricId, options);
-		double beta=1;
-		if(beta_s!=nooption){
-			std::istringstream stm(beta_s);
-			stm>>beta;
+/*
+// Loads both images of an evaluation, those already given (not NULL) are kept. A DICOM-SEG is placed
+// on the grid of the other image, which is therefore loaded first.
+*/
+bool loadImages(const char* f1, const char* f2, bool useStreamingFilter, const ImageType::RegionType* roi, ImageType::Pointer &truthImg, ImageType::Pointer &testImg){
+	if(truthImg.IsNull() && testImg.IsNull() && isDicomSegmentationInput(f1) && !isDicomSegmentationInput(f2)){
+		testImg = loadImage(f2, useStreamingFilter, roi);
+		if(testImg.IsNull()){
+			return false;
 		}
-		value =  classicMeasures->CalcFMeasure(beta);
-		pushValue(metricId, value, xmlObject,false, NULL);
 	}
-	metricId = ACURCY;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->CalcAccuracy();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-	metricId = FALLOUT;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->CalcFallout();
-		pushValue(metricId, value, xmlObject,false, NULL);
-	}
-
-	metricId = TP;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->getTP();
-		pushValue(metricId, value, xmlObject,true, "voxel");
-	}
-
-	metricId = FP;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->getFP();
-		pushValue(metricId, value, xmlObject,true, "voxel");
+	if(truthImg.IsNull()){
+		truthImg = loadImage(f1, useStreamingFilter, roi, testImg);
+		if(truthImg.IsNull()){
+			return false;
+		}
 	}
-
-	metricId = TN;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->getTN();
-		pushValue(metricId, value, xmlObject,true, "voxel");
+	if(testImg.IsNull()){
+		testImg = loadImage(f2, useStreamingFilter, roi, truthImg);
 	}
+	return testImg.IsNotNull();
+}
 
-	metricId = FN;
-	if(shouldUse(metricId, options)){
-		value =  classicMeasures->getFN();
-		pushValue(metricId, value, xmlObject,true, "voxel");
+/*
+// Loads an image, optionally only the region roi. A DICOM-SEG is placed on the grid of reference if
+// given (which then already is the region of interest), other images ignore it.
+*/
+ImageType::Pointer loadImage( const char* filename, bool useStreamingFilter, const ImageType::RegionType* roi, ImageType* reference){
+	bool truth_url=isUrl(filename);
+	HttpResponse response;
+	if(truth_url && isUrlCacheEnabled()){
+		// read from the cache directory, the file is kept for later evaluations
+		cout << "loading " << filename << std::endl;
+		UrlCacheEntry *entry = openCachedUrl(filename);
+		if(entry == NULL){
+			std::cerr << "Unable to load image!" << std::endl;
+			return ITK_NULLPTR;
+		}
+		ImageType::Pointer img = loadImage(entry->path.c_str(), useStreamingFilter, roi, reference);
+		delete entry;
+		return img;
 	}
-
-	metricId = REFVOL;
-	if(shouldUse(metricId, options)){
-		if(use_millimeter){
-			value =  classicMeasures->CalcReferenceVolumeInMl();
-		    pushValue(REFVOL, value, xmlObject,false, "milliliter");
+	else if(truth_url && isNiftiUrl(filename) && urlPrefetchCache.Take(filename, response)){
+		cout << "loading " << filename << std::endl;
+		try
+		{
+			if(response.error != ""){
+				throw std::runtime_error(response.error);
+			}
+			MemoryByteSource source(response.body.empty() ? NULL : &response.body[0], response.body.size());
+			return readNiftiStream(&source);
 		}
-		else{
-			value =  classicMeasures->CalcReferenceVolumeInVoxel();
-		    pushValue(REFVOL, value, xmlObject,true, "voxel");
+		catch( std::exception & err )
+		{
+			std::cerr << "Unable to load image!" << std::endl;
+			std::cerr << err.what() << std::endl;
 		}
-		
 	}
-	
-	metricId = SEGVOL;
-	if(shouldUse(metricId, options)){
-		if(use_millimeter){
-			value =  classicMeasures->CalcSegmentedVolumeInMl();
-		    pushValue(SEGVOL, value, xmlObject,false, "milliliter");
+	else if(truth_url && isNiftiUrl(filename)){
+		// decoded while it is received
+		cout << "loading " << filename << std::endl;
+		try
+		{
+			HttpByteSource source(filename);
+			return readNiftiStream(&source);
 		}
-		else{
-			value =  classicMeasures->CalcSegmentedVolumeInVoxel();
-		    pushValue(SEGVOL, value, xmlObject,true, "voxel");
+		catch( std::exception & err )
+		{
+			std::cerr << "Unable to load image!" << std::endl;
+			std::cerr << err.what() << std::endl;
 		}
-		
 	}
-	
-	
-	clock_t t = clock();
-    long long time_end= ((double)t*1000)/CLOCKS_PER_SEC;	
-	int total_milliseconds =  (time_end-time_start);
-	std::cout << "\nTotal execution time= "<< total_milliseconds << " milliseconds\n"<< std::endl;
-	std::cout << "\n  ---** VISCERAL 2013, www.visceral.eu **---\n" << std::endl;	
-	pushTotalExecutionTime(total_milliseconds, xmlObject);
-	pushDimentions(imagestatistics->max_x_f, imagestatistics->max_y_f, imagestatistics->max_z_f, imagestatistics->vspx, imagestatistics->vspy, imagestatistics->vspz, xmlObject);
-	SaveXmlObject(xmlObject, targetFile);
-
-	return EXIT_SUCCESS;
-}
-
-
-
-ImageType::Pointer loadImage( const char* filename, bool useStreamingFilter){
-	bool truth_url=isUrl(filename);
-	if(truth_url){
+	else if(truth_url){
 		string temp_file = download_image(filename, "__temp_image.nii"); 
 		cout << "loading " << filename << std::endl;
-		ImageType::Pointer img = loadImage(temp_file.c_str(), useStreamingFilter);
+		ImageType::Pointer img = loadImage(temp_file.c_str(), useStreamingFilter, roi, reference);
 		remove(temp_file.c_str()) ;
 		return img;
 	} 
+	else if(isSharedMemory(filename) || isStreamInput(filename) || isNumpyFile(filename) || isChunkedArray(filename) || isArchiveMember(filename) || isSparseMask(filename) || isDicomInput(filename)){
+		try
+		{
+			if(isDicomSegmentationInput(filename)){
+				ImageType::Pointer img = loadDicomSegmentation(filename, reference);
+				return roi == NULL || reference != NULL ? img : cropImage(img, *roi);
+			}
+			// these inputs are read as a whole (and rescaled from the range of the whole image), a
+			// region of interest is cut out afterwards
+			if(roi != NULL){
+				ImageType::Pointer img = loadImage(filename, useStreamingFilter, NULL);
+				return img.IsNull() ? img : cropImage(img, *roi);
+			}
+			if(isArchiveMember(filename)){
+				return loadArchiveMemberImage(filename);
+			}
+			if(isSharedMemory(filename)){
+				return loadSharedMemoryImage(filename);
+			}
+			if(isStreamInput(filename)){
+				return loadStreamImage(filename);
+			}
+			if(isNumpyFile(filename)){
+				return loadNumpyImage(filename);
+			}
+			if(isSparseMask(filename)){
+				return loadSparseImage(filename);
+			}
+			if(isChunkedArray(filename)){
+				return loadChunkedImage(filename);
+			}
+			return loadDicomImage(filename);
+		}
+		catch( std::exception & err )
+		{
+			std::cerr << "Unable to load image!" << std::endl;
+			std::cerr << err.what() << std::endl;
+		}
+	}
 	else{
 		if(itksys::SystemTools::FileExists(filename,true)){
 			
@@ -497,42 +740,74 @@ ImageType::Pointer loadImage( const char* filename, bool useStreamingFilter){
 		
 		try
 		{
-			ImageType::Pointer img ;
-			if(useStreamingFilter){
-				typedef itk::Image<float, 3> FloatImageType;	
-				typedef itk::ImageFileReader<FloatImageType> FloatFileReaderType;
-				typedef itk::RescaleIntensityImageFilter<FloatImageType,FloatImageType > FloatScalingFilterType;
-				typedef itk::CastImageFilter< FloatImageType, ImageType > CastFilterType;
-				typedef itk::StreamingImageFilter<ImageType, ImageType> StreamingFilterType;
-				FloatFileReaderType::Pointer reader1 = FloatFileReaderType::New();
-				reader1->SetFileName(filename);
-				StreamingFilterType::Pointer streamingFilter = StreamingFilterType::New();
-				FloatScalingFilterType::Pointer scalingfilter = FloatScalingFilterType::New();
+			// the intensities are rescaled in place in the buffer of the reader, which is released
+			// as soon as the cast filter has consumed it; only the 8 bit image is kept
+			typedef itk::Image<float, 3> FloatImageType;	
+			typedef itk::ImageFileReader<FloatImageType> FloatFileReaderType;
+			typedef itk::RescaleIntensityImageFilter<FloatImageType,FloatImageType > FloatScalingFilterType;
+			typedef itk::IntensityWindowingImageFilter<FloatImageType,FloatImageType > FloatWindowingFilterType;
+			typedef itk::CastImageFilter< FloatImageType, ImageType > CastFilterType;
+			typedef itk::StreamingImageFilter<ImageType, ImageType> StreamingFilterType;
+			FloatFileReaderType::Pointer reader1 = FloatFileReaderType::New();
+			reader1->SetFileName(filename);
+			reader1->ReleaseDataFlagOn();
+			CastFilterType::Pointer castFilter = CastFilterType::New();
+			FloatScalingFilterType::Pointer scalingfilter;
+			FloatWindowingFilterType::Pointer windowingfilter;
+			if(roi == NULL){
+				scalingfilter = FloatScalingFilterType::New();
 				scalingfilter->SetOutputMinimum( PIXEL_VALUE_RANGE_MIN );
 				scalingfilter->SetOutputMaximum( PIXEL_VALUE_RANGE_MAX );
 				scalingfilter->SetInput( reader1->GetOutput() );
-				CastFilterType::Pointer castFilter = CastFilterType::New();
+				scalingfilter->InPlaceOn();
+				scalingfilter->ReleaseDataFlagOn();
 				castFilter->SetInput(scalingfilter->GetOutput());
+			}
+			else{
+				// the rescale filter would take the range of the region only; the range of the whole
+				// image maps the voxels as in a full read (same formula, an image of one value gives 0)
+				IntensityRange range = getIntensityRange(filename);
+				windowingfilter = FloatWindowingFilterType::New();
+				windowingfilter->SetWindowMinimum( range.minimum );
+				windowingfilter->SetWindowMaximum( range.maximum > range.minimum ? range.maximum : range.minimum + 1 );
+				windowingfilter->SetOutputMinimum( PIXEL_VALUE_RANGE_MIN );
+				windowingfilter->SetOutputMaximum( PIXEL_VALUE_RANGE_MAX );
+				windowingfilter->SetInput( reader1->GetOutput() );
+				windowingfilter->InPlaceOn();
+				windowingfilter->ReleaseDataFlagOn();
+				castFilter->SetInput(windowingfilter->GetOutput());
+			}
+
+			ImageType::Pointer img ;
+			if(useStreamingFilter){
+				// the pieces produced by the cast filter are released once they are copied
+				castFilter->ReleaseDataFlagOn();
+				StreamingFilterType::Pointer streamingFilter = StreamingFilterType::New();
 				streamingFilter->SetInput(castFilter->GetOutput());
-				streamingFilter->Update();
+				if(roi != NULL){
+					streamingFilter->GetOutput()->SetRequestedRegion(*roi);
+					streamingFilter->GetOutput()->Update();
+				}
+				else{
+					streamingFilter->Update();
+				}
 				img = streamingFilter->GetOutput();
 			}
 			else{
-				typedef itk::Image<float, 3> FloatImageType;	
-				typedef itk::ImageFileReader<FloatImageType> FloatFileReaderType;
-				typedef itk::RescaleIntensityImageFilter<FloatImageType,FloatImageType > FloatScalingFilterType;
-				typedef itk::CastImageFilter< FloatImageType, ImageType > CastFilterType;
-				FloatFileReaderType::Pointer reader1 = FloatFileReaderType::New();
-				reader1->SetFileName(filename);
-				FloatScalingFilterType::Pointer scalingfilter = FloatScalingFilterType::New();
-				scalingfilter->SetOutputMinimum( PIXEL_VALUE_RANGE_MIN );
-				scalingfilter->SetOutputMaximum( PIXEL_VALUE_RANGE_MAX );
-				scalingfilter->SetInput( reader1->GetOutput() );
-				CastFilterType::Pointer castFilter = CastFilterType::New();
-				castFilter->SetInput(scalingfilter->GetOutput());
-				castFilter->Update();
+				if(roi != NULL){
+					castFilter->GetOutput()->SetRequestedRegion(*roi);
+					castFilter->GetOutput()->Update();
+				}
+				else{
+					castFilter->Update();
+				}
 				img = castFilter->GetOutput();
 			}
+			// the filters and their remaining buffers are freed when this function returns
+			img->DisconnectPipeline();
+			if(roi != NULL){
+				shiftRegionToZeroIndex(img);
+			}
 
 #ifdef _DEBUG
 			/*
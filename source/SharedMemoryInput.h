@@ -0,0 +1,147 @@
+/*
+// SharedMemoryInput.h
+//
+// Description:
+//
+// This file reads images handed over in POSIX shared memory (input path shm://name), e.g. by an
+// inference service running on the same host. The segment is mapped read-only and its voxels are
+// rescaled in one pass into the image evaluated (see ImageImport.h), without serializing the image
+// to a file or copying it first. The segment starts with the
+// descriptor SharedImageDescriptor (little endian, 80 bytes):
+//
+//   offset  0: char[8]    magic "EVALSEG1"
+//   offset  8: char[8]    pixel type as numpy dtype string, e.g. "|u1", "<u2", "<f4" (zero padded)
+//   offset 16: int32      number of dimensions (2 or 3)
+//   offset 20: int32      reserved (0)
+//   offset 24: int64[3]   size x, y, z (x fastest running)
+//   offset 48: float64[3] voxel spacing x, y, z
+//   offset 72: int64      offset of the voxel data from the beginning of the segment
+//
+*/
+
+#ifndef _SHAREDMEMORYINPUT
+#define _SHAREDMEMORYINPUT
+
+#include <string>
+#include <stdexcept>
+#include "ImageImport.h"
+#include "NumpyReader.h"
+
+#ifndef _WINOS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char SHARED_IMAGE_MAGIC[8] = {'E', 'V', 'A', 'L', 'S', 'E', 'G', '1'};
+
+typedef struct SharedImageDescriptor{
+	char magic[8];
+	char dtype[8];
+	int ndims;
+	int reserved;
+	long long size[3];
+	double spacing[3];
+	long long dataOffset;
+} SharedImageDescriptor;
+
+bool isSharedMemory(const char* path){
+	return std::string(path).compare(0, 6, "shm://") == 0;
+}
+
+/*
+// Maps a shared-memory segment read-only for the lifetime of the object
+*/
+class SharedMemorySegment
+{
+private:
+	void *data;
+	long long length;
+
+public:
+	SharedMemorySegment(const std::string &name){
+		data = NULL;
+		length = 0;
+#ifndef _WINOS
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if(fd < 0){
+			throw std::runtime_error("Cannot open shared memory: " + name);
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size == 0){
+			close(fd);
+			throw std::runtime_error("Empty shared memory: " + name);
+		}
+		length = st.st_size;
+		data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(data == MAP_FAILED){
+			data = NULL;
+			throw std::runtime_error("Cannot map shared memory: " + name);
+		}
+#else
+		throw std::runtime_error("Shared memory inputs are not supported on this platform");
+#endif
+	}
+
+	~SharedMemorySegment(){
+#ifndef _WINOS
+		if(data != NULL){
+			munmap(data, length);
+		}
+#endif
+	}
+
+	const char* GetData(){
+		return (const char*)data;
+	}
+
+	long long GetLength(){
+		return length;
+	}
+};
+
+ImageType::Pointer loadSharedMemoryImage(const char* path){
+	std::string name = std::string(path).substr(6);
+	if(name.empty() || name[0] != '/'){
+		name = "/" + name;
+	}
+	SharedMemorySegment segment(name);
+
+	SharedImageDescriptor descriptor;
+	if(segment.GetLength() < (long long)sizeof(descriptor)){
+		throw std::runtime_error("Shared memory too small for an image descriptor: " + name);
+	}
+	memcpy(&descriptor, segment.GetData(), sizeof(descriptor));
+	if(memcmp(descriptor.magic, SHARED_IMAGE_MAGIC, sizeof(SHARED_IMAGE_MAGIC)) != 0){
+		throw std::runtime_error("Invalid image descriptor in shared memory: " + name);
+	}
+	std::string dtype(descriptor.dtype, strnlen(descriptor.dtype, sizeof(descriptor.dtype)));
+	RawPixelType type = parseNumpyType(dtype);
+	if(type == RAW_UNKNOWN){
+		throw std::runtime_error("Unsupported pixel type in shared memory: " + dtype);
+	}
+	if(descriptor.ndims < 2 || descriptor.ndims > 3){
+		throw std::runtime_error("Only 2D and 3D images are supported in shared memory");
+	}
+
+	long long size[3];
+	double spacing[3];
+	long long count = 1;
+	for(int i = 0; i < 3; i++){
+		size[i] = i < descriptor.ndims ? descriptor.size[i] : 1;
+		spacing[i] = descriptor.spacing[i] > 0 ? descriptor.spacing[i] : 1;
+		if(size[i] < 1){
+			throw std::runtime_error("Invalid image size in shared memory: " + name);
+		}
+		count *= size[i];
+	}
+	if(descriptor.dataOffset < (long long)sizeof(descriptor) || descriptor.dataOffset + count * rawPixelSize(type) > segment.GetLength()){
+		throw std::runtime_error("Voxel data exceeds the shared memory: " + name);
+	}
+	// the segment is used in place and stays mapped until the image has been imported
+	return importRawImage(segment.GetData() + descriptor.dataOffset, type, size, spacing);
+}
+
+#endif
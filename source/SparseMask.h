@@ -0,0 +1,352 @@
+/*
+// SparseMask.h
+//
+// Description:
+//
+// This file reads binary segmentations given in a sparse form, which is much smaller than a dense
+// volume for small structures such as lesions:
+//
+// - run-length encoded masks (.rle.json), a JSON object
+//       {"size": [x, y, z], "spacing": [sx, sy, sz], "counts": [...]}
+//   where counts are the lengths of alternating background and foreground runs (starting with
+//   background) over the voxels in the order x fastest, then y, then z. As in COCO, counts can
+//   also be given as a compressed RLE string. "spacing" is optional.
+//
+// - foreground coordinate lists (.coords), a text file with one foreground voxel "x y z" (or
+//   "x y" for 2D masks) per line, preceded by the header lines "# size x y z" and optionally
+//   "# spacing sx sy sz". Lists sorted by z, y, x are read fastest.
+//
+// -spacing overrides the spacing of the header; masks without spacing use a sidecar file, see
+// resolveInputSpacing(). The foreground is kept as sorted runs of linear voxel indices. If both
+// images are sparse and only overlap based metrics are requested, the contingency table is
+// computed by intersecting the runs, without creating the dense volumes.
+//
+*/
+
+#ifndef _SPARSEMASK
+#define _SPARSEMASK
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include "ImageImport.h"
+#include "JointHistogram.h"
+#include "JsonParser.h"
+#include "NumpyReader.h"
+
+bool isSparseMask(const char* path){
+	std::string p = path;
+	return endsWith(p, ".rle.json") || endsWith(p, ".coords");
+}
+
+class SparseMask
+{
+private:
+	void readSize(const JsonValue *value, const std::string &path){
+		if(value == NULL || value->type != JsonValue::JSON_ARRAY || value->items.size() < 2 || value->items.size() > 3){
+			throw std::runtime_error("Sparse mask needs a 2D or 3D size: " + path);
+		}
+		dimensions = value->items.size();
+		for(int a = 0; a < 3; a++){
+			size[a] = a < dimensions ? (long long)value->items[a].number : 1;
+			if(size[a] < 1){
+				throw std::runtime_error("Invalid size of sparse mask: " + path);
+			}
+		}
+	}
+
+	// COCO compressed RLE: 6 bit groups, counts after the second are deltas to the count two before
+	static std::vector<long long> decodeRleString(const std::string &s){
+		std::vector<long long> counts;
+		size_t p = 0;
+		while(p < s.size()){
+			long long x = 0;
+			int k = 0;
+			bool more = true;
+			while(more){
+				if(p >= s.size()){
+					throw std::runtime_error("Truncated RLE string");
+				}
+				long long c = s[p] - 48;
+				x |= (c & 0x1f) << (5 * k);
+				more = (c & 0x20) != 0;
+				p++;
+				k++;
+				if(!more && (c & 0x10)){
+					x |= -1LL << (5 * k);
+				}
+			}
+			if(counts.size() > 2){
+				x += counts[counts.size() - 2];
+			}
+			counts.push_back(x);
+		}
+		return counts;
+	}
+
+	void readRle(const std::string &path){
+		JsonValue root = parseJsonFile(path);
+		readSize(root.Get("size"), path);
+		resolveSpacing(root.Get("spacing"), path);
+
+		std::vector<long long> counts;
+		const JsonValue *value = root.Get("counts");
+		if(value != NULL && value->type == JsonValue::JSON_STRING){
+			counts = decodeRleString(value->string);
+		}
+		else if(value != NULL && value->type == JsonValue::JSON_ARRAY){
+			for(size_t i = 0; i < value->items.size(); i++){
+				counts.push_back((long long)value->items[i].number);
+			}
+		}
+		else{
+			throw std::runtime_error("Sparse mask without counts: " + path);
+		}
+
+		long long pos = 0;
+		for(size_t i = 0; i < counts.size(); i++){
+			if(counts[i] < 0){
+				throw std::runtime_error("Negative run length in " + path);
+			}
+			if(i % 2 == 1 && counts[i] > 0){
+				AddRun(pos, counts[i]);
+			}
+			pos += counts[i];
+		}
+		if(pos > GetNumberOfElements()){
+			throw std::runtime_error("Runs exceed the size of the mask: " + path);
+		}
+	}
+
+	void readCoordinates(const std::string &path){
+		std::ifstream file(path.c_str());
+		if(!file){
+			throw std::runtime_error("Cannot open " + path);
+		}
+		dimensions = 0;
+		bool spacingRead = false;
+		std::vector<long long> indices;
+		std::string line;
+		while(std::getline(file, line)){
+			if(line.empty()){
+				continue;
+			}
+			if(line[0] == '#'){
+				std::istringstream header(line.substr(1));
+				std::string key;
+				header >> key;
+				if(key == "size"){
+					long long v;
+					while(dimensions < 3 && header >> v){
+						size[dimensions++] = v;
+					}
+					for(int a = dimensions; a < 3; a++){
+						size[a] = 1;
+					}
+					if(dimensions < 2 || size[0] < 1 || size[1] < 1 || size[2] < 1){
+						throw std::runtime_error("Invalid size of sparse mask: " + path);
+					}
+				}
+				else if(key == "spacing"){
+					for(int a = 0; a < 3; a++){
+						spacing[a] = 1;
+					}
+					for(int a = 0; a < 3 && header >> spacing[a]; a++){
+					}
+					spacingRead = true;
+				}
+				continue;
+			}
+			if(dimensions < 2){
+				throw std::runtime_error("Coordinate list without '# size' header: " + path);
+			}
+			long long c[3] = {0, 0, 0};
+			const char *p = line.c_str();
+			char *end;
+			for(int a = 0; a < dimensions; a++){
+				c[a] = strtoll(p, &end, 10);
+				if(end == p){
+					throw std::runtime_error("Invalid coordinate '" + line + "' in " + path);
+				}
+				p = end;
+				while(*p == ',' || *p == ' ' || *p == '\t'){
+					p++;
+				}
+				if(c[a] < 0 || c[a] >= size[a]){
+					throw std::runtime_error("Coordinate '" + line + "' outside of the mask: " + path);
+				}
+			}
+			indices.push_back(c[0] + size[0] * (c[1] + size[1] * c[2]));
+		}
+		if(dimensions < 2){
+			throw std::runtime_error("Coordinate list without '# size' header: " + path);
+		}
+		// -spacing overrides the header
+		if(!spacingRead || inputSpacing[0] > 0){
+			resolveSpacing(NULL, path);
+		}
+
+		if(!std::is_sorted(indices.begin(), indices.end())){
+			std::sort(indices.begin(), indices.end());
+		}
+		for(size_t i = 0; i < indices.size(); ){
+			size_t j = i + 1;
+			while(j < indices.size() && indices[j] <= indices[j-1] + 1){
+				j++;
+			}
+			AddRun(indices[i], indices[j-1] - indices[i] + 1);
+			i = j;
+		}
+	}
+
+	void resolveSpacing(const JsonValue *value, const std::string &path){
+		for(int a = 0; a < 3; a++){
+			spacing[a] = 1;
+		}
+		if(value != NULL && value->type == JsonValue::JSON_ARRAY && inputSpacing[0] <= 0){
+			for(size_t a = 0; a < 3 && a < value->items.size(); a++){
+				spacing[a] = value->items[a].number > 0 ? value->items[a].number : 1;
+			}
+			return;
+		}
+		resolveInputSpacing(path, spacing);
+	}
+
+public:
+	int dimensions;
+	long long size[3];
+	double spacing[3];
+	// foreground runs [runStart[i], runStart[i] + runLength[i]) of linear voxel indices, sorted
+	std::vector<long long> runStart;
+	std::vector<long long> runLength;
+
+	SparseMask(const std::string &path){
+		if(endsWith(path, ".rle.json")){
+			readRle(path);
+		}
+		else{
+			readCoordinates(path);
+		}
+	}
+
+	// appends a run behind the last one, adjacent runs are merged
+	void AddRun(long long start, long long length){
+		if(!runStart.empty() && runStart.back() + runLength.back() == start){
+			runLength.back() += length;
+			return;
+		}
+		runStart.push_back(start);
+		runLength.push_back(length);
+	}
+
+	long long GetNumberOfElements() const{
+		return size[0] * size[1] * size[2];
+	}
+
+	long long GetNumberOfForegroundElements() const{
+		long long n = 0;
+		for(size_t i = 0; i < runLength.size(); i++){
+			n += runLength[i];
+		}
+		return n;
+	}
+
+	// a mask that is all background or all foreground, which loadImage reads as all background:
+	// the rescaling maps an image of a single value to PIXEL_VALUE_RANGE_MIN (see rescaleToPixels())
+	bool IsUniform() const{
+		long long n = GetNumberOfForegroundElements();
+		return n == 0 || n == GetNumberOfElements();
+	}
+
+	bool HasSameSize(const SparseMask &other) const{
+		return size[0] == other.size[0] && size[1] == other.size[1] && size[2] == other.size[2];
+	}
+
+	// number of voxels in the foreground of both masks
+	long long Intersect(const SparseMask &other) const{
+		long long n = 0;
+		size_t i = 0, j = 0;
+		while(i < runStart.size() && j < other.runStart.size()){
+			long long end_i = runStart[i] + runLength[i];
+			long long end_j = other.runStart[j] + other.runLength[j];
+			long long start = std::max(runStart[i], other.runStart[j]);
+			long long end = std::min(end_i, end_j);
+			if(end > start){
+				n += end - start;
+			}
+			if(end_i < end_j){
+				i++;
+			}
+			else{
+				j++;
+			}
+		}
+		return n;
+	}
+};
+
+/*
+// Overlap of two sparse masks. The foreground is rescaled to PIXEL_VALUE_RANGE_MAX like loadImage
+// does for binary images, so the joint histogram has only four non-zero bins. Uniform masks have no
+// foreground, as their dense volumes (see SparseMask::IsUniform()).
+*/
+class SparseOverlap : public JointHistogram
+{
+public:
+	SparseOverlap(const SparseMask &fixedMask, const SparseMask &movingMask, bool fuzzy, double threshold){
+		numberElements = fixedMask.GetNumberOfElements();
+		for(int a = 0; a < 3; a++){
+			size[a] = fixedMask.size[a];
+		}
+		vspx = fixedMask.spacing[0];
+		vspy = fixedMask.spacing[1];
+		vspz = fixedMask.spacing[2];
+
+		bool uniform_f = fixedMask.IsUniform();
+		bool uniform_m = movingMask.IsUniform();
+		long long intersection = uniform_f || uniform_m ? 0 : fixedMask.Intersect(movingMask);
+		long long foreground_f = uniform_f ? 0 : fixedMask.GetNumberOfForegroundElements();
+		long long foreground_m = uniform_m ? 0 : movingMask.GetNumberOfForegroundElements();
+		jointHistogram.assign(HISTOGRAM_BINS * HISTOGRAM_BINS, 0);
+		jointHistogram[PIXEL_VALUE_RANGE_MAX * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MAX] = intersection;
+		jointHistogram[PIXEL_VALUE_RANGE_MAX * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MIN] = foreground_f - intersection;
+		jointHistogram[PIXEL_VALUE_RANGE_MIN * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MAX] = foreground_m - intersection;
+		jointHistogram[PIXEL_VALUE_RANGE_MIN * HISTOGRAM_BINS + PIXEL_VALUE_RANGE_MIN] = numberElements - foreground_f - foreground_m + intersection;
+
+		CountForeground(fuzzy, threshold);
+	}
+};
+
+/*
+// Computes the overlap of two sparse masks if they have the same size, otherwise returns NULL and
+// the masks are evaluated as dense images.
+*/
+SparseOverlap* computeSparseOverlap(const char* f1, const char* f2, bool fuzzy, double threshold){
+	SparseMask fixedMask(f1);
+	SparseMask movingMask(f2);
+	if(!fixedMask.HasSameSize(movingMask)){
+		return NULL;
+	}
+	std::cout << "Sparse evaluation: " << fixedMask.runStart.size() << " and " << movingMask.runStart.size() << " foreground runs\n" << std::endl;
+	return new SparseOverlap(fixedMask, movingMask, fuzzy, threshold);
+}
+
+// dense volume of a sparse mask, for metrics that need the images. The runs are written straight
+// into the pixels of the image, with the values the rescaling of a binary image gives.
+ImageType::Pointer loadSparseImage(const char* path){
+	SparseMask mask(path);
+	ImageType::Pointer img = allocateImportImage(mask.size, mask.spacing);
+	pixeltype* pixels = img->GetBufferPointer();
+	std::fill(pixels, pixels + mask.GetNumberOfElements(), (pixeltype)PIXEL_VALUE_RANGE_MIN);
+	if(!mask.IsUniform()){
+		for(size_t i = 0; i < mask.runStart.size(); i++){
+			std::fill(pixels + mask.runStart[i], pixels + mask.runStart[i] + mask.runLength[i], (pixeltype)PIXEL_VALUE_RANGE_MAX);
+		}
+	}
+	return img;
+}
+
+#endif
@@ -0,0 +1,230 @@
+/*
+// TaskGraph.h
+//
+// Description:
+//
+// This file contains the executor of the metrics that are independent of each other once the
+// images are preprocessed (HDRFDST, AVGDIST, bAVD, MAHLNBS). Each task declares the artifacts it
+// needs and those it produces (bit masks as in Metric_constants.h); a task starts when all tasks
+// added before it that produce one of its artifacts have finished. Artifacts made before the graph
+// runs (e.g. by the pass over the images) have no producer and are not waited for.
+//
+// The ready tasks are run on a pool of workers, the calling thread being the first. Worker t
+// allocates from evaluation arena t (see Arena.h), which is kept after the worker has ended. Each worker
+// has its own queue: it takes the task made ready last from its own queue, so that a consumer runs
+// where its artifact was just produced, and otherwise steals the oldest task of another worker.
+// The tasks only compute; their results are written by the caller in the canonical order of the
+// metrics after Run() returns, so the output does not depend on the order the tasks finished.
+//
+*/
+
+#ifndef _TASKGRAPH
+#define _TASKGRAPH
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include "Arena.h"
+
+class TaskGraph
+{
+private:
+	typedef struct Task{
+		std::string name;
+		std::function<void()> run;
+		unsigned needs;
+		unsigned produces;
+		std::vector<int> successors;
+		std::atomic<int> waiting;  // unfinished producers of the needed artifacts
+	} Task;
+
+	std::deque<Task> tasks;
+
+	// per worker: the queue of ready tasks and its lock
+	std::vector<std::deque<int> > queues;
+	std::deque<std::mutex> locks;
+
+	std::mutex idleMutex;
+	std::condition_variable idle;
+	std::atomic<int> ready;
+	int remaining;
+
+	std::exception_ptr error;
+	std::mutex errorMutex;
+
+	void push(int worker, int task){
+		{
+			std::lock_guard<std::mutex> lock(locks[worker]);
+			queues[worker].push_back(task);
+		}
+		{
+			std::lock_guard<std::mutex> lock(idleMutex);
+			ready++;
+		}
+		idle.notify_one();
+	}
+
+	// the newest task of the own queue, else the oldest of another queue
+	bool take(int worker, int &task){
+		int n = (int)queues.size();
+		for(int i = 0; i < n; i++){
+			int victim = (worker + i) % n;
+			std::lock_guard<std::mutex> lock(locks[victim]);
+			if(queues[victim].empty()){
+				continue;
+			}
+			if(i == 0){
+				task = queues[victim].back();
+				queues[victim].pop_back();
+			}
+			else{
+				task = queues[victim].front();
+				queues[victim].pop_front();
+			}
+			ready--;
+			return true;
+		}
+		return false;
+	}
+
+	void work(int worker){
+		for(;;){
+			int task;
+			if(!take(worker, task)){
+				std::unique_lock<std::mutex> lock(idleMutex);
+				if(remaining == 0){
+					return;
+				}
+				idle.wait(lock, [this](){ return remaining == 0 || ready > 0; });
+				continue;
+			}
+			// after an error the remaining tasks are skipped, but still release their successors
+			bool failed;
+			{
+				std::lock_guard<std::mutex> lock(errorMutex);
+				failed = (bool)error;
+			}
+			if(!failed){
+				try
+				{
+					tasks[task].run();
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if(!error){
+						error = std::current_exception();
+					}
+				}
+			}
+			for(size_t i = 0; i < tasks[task].successors.size(); i++){
+				int successor = tasks[task].successors[i];
+				if(--tasks[successor].waiting == 0){
+					push(worker, successor);
+				}
+			}
+			bool finished;
+			{
+				std::lock_guard<std::mutex> lock(idleMutex);
+				finished = --remaining == 0;
+			}
+			if(finished){
+				idle.notify_all();
+			}
+		}
+	}
+
+public:
+	TaskGraph(){
+		ready = 0;
+		remaining = 0;
+	}
+
+	/*
+	// Adds a task and returns its index. It waits for the tasks added before that produce one of
+	// the artifacts in needs.
+	*/
+	int Add(const char* name, std::function<void()> run, unsigned needs, unsigned produces){
+		int index = (int)tasks.size();
+		tasks.emplace_back();
+		Task &task = tasks.back();
+		task.name = name;
+		task.run = run;
+		task.needs = needs;
+		task.produces = produces;
+		task.waiting = 0;
+		for(int i = 0; i < index; i++){
+			if((tasks[i].produces & needs) != 0){
+				tasks[i].successors.push_back(index);
+				task.waiting++;
+			}
+		}
+		return index;
+	}
+
+	int GetNumberOfTasks() const{
+		return (int)tasks.size();
+	}
+
+	// number of tasks that wait for no other task, those that run at the same time at the start
+	int GetNumberOfRootTasks() const{
+		int count = 0;
+		for(size_t i = 0; i < tasks.size(); i++){
+			count += tasks[i].waiting == 0;
+		}
+		return count;
+	}
+
+	/*
+	// Runs all tasks on at most threads workers and returns when they have finished. The first
+	// exception thrown by a task is rethrown; the tasks not yet started are then skipped.
+	*/
+	void Run(int threads){
+		int count = (int)tasks.size();
+		if(count == 0){
+			return;
+		}
+		if(threads > count){
+			threads = count;
+		}
+		if(threads < 1){
+			threads = 1;
+		}
+		queues.assign(threads, std::deque<int>());
+		locks.resize(threads);
+		ready = 0;
+		remaining = count;
+		error = std::exception_ptr();
+		int next = 0;
+		for(int i = 0; i < count; i++){
+			if(tasks[i].waiting == 0){
+				queues[next++ % threads].push_back(i);
+				ready++;
+			}
+		}
+
+		std::vector<std::thread> workers;
+		reserveEvaluationArenas(threads);
+		for(int t = 1; t < threads; t++){
+			workers.push_back(std::thread([this, t](){
+				useEvaluationArena(t);
+				work(t);
+			}));
+		}
+		work(0);
+		for(size_t t = 0; t < workers.size(); t++){
+			workers[t].join();
+		}
+		if(error){
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the web servers EvaluateSegmentation reads images from (HttpByteSource and
+RangedDownload in Imagedownloader.h). It serves the files of a directory with the different ways
+an HTTP response can be delimited, so that each of them can be checked without a real server:
+
+  /length/<file>    body with Content-Length on a keep-alive connection
+  /chunked/<file>   chunked transfer encoding, with chunk extensions and odd chunk sizes
+  /close/<file>     HTTP/1.0 response without length, delimited by closing the connection
+  /trickle/<file>   body with Content-Length, sent in small pieces with pauses
+  /redirect/<file>  302 to /length/<file>
+  /ranges/<file>    byte ranges (206) with ETag, Last-Modified and If-Range, as used by RangedDownload,
+                    and 304 to If-None-Match / If-Modified-Since, as used by the url cache (-cache)
+  /fault?...        sets the faults of the following /ranges responses, /fault alone clears them:
+                      cut=N          the first response to each range is cut after N bytes of its body
+                      fail=K         the first K requests for each range except the first answer 503
+                      change-after=K the file changes after K more /ranges requests (new ETag,
+                                     Last-Modified and content), e.g. in the middle of a download
+                      change=1       the file changes now, e.g. between an interrupted and a resumed run
+  anything else     404
+
+Besides the files of the directory, sphere<N>.nii is generated: an uncompressed NIfTI image of
+N x N x N voxels (uint8) holding a sphere, e.g. sphere400.nii (64 MB) for downloads of several ranges.
+
+  python3 http_test_server.py [--port 8765] [--root DIR]
+
+See README.md in this directory for the checks and their expected results. Needs Python 3.7.
+"""
+
+import argparse
+import email.utils
+import http.server
+import os
+import re
+import socketserver
+import sys
+import threading
+import time
+
+from nifti_header import nifti_header
+
+SPHERE = re.compile(r"^sphere(\d+)\.nii$")
+RANGE = re.compile(r"^bytes=(\d+)-(\d*)$")
+spheres = {}
+
+# faults of the /ranges responses (see /fault) and the version of the files served
+lock = threading.Lock()
+faults = {}
+version = [1]
+requests = {}
+
+
+def sphere_image(n):
+    """uint8 NIfTI-1 image of n^3 voxels, 1 inside the sphere of radius n/3 around the center"""
+    if n not in spheres:
+        header = nifti_header((n, n, n), description=b"sphere")
+        c = (n - 1) / 2.0
+        r2 = (n / 3.0) ** 2
+        voxels = bytearray(n * n * n)
+        for z in range(n):
+            for y in range(n):
+                d = r2 - (z - c) ** 2 - (y - c) ** 2
+                if d < 0:
+                    continue
+                h = d ** 0.5
+                x0 = max(0, int(c - h + 0.999999))
+                x1 = min(n - 1, int(c + h))
+                if x0 <= x1:
+                    start = (z * n + y) * n
+                    voxels[start + x0:start + x1 + 1] = b"\1" * (x1 - x0 + 1)
+        spheres[n] = header + bytes(voxels)
+    return spheres[n]
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    root = "."
+
+    def log_message(self, format, *args):
+        sys.stderr.write("%s\n" % (format % args))
+
+    def load(self, name):
+        match = SPHERE.match(name)
+        if match:
+            return sphere_image(int(match.group(1)))
+        path = os.path.join(self.root, name)
+        if "/" in name or ".." in name or not os.path.isfile(path):
+            return None
+        with open(path, "rb") as f:
+            return f.read()
+
+    def reply(self, status, headers, body=b""):
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def do_HEAD(self):
+        self.do_GET()
+
+    def set_faults(self, query):
+        with lock:
+            faults.clear()
+            requests.clear()
+            for item in query.split("&") if query else []:
+                name, _, value = item.partition("=")
+                faults[name] = int(value or 1)
+            if faults.pop("change", 0):
+                version[0] += 1
+            if "change-after" in faults:
+                faults["change-at"] = faults.pop("change-after")
+        self.reply(200, [("Content-Length", "0")])
+
+    def send_ranges(self, name, data):
+        with lock:
+            if "change-at" in faults:
+                faults["change-at"] -= 1
+                if faults["change-at"] < 0:
+                    del faults["change-at"]
+                    version[0] += 1
+            current = version[0]
+        if current > 1:
+            data = data[:-1] + bytes([(data[-1] + current - 1) % 256])
+        etag = '"%s-v%d-%d"' % (name, current, len(data))
+        modified = email.utils.formatdate(1500000000 + current * 3600, usegmt=True)
+        validators = [("ETag", etag), ("Last-Modified", modified), ("Accept-Ranges", "bytes")]
+
+        if self.headers.get("If-None-Match") == etag or self.headers.get("If-Modified-Since") == modified:
+            self.reply(304, validators)
+            return
+        match = RANGE.match(self.headers.get("Range", ""))
+        condition = self.headers.get("If-Range")
+        if match is None or (condition is not None and condition not in (etag, modified)):
+            self.reply(200, validators + [("Content-Length", str(len(data)))], data)
+            return
+        start = int(match.group(1))
+        end = min(int(match.group(2)) if match.group(2) else len(data) - 1, len(data) - 1)
+        if start > end:
+            self.reply(416, [("Content-Range", "bytes */%d" % len(data)), ("Content-Length", "0")])
+            return
+        with lock:
+            count = requests.get(start, 0)
+            requests[start] = count + 1
+            fail = start > 0 and count < faults.get("fail", 0)
+            cut = faults.get("cut") if count == 0 else None
+        if fail:
+            self.reply(503, [("Content-Length", "0")])
+            return
+        body = data[start:end + 1]
+        headers = validators + [("Content-Range", "bytes %d-%d/%d" % (start, end, len(data))), ("Content-Length", str(len(body)))]
+        if cut is not None and cut < len(body):
+            # the connection is closed before the end of the body
+            self.close_connection = True
+            self.reply(206, headers, body[:cut])
+            return
+        self.reply(206, headers, body)
+
+    def do_GET(self):
+        path, _, query = self.path.partition("?")
+        if path == "/fault":
+            self.set_faults(query)
+            return
+        parts = path.lstrip("/").split("/", 1)
+        mode = parts[0]
+        name = parts[1] if len(parts) > 1 else ""
+        data = self.load(name) if name else None
+        if data is None or mode not in ("length", "chunked", "close", "trickle", "redirect", "ranges"):
+            self.reply(404, [("Content-Length", "0")])
+            return
+
+        if mode == "length":
+            self.reply(200, [("Content-Length", str(len(data)))], data)
+        elif mode == "chunked":
+            self.send_response(200)
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            if self.command == "HEAD":
+                return
+            size = 1
+            offset = 0
+            while offset < len(data):
+                chunk = data[offset:offset + size]
+                self.wfile.write(b"%x;part=%d\r\n" % (len(chunk), offset) + chunk + b"\r\n")
+                offset += len(chunk)
+                size = size * 7 + 3 if size < 100000 else 1
+            self.wfile.write(b"0\r\n\r\n")
+        elif mode == "close":
+            self.protocol_version = "HTTP/1.0"
+            self.close_connection = True
+            self.reply(200, [("Connection", "close")], data)
+        elif mode == "trickle":
+            self.send_response(200)
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            if self.command == "HEAD":
+                return
+            piece = max(1, len(data) // 50)
+            for offset in range(0, len(data), piece):
+                self.wfile.write(data[offset:offset + piece])
+                self.wfile.flush()
+                time.sleep(0.01)
+        elif mode == "redirect":
+            self.reply(302, [("Location", "/length/" + name), ("Content-Length", "0")])
+        elif mode == "ranges":
+            self.send_ranges(name, data)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local test server for the http input of EvaluateSegmentation")
+    parser.add_argument("--port", type=int, default=8765)
+    parser.add_argument("--root", default=os.path.dirname(os.path.abspath(__file__)), help="directory of the files served")
+    args = parser.parse_args()
+    Handler.root = args.root
+    server = Server(("127.0.0.1", args.port), Handler)
+    print("Serving %s on http://127.0.0.1:%d/" % (args.root, args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,26 @@
+"""
+NIfTI-1 header of the uint8 images written by the scripts of this directory (rle_to_nifti.py,
+http_test_server.py). Imported by them, not run on its own.
+"""
+
+import struct
+
+
+def nifti_header(size, spacing=(1, 1, 1), description=b""):
+    """NIfTI-1 header of a 3D uint8 image, with the 4 bytes of the extension flag"""
+    header = struct.pack("<i10s18sihsB", 348, b"", b"", 0, 0, b"r", 0)
+    header += struct.pack("<8h", 3, size[0], size[1], size[2], 1, 1, 1, 1)
+    header += struct.pack("<3f", 0, 0, 0)
+    header += struct.pack("<4h", 0, 2, 8, 0)
+    header += struct.pack("<8f", 1, spacing[0], spacing[1], spacing[2], 0, 0, 0, 0)
+    header += struct.pack("<3f", 352, 1, 0)
+    header += struct.pack("<hBB", 0, 10, 0)
+    header += struct.pack("<2f", 0, 0)
+    header += struct.pack("<2f2i", 0, 0, 0, 0)
+    header += struct.pack("<80s24s", description, b"")
+    header += struct.pack("<2h", 0, 0)
+    header += struct.pack("<6f", 0, 0, 0, 0, 0, 0)
+    header += struct.pack("<12f", *([0] * 12))
+    header += struct.pack("<16s4s", b"", b"n+1\0")
+    assert len(header) == 348
+    return header + b"\0\0\0\0"
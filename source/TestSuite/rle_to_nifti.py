@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""
+Writes the dense NIfTI image (uint8, 1 = foreground) of a run-length encoded mask (.rle.json, see
+SparseMask.h), e.g. of large_truth.rle.json and large_test.rle.json, to check the evaluation of dense
+images beyond 2^31 voxels with the same expected results as the masks:
+
+  python3 rle_to_nifti.py large_truth.rle.json large_truth.nii.gz
+
+The image is written run by run, so the memory needed does not depend on its size. A name ending in
+.nii.gz gives a gzip compressed file (a few MB for the large masks), .nii an uncompressed one, which
+can also be read in slabs (-max-memory). Only counts given as a list of numbers are supported, not the
+compressed RLE strings of COCO. Needs Python 3.
+"""
+
+import argparse
+import gzip
+import json
+import struct
+import sys
+
+from nifti_header import nifti_header
+
+# bytes written at once
+BLOCK = 64 << 20
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Writes the dense NIfTI image of a run-length encoded mask")
+    parser.add_argument("mask", help="run-length encoded mask (.rle.json)")
+    parser.add_argument("image", help="NIfTI image written (.nii or .nii.gz)")
+    args = parser.parse_args()
+
+    with open(args.mask) as f:
+        mask = json.load(f)
+    size = mask["size"]
+    spacing = mask.get("spacing", [1, 1, 1])
+    counts = mask["counts"]
+    if len(size) != 3 or not isinstance(counts, list):
+        sys.exit("%s: only 3D masks with counts given as a list are supported" % args.mask)
+    voxels = size[0] * size[1] * size[2]
+    if sum(counts) != voxels:
+        sys.exit("%s: the counts cover %d voxels instead of %d" % (args.mask, sum(counts), voxels))
+
+    opener = gzip.open if args.image.endswith(".gz") else open
+    with opener(args.image, "wb") as out:
+        out.write(nifti_header(size, spacing, b"rle_to_nifti"))
+        blocks = {0: bytes(BLOCK), 1: b"\1" * BLOCK}
+        for i, count in enumerate(counts):
+            value = i % 2
+            while count > 0:
+                n = min(count, BLOCK)
+                out.write(blocks[value] if n == BLOCK else blocks[value][:n])
+                count -= n
+    print("%s: %d voxels, %d foreground" % (args.image, voxels, sum(counts[1::2])))
+
+
+if __name__ == "__main__":
+    main()
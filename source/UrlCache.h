@@ -0,0 +1,255 @@
+/*
+// UrlCache.h
+//
+// Description:
+//
+// This file keeps images given by URL in a local cache directory (option -cache), so that truth
+// images hosted remotely are not downloaded again for every evaluation. An entry consists of the
+// data file <key><extension>, named after a hash of the URL, and the metadata file <key>.meta with
+// the URL and the validators (ETag, Last-Modified) sent by the server. Before a cached file is
+// used it is revalidated with a conditional request (If-None-Match / If-Modified-Since) for the
+// first range of the image; the server then answers 304 without a body if the image did not
+// change, otherwise the response is the start of the download of the new image, so the image is
+// not requested twice. If the server cannot be reached, the cached file is used as is.
+//
+// Several processes can share a cache directory: an entry is downloaded under an exclusive lock
+// (and moved into place by renaming), and read under a shared lock. Downloads use RangedDownload,
+// so an interrupted download of a large image is resumed by the next run. The size of the cache
+// is limited (option -cachesize); the least recently used entries that are not in use are removed.
+// Locking uses flock() and is not available on Windows.
+//
+*/
+
+#ifndef _URLCACHE
+#define _URLCACHE
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+#include "Imagedownloader.h"
+
+#ifndef _WINOS
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+// cache directory, empty if the cache is not used
+static std::string urlCacheDirectory = "";
+static long long urlCacheLimit = 4096LL * 1024 * 1024;
+
+bool isUrlCacheEnabled(){
+	return urlCacheDirectory != "";
+}
+
+typedef struct UrlCacheMeta{
+	bool valid;
+	std::string url;
+	std::string file;
+	std::string etag;
+	std::string lastModified;
+} UrlCacheMeta;
+
+UrlCacheMeta readUrlCacheMeta(const std::string &path){
+	UrlCacheMeta meta;
+	meta.valid = false;
+	std::ifstream in(path.c_str());
+	std::string line;
+	while(std::getline(in, line)){
+		size_t space = line.find(' ');
+		std::string key = line.substr(0, space);
+		std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+		if(key == "url"){
+			meta.url = value;
+		}
+		else if(key == "file"){
+			meta.file = value;
+		}
+		else if(key == "etag"){
+			meta.etag = value;
+		}
+		else if(key == "last-modified"){
+			meta.lastModified = value;
+		}
+	}
+	meta.valid = meta.url != "" && meta.file != "";
+	return meta;
+}
+
+std::string uniqueTemporaryPath(const std::string &path){
+	std::ostringstream name;
+#ifndef _WINOS
+	name << path << "." << getpid() << ".part";
+#else
+	name << path << "." << _getpid() << ".part";
+#endif
+	return name.str();
+}
+
+// writes the metadata to a temporary file that is renamed, so readers never see a partial file
+bool writeUrlCacheMeta(const std::string &path, const UrlCacheMeta &meta){
+	std::string temp = uniqueTemporaryPath(path);
+	{
+		std::ofstream out(temp.c_str());
+		out << "url " << meta.url << "\n" << "file " << meta.file << "\n";
+		out << "etag " << meta.etag << "\n" << "last-modified " << meta.lastModified << "\n";
+		if(!out){
+			return false;
+		}
+	}
+	return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+long long urlCacheFileSize(const std::string &path){
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? (long long)st.st_size : -1;
+}
+
+/*
+// A file of the cache, locked (shared) as long as the object exists so that it is not removed
+*/
+class UrlCacheEntry
+{
+public:
+	std::string path;
+	FileLock *lock;
+
+	UrlCacheEntry(const std::string &path, FileLock *lock){
+		this->path = path;
+		this->lock = lock;
+	}
+
+	~UrlCacheEntry(){
+		delete lock;
+	}
+};
+
+/*
+// Removes the least recently used entries (by the time of the metadata file, which is touched on
+// every use) until the cache is within urlCacheLimit. Entries in use are skipped.
+*/
+void evictUrlCache(const std::string &keep){
+	FileLock cacheLock(urlCacheDirectory + "/cache.lock", true, false);
+	if(!cacheLock.locked){
+		// another process is cleaning up
+		return;
+	}
+	itksys::Directory directory;
+	if(!directory.Load(urlCacheDirectory)){
+		return;
+	}
+	std::vector< std::pair<long long, std::string> > entries;
+	long long total = 0;
+	for(unsigned long i = 0; i < directory.GetNumberOfFiles(); i++){
+		std::string name = directory.GetFile(i);
+		if(name.size() != 21 || name.compare(16, 5, ".meta") != 0){
+			continue;
+		}
+		std::string key = name.substr(0, 16);
+		std::string metaPath = urlCacheDirectory + "/" + name;
+		UrlCacheMeta meta = readUrlCacheMeta(metaPath);
+		struct stat st;
+		if(!meta.valid || stat(metaPath.c_str(), &st) != 0){
+			continue;
+		}
+		long long size = urlCacheFileSize(urlCacheDirectory + "/" + meta.file);
+		if(size < 0){
+			continue;
+		}
+		total += size;
+		if(key != keep){
+			entries.push_back(std::make_pair((long long)st.st_mtime, key));
+		}
+	}
+	std::sort(entries.begin(), entries.end());
+	for(size_t i = 0; i < entries.size() && total > urlCacheLimit; i++){
+		std::string base = urlCacheDirectory + "/" + entries[i].second;
+		FileLock lock(base + ".lock", true, false);
+		if(!lock.locked){
+			continue;
+		}
+		UrlCacheMeta meta = readUrlCacheMeta(base + ".meta");
+		if(!meta.valid){
+			continue;
+		}
+		std::string dataPath = urlCacheDirectory + "/" + meta.file;
+		long long size = urlCacheFileSize(dataPath);
+		// the lock file is kept, other processes may be waiting on it
+		remove((base + ".meta").c_str());
+		remove(dataPath.c_str());
+		total -= size > 0 ? size : 0;
+	}
+}
+
+/*
+// Returns the cached file of url after revalidating (or downloading) it, NULL if the url can
+// neither be fetched nor is in the cache
+*/
+UrlCacheEntry* openCachedUrl(const char* url){
+	itksys::SystemTools::MakeDirectory(urlCacheDirectory);
+	std::string key = urlCacheKey(url);
+	std::string base = urlCacheDirectory + "/" + key;
+	std::string metaPath = base + ".meta";
+	// the data file keeps the extension of the url, so that it can be read by ITK
+	std::string file = key + (UrlFileEnding(url) != "" ? UrlFileEnding(url) : ".nii");
+	std::string dataPath = urlCacheDirectory + "/" + file;
+
+	// the file may be removed by another process between the download and the shared lock
+	for(int attempt = 0; attempt < 3; attempt++){
+		{
+			FileLock lock(base + ".lock", true);
+			UrlCacheMeta meta = readUrlCacheMeta(metaPath);
+			bool cached = meta.valid && meta.url == url && meta.file == file && urlCacheFileSize(dataPath) >= 0;
+			// the partial file is named after the entry, it is only written under the lock
+			RangedDownload download(url, dataPath);
+			std::vector<std::string> headers = download.FirstRangeHeaders();
+			if(cached && meta.etag != ""){
+				headers.push_back("If-None-Match: " + meta.etag);
+			}
+			if(cached && meta.lastModified != ""){
+				headers.push_back("If-Modified-Since: " + meta.lastModified);
+			}
+			try
+			{
+				// one request revalidates the entry and, if the image changed, starts its download
+				HttpByteSource source(url, headers);
+				if(source.status == 304){
+					std::cout << "Using cached " << url << std::endl;
+				}
+				else{
+					download.Run(source);
+					meta.url = url;
+					meta.file = file;
+					meta.etag = download.etag;
+					meta.lastModified = download.lastModified;
+					writeUrlCacheMeta(metaPath, meta);
+				}
+			}
+			catch(std::exception &e)
+			{
+				if(!cached){
+					std::cerr << e.what() << std::endl;
+					return NULL;
+				}
+				std::cout << "Cannot revalidate " << url << " (" << e.what() << "), using the cached file" << std::endl;
+			}
+#ifndef _WINOS
+			// most recently used
+			utime(metaPath.c_str(), NULL);
+#endif
+		}
+
+		FileLock *shared = new FileLock(base + ".lock", false);
+		if(urlCacheFileSize(dataPath) >= 0){
+			evictUrlCache(key);
+			return new UrlCacheEntry(dataPath, shared);
+		}
+		delete shared;
+	}
+	return NULL;
+}
+
+#endif
@@ -22,7 +22,8 @@
 // Description:
 //
 // This class performs some preprocessing on the volumes to be compared such as counting 
-// the voxels and saving them in the memory. The class is used from almost all evaluation algorithms. 
+// the voxels and saving them in the memory. The copies are only made for the metrics reading the
+// voxel values (ARTIFACT_VOXEL_VALUES), the other metrics are accumulated by ImageStatistics.
 //
 */
 
@@ -31,17 +32,25 @@
 #include "itkImage.h"
 #include "ImageStatistics.h"
 
+// frees the voxel values of the last evaluation
+void releaseVoxelValues(){
+	free(values_f);
+	free(values_m);
+	values_f = NULL;
+	values_m = NULL;
+}
+
 class VoxelPreprocessor
 {
 private:
 	bool empty_f;
 	bool empty_m;	
 public: 
-	int numberElements_f;
-	int numberElements_m;
-	int num_nonzero_points_f;
-	int num_nonzero_points_m;
-	int num_intersection;
+	long long numberElements_f;
+	long long numberElements_m;
+	long long num_nonzero_points_f;
+	long long num_nonzero_points_m;
+	long long num_intersection;
 	double mean_f;
 	double mean_m;
 	
@@ -75,24 +84,13 @@ public:
 		
 		
 
-		int ind=0;
+		long long ind=0;
 		double sum_f = 0;
 		empty_f=true;
         fixedIt.GoToBegin();
 		while (!fixedIt.IsAtEnd()){
 			  //std::cout << "i:" << ind << std::endl;
-			if(fuzzy){
-				values_f[ind] = fixedIt.Value();
-				if(values_f[ind]>PIXEL_VALUE_RANGE_MAX)
-					values_f[ind] = PIXEL_VALUE_RANGE_MAX;
-				if(values_f[ind]<PIXEL_VALUE_RANGE_MIN)
-					values_f[ind] = PIXEL_VALUE_RANGE_MIN;
-
-			}
-			else{
-				values_f[ind] =  fixedIt.Value()>(threshold*PIXEL_VALUE_RANGE_MAX)?PIXEL_VALUE_RANGE_MAX:PIXEL_VALUE_RANGE_MIN;
-				
-			}
+			values_f[ind] = preprocessVoxel(fixedIt.Value(), fuzzy, threshold);
 
 			if(values_f[ind] !=0){
 					empty_f=false;
@@ -108,17 +106,7 @@ public:
 		empty_m=true;
 		ind=0; 
 	    while (!movingIt.IsAtEnd()){
-			if(fuzzy){
-				values_m[ind] = movingIt.Value();
-				if(values_m[ind]>PIXEL_VALUE_RANGE_MAX)
-					values_m[ind] = PIXEL_VALUE_RANGE_MAX;
-				if(values_m[ind]<PIXEL_VALUE_RANGE_MIN)
-					values_m[ind] = PIXEL_VALUE_RANGE_MIN;
-	
-			}
-			else{
-				values_m[ind] = movingIt.Value()>(threshold*PIXEL_VALUE_RANGE_MAX)?PIXEL_VALUE_RANGE_MAX:PIXEL_VALUE_RANGE_MIN;
-			}
+			values_m[ind] = preprocessVoxel(movingIt.Value(), fuzzy, threshold);
 			if(values_m[ind] !=0){
 				empty_m=false;
 			} 
@@ -133,10 +121,10 @@ public:
 		mean_f = sum_f/numberElements_f;
 		mean_m = sum_m/numberElements_m;
 	}
-	int GetFixedImageVoxelCount(){
+	long long GetFixedImageVoxelCount(){
 		return numberElements_f;
 	}
-	int GetMovingImageVoxelCount(){
+	long long GetMovingImageVoxelCount(){
 		return numberElements_m;
 	}
 	bool IsDifferentImageSize(){
@@ -0,0 +1,218 @@
+/*
+// ZipArchive.h
+//
+// Description:
+//
+// This file reads the directory of zip archives (including zip64) and opens their members as
+// byte sources, so that members can be decoded without extracting them to disk. Only the
+// compression methods "stored" and "deflate" are supported.
+//
+*/
+
+#ifndef _ZIPARCHIVE
+#define _ZIPARCHIVE
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "ByteSource.h"
+
+typedef struct ZipEntry{
+	std::string name;
+	int method;
+	long long compressedSize;
+	long long uncompressedSize;
+	long long localHeaderOffset;
+} ZipEntry;
+
+class ZipEntrySource : public ByteSource
+{
+private:
+	FileByteSource data;
+	InflateByteSource *inflater;
+
+public:
+	ZipEntrySource(const std::string &filename, long long offset, long long length, bool deflated) : data(filename, offset, length){
+		inflater = deflated ? new InflateByteSource(&data, InflateByteSource::INFLATE_RAW) : NULL;
+	}
+
+	~ZipEntrySource(){
+		delete inflater;
+	}
+
+	long long Read(char *buf, long long len){
+		return inflater != NULL ? inflater->Read(buf, len) : data.Read(buf, len);
+	}
+};
+
+class ZipArchive
+{
+private:
+	std::string filename;
+
+	static unsigned int le16(const unsigned char *p){
+		return p[0] | (p[1] << 8);
+	}
+
+	static unsigned int le32(const unsigned char *p){
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	}
+
+	static long long le64(const unsigned char *p){
+		return (long long)le32(p) | ((long long)le32(p + 4) << 32);
+	}
+
+	void readAt(std::ifstream &stream, long long offset, unsigned char *buf, long long len){
+		stream.clear();
+		stream.seekg(offset, std::ios::beg);
+		stream.read((char*)buf, len);
+		if(stream.gcount() != len){
+			throw std::runtime_error("Corrupt zip archive: " + filename);
+		}
+	}
+
+public:
+	std::vector<ZipEntry> entries;
+
+	ZipArchive(const std::string &filename){
+		this->filename = filename;
+		std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+		if(!stream.is_open()){
+			throw std::runtime_error("Cannot open archive: " + filename);
+		}
+		stream.seekg(0, std::ios::end);
+		long long fileSize = stream.tellg();
+
+		// the end of central directory record is at the end of the file, followed by a comment of up to 64k
+		long long tailSize = std::min(fileSize, 22LL + 65535LL);
+		std::vector<unsigned char> tail(tailSize);
+		readAt(stream, fileSize - tailSize, &tail[0], tailSize);
+		long long eocd = -1;
+		for(long long i = tailSize - 22; i >= 0; i--){
+			if(le32(&tail[i]) == 0x06054b50){
+				eocd = i;
+				break;
+			}
+		}
+		if(eocd < 0){
+			throw std::runtime_error("Not a zip archive: " + filename);
+		}
+		long long numberEntries = le16(&tail[eocd + 10]);
+		long long directorySize = le32(&tail[eocd + 12]);
+		long long directoryOffset = le32(&tail[eocd + 16]);
+
+		// zip64 end of central directory locator precedes the end of central directory record
+		if(eocd >= 20 && le32(&tail[eocd - 20]) == 0x07064b50){
+			unsigned char record[56];
+			readAt(stream, le64(&tail[eocd - 20 + 8]), record, sizeof(record));
+			if(le32(record) != 0x06064b50){
+				throw std::runtime_error("Corrupt zip64 archive: " + filename);
+			}
+			numberEntries = le64(record + 32);
+			directorySize = le64(record + 40);
+			directoryOffset = le64(record + 48);
+		}
+
+		std::vector<unsigned char> directory(directorySize);
+		if(directorySize > 0){
+			readAt(stream, directoryOffset, &directory[0], directorySize);
+		}
+		long long pos = 0;
+		for(long long n = 0; n < numberEntries; n++){
+			if(pos + 46 > directorySize || le32(&directory[pos]) != 0x02014b50){
+				throw std::runtime_error("Corrupt zip directory: " + filename);
+			}
+			const unsigned char *h = &directory[pos];
+			ZipEntry entry;
+			entry.method = le16(h + 10);
+			entry.compressedSize = le32(h + 20);
+			entry.uncompressedSize = le32(h + 24);
+			unsigned int nameLength = le16(h + 28);
+			unsigned int extraLength = le16(h + 30);
+			unsigned int commentLength = le16(h + 32);
+			entry.localHeaderOffset = le32(h + 42);
+			if(pos + 46 + nameLength + extraLength + commentLength > directorySize){
+				throw std::runtime_error("Corrupt zip directory: " + filename);
+			}
+			entry.name = std::string((const char*)h + 46, nameLength);
+
+			// zip64 extended information: only the fields saturated in the header are present
+			const unsigned char *extra = h + 46 + nameLength;
+			unsigned int e = 0;
+			while(e < extraLength){
+				if(e + 4 > extraLength){
+					throw std::runtime_error("Corrupt extra field in zip directory: " + filename);
+				}
+				unsigned int id = le16(extra + e);
+				unsigned int size = le16(extra + e + 2);
+				if(e + 4 + size > extraLength){
+					throw std::runtime_error("Corrupt extra field in zip directory: " + filename);
+				}
+				if(id == 0x0001){
+					const unsigned char *f = extra + e + 4;
+					const unsigned char *end = f + size;
+					if(entry.uncompressedSize == 0xffffffffLL){
+						if(f + 8 > end){
+							throw std::runtime_error("Corrupt zip64 extra field: " + filename);
+						}
+						entry.uncompressedSize = le64(f);
+						f += 8;
+					}
+					if(entry.compressedSize == 0xffffffffLL){
+						if(f + 8 > end){
+							throw std::runtime_error("Corrupt zip64 extra field: " + filename);
+						}
+						entry.compressedSize = le64(f);
+						f += 8;
+					}
+					if(entry.localHeaderOffset == 0xffffffffLL){
+						if(f + 8 > end){
+							throw std::runtime_error("Corrupt zip64 extra field: " + filename);
+						}
+						entry.localHeaderOffset = le64(f);
+					}
+				}
+				e += 4 + size;
+			}
+			if(nameLength > 0 && entry.name[nameLength-1] != '/'){
+				entries.push_back(entry);
+			}
+			pos += 46 + nameLength + extraLength + commentLength;
+		}
+	}
+
+	const ZipEntry* FindEntry(const std::string &name){
+		for(size_t i = 0; i < entries.size(); i++){
+			if(entries[i].name == name){
+				return &entries[i];
+			}
+		}
+		return NULL;
+	}
+
+	// offset of the (possibly compressed) member data in the archive file
+	long long GetDataOffset(const ZipEntry &entry){
+		std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+		unsigned char header[30];
+		readAt(stream, entry.localHeaderOffset, header, sizeof(header));
+		if(le32(header) != 0x04034b50){
+			throw std::runtime_error("Corrupt zip member: " + entry.name);
+		}
+		return entry.localHeaderOffset + 30 + le16(header + 26) + le16(header + 28);
+	}
+
+	// opens a member for sequential reading, the member is decoded while it is read
+	ByteSource* OpenEntry(const ZipEntry &entry){
+		if(entry.method != 0 && entry.method != 8){
+			throw std::runtime_error("Unsupported zip compression method in member: " + entry.name);
+		}
+		return new ZipEntrySource(filename, GetDataOffset(entry), entry.compressedSize, entry.method == 8);
+	}
+
+	const std::string& GetFileName(){
+		return filename;
+	}
+};
+
+#endif